@@ -10,10 +10,12 @@
 #include "drm-common.h"
 
 #include <drmu_output.h>
+#include <drmu_util.h>
 
 struct runcube_env_s {
     atomic_int kill;
     struct drmu_output_s * dout;
+    drmu_thread_cfg_t tcfg;
     bool thread_ok;
     pthread_t thread_id;
 };
@@ -29,6 +31,8 @@ cube_thread(void * v)
     const struct gbm *gbm;
     struct drm *drm;
 
+    drmu_thread_cfg_apply(&rce->tcfg);
+
     drm = init_drmu_dout(dout, 1000, format);
     gbm = init_gbm_drmu(drm->du, drm->mode->hdisplay, drm->mode->vdisplay, format, modifier);
     egl = init_cube_smooth(gbm, 0);
@@ -43,7 +47,7 @@ cube_thread(void * v)
 }
 
 runcube_env_t *
-runcube_drmu_start(struct drmu_output_s * const dout)
+runcube_drmu_start(struct drmu_output_s * const dout, const drmu_thread_cfg_t * const tcfg)
 {
     runcube_env_t * rce = calloc(1, sizeof(*rce));
 
@@ -51,6 +55,8 @@ runcube_drmu_start(struct drmu_output_s * const dout)
         return NULL;
 
     rce->dout = drmu_output_ref(dout);
+    if (tcfg != NULL)
+        rce->tcfg = *tcfg;
     if (pthread_create(&rce->thread_id, NULL, cube_thread, rce) != 0)
         goto fail;
     rce->thread_ok = true;
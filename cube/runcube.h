@@ -5,8 +5,10 @@ struct runcube_env_s;
 typedef struct runcube_env_s runcube_env_t;
 
 struct drmu_output_s;
+struct drmu_thread_cfg_s;
 
-runcube_env_t * runcube_drmu_start(struct drmu_output_s * const dout);
+// tcfg is applied to the cube thread when it starts, NULL => default
+runcube_env_t * runcube_drmu_start(struct drmu_output_s * const dout, const struct drmu_thread_cfg_s * const tcfg);
 void runcube_drmu_stop(runcube_env_t ** const ppRce);
 
 #endif
@@ -5,8 +5,11 @@
 #include "drmu.h"
 #include "drmu_fmts.h"
 #include "drmu_log.h"
+#include "drmu_pool.h"
+#include "drmu_util.h"
 
 #include <pthread.h>
+#include <semaphore.h>
 
 #include "pollqueue.h"
 
@@ -14,6 +17,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <poll.h>
+#include <sched.h>
 #include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
@@ -21,6 +26,10 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/netlink.h>
 
 #include <libdrm/drm.h>
 #include <libdrm/drm_mode.h>
@@ -41,9 +50,13 @@
 
 struct drmu_bo_env_s;
 struct drmu_atomic_q_s;
+struct drmu_propcache_s;
 static struct drmu_bo_env_s * env_boe(drmu_env_t * const du);
+static struct drmu_propcache_s * env_propcache(drmu_env_t * const du);
 static struct pollqueue * env_pollqueue(const drmu_env_t * const du);
 static struct drmu_atomic_q_s * env_atomic_q(drmu_env_t * const du);
+static uint32_t env_atomic_crtc_mask(drmu_env_t * const du, const drmu_atomic_t * const da);
+static bool env_fb_free_defer(drmu_env_t * const du, struct drmu_fb_s * const dfb);
 static int env_object_state_save(drmu_env_t * const du, const uint32_t obj_id, const uint32_t obj_type);
 
 // Update return value with a new one for cases where we don't stop on error
@@ -52,6 +65,19 @@ static inline int rvup(int rv1, int rv2)
     return rv2 ? rv2 : rv1;
 }
 
+// The env's own tasks (flip handling, atomic Q) share state & ordering
+// with each other so are always pinned to the poll thread, whatever
+// executors the pollqueue may have
+static struct polltask *
+env_polltask_new(struct pollqueue * const pq, const int fd, const short events,
+                 void (* const fn)(void * v, short revents), void * const v)
+{
+    struct polltask * const pt = polltask_new(pq, fd, events, fn, v);
+    if (pt != NULL)
+        polltask_set_key(pt, POLLTASK_KEY_POLL_THREAD);
+    return pt;
+}
+
 // Use io_alloc when allocating arrays to pass into ioctls.
 //
 // When debugging with valgrind use calloc rather than malloc otherwise arrays
@@ -100,6 +126,501 @@ propinfo_prop_id(const drmu_propinfo_t * const pi)
 }
 
 
+//----------------------------------------------------------------------------
+//
+// Prop cache fns (internal)
+//
+// Per env cache of the results of GETPROPERTY (without value or enum
+// arrays), OBJ_GETPROPERTIES and GETPROPBLOB so that plane init, claim,
+// snapshot & restore don't keep asking the kernel the same questions.
+//
+// Prop definitions never change. Object values are updated from our own
+// successful commits; anything that changes them behind our back (hotplug,
+// link status, content protection) comes with a change uevent for the
+// device, on which values & blobs are dropped. Blob contents are immutable
+// but ids are reused so blobs we destroy are dropped too.
+//
+// gen is bumped by every update so a value read from the kernel isn't added
+// if a commit completed whilst the ioctl was in progress.
+//
+// Some props are write-only: the kernel consumes them on commit and reads
+// back 0 / -1. Their committed values (fb ids, pointers into our fbs) must
+// never be replayed by a snapshot or restore so they are never updated from
+// commits.
+
+#define PROPCACHE_NOCACHE_MAX 8
+static const char * const propcache_nocache_names[] = {
+    "WRITEBACK_FB_ID",
+    "WRITEBACK_OUT_FENCE_PTR",
+    "OUT_FENCE_PTR",
+    "IN_FENCE_FD",
+    NULL
+};
+
+typedef struct propcache_obj_s {
+    uint32_t obj_id;
+    uint32_t obj_type;
+    unsigned int n;
+    uint32_t * prop_ids;    // In kernel order
+    uint64_t * values;
+} propcache_obj_t;
+
+typedef struct propcache_blob_s {
+    uint32_t blob_id;
+    size_t len;
+    void * data;
+} propcache_blob_t;
+
+typedef struct drmu_propcache_s {
+    pthread_mutex_t lock;
+    unsigned int gen;
+
+    unsigned int obj_n;
+    unsigned int obj_size;
+    propcache_obj_t * objs;
+
+    unsigned int blob_n;
+    unsigned int blob_size;
+    propcache_blob_t * blobs;
+
+    unsigned int def_n;
+    unsigned int def_size;
+    struct drm_mode_get_property * defs;
+
+    // Ids of props whose committed values aren't cached
+    unsigned int nocache_n;
+    uint32_t nocache_ids[PROPCACHE_NOCACHE_MAX];
+
+    // Kernel uevent monitor
+    int uevent_fd;              // -1 if none
+    dev_t rdev;                 // Our DRM device
+    struct polltask * uevent_task;
+} drmu_propcache_t;
+
+// Make room for n els. Returns 0 or -ENOMEM
+static int
+propcache_grow(void ** const pp, unsigned int * const psize, const unsigned int n, const size_t el_size)
+{
+    unsigned int newsize;
+    void * p;
+
+    if (n <= *psize)
+        return 0;
+    newsize = *psize < 16 ? 16 : *psize * 2;
+    if ((p = realloc(*pp, newsize * el_size)) == NULL)
+        return -ENOMEM;
+    *pp = p;
+    *psize = newsize;
+    return 0;
+}
+
+static void
+propcache_obj_uninit(propcache_obj_t * const po)
+{
+    free(po->prop_ids);
+    free(po->values);
+}
+
+// Needs locked
+static void
+propcache_clear_values(drmu_propcache_t * const pc)
+{
+    unsigned int i;
+
+    for (i = 0; i != pc->obj_n; ++i)
+        propcache_obj_uninit(pc->objs + i);
+    pc->obj_n = 0;
+    for (i = 0; i != pc->blob_n; ++i)
+        free(pc->blobs[i].data);
+    pc->blob_n = 0;
+    ++pc->gen;
+}
+
+static void
+propcache_invalidate(drmu_propcache_t * const pc)
+{
+    pthread_mutex_lock(&pc->lock);
+    propcache_clear_values(pc);
+    pthread_mutex_unlock(&pc->lock);
+}
+
+// Needs locked
+static propcache_obj_t *
+propcache_obj_find(drmu_propcache_t * const pc, const uint32_t obj_id)
+{
+    unsigned int i;
+
+    for (i = 0; i != pc->obj_n; ++i) {
+        if (pc->objs[i].obj_id == obj_id)
+            return pc->objs + i;
+    }
+    return NULL;
+}
+
+// Copy of the cached props of an object
+// Returns count of props, -ENOENT if not cached
+static int
+propcache_obj_get(drmu_propcache_t * const pc, const uint32_t obj_id, const uint32_t obj_type,
+                  uint32_t ** const ppPropids, uint64_t ** const ppValues)
+{
+    const propcache_obj_t * po;
+    int rv = -ENOENT;
+
+    pthread_mutex_lock(&pc->lock);
+    if ((po = propcache_obj_find(pc, obj_id)) != NULL && po->obj_type == obj_type) {
+        const unsigned int n = po->n;
+        // n == 0 still needs a non-NULL alloc to look like the ioctl path
+        *ppValues = NULL;
+        if ((*ppPropids = malloc((n + 1) * sizeof(**ppPropids))) == NULL ||
+            (*ppValues = malloc((n + 1) * sizeof(**ppValues))) == NULL) {
+            free(*ppPropids);
+            *ppPropids = NULL;
+            rv = -ENOMEM;
+        }
+        else {
+            memcpy(*ppPropids, po->prop_ids, n * sizeof(**ppPropids));
+            memcpy(*ppValues, po->values, n * sizeof(**ppValues));
+            rv = (int)n;
+        }
+    }
+    pthread_mutex_unlock(&pc->lock);
+    return rv;
+}
+
+// Add props read at gen. Failure to add isn't an error
+static void
+propcache_obj_add(drmu_propcache_t * const pc, const unsigned int gen,
+                  const uint32_t obj_id, const uint32_t obj_type, const unsigned int n,
+                  const uint32_t * const propids, const uint64_t * const values)
+{
+    propcache_obj_t po = {.obj_id = obj_id, .obj_type = obj_type, .n = n};
+
+    if ((po.prop_ids = malloc((n + 1) * sizeof(*po.prop_ids))) == NULL ||
+        (po.values = malloc((n + 1) * sizeof(*po.values))) == NULL) {
+        propcache_obj_uninit(&po);
+        return;
+    }
+    // An obj with no props may come with NULL arrays
+    if (n != 0) {
+        memcpy(po.prop_ids, propids, n * sizeof(*po.prop_ids));
+        memcpy(po.values, values, n * sizeof(*po.values));
+    }
+
+    pthread_mutex_lock(&pc->lock);
+    if (gen != pc->gen || propcache_obj_find(pc, obj_id) != NULL ||
+        propcache_grow((void **)&pc->objs, &pc->obj_size, pc->obj_n + 1, sizeof(*pc->objs)) != 0) {
+        propcache_obj_uninit(&po);
+    }
+    else {
+        pc->objs[pc->obj_n++] = po;
+    }
+    pthread_mutex_unlock(&pc->lock);
+}
+
+static unsigned int
+propcache_gen(drmu_propcache_t * const pc)
+{
+    unsigned int gen;
+    pthread_mutex_lock(&pc->lock);
+    gen = pc->gen;
+    pthread_mutex_unlock(&pc->lock);
+    return gen;
+}
+
+static bool
+propcache_def_get(drmu_propcache_t * const pc, struct drm_mode_get_property * const prop)
+{
+    unsigned int i;
+    bool found = false;
+
+    pthread_mutex_lock(&pc->lock);
+    for (i = 0; i != pc->def_n; ++i) {
+        if (pc->defs[i].prop_id == prop->prop_id) {
+            *prop = pc->defs[i];
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pc->lock);
+    return found;
+}
+
+static bool
+propcache_nocache_name(const char * const name)
+{
+    const char * const * p;
+
+    for (p = propcache_nocache_names; *p != NULL; ++p) {
+        if (strcmp(*p, name) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Needs locked
+static bool
+propcache_nocache(const drmu_propcache_t * const pc, const uint32_t prop_id)
+{
+    unsigned int i;
+
+    for (i = 0; i != pc->nocache_n; ++i) {
+        if (pc->nocache_ids[i] == prop_id)
+            return true;
+    }
+    return false;
+}
+
+static void
+propcache_def_add(drmu_propcache_t * const pc, const struct drm_mode_get_property * const prop)
+{
+    pthread_mutex_lock(&pc->lock);
+    // Every prop id we commit has been looked up by name first so flagging
+    // here catches them before any commit
+    if (propcache_nocache_name(prop->name) && !propcache_nocache(pc, prop->prop_id) &&
+        pc->nocache_n < PROPCACHE_NOCACHE_MAX)
+        pc->nocache_ids[pc->nocache_n++] = prop->prop_id;
+    if (propcache_grow((void **)&pc->defs, &pc->def_size, pc->def_n + 1, sizeof(*pc->defs)) == 0) {
+        struct drm_mode_get_property * const p = pc->defs + pc->def_n++;
+        *p = *prop;
+        // Arrays weren't asked for - don't keep pointers to them
+        p->values_ptr = 0;
+        p->enum_blob_ptr = 0;
+    }
+    pthread_mutex_unlock(&pc->lock);
+}
+
+// Copy of cached blob data (NULL if zero length)
+// Returns 0, -ENOENT if not cached
+static int
+propcache_blob_get(drmu_propcache_t * const pc, const uint32_t blob_id, void ** const ppdata, size_t * const plen)
+{
+    unsigned int i;
+    int rv = -ENOENT;
+
+    pthread_mutex_lock(&pc->lock);
+    for (i = 0; i != pc->blob_n; ++i) {
+        const propcache_blob_t * const b = pc->blobs + i;
+        if (b->blob_id != blob_id)
+            continue;
+        rv = 0;
+        if (b->len != 0) {
+            if ((*ppdata = malloc(b->len)) == NULL)
+                rv = -ENOMEM;
+            else {
+                memcpy(*ppdata, b->data, b->len);
+                *plen = b->len;
+            }
+        }
+        break;
+    }
+    pthread_mutex_unlock(&pc->lock);
+    return rv;
+}
+
+static void
+propcache_blob_add(drmu_propcache_t * const pc, const unsigned int gen,
+                   const uint32_t blob_id, const void * const data, const size_t len)
+{
+    propcache_blob_t b = {.blob_id = blob_id, .len = len};
+
+    if (len != 0) {
+        if ((b.data = malloc(len)) == NULL)
+            return;
+        memcpy(b.data, data, len);
+    }
+
+    pthread_mutex_lock(&pc->lock);
+    if (gen != pc->gen ||
+        propcache_grow((void **)&pc->blobs, &pc->blob_size, pc->blob_n + 1, sizeof(*pc->blobs)) != 0)
+        free(b.data);
+    else
+        pc->blobs[pc->blob_n++] = b;
+    pthread_mutex_unlock(&pc->lock);
+}
+
+// Called when a blob is destroyed as its id may be reused
+static void
+propcache_blob_drop(drmu_propcache_t * const pc, const uint32_t blob_id)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&pc->lock);
+    for (i = 0; i != pc->blob_n; ++i) {
+        if (pc->blobs[i].blob_id == blob_id) {
+            free(pc->blobs[i].data);
+            pc->blobs[i] = pc->blobs[--pc->blob_n];
+            ++pc->gen;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pc->lock);
+}
+
+void
+drmu_env_prop_cache_commit(drmu_env_t * const du, const unsigned int n_objs,
+                           const uint32_t * const obj_ids, const uint32_t * const prop_counts,
+                           const uint32_t * const prop_ids, const uint64_t * const values)
+{
+    drmu_propcache_t * const pc = env_propcache(du);
+    unsigned int i, j, k;
+    unsigned int p0 = 0;
+
+    pthread_mutex_lock(&pc->lock);
+    ++pc->gen;
+    for (i = 0; i != n_objs; p0 += prop_counts[i++]) {
+        propcache_obj_t * const po = propcache_obj_find(pc, obj_ids[i]);
+
+        if (po == NULL)
+            continue;
+        // Props are sorted by id, the cache isn't, but the cache is short
+        for (j = p0; j != p0 + prop_counts[i]; ++j) {
+            if (propcache_nocache(pc, prop_ids[j]))
+                continue;
+            for (k = 0; k != po->n && po->prop_ids[k] != prop_ids[j]; ++k)
+                /* Loop */;
+            if (k == po->n)
+                break;
+            po->values[k] = values[j];
+        }
+        // Prop we don't know about - obj list must be stale
+        if (j != p0 + prop_counts[i]) {
+            propcache_obj_uninit(po);
+            *po = pc->objs[--pc->obj_n];
+        }
+    }
+    pthread_mutex_unlock(&pc->lock);
+}
+
+void
+drmu_env_prop_cache_invalidate(drmu_env_t * const du)
+{
+    propcache_invalidate(env_propcache(du));
+}
+
+// Drop values on any change uevent for our device
+// Kernel uevents are "action@devpath\0KEY=value\0..."
+static void
+propcache_uevent_cb(void * v, short revents)
+{
+    drmu_env_t * const du = v;
+    drmu_propcache_t * const pc = env_propcache(du);
+    char buf[2048];
+    ssize_t len;
+
+    (void)revents;
+
+    for (;;) {
+        struct sockaddr_nl addr;
+        socklen_t addr_len = sizeof(addr);
+        bool is_change;
+        bool is_drm = false;
+        unsigned int ev_major = ~0U;
+        unsigned int ev_minor = ~0U;
+        const char * p;
+
+        if ((len = recvfrom(pc->uevent_fd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&addr, &addr_len)) <= 0)
+            break;
+        // Only believe the kernel
+        if (addr_len != sizeof(addr) || addr.nl_pid != 0)
+            continue;
+        buf[len] = '\0';
+
+        is_change = strncmp(buf, "change@", 7) == 0;
+        for (p = buf; p < buf + len; p += strlen(p) + 1) {
+            if (strcmp(p, "SUBSYSTEM=drm") == 0)
+                is_drm = true;
+            else if (strncmp(p, "MAJOR=", 6) == 0)
+                ev_major = (unsigned int)strtoul(p + 6, NULL, 10);
+            else if (strncmp(p, "MINOR=", 6) == 0)
+                ev_minor = (unsigned int)strtoul(p + 6, NULL, 10);
+        }
+
+        if (is_change && is_drm && ev_major == major(pc->rdev) && ev_minor == minor(pc->rdev)) {
+            drmu_debug(du, "%s: Device changed - dropping cached props", __func__);
+            propcache_invalidate(pc);
+        }
+    }
+
+    pollqueue_add_task(pc->uevent_task, -1);
+}
+
+// Values are only cached if we can see uevents. Opened before anything is
+// read so that no change can be missed; uevents queue on the socket until
+// propcache_start
+static void
+propcache_uevent_open(drmu_propcache_t * const pc, drmu_env_t * const du, const int drm_fd)
+{
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = 1,     // Kernel uevents
+    };
+    struct stat st;
+    int fd;
+
+    if (fstat(drm_fd, &st) != 0 || !S_ISCHR(st.st_mode)) {
+        drmu_debug(du, "%s: DRM fd isn't a char device - not caching prop values", __func__);
+        return;
+    }
+    if ((fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT)) == -1) {
+        drmu_debug(du, "%s: Failed to open uevent socket: %s", __func__, strerror(errno));
+        return;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        drmu_debug(du, "%s: Failed to bind uevent socket: %s", __func__, strerror(errno));
+        close(fd);
+        return;
+    }
+    pc->rdev = st.st_rdev;
+    pc->uevent_fd = fd;
+}
+
+static bool
+propcache_values_enabled(const drmu_propcache_t * const pc)
+{
+    return pc->uevent_fd != -1;
+}
+
+// Called once the pollqueue exists
+static int
+propcache_start(drmu_propcache_t * const pc, drmu_env_t * const du, struct pollqueue * const pq)
+{
+    if (!propcache_values_enabled(pc))
+        return 0;
+    if ((pc->uevent_task = env_polltask_new(pq, pc->uevent_fd, POLLIN, propcache_uevent_cb, du)) == NULL)
+        return -ENOMEM;
+    pollqueue_add_task(pc->uevent_task, -1);
+    return 0;
+}
+
+static void
+propcache_uevent_stop(drmu_propcache_t * const pc)
+{
+    polltask_delete(&pc->uevent_task);
+    if (pc->uevent_fd != -1)
+        close(pc->uevent_fd);
+    pc->uevent_fd = -1;
+}
+
+static void
+propcache_init(drmu_propcache_t * const pc, drmu_env_t * const du, const int drm_fd)
+{
+    memset(pc, 0, sizeof(*pc));
+    pthread_mutex_init(&pc->lock, NULL);
+    pc->uevent_fd = -1;
+    propcache_uevent_open(pc, du, drm_fd);
+}
+
+static void
+propcache_uninit(drmu_propcache_t * const pc)
+{
+    propcache_uevent_stop(pc);
+    propcache_clear_values(pc);
+    free(pc->objs);
+    free(pc->blobs);
+    free(pc->defs);
+    pthread_mutex_destroy(&pc->lock);
+}
+
 //----------------------------------------------------------------------------
 //
 // Blob fns
@@ -124,6 +645,7 @@ blob_free(drmu_blob_t * const blob)
         };
         if (drmu_ioctl(du, DRM_IOCTL_MODE_DESTROYPROPBLOB, &dblob) != 0)
             drmu_err(du, "%s: Failed to destroy blob: %s", __func__, strerror(errno));
+        propcache_blob_drop(env_propcache(du), blob->blob_id);
     }
     free(blob->data);
     free(blob);
@@ -233,6 +755,9 @@ drmu_blob_update(drmu_env_t * const du, drmu_blob_t ** const ppblob, const void
 static int
 blob_data_read(drmu_env_t * const du, uint32_t blob_id, void ** const ppdata, size_t * plen)
 {
+    drmu_propcache_t * const pc = env_propcache(du);
+    const bool cache = propcache_values_enabled(pc);
+    const unsigned int gen = propcache_gen(pc);
     uint8_t * data;
     struct drm_mode_get_blob gblob = {.blob_id = blob_id};
     int rv;
@@ -243,11 +768,17 @@ blob_data_read(drmu_env_t * const du, uint32_t blob_id, void ** const ppdata, si
     if (blob_id == 0)
         return 0;
 
+    if (cache && (rv = propcache_blob_get(pc, blob_id, ppdata, plen)) != -ENOENT)
+        return rv;
+
     if ((rv = drmu_ioctl(du, DRM_IOCTL_MODE_GETPROPBLOB, &gblob)) != 0)
         return rv;
 
-    if (gblob.length == 0)
+    if (gblob.length == 0) {
+        if (cache)
+            propcache_blob_add(pc, gen, blob_id, NULL, 0);
         return 0;
+    }
 
     if ((gblob.data = io_alloc(data, gblob.length)) == 0)
         return -ENOMEM;
@@ -257,6 +788,8 @@ blob_data_read(drmu_env_t * const du, uint32_t blob_id, void ** const ppdata, si
         return rv;
     }
 
+    if (cache)
+        propcache_blob_add(pc, gen, blob_id, data, gblob.length);
     *ppdata = data;
     *plen = gblob.length;
     return 0;
@@ -749,17 +1282,112 @@ typedef struct drmu_bo_s {
     struct drmu_env_s * du;
     enum drmu_bo_type_e bo_type;
     uint32_t handle;
-
-    // FD only els - FD BOs need to be tracked globally
-    struct drmu_bo_s * next;
-    struct drmu_bo_s * prev;
 } drmu_bo_t;
 
+// FD BOs need to be tracked globally - they are kept in an open addressed
+// hash keyed on GEM handle (linear probe, backward shift delete)
+#define BO_HASH_SIZE_MIN 64
+
 typedef struct drmu_bo_env_s {
     pthread_mutex_t lock;
-    drmu_bo_t * fd_head;
+    unsigned int fd_count;
+    unsigned int hash_size;  // Always power of 2 (or 0)
+    drmu_bo_t ** fd_hash;
 } drmu_bo_env_t;
 
+static inline unsigned int
+bo_hash_idx(const drmu_bo_env_t * const boe, const uint32_t handle)
+{
+    // Handles tend to be small & sequential so Fibonacci hash them
+    return (handle * 0x9E3779B1U) & (boe->hash_size - 1);
+}
+
+// BOE lock expected
+static drmu_bo_t *
+bo_hash_find(const drmu_bo_env_t * const boe, const uint32_t handle)
+{
+    unsigned int i;
+    drmu_bo_t * bo;
+
+    if (boe->fd_count == 0)
+        return NULL;
+
+    for (i = bo_hash_idx(boe, handle); (bo = boe->fd_hash[i]) != NULL; i = (i + 1) & (boe->hash_size - 1)) {
+        if (bo->handle == handle)
+            return bo;
+    }
+    return NULL;
+}
+
+// BOE lock expected
+// Table must have a free slot
+static void
+bo_hash_insert(drmu_bo_env_t * const boe, drmu_bo_t * const bo)
+{
+    unsigned int i = bo_hash_idx(boe, bo->handle);
+
+    while (boe->fd_hash[i] != NULL)
+        i = (i + 1) & (boe->hash_size - 1);
+    boe->fd_hash[i] = bo;
+    ++boe->fd_count;
+}
+
+// BOE lock expected
+// Keep load <= 1/2
+static int
+bo_hash_reserve(drmu_bo_env_t * const boe)
+{
+    drmu_bo_t ** const old_hash = boe->fd_hash;
+    const unsigned int old_size = boe->hash_size;
+    unsigned int i;
+
+    if ((boe->fd_count + 1) * 2 <= old_size)
+        return 0;
+
+    boe->hash_size = old_size == 0 ? BO_HASH_SIZE_MIN : old_size * 2;
+    if ((boe->fd_hash = calloc(boe->hash_size, sizeof(*boe->fd_hash))) == NULL) {
+        boe->fd_hash = old_hash;
+        boe->hash_size = old_size;
+        return -ENOMEM;
+    }
+
+    boe->fd_count = 0;
+    for (i = 0; i != old_size; ++i) {
+        if (old_hash[i] != NULL)
+            bo_hash_insert(boe, old_hash[i]);
+    }
+    free(old_hash);
+    return 0;
+}
+
+// BOE lock expected
+static void
+bo_hash_remove(drmu_bo_env_t * const boe, const drmu_bo_t * const bo)
+{
+    const unsigned int mask = boe->hash_size - 1;
+    unsigned int i, j;
+
+    if (boe->fd_count == 0)
+        return;
+
+    for (i = bo_hash_idx(boe, bo->handle); boe->fd_hash[i] != bo; i = (i + 1) & mask) {
+        if (boe->fd_hash[i] == NULL)
+            return;
+    }
+
+    // Shift back any following els that would no longer be found
+    for (j = (i + 1) & mask; boe->fd_hash[j] != NULL; j = (j + 1) & mask) {
+        const unsigned int k = bo_hash_idx(boe, boe->fd_hash[j]->handle);
+        // Move if the home slot k is not cyclically in (i, j]
+        if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+            boe->fd_hash[i] = boe->fd_hash[j];
+            i = j;
+        }
+    }
+    boe->fd_hash[i] = NULL;
+    --boe->fd_count;
+}
+
 static int
 bo_close(drmu_env_t * const du, uint32_t * const ph)
 {
@@ -794,14 +1422,9 @@ bo_free_fd(drmu_bo_t * const bo)
         drmu_bo_env_t *const boe = env_boe(du);
         const uint32_t h = bo->handle;
 
+        bo_hash_remove(boe, bo);
         if (bo_close(du, &bo->handle) != 0)
             drmu_warn(du, "%s: Failed to close BO handle %d", __func__, h);
-        if (bo->next != NULL)
-            bo->next->prev = bo->prev;
-        if (bo->prev != NULL)
-            bo->prev->next = bo->next;
-        else
-            boe->fd_head = bo->next;
     }
     free(bo);
 }
@@ -911,23 +1534,17 @@ drmu_bo_new_fd(drmu_env_t *const du, const int fd)
         goto unlock;
     }
 
-    bo = boe->fd_head;
-    while (bo != NULL && bo->handle != ph.handle)
-        bo = bo->next;
-
-    if (bo != NULL) {
+    if ((bo = bo_hash_find(boe, ph.handle)) != NULL) {
         drmu_bo_ref(bo);
     }
     else {
-        if ((bo = bo_alloc(du, BO_TYPE_FD)) == NULL) {
+        if (bo_hash_reserve(boe) != 0 || (bo = bo_alloc(du, BO_TYPE_FD)) == NULL) {
+            drmu_err(du, "%s: Failed to track BO", __func__);
             bo_close(du, &ph.handle);
         }
         else {
             bo->handle = ph.handle;
-
-            if ((bo->next = boe->fd_head) != NULL)
-                bo->next->prev = bo;
-            boe->fd_head = bo;
+            bo_hash_insert(boe, bo);
         }
     }
 
@@ -961,16 +1578,29 @@ drmu_bo_new_dumb(drmu_env_t *const du, struct drm_mode_create_dumb * const d)
 void
 drmu_bo_env_uninit(drmu_bo_env_t * const boe)
 {
-    if (boe->fd_head != NULL)
-        drmu_warn(boe->fd_head->du, "%s: fd chain not null", __func__);
-    boe->fd_head = NULL;
+    unsigned int i;
+
+    if (boe->fd_count != 0) {
+        for (i = 0; i != boe->hash_size; ++i) {
+            if (boe->fd_hash[i] != NULL) {
+                drmu_warn(boe->fd_hash[i]->du, "%s: %d fd BOs still tracked", __func__, boe->fd_count);
+                break;
+            }
+        }
+    }
+    free(boe->fd_hash);
+    boe->fd_hash = NULL;
+    boe->hash_size = 0;
+    boe->fd_count = 0;
     pthread_mutex_destroy(&boe->lock);
 }
 
 void
 drmu_bo_env_init(drmu_bo_env_t * boe)
 {
-    boe->fd_head = NULL;
+    boe->fd_count = 0;
+    boe->hash_size = 0;
+    boe->fd_hash = NULL;
     pthread_mutex_init(&boe->lock, NULL);
 }
 
@@ -990,11 +1620,21 @@ typedef struct drmu_fb_s {
     drmu_rect_t active;     // Area that was asked for inside the buffer; pixels
     drmu_rect_t crop;       // Cropping inside that; fractional pels (16.16, 16.16)
 
-    int buf_fd;
-
-    void * map_ptr;
-    size_t map_size;
+    // Buffer objects we own, indexed as bo_list
+    // If map is lazy then an obj is mapped on first CPU access so map_ptr
+    // can go from NULL to set at any time (but never back)
+    struct {
+        int fd;             // dmabuf, -1 if none
+        int map_fd;         // What to mmap (not owned), -1 if none
+        uint64_t map_offset;
+        _Atomic(void *) map_ptr;
+        size_t map_size;
+    } objs[4];
+    uint8_t layer_obj[4];   // Object index of each layer
     size_t map_pitch;
+    drmu_fb_map_t map;
+    bool map_huge;
+    bool coherent;          // CPU access needs no sync
 
     drmu_bo_t * bo_list[4];
 
@@ -1012,6 +1652,8 @@ typedef struct drmu_fb_s {
     void * on_delete_v;
     drmu_fb_on_delete_fn on_delete_fn;
 
+    struct drmu_fb_s * free_next;  // Deferred free list
+
     // We pass a pointer to this to DRM which defines it as s32 so do not use
     // int that might be s64.
     int32_t fence_fd;
@@ -1047,15 +1689,13 @@ drmu_fb_out_fence_wait(drmu_fb_t * const fb, const int timeout_ms)
     return rv;
 }
 
-void
-drmu_fb_int_free(drmu_fb_t * const dfb)
+// Release everything - may be deferred to the env background worker
+static void
+fb_destroy(drmu_fb_t * const dfb)
 {
     drmu_env_t * const du = dfb->du;
     unsigned int i;
 
-    if (dfb->pre_delete_fn && dfb->pre_delete_fn(dfb, dfb->pre_delete_v) != 0)
-        return;
-
     // * If we implement callbacks this logic will want revision
     if (dfb->fence_fd != -1) {
         drmu_warn(du, "Out fence still set on FB on delete");
@@ -1068,14 +1708,19 @@ drmu_fb_int_free(drmu_fb_t * const dfb)
     if (dfb->fb.fb_id != 0)
         drmu_ioctl(du, DRM_IOCTL_MODE_RMFB, &dfb->fb.fb_id);
 
-    if (dfb->map_ptr != NULL && dfb->map_ptr != MAP_FAILED)
-        munmap(dfb->map_ptr, dfb->map_size);
+    for (i = 0; i != 4; ++i) {
+        void * const map_ptr = dfb->objs[i].map_ptr;
+        if (map_ptr != NULL && map_ptr != MAP_FAILED)
+            munmap(map_ptr, dfb->objs[i].map_size);
+    }
 
     for (i = 0; i != 4; ++i)
         drmu_bo_unref(dfb->bo_list + i);
 
-    if (dfb->buf_fd != -1)
-        close(dfb->buf_fd);
+    for (i = 0; i != 4; ++i) {
+        if (dfb->objs[i].fd != -1)
+            close(dfb->objs[i].fd);
+    }
 
     // Call on_delete last so we have stopped using anything that might be
     // freed by it
@@ -1090,6 +1735,18 @@ drmu_fb_int_free(drmu_fb_t * const dfb)
     }
 }
 
+void
+drmu_fb_int_free(drmu_fb_t * const dfb)
+{
+    if (dfb->pre_delete_fn && dfb->pre_delete_fn(dfb, dfb->pre_delete_v) != 0)
+        return;
+
+    if (env_fb_free_defer(dfb->du, dfb))
+        return;
+
+    fb_destroy(dfb);
+}
+
 void
 drmu_fb_unref(drmu_fb_t ** const ppdfb)
 {
@@ -1169,10 +1826,90 @@ drmu_fb_pitch2(const drmu_fb_t *const dfb, const unsigned int layer)
     return 0;
 }
 
+// Fault in all of a mapping that was made without MAP_POPULATE
+// MADV_POPULATE_WRITE fails on some exporters' mappings (EINVAL on PFN maps)
+// and may not be defined at all, so fall back to reading a byte from each
+// page - the same read faults MAP_POPULATE does on a shared map
+static void
+map_populate(drmu_env_t * const du, void * const map_ptr, const size_t size)
+{
+    const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    const volatile uint8_t * p = map_ptr;
+    size_t i;
+
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(map_ptr, size, MADV_POPULATE_WRITE) == 0)
+        return;
+    drmu_debug(du, "%s: MADV_POPULATE_WRITE failed: %s", __func__, strerror(errno));
+#else
+    (void)du;
+#endif
+
+    for (i = 0; i < size; i += page_size)
+        (void)p[i];
+}
+
+// mmap obj as the fb's map policy says
+// Returns NULL on failure
+static void *
+fb_obj_mmap(drmu_fb_t * const dfb, const unsigned int obj, const bool populate)
+{
+    const int fd = dfb->objs[obj].map_fd;
+    const size_t size = dfb->objs[obj].map_size;
+    void * map_ptr;
+
+    // If we want huge pages then populating before madvise would fault in
+    // small ones
+    if ((map_ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | (populate && !dfb->map_huge ? MAP_POPULATE : 0),
+                        fd, (off_t)dfb->objs[obj].map_offset)) == MAP_FAILED) {
+        drmu_err(dfb->du, "%s: mmap failed (size=%zd, fd=%d, off=%#"PRIx64"): %s", __func__,
+                 size, fd, dfb->objs[obj].map_offset, strerror(errno));
+        return NULL;
+    }
+
+    if (dfb->map_huge) {
+        // Only some exporters can back a shared mapping with huge pages
+        if (madvise(map_ptr, size, MADV_HUGEPAGE) != 0)
+            drmu_debug(dfb->du, "%s: No huge pages (fd=%d): %s", __func__, fd, strerror(errno));
+        if (populate)
+            map_populate(dfb->du, map_ptr, size);
+    }
+    return map_ptr;
+}
+
+// Map an obj of a lazily mapped fb
+// Returns NULL if not mappable or the map fails
+static void *
+fb_map(drmu_fb_t * const dfb, const unsigned int obj)
+{
+    void * map_ptr = atomic_load(&dfb->objs[obj].map_ptr);
+    void * expected = NULL;
+
+    if (map_ptr != NULL || dfb->map != DRMU_FB_MAP_LAZY || dfb->objs[obj].map_fd == -1)
+        return map_ptr;
+
+    if ((map_ptr = fb_obj_mmap(dfb, obj, false)) == NULL)
+        return NULL;
+    // Lost a race to map?
+    if (!atomic_compare_exchange_strong(&dfb->objs[obj].map_ptr, &expected, map_ptr)) {
+        munmap(map_ptr, dfb->objs[obj].map_size);
+        map_ptr = expected;
+    }
+    return map_ptr;
+}
+
 void *
 drmu_fb_data(const drmu_fb_t *const dfb, const unsigned int layer)
 {
-    return (layer >= 4 || dfb->map_ptr == NULL) ? NULL : (uint8_t * )dfb->map_ptr + dfb->fb.offsets[layer];
+    uint8_t * map_ptr;
+
+    if (layer >= 4)
+        return NULL;
+    // Mapping doesn't change the fb as far as the caller can see
+    if ((map_ptr = fb_map((drmu_fb_t *)dfb, dfb->layer_obj[layer])) == NULL)
+        return NULL;
+    return map_ptr + dfb->fb.offsets[layer];
 }
 
 drmu_bo_t *
@@ -1181,6 +1918,17 @@ drmu_fb_bo(const drmu_fb_t * const dfb, const unsigned int layer)
     return (layer >= 4) ? NULL : dfb->bo_list[layer];
 }
 
+size_t
+drmu_fb_size(const drmu_fb_t *const dfb)
+{
+    size_t size = 0;
+    unsigned int i;
+
+    for (i = 0; i != 4; ++i)
+        size += dfb->objs[i].map_size;
+    return size;
+}
+
 uint32_t
 drmu_fb_width(const drmu_fb_t *const dfb)
 {
@@ -1264,24 +2012,58 @@ drmu_fb_int_bo_set(drmu_fb_t *const dfb, unsigned int i, drmu_bo_t * const bo)
     dfb->bo_list[i] = bo;
 }
 
+void
+drmu_fb_int_obj_fd_set(drmu_fb_t *const dfb, const unsigned int obj, const int fd)
+{
+    dfb->objs[obj].fd = fd;
+}
+
+int
+drmu_fb_int_obj_map_set(drmu_fb_t *const dfb, const unsigned int obj,
+                        const int map_fd, const uint64_t offset, const size_t size,
+                        const drmu_fb_map_t map, const bool huge)
+{
+    void * map_ptr;
+
+    dfb->objs[obj].map_fd = map_fd;
+    dfb->objs[obj].map_offset = offset;
+    dfb->objs[obj].map_size = size;
+    dfb->map = map == DRMU_FB_MAP_DEFAULT ? DRMU_FB_MAP_POPULATE : map;
+    dfb->map_huge = huge;
+
+    if (dfb->map != DRMU_FB_MAP_POPULATE)
+        return 0;
+    if ((map_ptr = fb_obj_mmap(dfb, obj, true)) == NULL)
+        return -ENOMEM;
+    dfb->objs[obj].map_ptr = map_ptr;
+    return 0;
+}
+
 void
 drmu_fb_int_fd_set(drmu_fb_t *const dfb, const int fd)
 {
-    dfb->buf_fd = fd;
+    drmu_fb_int_obj_fd_set(dfb, 0, fd);
 }
 
 void
 drmu_fb_int_mmap_set(drmu_fb_t *const dfb, void * const buf, const size_t size, const size_t pitch)
 {
-    dfb->map_ptr = buf;
-    dfb->map_size = size;
+    dfb->objs[0].map_ptr = buf;
+    dfb->objs[0].map_size = size;
     dfb->map_pitch = pitch;
 }
 
+void
+drmu_fb_int_coherent_set(drmu_fb_t *const dfb, const bool coherent)
+{
+    dfb->coherent = coherent;
+}
+
 void
 drmu_fb_int_layer_mod_set(drmu_fb_t *const dfb, unsigned int i, unsigned int obj_idx, uint32_t pitch, uint32_t offset, uint64_t modifier)
 {
     dfb->fb.handles[i] = dfb->bo_list[obj_idx]->handle;
+    dfb->layer_obj[i] = (uint8_t)obj_idx;
     dfb->fb.pitches[i] = pitch;
     dfb->fb.offsets[i] = offset;
     // We should be able to have "invalid" modifiers and not set the flag
@@ -1321,6 +2103,12 @@ drmu_fb_hdr_metadata_set(drmu_fb_t *const dfb, const struct hdr_output_metadata
     }
 }
 
+void
+drmu_fb_int_hdr_metadata_unset(drmu_fb_t *const dfb)
+{
+    dfb->hdr_metadata_isset = DRMU_ISSET_UNSET;
+}
+
 drmu_isset_t
 drmu_fb_hdr_metadata_isset(const drmu_fb_t *const dfb)
 {
@@ -1367,12 +2155,17 @@ drmu_fb_t *
 drmu_fb_int_alloc(drmu_env_t * const du)
 {
     drmu_fb_t * const dfb = calloc(1, sizeof(*dfb));
+    unsigned int i;
+
     if (dfb == NULL)
         return NULL;
 
     dfb->du = du;
     dfb->chroma_siting = DRMU_CHROMA_SITING_UNSPECIFIED;
-    dfb->buf_fd = -1;
+    for (i = 0; i != 4; ++i) {
+        dfb->objs[i].fd = -1;
+        dfb->objs[i].map_fd = -1;
+    }
     dfb->fence_fd = -1;
     return dfb;
 }
@@ -1402,16 +2195,31 @@ fb_sync(drmu_fb_t * const dfb, unsigned int flags)
     struct dma_buf_sync sync = {
         .flags = flags
     };
-    if (dfb->buf_fd == -1 || dfb->map_ptr == NULL)
+    unsigned int i;
+    int rv = 0;
+
+    if (dfb->coherent)
         return 0;
-    while (ioctl(dfb->buf_fd, DMA_BUF_IOCTL_SYNC, &sync) == -1) {
-        const int err = errno;
-        if (errno == EINTR)
+
+    for (i = 0; i != 4; ++i) {
+        if (dfb->objs[i].fd == -1)
             continue;
-        drmu_debug(dfb->du, "%s: ioctl failed: flags=%#x\n", __func__, flags);
-        return -err;
+        // Map lazy fbs at start of access so that end always has a matching start
+        if ((flags & DMA_BUF_SYNC_END) == 0)
+            fb_map(dfb, i);
+        if (atomic_load(&dfb->objs[i].map_ptr) == NULL)
+            continue;
+        while (ioctl(dfb->objs[i].fd, DMA_BUF_IOCTL_SYNC, &sync) == -1) {
+            const int err = errno;
+            if (errno == EINTR)
+                continue;
+            drmu_debug(dfb->du, "%s: ioctl failed: flags=%#x\n", __func__, flags);
+            if (rv == 0)
+                rv = -err;
+            break;
+        }
     }
-    return 0;
+    return rv;
 }
 
 int drmu_fb_write_start(drmu_fb_t * const dfb)
@@ -1498,13 +2306,98 @@ fb_pitches_set_mod(drmu_fb_t * const dfb, uint64_t mod)
     }
 }
 
+static bool
+is_pow2_or_0(const uint32_t x)
+{
+    return (x & (x - 1)) == 0;
+}
+
+static uint32_t
+align_up(const uint32_t x, const uint32_t align)
+{
+    return align == 0 ? x : (x + align - 1) & ~(align - 1);
+}
+
+int
+drmu_fb_layout_planes(const drmu_fb_layout_t * const layout, const uint32_t format,
+                      const uint32_t w, const uint32_t h, drmu_fb_planes_t * const planes)
+{
+    static const drmu_fb_layout_t layout_default = {0};
+    const drmu_fb_layout_t * const lo = layout != NULL ? layout : &layout_default;
+    const drmu_fmt_info_t * const fmti = drmu_fmt_info_find_fmt(format);
+    unsigned int bypp;
+    unsigned int i;
+    size_t offset = 0;
+
+    memset(planes, 0, sizeof(*planes));
+
+    if (fmti == NULL || (bypp = (drmu_fmt_info_pixel_bits(fmti) + 7) / 8) == 0)
+        return -EINVAL;
+    if (!is_pow2_or_0(lo->w_align) || !is_pow2_or_0(lo->h_align) || !is_pow2_or_0(lo->offset_align))
+        return -EINVAL;
+
+    planes->width = align_up(w, lo->w_align != 0 ? lo->w_align : 16);
+    planes->height = align_up(h, lo->h_align != 0 ? lo->h_align : 16);
+    planes->plane_count = drmu_fmt_info_plane_count(fmti);
+    planes->obj_count = lo->separate_objects ? planes->plane_count : 1;
+
+    for (i = 0; i != planes->plane_count; ++i) {
+        const unsigned int hdiv = drmu_fmt_info_hdiv(fmti, i);
+        const uint32_t pitch = align_up(planes->width * bypp / drmu_fmt_info_wdiv(fmti, i), lo->pitch_align[i]);
+        // Padding is allocated but not part of the fb height
+        const size_t size = (size_t)pitch * ((planes->height + lo->h_pad + hdiv - 1) / hdiv);
+
+        if (!is_pow2_or_0(lo->pitch_align[i]))
+            return -EINVAL;
+
+        planes->pitch[i] = pitch;
+        if (lo->separate_objects) {
+            planes->obj[i] = i;
+            planes->offset[i] = 0;
+            planes->obj_size[i] = size;
+        }
+        else {
+            offset = align_up((uint32_t)offset, lo->offset_align);
+            planes->obj[i] = 0;
+            planes->offset[i] = (uint32_t)offset;
+            offset += size;
+            planes->obj_size[0] = offset;
+        }
+    }
+    return 0;
+}
+
+// Set up mapping of a dumb BO in obj
+static int
+fb_dumb_obj_map(drmu_fb_t * const dfb, const unsigned int obj, const size_t size,
+                const drmu_fb_map_t map, const bool huge)
+{
+    drmu_env_t * const du = dfb->du;
+    struct drm_mode_map_dumb map_dumb = {
+        .handle = dfb->bo_list[obj]->handle
+    };
+    int rv;
+
+    if (map == DRMU_FB_MAP_NONE) {
+        // Still want the size
+        return drmu_fb_int_obj_map_set(dfb, obj, -1, 0, size, map, huge);
+    }
+
+    if ((rv = drmu_ioctl(du, DRM_IOCTL_MODE_MAP_DUMB, &map_dumb)) != 0)
+    {
+        drmu_err(du, "%s: map dumb failed: %s", __func__, strerror(-rv));
+        return rv;
+    }
+
+    return drmu_fb_int_obj_map_set(dfb, obj, drmu_fd(du), map_dumb.offset, size, map, huge);
+}
+
 drmu_fb_t *
 drmu_fb_new_dumb_mod(drmu_env_t * const du, uint32_t w, uint32_t h,
                      const uint32_t format, const uint64_t mod)
 {
     drmu_fb_t * const dfb = drmu_fb_int_alloc(du);
     uint32_t bpp;
-    int rv;
     uint32_t w2;
     const uint32_t s30_cw = 128 / 4 * 3;
 
@@ -1545,40 +2438,78 @@ drmu_fb_new_dumb_mod(drmu_env_t * const du, uint32_t w, uint32_t h,
         drmu_fb_int_bo_set(dfb, 0, bo);
 
         dfb->map_pitch = dumb.pitch;
-        dfb->map_size = (size_t)dumb.size;
+        if (fb_dumb_obj_map(dfb, 0, (size_t)dumb.size, DRMU_FB_MAP_DEFAULT, false) != 0)
+            goto fail;
     }
 
-    {
-        struct drm_mode_map_dumb map_dumb = {
-            .handle = dfb->bo_list[0]->handle
+    fb_pitches_set_mod(dfb, mod);
+
+    if (drmu_fb_int_make(dfb))
+        goto fail;
+
+    drmu_debug(du, "Create dumb %p %s %dx%d / %dx%d size: %zd", dfb,
+               drmu_log_fourcc(format), dfb->fb.width, dfb->fb.height, dfb->active.w, dfb->active.h, drmu_fb_size(dfb));
+    return dfb;
+
+fail:
+    drmu_fb_int_free(dfb);
+    return NULL;
+}
+
+drmu_fb_t *
+drmu_fb_new_dumb_layout(drmu_env_t * const du, uint32_t w, uint32_t h,
+                        const uint32_t format, const uint64_t mod,
+                        const drmu_fb_layout_t * const layout)
+{
+    drmu_fb_t * dfb;
+    drmu_fb_planes_t planes;
+    unsigned int i;
+
+    if (layout == NULL)
+        return drmu_fb_new_dumb_mod(du, w, h, format, mod);
+
+    if (fourcc_mod_broadcom_mod(mod) == DRM_FORMAT_MOD_BROADCOM_SAND128) {
+        drmu_err(du, "%s: Sand has a fixed layout", __func__);
+        return NULL;
+    }
+    if (drmu_fb_layout_planes(layout, format, w, h, &planes) != 0) {
+        drmu_err(du, "%s: Bad layout for %s", __func__, drmu_log_fourcc(format));
+        return NULL;
+    }
+    if ((dfb = drmu_fb_int_alloc(du)) == NULL) {
+        drmu_err(du, "%s: Alloc failure", __func__);
+        return NULL;
+    }
+
+    drmu_fb_int_fmt_size_set(dfb, format, planes.width, planes.height, drmu_rect_wh(w, h));
+
+    // Dumb objects are just bytes to us - driver may round up pitch & size
+    for (i = 0; i != planes.obj_count; ++i) {
+        const uint32_t width = planes.pitch[i];  // 1st plane in obj i
+        struct drm_mode_create_dumb dumb = {
+            .height = (uint32_t)((planes.obj_size[i] + width - 1) / width),
+            .width = width,
+            .bpp = 8
         };
-        void * map_ptr;
+        drmu_bo_t * const bo = drmu_bo_new_dumb(du, &dumb);
 
-        if ((rv = drmu_ioctl(du, DRM_IOCTL_MODE_MAP_DUMB, &map_dumb)) != 0)
-        {
-            drmu_err(du, "%s: map dumb failed: %s", __func__, strerror(-rv));
+        if (bo == NULL)
             goto fail;
-        }
-
-        // Avoid having to test for MAP_FAILED when testing for mapped/unmapped
-        if ((map_ptr = mmap(NULL, dfb->map_size,
-                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
-                            drmu_fd(du), map_dumb.offset)) == MAP_FAILED) {
-            drmu_err(du, "%s: mmap failed (size=%zd, fd=%d, off=%#"PRIx64"): %s", __func__,
-                     dfb->map_size, drmu_fd(du), map_dumb.offset, strerror(errno));
+        drmu_fb_int_bo_set(dfb, i, bo);
+        if (fb_dumb_obj_map(dfb, i, (size_t)dumb.size, layout->map, layout->map_huge) != 0)
             goto fail;
-        }
-
-        dfb->map_ptr = map_ptr;
     }
+    dfb->map_pitch = planes.pitch[0];
 
-    fb_pitches_set_mod(dfb, mod);
+    for (i = 0; i != planes.plane_count; ++i)
+        drmu_fb_int_layer_mod_set(dfb, i, planes.obj[i], planes.pitch[i], planes.offset[i], mod);
 
     if (drmu_fb_int_make(dfb))
         goto fail;
 
-    drmu_debug(du, "Create dumb %p %s %dx%d / %dx%d size: %zd", dfb,
-               drmu_log_fourcc(format), dfb->fb.width, dfb->fb.height, dfb->active.w, dfb->active.h, dfb->map_size);
+    drmu_debug(du, "Create dumb %p %s %dx%d / %dx%d size: %zd objs: %u", dfb,
+               drmu_log_fourcc(format), dfb->fb.width, dfb->fb.height, dfb->active.w, dfb->active.h,
+               drmu_fb_size(dfb), planes.obj_count);
     return dfb;
 
 fail:
@@ -1635,20 +2566,29 @@ atomic_prop_fb_ref(void * v)
     drmu_fb_ref(v);
 }
 
+static const drmu_atomic_prop_fns_t atomic_prop_fb_fns = {
+    .ref    = atomic_prop_fb_ref,
+    .unref  = atomic_prop_fb_unref,
+    .commit = drmu_prop_fn_null_commit,
+};
+
+int
+drmu_atomic_template_set_fb(drmu_atomic_template_t * const dt, const unsigned int slot, drmu_fb_t * const dfb)
+{
+    if (dfb == NULL)
+        return drmu_atomic_template_set_value(dt, slot, 0);
+    return drmu_atomic_template_set_generic(dt, slot, dfb->fb.fb_id, &atomic_prop_fb_fns, dfb);
+}
+
 int
 drmu_atomic_add_prop_fb(drmu_atomic_t * const da, const uint32_t obj_id, const uint32_t prop_id, drmu_fb_t * const dfb)
 {
     int rv;
-    static const drmu_atomic_prop_fns_t fns = {
-        .ref    = atomic_prop_fb_ref,
-        .unref  = atomic_prop_fb_unref,
-        .commit = drmu_prop_fn_null_commit,
-    };
 
     if (dfb == NULL)
         return drmu_atomic_add_prop_value(da, obj_id, prop_id, 0);
 
-    rv = drmu_atomic_add_prop_generic(da, obj_id, prop_id, dfb->fb.fb_id, &fns, dfb);
+    rv = drmu_atomic_add_prop_generic(da, obj_id, prop_id, dfb->fb.fb_id, &atomic_prop_fb_fns, dfb);
     if (rv != 0)
         drmu_warn(drmu_atomic_env(da), "%s: Failed to add fb obj_id=%#x, prop_id=%#x: %s", __func__, obj_id, prop_id, strerror(-rv));
 
@@ -1789,10 +2729,16 @@ propinfo_fill(drmu_env_t * const du, drmu_propinfo_t * const inf, uint32_t propi
 {
     int rv;
 
+    drmu_propcache_t * const pc = env_propcache(du);
+
     inf->val = val;
     inf->prop.prop_id = propid;
+    if (propcache_def_get(pc, &inf->prop))
+        return 0;
     if ((rv = drmu_ioctl(du, DRM_IOCTL_MODE_GETPROPERTY, &inf->prop)) != 0)
         drmu_err(du, "Failed to get property %d: %s", propid, strerror(-rv));
+    else
+        propcache_def_add(pc, &inf->prop);
     return rv;
 }
 
@@ -1804,11 +2750,17 @@ props_get_properties(drmu_env_t * const du, const uint32_t objid, const uint32_t
         .obj_id = objid,
         .obj_type = objtype,
     };
+    drmu_propcache_t * const pc = env_propcache(du);
+    const bool cache = propcache_values_enabled(pc);
+    const unsigned int gen = propcache_gen(pc);
     uint64_t * values = NULL;
     uint32_t * propids = NULL;
     unsigned int n = 0;
     int rv;
 
+    if (cache && (rv = propcache_obj_get(pc, objid, objtype, ppPropids, ppValues)) != -ENOENT)
+        return rv;
+
     for (;;) {
         if ((rv = drmu_ioctl(du, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &obj_props)) != 0) {
             drmu_err(du, "drmModeObjectGetProperties failed: %s", strerror(-rv));
@@ -1831,6 +2783,8 @@ props_get_properties(drmu_env_t * const du, const uint32_t objid, const uint32_t
         }
     }
 
+    if (cache)
+        propcache_obj_add(pc, gen, objid, objtype, n, propids, values);
     *ppValues = values;
     *ppPropids = propids;
     return (int)n;
@@ -2653,142 +3607,773 @@ drmu_conn_claim_ref(drmu_conn_t * const dn)
 //
 // Atomic Q fns (internal)
 
+// Flips are tracked per CRTC so that a slow flip on one output does not
+// hold up the others. Atomics are routed by the CRTCs their objects are
+// bound to; one that touches >1 CRTC is held as span_next until all of its
+// CRTCs are idle and is then in flight on all of them until every CRTC has
+// reported its flip.
+//
+// Atomics with a target time are held on the CRTC timed list until the
+// CRTC is idle and the next vblank is the one nearest their target. If more
+// than one is due at once only the latest is committed.
+
+// Bin of each flip in the histogram window so it can be removed when it
+// drops out
+typedef struct atomic_q_hist_ent_s {
+    uint8_t latency;
+    uint8_t interval;
+    uint8_t error;              // HIST_NONE if untimed
+} atomic_q_hist_ent_t;
+#define HIST_NONE 0xff
+
+typedef struct atomic_q_crtc_s {
+    struct drmu_atomic_q_s * aq;
+    unsigned int idx;
+    drmu_atomic_t * next_flip;  // Pending commit for this CRTC alone
+    drmu_atomic_t * cur_flip;   // In flight - may be == span_cur (not reffed)
+    unsigned int retry_count;
+
+    drmu_atomic_t ** timed;     // [timed_n] Sorted by target
+    unsigned int timed_n;
+    unsigned int timed_size;
+    uint64_t wake_ns;           // Time timed_task is Qed for, 0 if not Qed
+    struct polltask * timed_task;
+
+    uint64_t vbl_ns;            // Time of last flip, 0 if none yet
+    uint32_t vbl_seq;           // Sequence of last flip
+    uint64_t period_ns;         // Measured frame period, 0 if unknown
+    drmu_queue_present_t pres;
+    unsigned int hist_pos;      // Next entry in hist_ents to (re)use
+    atomic_q_hist_ent_t hist_ents[DRMU_QUEUE_HIST_WINDOW];
+} atomic_q_crtc_t;
+
+// Producers never take the lock: queued atomics are pushed onto the lock-free
+// submit list and the poll thread is kicked to route them and commit. The
+// lock is only taken on the poll thread and when waiting.
 typedef struct drmu_atomic_q_s {
-    bool kill;
+    atomic_bool kill;
+    atomic_int submitters;      // Producers currently in drmu_atomic_queue
+    drmu_atomic_list_t * submit;
+    struct polltask * submit_task;
     pthread_mutex_t lock;
     pthread_cond_t cond;
-    drmu_atomic_t * next_flip;
-    drmu_atomic_t * cur_flip;
-    drmu_atomic_t * last_flip;
-    unsigned int retry_count;
+
+    drmu_env_t * du;            // Not reffed - we are part of it
+    struct pollqueue * pq;
+    unsigned int crtc_count;
+    atomic_q_crtc_t * crtcs;    // [crtc_count]
+
+    drmu_atomic_t * span_next;  // Pending commit for >1 CRTC
+    uint32_t span_next_mask;
+    drmu_atomic_t * span_cur;   // In flight commit for >1 CRTC
+    uint32_t span_cur_mask;     // CRTCs yet to flip
+    unsigned int span_retry_count;
+
+    drmu_atomic_t * last_flip;  // Everything that may still be on screen
     struct polltask * retry_task;
+
+    // With executors commit callbacks are run by cb_task rather than
+    // inline in the commit. NULL task => inline
+    struct polltask * cb_task;
+    drmu_atomic_t * cb_hold;    // Callbacks of the commit being done
+    drmu_atomic_t * cb_pending; // Callbacks waiting for cb_task
+
+    bool delta;                 // Only commit props that differ from last_flip
+    uint32_t * delta_keep;      // [delta_keep_n] Props that are always committed
+    unsigned int delta_keep_n;
+
+    drmu_queue_present_fn * present_fn;
+    void * present_v;
 } drmu_atomic_q_t;
 
 static void atomic_q_retry(drmu_atomic_q_t * const aq, drmu_env_t * const du);
+static bool atomic_q_has_cur(const drmu_atomic_q_t * const aq);
+
+// Needs locked
+// Delta mode: drop props that are already on screen with the same value.
+// last_flip is only the kernel's state if nothing else is in flight so
+// don't try otherwise. Objects are never dropped entirely so the commit
+// still hits the same CRTCs & gets the same flip events.
+static void
+atomic_q_delta(drmu_atomic_q_t * const aq, drmu_atomic_t * const da)
+{
+    if (!aq->delta || aq->last_flip == NULL || atomic_q_has_cur(aq))
+        return;
+    drmu_atomic_sub_unchanged(da, aq->last_flip, aq->delta_keep, aq->delta_keep_n);
+}
+
+static void
+atomic_q_callbacks_cb(void * v, short revents)
+{
+    drmu_atomic_q_t * const aq = v;
+    drmu_atomic_t * da;
+    (void)revents;
+
+    pthread_mutex_lock(&aq->lock);
+    da = aq->cb_pending;
+    aq->cb_pending = NULL;
+    pthread_mutex_unlock(&aq->lock);
+
+    drmu_atomic_run_commit_callbacks(da);
+    drmu_atomic_unref(&da);
+}
+
+// Needs locked
+// Run (and clear) da's commit callbacks, on an executor if we have them
+static void
+atomic_q_callbacks_run(drmu_atomic_q_t * const aq, drmu_atomic_t * const da)
+{
+    if (da == NULL)
+        return;
+
+    if (aq->cb_task != NULL) {
+        if (aq->cb_pending == NULL)
+            aq->cb_pending = drmu_atomic_new(aq->du);
+        if (aq->cb_pending != NULL) {
+            if (drmu_atomic_commit_callbacks_move(aq->cb_pending, da))
+                pollqueue_add_task(aq->cb_task, 0);
+            return;
+        }
+    }
+
+    drmu_atomic_run_commit_callbacks(da);
+    drmu_atomic_clear_commit_callbacks(da);
+}
 
 // Needs locked
+// Returns 0 if committed, -EAGAIN if a retry has been scheduled
 static int
-atomic_q_attempt_commit_next(drmu_atomic_q_t * const aq)
+atomic_q_commit_ioctl(drmu_atomic_q_t * const aq, drmu_atomic_t * const da, unsigned int * const retry_count)
 {
-    drmu_env_t * const du = drmu_atomic_env(aq->next_flip);
+    drmu_env_t * const du = drmu_atomic_env(da);
     uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_ALLOW_MODESET;
     int rv;
 
-    if ((rv = drmu_atomic_commit(aq->next_flip, flags)) == 0) {
-        if (aq->retry_count != 0)
+    atomic_q_delta(aq, da);
+
+    if ((rv = drmu_atomic_commit(da, flags)) == 0) {
+        if (*retry_count != 0)
             drmu_warn(du, "%s: Atomic commit OK", __func__);
-        aq->cur_flip = aq->next_flip;
-        aq->next_flip = NULL;
-        aq->retry_count = 0;
+        *retry_count = 0;
+        return 0;
     }
-    else if (rv == -EBUSY && ++aq->retry_count < 16) {
+
+    if (rv == -EBUSY && ++*retry_count < 16) {
         // This really shouldn't happen but we observe that the 1st commit after
         // a modeset often fails with BUSY.  It seems to be fine on a 10ms retry
         // but allow some more in case ww need a bit longer in some cases
         drmu_warn(du, "%s: Atomic commit BUSY", __func__);
         atomic_q_retry(aq, du);
-        rv = 0;
-    }
-    else {
-        drmu_err(du, "%s: Atomic commit failed: %s", __func__, strerror(-rv));
-        drmu_atomic_dump(aq->next_flip);
-        drmu_atomic_unref(&aq->next_flip);
-        aq->retry_count = 0;
+        return -EAGAIN;
     }
 
+    drmu_err(du, "%s: Atomic commit failed: %s", __func__, strerror(-rv));
+    drmu_atomic_dump(da);
+    *retry_count = 0;
     return rv;
 }
 
-static void
-atomic_q_retry_cb(void * v, short revents)
+// Needs locked
+// Returns 0 if committed, -EAGAIN if a retry has been scheduled
+static int
+atomic_q_commit(drmu_atomic_q_t * const aq, drmu_atomic_t * const da, unsigned int * const retry_count)
 {
-    drmu_atomic_q_t * const aq = v;
-    (void)revents;
+    int rv;
 
-    pthread_mutex_lock(&aq->lock);
+    // Without executors commit callbacks run inline in the commit
+    if (aq->cb_task == NULL)
+        return atomic_q_commit_ioctl(aq, da, retry_count);
 
-    // If we need a retry then next != NULL && cur == NULL
-    // if not that then we've fixed ourselves elsewhere
+    // Otherwise hold them back until the commit is done with (not on a
+    // retry) & pass them on
+    drmu_atomic_commit_callbacks_move(aq->cb_hold, da);
+    rv = atomic_q_commit_ioctl(aq, da, retry_count);
+    if (rv == -EAGAIN)
+        drmu_atomic_commit_callbacks_move(da, aq->cb_hold);
+    else
+        atomic_q_callbacks_run(aq, aq->cb_hold);
+    return rv;
+}
 
-    if (aq->next_flip != NULL && aq->cur_flip == NULL)
-        atomic_q_attempt_commit_next(aq);
+static bool
+atomic_q_crtcs_idle(const drmu_atomic_q_t * const aq, uint32_t mask)
+{
+    unsigned int i;
 
-    pthread_mutex_unlock(&aq->lock);
+    for (i = 0; mask != 0; ++i, mask >>= 1) {
+        if ((mask & 1) != 0 && aq->crtcs[i].cur_flip != NULL)
+            return false;
+    }
+    return true;
 }
 
-static void
+static uint64_t
+atomic_q_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Measured period or failing that the period of the current mode
+static uint64_t
+atomic_q_period_ns(const atomic_q_crtc_t * const qc)
+{
+    const struct drm_mode_modeinfo * mode;
+
+    if (qc->period_ns != 0)
+        return qc->period_ns;
+    mode = drmu_crtc_modeinfo(drmu_env_crtc_find_n(qc->aq->du, qc->idx));
+    return (mode == NULL || mode->vrefresh == 0) ? 16666667 : 1000000000 / mode->vrefresh;
+}
+
+static void atomic_q_run(drmu_atomic_q_t * const aq);
+
+static void
+atomic_q_timed_cb(void * v, short revents)
+{
+    atomic_q_crtc_t * const qc = v;
+    drmu_atomic_q_t * const aq = qc->aq;
+    (void)revents;
+
+    pthread_mutex_lock(&aq->lock);
+    qc->wake_ns = 0;
+    atomic_q_run(aq);
+    pthread_cond_broadcast(&aq->cond);
+    pthread_mutex_unlock(&aq->lock);
+}
+
+// Needs locked, poll thread only
+static void
+atomic_q_timed_wake(atomic_q_crtc_t * const qc, const uint64_t wake_ns, const uint64_t now)
+{
+    drmu_atomic_q_t * const aq = qc->aq;
+
+    // Already Qed for earlier? Will re-evaluate then
+    if (qc->wake_ns != 0 && qc->wake_ns <= wake_ns)
+        return;
+
+    // A Qed polltask can't be moved so replace it
+    if (qc->wake_ns != 0)
+        polltask_delete(&qc->timed_task);
+    if (qc->timed_task == NULL &&
+        (qc->timed_task = env_polltask_new(aq->pq, -1, 0, atomic_q_timed_cb, qc)) == NULL) {
+        drmu_err(aq->du, "%s: Failed to create timer", __func__);
+        return;
+    }
+
+    qc->wake_ns = wake_ns;
+    pollqueue_add_task(qc->timed_task, wake_ns <= now ? 0 : (int)((wake_ns - now + 999999) / 1000000));
+}
+
+// Needs locked
+static int
+atomic_q_timed_add(atomic_q_crtc_t * const qc, drmu_atomic_t ** const ppda)
+{
+    const uint64_t target = drmu_atomic_target_ns(*ppda);
+    unsigned int i;
+
+    if (qc->timed_n >= qc->timed_size) {
+        const unsigned int size = qc->timed_size == 0 ? 8 : qc->timed_size * 2;
+        drmu_atomic_t ** const timed = realloc(qc->timed, size * sizeof(*timed));
+        if (timed == NULL)
+            return -ENOMEM;
+        qc->timed = timed;
+        qc->timed_size = size;
+    }
+
+    // Usually appending so search from the end
+    for (i = qc->timed_n; i != 0 && drmu_atomic_target_ns(qc->timed[i - 1]) > target; --i)
+        qc->timed[i] = qc->timed[i - 1];
+    qc->timed[i] = *ppda;
+    *ppda = NULL;
+    ++qc->timed_n;
+    return 0;
+}
+
+// Needs locked
+// Flush (run callbacks) if not committing
+static void
+atomic_q_timed_clear(atomic_q_crtc_t * const qc, const bool flush)
+{
+    unsigned int i;
+
+    for (i = 0; i != qc->timed_n; ++i) {
+        if (flush)
+            atomic_q_callbacks_run(qc->aq, qc->timed[i]);
+        drmu_atomic_unref(qc->timed + i);
+    }
+    qc->timed_n = 0;
+}
+
+// Needs locked, CRTC idle
+// Move whatever is due for the next vblank into next_flip. If more than one
+// is due the earlier ones are superseded: they are merged in target order
+// so only their values are replaced & any prop that only they set (e.g. a
+// plane disable) still gets to the screen. Timed props go under anything
+// already in next_flip as that was queued to be shown ASAP.
+// If nothing is due set a timer for when the head will be.
+static void
+atomic_q_timed_run(atomic_q_crtc_t * const qc)
+{
+    const uint64_t now = atomic_q_now_ns();
+    const uint64_t period = atomic_q_period_ns(qc);
+    drmu_atomic_t * da = NULL;
+    uint64_t next_vbl;
+    uint64_t target;
+    unsigned int n;
+    unsigned int i;
+
+    if (qc->timed_n == 0)
+        return;
+
+    // If we commit now we will be presented at the 1st vblank after now
+    if (qc->vbl_ns == 0 || qc->vbl_ns > now)
+        next_vbl = now + period;
+    else
+        next_vbl = qc->vbl_ns + ((now - qc->vbl_ns) / period + 1) * period;
+
+    // Due if next_vbl is the vblank nearest target (or later)
+    for (n = 0; n != qc->timed_n && drmu_atomic_target_ns(qc->timed[n]) <= next_vbl + period / 2; ++n)
+        /* Loop */;
+
+    if (n == 0) {
+        // Wake just after the vblank before the one we want
+        target = drmu_atomic_target_ns(qc->timed[0]);
+        atomic_q_timed_wake(qc, next_vbl + ((target - period / 2 - next_vbl) / period) * period + 1000000, now);
+        return;
+    }
+
+    target = drmu_atomic_target_ns(qc->timed[n - 1]);
+    qc->pres.dropped += n - 1;
+    for (i = 0; i != n; ++i) {
+        if (drmu_atomic_move_merge(&da, qc->timed + i) != 0)
+            drmu_warn(qc->aq->du, "%s: Merge failed", __func__);
+    }
+    if (drmu_atomic_move_merge(&da, &qc->next_flip) != 0)
+        drmu_warn(qc->aq->du, "%s: Merge failed", __func__);
+    qc->next_flip = da;
+    if (da != NULL)
+        drmu_atomic_target_ns_set(da, target);
+
+    qc->timed_n -= n;
+    memmove(qc->timed, qc->timed + n, qc->timed_n * sizeof(*qc->timed));
+}
+
+// Needs locked
+// Commit anything pending whose CRTCs are idle
+static void
+atomic_q_run(drmu_atomic_q_t * const aq)
+{
+    unsigned int i;
+    int rv;
+
+    if (atomic_load(&aq->kill))
+        return;
+
+    if (aq->span_next != NULL && aq->span_cur == NULL && atomic_q_crtcs_idle(aq, aq->span_next_mask)) {
+        if ((rv = atomic_q_commit(aq, aq->span_next, &aq->span_retry_count)) == 0) {
+            aq->span_cur = aq->span_next;
+            aq->span_cur_mask = aq->span_next_mask;
+            for (i = 0; i != aq->crtc_count; ++i) {
+                if ((aq->span_cur_mask & (1U << i)) != 0)
+                    aq->crtcs[i].cur_flip = aq->span_cur;
+            }
+            aq->span_next = NULL;
+            aq->span_next_mask = 0;
+        }
+        else if (rv != -EAGAIN) {
+            drmu_atomic_unref(&aq->span_next);
+            aq->span_next_mask = 0;
+        }
+    }
+
+    for (i = 0; i != aq->crtc_count; ++i) {
+        atomic_q_crtc_t * const qc = aq->crtcs + i;
+
+        if (qc->cur_flip != NULL || (aq->span_next_mask & (1U << i)) != 0)
+            continue;
+
+        atomic_q_timed_run(qc);
+        if (qc->next_flip == NULL)
+            continue;
+
+        if ((rv = atomic_q_commit(aq, qc->next_flip, &qc->retry_count)) == 0) {
+            qc->cur_flip = qc->next_flip;
+            qc->next_flip = NULL;
+        }
+        else if (rv != -EAGAIN) {
+            drmu_atomic_unref(&qc->next_flip);
+        }
+    }
+}
+
+// Needs locked
+static void
+atomic_q_route_cb(void * v, drmu_atomic_t ** const ppda)
+{
+    drmu_atomic_q_t * const aq = v;
+    drmu_env_t * const du = drmu_atomic_env(*ppda);
+    const uint32_t all_mask = aq->crtc_count >= 32 ? ~0U : (1U << aq->crtc_count) - 1;
+    uint32_t mask = env_atomic_crtc_mask(du, *ppda) & all_mask;
+    int rv;
+
+    // Nothing attributable to a CRTC - Q on the 1st
+    if (mask == 0)
+        mask = 1;
+
+    if ((mask & (mask - 1)) != 0 || (mask & aq->span_next_mask) != 0) {
+        // Take over anything pending on newly spanned CRTCs - it is older
+        // than this so must be merged first
+        const uint32_t new_mask = mask & ~aq->span_next_mask;
+        unsigned int i;
+
+        for (i = 0; i != aq->crtc_count; ++i) {
+            if ((new_mask & (1U << i)) != 0) {
+                drmu_atomic_move_merge(&aq->span_next, &aq->crtcs[i].next_flip);
+                aq->crtcs[i].retry_count = 0;
+            }
+        }
+        aq->span_next_mask |= mask;
+        rv = drmu_atomic_move_merge(&aq->span_next, ppda);
+    }
+    else if (drmu_atomic_target_ns(*ppda) != 0 &&
+             atomic_q_timed_add(aq->crtcs + __builtin_ctz(mask), ppda) == 0) {
+        rv = 0;
+    }
+    else {
+        rv = drmu_atomic_move_merge(&aq->crtcs[__builtin_ctz(mask)].next_flip, ppda);
+    }
+
+    if (rv != 0)
+        drmu_warn(du, "%s: Merge failed: %s", __func__, strerror(-rv));
+}
+
+// Needs locked
+// Route anything submitted to its CRTC(s)
+static void
+atomic_q_take_submitted(drmu_atomic_q_t * const aq)
+{
+    drmu_atomic_list_take_each(aq->submit, atomic_q_route_cb, aq);
+}
+
+static void
+atomic_q_retry_cb(void * v, short revents)
+{
+    drmu_atomic_q_t * const aq = v;
+    (void)revents;
+
+    pthread_mutex_lock(&aq->lock);
+
+    // Anything that needs a retry is still next with its CRTCs idle
+    // if not that then we've fixed ourselves elsewhere
+    atomic_q_run(aq);
+
+    pthread_mutex_unlock(&aq->lock);
+}
+
+static void
 atomic_q_retry(drmu_atomic_q_t * const aq, drmu_env_t * const du)
 {
     if (aq->retry_task == NULL)
-        aq->retry_task = polltask_new_timer(env_pollqueue(du), atomic_q_retry_cb, aq);
+        aq->retry_task = env_polltask_new(env_pollqueue(du), -1, 0, atomic_q_retry_cb, aq);
     pollqueue_add_task(aq->retry_task, 20);
 }
 
-// Called after an atomic commit has completed
+static void
+atomic_q_submit_cb(void * v, short revents)
+{
+    drmu_atomic_q_t * const aq = v;
+    (void)revents;
+
+    pthread_mutex_lock(&aq->lock);
+
+    // If a CRTC has a flip pending then we will commit when it completes
+    // If the Q is dead then atomic_q_kill will flush next
+    atomic_q_take_submitted(aq);
+    atomic_q_run(aq);
+
+    pthread_cond_broadcast(&aq->cond);
+    pthread_mutex_unlock(&aq->lock);
+}
+
+// Needs locked
+static int
+atomic_q_crtc_n_find(const drmu_atomic_q_t * const aq, drmu_env_t * const du,
+                     const drmu_atomic_t * const da, const uint32_t crtc_id)
+{
+    const drmu_crtc_t * const dc = crtc_id == 0 ? NULL : drmu_env_crtc_find_id(du, crtc_id);
+    unsigned int i;
+
+    if (dc != NULL)
+        return drmu_crtc_idx(dc);
+
+    // Old kernels don't fill in crtc_id - match on the atomic
+    for (i = 0; i != aq->crtc_count; ++i) {
+        if (aq->crtcs[i].cur_flip == da)
+            return i;
+    }
+    return -1;
+}
+
+static unsigned int
+hist_bin(const uint64_t x, const uint64_t bin_size)
+{
+    const uint64_t n = x / bin_size;
+    return n >= DRMU_QUEUE_HIST_BINS ? DRMU_QUEUE_HIST_BINS - 1 : (unsigned int)n;
+}
+
+// Needs locked
+static void
+atomic_q_hist_add(atomic_q_crtc_t * const qc, const drmu_present_info_t * const info, const uint32_t seqs)
+{
+    drmu_queue_hist_t * const hist = &qc->pres.hist;
+    atomic_q_hist_ent_t * const ent = qc->hist_ents + qc->hist_pos;
+
+    // Remove the flip that is dropping out of the window
+    if (hist->flips == DRMU_QUEUE_HIST_WINDOW) {
+        --hist->latency[ent->latency];
+        --hist->interval[ent->interval];
+        if (ent->error != HIST_NONE) {
+            --hist->error[ent->error];
+            --hist->timed;
+        }
+    }
+    else {
+        ++hist->flips;
+    }
+
+    ent->latency = hist_bin(info->latency_ns, 2000000);
+    ent->interval = hist_bin(seqs, 1);
+    ++hist->latency[ent->latency];
+    ++hist->interval[ent->interval];
+    if (info->target_ns == 0) {
+        ent->error = HIST_NONE;
+    }
+    else {
+        const uint64_t err = info->present_ns > info->target_ns ?
+            info->present_ns - info->target_ns : info->target_ns - info->present_ns;
+        ent->error = hist_bin(err, 1000000);
+        ++hist->error[ent->error];
+        ++hist->timed;
+    }
+
+    qc->hist_pos = qc->hist_pos + 1 >= DRMU_QUEUE_HIST_WINDOW ? 0 : qc->hist_pos + 1;
+}
+
+// Needs locked
+static void
+atomic_q_flip_time(atomic_q_crtc_t * const qc, const struct drm_event_vblank * const vb, drmu_present_info_t * const info)
+{
+    const uint64_t flip_ns = (uint64_t)vb->tv_sec * 1000000000 + (uint64_t)vb->tv_usec * 1000;
+    const uint32_t seqs = qc->vbl_ns == 0 ? 1 : vb->sequence - qc->vbl_seq;
+
+    // Flip time is on a vblank so we can measure the period even if we
+    // haven't flipped every frame
+    if (qc->vbl_ns != 0 && seqs != 0 && flip_ns > qc->vbl_ns) {
+        const uint64_t period = (flip_ns - qc->vbl_ns) / seqs;
+        qc->period_ns = qc->period_ns == 0 ? period : (qc->period_ns * 7 + period) / 8;
+    }
+    qc->vbl_ns = flip_ns;
+    qc->vbl_seq = vb->sequence;
+
+    info->crtc_id = vb->crtc_id;
+    info->sequence = vb->sequence;
+    info->present_ns = flip_ns;
+    info->target_ns = drmu_atomic_target_ns(qc->cur_flip);
+    info->queue_ns = drmu_atomic_queue_ns(qc->cur_flip);
+    info->latency_ns = (info->queue_ns == 0 || info->queue_ns > flip_ns) ? 0 : flip_ns - info->queue_ns;
+    info->merged = drmu_atomic_merge_count(qc->cur_flip);
+
+    qc->pres.last = *info;
+    ++qc->pres.flips;
+    if (info->target_ns != 0) {
+        const uint64_t err = flip_ns > info->target_ns ? flip_ns - info->target_ns : info->target_ns - flip_ns;
+        ++qc->pres.presented;
+        if (err > atomic_q_period_ns(qc) / 2)
+            ++qc->pres.late;
+    }
+    atomic_q_hist_add(qc, info, seqs);
+}
+
+// Called after an atomic commit has completed on a CRTC
 // not called on every vsync, so if we haven't committed anything this won't be called
 static void
-drmu_atomic_page_flip_cb(drmu_env_t * const du, void *user_data)
+drmu_atomic_page_flip_cb(drmu_env_t * const du, const struct drm_event_vblank * const vb)
 {
-    drmu_atomic_t * const da = user_data;
+    drmu_atomic_t * const da = (drmu_atomic_t *)(uintptr_t)vb->user_data;
+    const uint32_t crtc_id = vb->crtc_id;
     drmu_atomic_q_t * const aq = env_atomic_q(du);
+    atomic_q_crtc_t * qc;
+    drmu_present_info_t info;
+    drmu_queue_present_fn * present_fn = NULL;
+    void * present_v = NULL;
+    int n;
 
-    // At this point:
+    // At this point for this CRTC:
     //  next   The atomic we are about to commit
     //  cur    The last atomic we committed, now in use (must be != NULL)
     //  last   The atomic that has just become obsolete
 
     pthread_mutex_lock(&aq->lock);
 
-    if (da != aq->cur_flip) {
-        drmu_err(du, "%s: User data el (%p) != cur (%p)", __func__, da, aq->cur_flip);
+    if ((n = atomic_q_crtc_n_find(aq, du, da, crtc_id)) < 0 || (unsigned int)n >= aq->crtc_count) {
+        drmu_err(du, "%s: Flip for unknown CRTC %u (%p)", __func__, crtc_id, da);
+        goto done;
     }
+    qc = aq->crtcs + n;
+
+    if (da != qc->cur_flip) {
+        drmu_err(du, "%s: User data el (%p) != cur (%p)", __func__, da, qc->cur_flip);
+    }
+    atomic_q_flip_time(qc, vb, &info);
+    present_fn = aq->present_fn;
+    present_v = aq->present_v;
 
     // Must merge cur into last rather than just replace last as there may
     // still be things on screen not updated by the current commit
-    drmu_atomic_move_merge(&aq->last_flip, &aq->cur_flip);
+    // A spanning commit is only done once all its CRTCs have flipped
+    if (qc->cur_flip != NULL && qc->cur_flip == aq->span_cur) {
+        qc->cur_flip = NULL;
+        aq->span_cur_mask &= ~(1U << n);
+        if (aq->span_cur_mask == 0)
+            drmu_atomic_move_merge(&aq->last_flip, &aq->span_cur);
+    }
+    else {
+        drmu_atomic_move_merge(&aq->last_flip, &qc->cur_flip);
+    }
 
-    if (aq->next_flip != NULL)
-        atomic_q_attempt_commit_next(aq);
+    atomic_q_take_submitted(aq);
+    atomic_q_run(aq);
 
+done:
     pthread_cond_broadcast(&aq->cond);
     pthread_mutex_unlock(&aq->lock);
+
+    if (present_fn)
+        present_fn(present_v, &info);
+}
+
+// Needs locked
+static bool
+atomic_q_has_next(const drmu_atomic_q_t * const aq)
+{
+    unsigned int i;
+
+    if (aq->span_next != NULL || !drmu_atomic_list_is_empty(aq->submit))
+        return true;
+    for (i = 0; i != aq->crtc_count; ++i) {
+        if (aq->crtcs[i].next_flip != NULL || aq->crtcs[i].timed_n != 0)
+            return true;
+    }
+    return false;
+}
+
+// Needs locked
+// Latest target of any timed atomic still held, 0 if none
+static uint64_t
+atomic_q_timed_last_ns(const drmu_atomic_q_t * const aq)
+{
+    uint64_t last = 0;
+    unsigned int i;
+
+    for (i = 0; i != aq->crtc_count; ++i) {
+        const atomic_q_crtc_t * const qc = aq->crtcs + i;
+        if (qc->timed_n != 0 && drmu_atomic_target_ns(qc->timed[qc->timed_n - 1]) > last)
+            last = drmu_atomic_target_ns(qc->timed[qc->timed_n - 1]);
+    }
+    return last;
+}
+
+// Needs locked
+static bool
+atomic_q_has_cur(const drmu_atomic_q_t * const aq)
+{
+    unsigned int i;
+
+    for (i = 0; i != aq->crtc_count; ++i) {
+        if (aq->crtcs[i].cur_flip != NULL)
+            return true;
+    }
+    return false;
 }
 
 static int
 atomic_q_kill(drmu_atomic_q_t * const aq)
 {
     struct timespec ts;
+    unsigned int i;
     int rv = 0;
 
+    // Stop new submissions & wait for any in progress to finish with the
+    // submit task before deleting it
+    atomic_store(&aq->kill, true);
+    while (atomic_load(&aq->submitters) != 0)
+        sched_yield();
+    polltask_delete(&aq->submit_task);
+
     pthread_mutex_lock(&aq->lock);
-    aq->kill = true;
 
     clock_gettime(CLOCK_MONOTONIC, &ts);
     ts.tv_sec += 1;  // We should never timeout if all is well - 1 sec is plenty
 
     // Can flush next safely - but call commit cbs
-    drmu_atomic_run_commit_callbacks(aq->next_flip);
-    drmu_atomic_unref(&aq->next_flip);
+    atomic_q_take_submitted(aq);
+    for (i = 0; i != aq->crtc_count; ++i) {
+        atomic_q_timed_clear(aq->crtcs + i, true);
+        atomic_q_callbacks_run(aq, aq->crtcs[i].next_flip);
+        drmu_atomic_unref(&aq->crtcs[i].next_flip);
+    }
+    atomic_q_callbacks_run(aq, aq->span_next);
+    drmu_atomic_unref(&aq->span_next);
+    aq->span_next_mask = 0;
     polltask_delete(&aq->retry_task); // If we've got here then retry would not succeed
 
     // Wait for cur to finish - seems to confuse the world otherwise
-    while (aq->cur_flip != NULL) {
+    while (atomic_q_has_cur(aq)) {
         if ((rv = pthread_cond_timedwait(&aq->cond, &aq->lock, &ts)) != 0)
             break;
     }
 
     pthread_mutex_unlock(&aq->lock);
+
+    // Nothing will touch the timers now kill is set & we have had the lock
+    // Delete outside the lock as the callback takes it
+    for (i = 0; i != aq->crtc_count; ++i)
+        polltask_delete(&aq->crtcs[i].timed_task);
+
+    // Nothing more will be committed so run any callbacks cb_task hasn't
+    // got to yet
+    polltask_delete(&aq->cb_task);
+    drmu_atomic_run_commit_callbacks(aq->cb_pending);
+    drmu_atomic_unref(&aq->cb_pending);
+
     return rv;
 }
 
 static void
 atomic_q_clear_flips(drmu_atomic_q_t * const aq)
 {
-    drmu_atomic_unref(&aq->next_flip);
-    drmu_atomic_unref(&aq->cur_flip);
+    unsigned int i;
+
+    for (i = 0; i != aq->crtc_count; ++i) {
+        atomic_q_crtc_t * const qc = aq->crtcs + i;
+
+        atomic_q_timed_clear(qc, false);
+        drmu_atomic_unref(&qc->next_flip);
+        if (qc->cur_flip == aq->span_cur)
+            qc->cur_flip = NULL;
+        drmu_atomic_unref(&qc->cur_flip);
+    }
+    drmu_atomic_unref(&aq->span_next);
+    drmu_atomic_unref(&aq->span_cur);
+    aq->span_next_mask = 0;
+    aq->span_cur_mask = 0;
     drmu_atomic_unref(&aq->last_flip);
 }
 
+// Lock-free: the routing & commit happen on the poll thread so commit errors
+// are logged rather than returned
 int
 drmu_atomic_queue(drmu_atomic_t ** ppda)
 {
@@ -2800,38 +4385,90 @@ drmu_atomic_queue(drmu_atomic_t ** ppda)
 
     aq = env_atomic_q(drmu_atomic_env(*ppda));
 
-    pthread_mutex_lock(&aq->lock);
+    // Unshare here rather than in the push so we can stamp it
+    if ((*ppda = drmu_atomic_move(ppda)) == NULL)
+        return -ENOMEM;
+    drmu_atomic_queue_stamp(*ppda, atomic_q_now_ns());
+
+    atomic_fetch_add(&aq->submitters, 1);
 
-    if (aq->kill) {
+    if (atomic_load(&aq->kill) || aq->submit_task == NULL) {
         drmu_atomic_unref(ppda);
         rv = -EBUSY;
     }
-    else {
-        rv = drmu_atomic_move_merge(&aq->next_flip, ppda);
-
-        // No pending commit?
-        if (rv == 0 && aq->cur_flip == NULL)
-            rv = atomic_q_attempt_commit_next(aq);
+    // Only need to kick if the list was empty - otherwise a kick is already
+    // pending or the poll thread is about to take the list
+    else if ((rv = drmu_atomic_list_push(aq->submit, ppda)) > 0) {
+        pollqueue_add_task(aq->submit_task, 0);
+        rv = 0;
     }
 
-    pthread_mutex_unlock(&aq->lock);
+    atomic_fetch_sub(&aq->submitters, 1);
     return rv;
 }
 
+int
+drmu_atomic_queue_at(drmu_atomic_t ** ppda, const uint64_t target_ns)
+{
+    drmu_atomic_t * da;
+
+    if (*ppda == NULL)
+        return 0;
+
+    // Unshare before changing target
+    if ((da = drmu_atomic_move(ppda)) == NULL)
+        return -ENOMEM;
+    drmu_atomic_target_ns_set(da, target_ns);
+    return drmu_atomic_queue(&da);
+}
+
+void
+drmu_env_queue_present_cb_set(drmu_env_t * const du, drmu_queue_present_fn * const fn, void * const v)
+{
+    drmu_atomic_q_t * const aq = env_atomic_q(du);
+
+    pthread_mutex_lock(&aq->lock);
+    aq->present_fn = fn;
+    aq->present_v = v;
+    pthread_mutex_unlock(&aq->lock);
+}
+
+int
+drmu_env_queue_present_get(drmu_env_t * const du, const drmu_crtc_t * const dc, drmu_queue_present_t * const pres)
+{
+    drmu_atomic_q_t * const aq = env_atomic_q(du);
+    const int n = drmu_crtc_idx(dc);
+
+    if (n < 0 || (unsigned int)n >= aq->crtc_count)
+        return -EINVAL;
+
+    pthread_mutex_lock(&aq->lock);
+    *pres = aq->crtcs[n].pres;
+    pres->period_ns = atomic_q_period_ns(aq->crtcs + n);
+    pthread_mutex_unlock(&aq->lock);
+    return 0;
+}
+
 int
 drmu_env_queue_wait(drmu_env_t * const du)
 {
 
     drmu_atomic_q_t *const aq = env_atomic_q(du);
     struct timespec ts;
+    uint64_t end_ns;
     int rv = 0;
 
     pthread_mutex_lock(&aq->lock);
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    ts.tv_sec += 1;  // We should never timeout if all is well - 1 sec is plenty
-
-    // Next should clear quickly
-    while (aq->next_flip != NULL) {
+    // We should never timeout if all is well - 1 sec is plenty
+    end_ns = atomic_q_now_ns() + 1000000000;
+
+    // Next should clear quickly, timed atomics once they are due
+    while (atomic_q_has_next(aq)) {
+        const uint64_t timed_ns = atomic_q_timed_last_ns(aq);
+        if (timed_ns != 0 && timed_ns + 1000000000 > end_ns)
+            end_ns = timed_ns + 1000000000;
+        ts.tv_sec = end_ns / 1000000000;
+        ts.tv_nsec = end_ns % 1000000000;
         if ((rv = pthread_cond_timedwait(&aq->cond, &aq->lock, &ts)) != 0)
             break;
     }
@@ -2840,31 +4477,102 @@ drmu_env_queue_wait(drmu_env_t * const du)
     return rv;
 }
 
-static void
-atomic_q_uninit(drmu_atomic_q_t * const aq)
-{
-    aq->kill = true;
-    polltask_delete(&aq->retry_task);
-    atomic_q_clear_flips(aq);
-    pthread_cond_destroy(&aq->cond);
-    pthread_mutex_destroy(&aq->lock);
+static void
+atomic_q_uninit(drmu_atomic_q_t * const aq)
+{
+    unsigned int i;
+
+    atomic_store(&aq->kill, true);
+    polltask_delete(&aq->submit_task);
+    polltask_delete(&aq->retry_task);
+    for (i = 0; i != aq->crtc_count; ++i)
+        polltask_delete(&aq->crtcs[i].timed_task);
+    polltask_delete(&aq->cb_task);
+    drmu_atomic_unref(&aq->cb_pending);
+    drmu_atomic_unref(&aq->cb_hold);
+    atomic_q_clear_flips(aq);
+    drmu_atomic_list_free(&aq->submit);
+    for (i = 0; i != aq->crtc_count; ++i)
+        free(aq->crtcs[i].timed);
+    free(aq->crtcs);
+    aq->crtcs = NULL;
+    aq->crtc_count = 0;
+    free(aq->delta_keep);
+    aq->delta_keep = NULL;
+    aq->delta_keep_n = 0;
+    pthread_cond_destroy(&aq->cond);
+    pthread_mutex_destroy(&aq->lock);
+}
+
+// Called once the CRTCs have been found & the pollqueue exists
+// executors is true if the pollqueue has them
+static int
+atomic_q_start(drmu_atomic_q_t * const aq, drmu_env_t * const du, struct pollqueue * const pq,
+               const unsigned int crtc_count, const bool executors)
+{
+    // Flip events can only identify 32 CRTCs (possible_crtcs is a u32 mask)
+    // & always have at least one Q
+    const unsigned int n = crtc_count == 0 ? 1 : crtc_count > 32 ? 32 : crtc_count;
+    unsigned int i;
+
+    if ((aq->crtcs = calloc(n, sizeof(*aq->crtcs))) == NULL)
+        return -ENOMEM;
+    aq->crtc_count = n;
+    for (i = 0; i != n; ++i) {
+        aq->crtcs[i].aq = aq;
+        aq->crtcs[i].idx = i;
+    }
+    aq->du = du;
+    aq->pq = pq;
+
+    if ((aq->submit_task = env_polltask_new(pq, -1, 0, atomic_q_submit_cb, aq)) == NULL)
+        return -ENOMEM;
+
+    // Not pinned: serialized only with itself so callbacks run in order
+    // but off the poll thread
+    if (executors &&
+        ((aq->cb_hold = drmu_atomic_new(du)) == NULL ||
+         (aq->cb_task = polltask_new_timer(pq, atomic_q_callbacks_cb, aq)) == NULL))
+        return -ENOMEM;
+    return 0;
 }
 
-static void
+static int
 atomic_q_init(drmu_atomic_q_t * const aq)
 {
     pthread_condattr_t condattr;
 
-    aq->kill = false;
-    aq->next_flip = NULL;
-    aq->cur_flip = NULL;
+    atomic_init(&aq->kill, false);
+    atomic_init(&aq->submitters, 0);
+    aq->submit_task = NULL;
+    if ((aq->submit = drmu_atomic_list_new()) == NULL)
+        return -ENOMEM;
+    aq->du = NULL;
+    aq->pq = NULL;
+    aq->crtc_count = 0;
+    aq->crtcs = NULL;
+    aq->span_next = NULL;
+    aq->span_next_mask = 0;
+    aq->span_cur = NULL;
+    aq->span_cur_mask = 0;
+    aq->span_retry_count = 0;
     aq->last_flip = NULL;
+    aq->retry_task = NULL;
+    aq->cb_task = NULL;
+    aq->cb_hold = NULL;
+    aq->cb_pending = NULL;
+    aq->present_fn = NULL;
+    aq->present_v = NULL;
+    aq->delta = false;
+    aq->delta_keep = NULL;
+    aq->delta_keep_n = 0;
     pthread_mutex_init(&aq->lock, NULL);
 
     pthread_condattr_init(&condattr);
     pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
     pthread_cond_init(&aq->cond, &condattr);
     pthread_condattr_destroy(&condattr);
+    return 0;
 }
 
 //----------------------------------------------------------------------------
@@ -2948,6 +4656,22 @@ drmu_atomic_plane_add_zpos(struct drmu_atomic_s * const da, const drmu_plane_t *
     return drmu_atomic_add_prop_range(da, dp->plane.plane_id, dp->pid.zpos, zpos);
 }
 
+bool
+drmu_plane_has_alpha(const drmu_plane_t * const dp)
+{
+    return dp->pid.alpha != NULL;
+}
+
+int
+drmu_plane_zpos_range(const drmu_plane_t * const dp, int * const pmin, int * const pmax)
+{
+    if (dp->pid.zpos == NULL)
+        return -ENOENT;
+    *pmin = (int)drmu_prop_range_min(dp->pid.zpos);
+    *pmax = (int)drmu_prop_range_max(dp->pid.zpos);
+    return 0;
+}
+
 int
 drmu_atomic_plane_add_rotation(struct drmu_atomic_s * const da, const drmu_plane_t * const dp, const int rot)
 {
@@ -3006,6 +4730,81 @@ drmu_atomic_plane_add_fb(drmu_atomic_t * const da, drmu_plane_t * const dp,
     return 0;
 }
 
+// Order must match template_plane_set
+int
+drmu_atomic_template_add_plane(drmu_atomic_template_t * const dt, const drmu_plane_t * const dp)
+{
+    const uint32_t plid = dp->plane.plane_id;
+    const uint32_t ids[DRMU_TEMPLATE_PLANE_SLOTS] = {
+        dp->pid.crtc_id,
+        dp->pid.fb_id,
+        dp->pid.crtc_x,
+        dp->pid.crtc_y,
+        drmu_prop_range_id(dp->pid.crtc_w),
+        drmu_prop_range_id(dp->pid.crtc_h),
+        dp->pid.src_x,
+        dp->pid.src_y,
+        drmu_prop_range_id(dp->pid.src_w),
+        drmu_prop_range_id(dp->pid.src_h),
+    };
+    int slot0 = -EINVAL;
+    unsigned int i;
+
+    for (i = 0; i != DRMU_TEMPLATE_PLANE_SLOTS; ++i) {
+        const int slot = drmu_atomic_template_add(dt, plid, ids[i]);
+        if (slot < 0)
+            return slot;
+        if (i == 0)
+            slot0 = slot;
+        else if (slot != slot0 + (int)i)
+            return -EEXIST;
+    }
+    return slot0;
+}
+
+static int
+template_plane_set(drmu_atomic_template_t * const dt, const int slot0,
+                   drmu_plane_t * const dp,
+                   drmu_fb_t * const dfb,
+                   int32_t crtc_x, int32_t crtc_y,
+                   uint32_t crtc_w, uint32_t crtc_h,
+                   uint32_t src_x, uint32_t src_y,
+                   uint32_t src_w, uint32_t src_h)
+{
+    int rv;
+
+    if (slot0 < 0)
+        return -EINVAL;
+    if ((rv = drmu_atomic_template_set_fb(dt, slot0 + 1, dfb)) != 0)
+        return rv;
+    drmu_atomic_template_set_value(dt, slot0 + 0, dfb == NULL ? 0 : drmu_crtc_id(dp->dc));
+    drmu_atomic_template_set_value(dt, slot0 + 2, crtc_x);
+    drmu_atomic_template_set_value(dt, slot0 + 3, crtc_y);
+    drmu_atomic_template_set_value(dt, slot0 + 4, crtc_w);
+    drmu_atomic_template_set_value(dt, slot0 + 5, crtc_h);
+    drmu_atomic_template_set_value(dt, slot0 + 6, src_x);
+    drmu_atomic_template_set_value(dt, slot0 + 7, src_y);
+    drmu_atomic_template_set_value(dt, slot0 + 8, src_w);
+    drmu_atomic_template_set_value(dt, slot0 + 9, src_h);
+    return 0;
+}
+
+int
+drmu_atomic_template_plane_set_fb(drmu_atomic_template_t * const dt, const int slot0,
+                                  drmu_plane_t * const dp, drmu_fb_t * const dfb, const drmu_rect_t pos)
+{
+    if (dfb == NULL)
+        return template_plane_set(dt, slot0, dp, NULL,
+                                  0, 0, 0, 0,
+                                  0, 0, 0, 0);
+
+    return template_plane_set(dt, slot0, dp, dfb,
+                              pos.x, pos.y,
+                              pos.w, pos.h,
+                              dfb->crop.x + (dfb->active.x << 16), dfb->crop.y + (dfb->active.y << 16),
+                              dfb->crop.w, dfb->crop.h);
+}
+
 uint32_t
 drmu_plane_id(const drmu_plane_t * const dp)
 {
@@ -3283,11 +5082,33 @@ typedef struct drmu_env_s {
     drmu_atomic_q_t aq;
     // global env for bo tracking
     drmu_bo_env_t boe;
+    // cached prop defs, values & blobs
+    drmu_propcache_t propcache;
     // global atomic for restore op
     drmu_atomic_t * da_restore;
+    // recycled atomic storage
+    drmu_atomic_pool_t * dap;
 
     struct pollqueue * pq;
     struct polltask * pt;
+
+    // DRM event handlers indexed by event type, only used on the poll thread
+    struct {
+        drmu_env_event_fn * fn;
+        void * v;
+    } evt_handlers[DRMU_ENV_EVENT_TYPES];
+    // Event read buffer, u64 for alignment
+    uint64_t evt_buf[4096 / sizeof(uint64_t)];
+
+    // Low priority background worker - created on first use
+    pthread_mutex_t bg_lock;
+    struct pollqueue * bg_pq;
+    // Deferred fb destruction, NULL task => destroy inline
+    _Atomic(struct polltask *) fb_free_task;
+    _Atomic(drmu_fb_t *) fb_free_head;
+
+    // Byte budget shared by all fb pools on this env
+    struct drmu_pool_budget_s * pool_budget;
 } drmu_env_t;
 
 // Retrieve the the n-th conn
@@ -3456,6 +5277,12 @@ env_boe(drmu_env_t * const du)
     return &du->boe;
 }
 
+static struct drmu_propcache_s *
+env_propcache(drmu_env_t * const du)
+{
+    return &du->propcache;
+}
+
 static struct pollqueue *
 env_pollqueue(const drmu_env_t * const du)
 {
@@ -3468,6 +5295,120 @@ env_atomic_q(drmu_env_t * const du)
     return &du->aq;
 }
 
+typedef struct env_crtc_mask_s {
+    drmu_env_t * du;
+    uint32_t mask;
+} env_crtc_mask_t;
+
+static void
+env_crtc_mask_add_id(env_crtc_mask_t * const ecm, const uint32_t crtc_id)
+{
+    const drmu_crtc_t * const dc = crtc_id == 0 ? NULL : drmu_env_crtc_find_id(ecm->du, crtc_id);
+
+    if (dc != NULL && dc->crtc_idx < 32)
+        ecm->mask |= 1U << dc->crtc_idx;
+}
+
+static void
+env_crtc_mask_obj_cb(void * v, uint32_t obj_id)
+{
+    env_crtc_mask_t * const ecm = v;
+    drmu_env_t * const du = ecm->du;
+    unsigned int i;
+
+    for (i = 0; i != du->crtc_count; ++i) {
+        if (du->crtcs[i].crtc.crtc_id == obj_id) {
+            env_crtc_mask_add_id(ecm, obj_id);
+            return;
+        }
+    }
+    // Planes follow the CRTC they have been allocated to, failing that
+    // wherever they were last seen
+    for (i = 0; i != du->plane_count; ++i) {
+        const drmu_plane_t * const dp = du->planes + i;
+        if (dp->plane.plane_id == obj_id) {
+            env_crtc_mask_add_id(ecm, dp->dc != NULL ? drmu_crtc_id(dp->dc) : dp->plane.crtc_id);
+            return;
+        }
+    }
+    for (i = 0; i != du->conn_count; ++i) {
+        if (du->conns[i].conn.connector_id == obj_id) {
+            env_crtc_mask_add_id(ecm, drmu_conn_crtc_id_get(du->conns + i));
+            return;
+        }
+    }
+}
+
+// Mask of CRTC idxs that the atomic's objects are bound to
+static uint32_t
+env_atomic_crtc_mask(drmu_env_t * const du, const drmu_atomic_t * const da)
+{
+    env_crtc_mask_t ecm = {.du = du, .mask = 0};
+
+    drmu_atomic_obj_foreach(da, env_crtc_mask_obj_cb, &ecm);
+    return ecm.mask;
+}
+
+static void
+delta_keep_add(uint32_t * const ids, unsigned int * const pn, const uint32_t id)
+{
+    unsigned int i;
+
+    if (id == 0)
+        return;
+    for (i = 0; i != *pn; ++i) {
+        if (ids[i] == id)
+            return;
+    }
+    ids[(*pn)++] = id;
+}
+
+int
+drmu_env_queue_delta_set(drmu_env_t * const du, const bool enable)
+{
+    drmu_atomic_q_t * const aq = env_atomic_q(du);
+    uint32_t * keep = NULL;
+    unsigned int n = 0;
+    unsigned int i;
+
+    // Props that must be committed even if unchanged. Drivers share the
+    // plane props so this is normally just a couple of ids.
+    if (enable) {
+        if ((keep = malloc(((du->plane_count + du->conn_count) * 2 + 1) * sizeof(*keep))) == NULL)
+            return -ENOMEM;
+        for (i = 0; i != du->plane_count; ++i) {
+            // FB_ID keeps the plane (& so its CRTC) in the commit
+            delta_keep_add(keep, &n, du->planes[i].pid.fb_id);
+            delta_keep_add(keep, &n, du->planes[i].pid.crtc_id);
+        }
+        for (i = 0; i != du->conn_count; ++i) {
+            // Writeback props are one-shot - each commit is a new job
+            delta_keep_add(keep, &n, du->conns[i].pid.writeback_fb_id);
+            delta_keep_add(keep, &n, du->conns[i].pid.writeback_out_fence_ptr);
+        }
+    }
+
+    pthread_mutex_lock(&aq->lock);
+    free(aq->delta_keep);
+    aq->delta = enable;
+    aq->delta_keep = keep;
+    aq->delta_keep_n = n;
+    pthread_mutex_unlock(&aq->lock);
+    return 0;
+}
+
+drmu_atomic_pool_t *
+drmu_env_atomic_pool(const drmu_env_t * const du)
+{
+    return du == NULL ? NULL : du->dap;
+}
+
+struct drmu_pool_budget_s *
+drmu_env_pool_budget(const drmu_env_t * const du)
+{
+    return du == NULL ? NULL : du->pool_budget;
+}
+
 static void
 env_restore(drmu_env_t * const du)
 {
@@ -3493,9 +5434,17 @@ env_free(drmu_env_t * const du)
     if (!du)
         return;
 
+    // Every deferred fb holds an env ref so there are none left to do.
+    // Destroy anything freed from here on inline.
+    {
+        struct polltask * pt = atomic_exchange(&du->fb_free_task, NULL);
+        polltask_delete(&pt);
+    }
+
     atomic_q_kill(env_atomic_q(du));
 
     polltask_delete(&du->pt);
+    propcache_uevent_stop(env_propcache(du));
     pollqueue_finish(&du->pq);
 
     // Restore previous values after shutting down the polltask but
@@ -3513,6 +5462,14 @@ env_free(drmu_env_t * const du)
     env_free_conns(du);
     env_free_crtcs(du);
     drmu_bo_env_uninit(&du->boe);
+    propcache_uninit(&du->propcache);
+    drmu_atomic_pool_unref(&du->dap);
+
+    // Pools may still be using the worker - it goes when they do
+    pollqueue_unref(&du->bg_pq);
+    pthread_mutex_destroy(&du->bg_lock);
+    // ... as may the budget
+    drmu_pool_budget_unref(&du->pool_budget);
 
     close(du->fd);
     free(du);
@@ -3553,6 +5510,7 @@ drmu_env_kill(drmu_env_t ** const ppdu)
     atomic_q_kill(&du->aq);
 
     polltask_delete(&du->pt);
+    propcache_uevent_stop(env_propcache(du));
     pollqueue_finish(&du->pq);
 
     if (du->da_restore)
@@ -3660,41 +5618,246 @@ drmu_atomic_env_restore_add_snapshot(drmu_atomic_t ** const ppda)
     return drmu_atomic_merge(du->da_restore, &da);
 }
 
+static void
+evt_flip_complete(void * v, const struct drm_event * const ev)
+{
+    drmu_atomic_page_flip_cb(v, (const struct drm_event_vblank *)ev);
+}
+
+static void
+evt_unhandled(void * v, const struct drm_event * const ev)
+{
+    drmu_warn((drmu_env_t *)v, "Unexpected DRM event #%x", ev->type);
+}
+
+// Minimum lengths by event type, 0 if not a type we know
+static size_t
+evt_min_len(const uint32_t type)
+{
+    switch (type) {
+        case DRM_EVENT_VBLANK:
+        case DRM_EVENT_FLIP_COMPLETE:
+            return sizeof(struct drm_event_vblank);
+        case DRM_EVENT_CRTC_SEQUENCE:
+            return sizeof(struct drm_event_crtc_sequence);
+        default:
+            break;
+    }
+    return 0;
+}
+
+int
+drmu_env_event_handler_set(drmu_env_t * const du, const uint32_t type, drmu_env_event_fn * const fn, void * const v)
+{
+    // Flip complete is ours
+    if (type >= DRMU_ENV_EVENT_TYPES || evt_min_len(type) == 0 || type == DRM_EVENT_FLIP_COMPLETE)
+        return -EINVAL;
+    du->evt_handlers[type].fn = fn == 0 ? evt_unhandled : fn;
+    du->evt_handlers[type].v = fn == 0 ? du : v;
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+//
+// Background worker fns
+
+static void
+env_bg_thread_init_cb(void * v, short revents)
+{
+    static const drmu_thread_cfg_t bg_cfg = {.nice = 10, .name = "drmu-bg"};
+    (void)v;
+    (void)revents;
+
+    drmu_thread_cfg_apply(&bg_cfg);
+}
+
+// Needs bg_lock
+static struct pollqueue *
+env_bg_pollqueue(drmu_env_t * const du)
+{
+    if (du->bg_pq == NULL && (du->bg_pq = pollqueue_new()) != NULL)
+        pollqueue_callback_once(du->bg_pq, env_bg_thread_init_cb, NULL);
+    return du->bg_pq;
+}
+
+struct pollqueue *
+drmu_env_bg_pollqueue_ref(drmu_env_t * const du)
+{
+    struct pollqueue * pq;
+
+    pthread_mutex_lock(&du->bg_lock);
+    if ((pq = env_bg_pollqueue(du)) != NULL)
+        pollqueue_ref(pq);
+    pthread_mutex_unlock(&du->bg_lock);
+    return pq;
+}
+
+struct pollqueue *
+drmu_env_pollqueue_ref(drmu_env_t * const du)
+{
+    return du->pq == NULL ? NULL : pollqueue_ref(du->pq);
+}
+
+static void
+env_fb_free_cb(void * v, short revents)
+{
+    drmu_env_t * const du = v;
+    drmu_fb_t * dfb = atomic_exchange(&du->fb_free_head, NULL);
+    (void)revents;
+
+    // Each fb holds an env ref so the env (and this task) stays valid until
+    // the last is done. Do not touch du after that.
+    while (dfb != NULL) {
+        drmu_fb_t * const next = dfb->free_next;
+        drmu_env_t * du2 = dfb->du;
+
+        fb_destroy(dfb);
+        drmu_env_unref(&du2);
+        dfb = next;
+    }
+}
+
+static bool
+env_fb_free_defer(drmu_env_t * const du, drmu_fb_t * const dfb)
+{
+    struct polltask * const pt = atomic_load(&du->fb_free_task);
+    drmu_fb_t * head;
+
+    if (pt == NULL)
+        return false;
+
+    drmu_env_ref(du);
+    head = atomic_load(&du->fb_free_head);
+    do {
+        dfb->free_next = head;
+    } while (!atomic_compare_exchange_weak(&du->fb_free_head, &head, dfb));
+
+    // Only need to kick the worker if it might be idle - anything added
+    // whilst it has a batch pending goes into that batch
+    if (head == NULL)
+        pollqueue_add_task(pt, 0);
+    return true;
+}
+
+int
+drmu_env_fb_defer_free_enable(drmu_env_t * const du)
+{
+    struct pollqueue * pq;
+    struct polltask * pt;
+    int rv = 0;
+
+    pthread_mutex_lock(&du->bg_lock);
+    if (atomic_load(&du->fb_free_task) != NULL)
+        goto unlock;
+
+    if ((pq = env_bg_pollqueue(du)) == NULL ||
+        (pt = polltask_new_timer(pq, env_fb_free_cb, du)) == NULL) {
+        drmu_err(du, "%s: Failed to create background worker", __func__);
+        rv = -ENOMEM;
+        goto unlock;
+    }
+    atomic_store(&du->fb_free_task, pt);
+
+unlock:
+    pthread_mutex_unlock(&du->bg_lock);
+    return rv;
+}
+
+typedef struct env_thread_cfg_s {
+    const drmu_thread_cfg_t * cfg;
+    int rv;
+    sem_t sem;
+} env_thread_cfg_t;
+
+static void
+env_thread_cfg_cb(void * v, short revents)
+{
+    env_thread_cfg_t * const etc = v;
+    (void)revents;
+
+    etc->rv = drmu_thread_cfg_apply(etc->cfg);
+    sem_post(&etc->sem);
+}
+
+int
+drmu_env_poll_thread_cfg_set(drmu_env_t * const du, const drmu_thread_cfg_t * const cfg)
+{
+    env_thread_cfg_t etc = {.cfg = cfg, .rv = 0};
+    struct polltask * pt;
+    int rv;
+
+    if ((pt = env_polltask_new(du->pq, -1, 0, env_thread_cfg_cb, &etc)) == NULL)
+        return -ENOMEM;
+    sem_init(&etc.sem, 0, 0);
+
+    pollqueue_add_task(pt, 0);
+    do {
+        rv = sem_wait(&etc.sem);
+    } while (rv == -1 && errno == EINTR);
+
+    polltask_delete(&pt);
+    sem_destroy(&etc.sem);
+    if (etc.rv != 0)
+        drmu_warn(du, "%s: Failed to set poll thread scheduling: %s", __func__, strerror(-etc.rv));
+    return etc.rv;
+}
+
+static void
+evt_handlers_init(drmu_env_t * const du)
+{
+    unsigned int i;
+
+    for (i = 0; i != DRMU_ENV_EVENT_TYPES; ++i) {
+        du->evt_handlers[i].fn = evt_unhandled;
+        du->evt_handlers[i].v = du;
+    }
+    du->evt_handlers[DRM_EVENT_FLIP_COMPLETE].fn = evt_flip_complete;
+}
+
+// Read & dispatch all pending events
+// The kernel only returns whole events so if the buffer was (nearly) filled
+// there may be more waiting; check without blocking and go round again.
 #define EVT(p) ((const struct drm_event *)(p))
 static int
 evt_read(drmu_env_t * const du)
 {
-    uint8_t buf[256] __attribute__((aligned(__BIGGEST_ALIGNMENT__)));
-    const ssize_t rlen = read(drmu_fd(du), buf, sizeof(buf));
-    size_t i;
+    const uint8_t * const buf = (const uint8_t *)du->evt_buf;
+    unsigned int reads;
 
-    if (rlen < 0) {
-        const int err = errno;
-        drmu_err(du, "Event read failure: %s", strerror(err));
-        return -err;
-    }
+    for (reads = 0; reads != 16; ++reads) {
+        const ssize_t rlen = read(drmu_fd(du), du->evt_buf, sizeof(du->evt_buf));
+        struct pollfd pfd = {.fd = drmu_fd(du), .events = POLLIN};
+        size_t i;
 
-    for (i = 0;
-         i + sizeof(struct drm_event) <= (size_t)rlen && EVT(buf + i)->length <= (size_t)rlen - i;
-         i += EVT(buf + i)->length) {
-        switch (EVT(buf + i)->type) {
-            case DRM_EVENT_FLIP_COMPLETE:
-            {
-                const struct drm_event_vblank * const vb = (struct drm_event_vblank*)(buf + i);
-                if (EVT(buf + i)->length < sizeof(*vb))
-                    break;
+        if (rlen < 0) {
+            const int err = errno;
+            drmu_err(du, "Event read failure: %s", strerror(err));
+            return -err;
+        }
 
-                drmu_atomic_page_flip_cb(du, (void *)(uintptr_t)vb->user_data);
-                break;
-            }
-            default:
-                drmu_warn(du, "Unexpected DRM event #%x", EVT(buf + i)->type);
+        for (i = 0;
+             i + sizeof(struct drm_event) <= (size_t)rlen && EVT(buf + i)->length <= (size_t)rlen - i;
+             i += EVT(buf + i)->length) {
+            const struct drm_event * const ev = EVT(buf + i);
+            const size_t min_len = evt_min_len(ev->type);
+
+            if (ev->length < sizeof(*ev))
                 break;
+            if (min_len == 0)
+                evt_unhandled(du, ev);
+            else if (ev->length >= min_len)
+                du->evt_handlers[ev->type].fn(du->evt_handlers[ev->type].v, ev);
+        }
+
+        if (i != (size_t)rlen) {
+            drmu_warn(du, "Bad event received: len=%zd, processed=%zd", rlen, i);
+            break;
         }
-    }
 
-    if (i != (size_t)rlen)
-        drmu_warn(du, "Partial event received: len=%zd, processed=%zd", rlen, i);
+        // Room for another event? Then we have had everything
+        if ((size_t)rlen + 256 <= sizeof(du->evt_buf) || poll(&pfd, 1, 0) != 1)
+            break;
+    }
 
     return 0;
 }
@@ -3727,7 +5890,7 @@ env_set_client_cap(drmu_env_t * const du, uint64_t cap_id, uint64_t cap_val)
 
 // Closes fd on failure
 drmu_env_t *
-drmu_env_new_fd(const int fd, const struct drmu_log_env_s * const log)
+drmu_env_new_fd_n(const int fd, const unsigned int n, const struct drmu_log_env_s * const log)
 {
     drmu_env_t * const du = calloc(1, sizeof(*du));
     int rv;
@@ -3740,12 +5903,31 @@ drmu_env_new_fd(const int fd, const struct drmu_log_env_s * const log)
         close(fd);
         return NULL;
     }
+    pthread_mutex_init(&du->bg_lock, NULL);
 
     du->log = (log == NULL) ? drmu_log_env_none : *log;
     du->fd = fd;
+    evt_handlers_init(du);
 
     drmu_bo_env_init(&du->boe);
-    atomic_q_init(&du->aq);
+    if (atomic_q_init(&du->aq) != 0) {
+        drmu_bo_env_uninit(&du->boe);
+        drmu_err_log(log, "Failed to create du: No memory");
+        free(du);
+        close(fd);
+        return NULL;
+    }
+
+    propcache_init(&du->propcache, du, fd);
+
+    if ((du->dap = drmu_atomic_pool_new()) == NULL) {
+        drmu_err(du, "Failed to create atomic pool");
+        goto fail1;
+    }
+    if ((du->pool_budget = drmu_pool_budget_new()) == NULL) {
+        drmu_err(du, "Failed to create pool budget");
+        goto fail1;
+    }
 
     // We need atomic for almost everything we do
     if ((rv = env_set_client_cap(du, DRM_CLIENT_CAP_ATOMIC, 1)) != 0) {
@@ -3822,14 +6004,23 @@ drmu_env_new_fd(const int fd, const struct drmu_log_env_s * const log)
         crtc_ids = NULL;
     }
 
-    if ((du->pq = pollqueue_new()) == NULL) {
+    if ((du->pq = pollqueue_new_n(n)) == NULL) {
         drmu_err(du, "Failed to create pollqueue");
         goto fail1;
     }
-    if ((du->pt = polltask_new(du->pq, du->fd, POLLIN | POLLPRI, drmu_env_polltask_cb, du)) == NULL) {
+    if ((du->pt = env_polltask_new(du->pq, du->fd, POLLIN | POLLPRI, drmu_env_polltask_cb, du)) == NULL) {
         drmu_err(du, "Failed to create polltask");
         goto fail1;
     }
+    if (propcache_start(&du->propcache, du, du->pq) != 0) {
+        drmu_err(du, "Failed to create uevent polltask");
+        goto fail1;
+    }
+
+    if (atomic_q_start(&du->aq, du, du->pq, du->crtc_count, n != 0) != 0) {
+        drmu_err(du, "Failed to create atomic Q task");
+        goto fail1;
+    }
 
     pollqueue_add_task(du->pt, 1000);
 
@@ -3845,7 +6036,13 @@ fail1:
 }
 
 drmu_env_t *
-drmu_env_new_open(const char * name, const struct drmu_log_env_s * const log2)
+drmu_env_new_fd(const int fd, const struct drmu_log_env_s * const log)
+{
+    return drmu_env_new_fd_n(fd, 0, log);
+}
+
+drmu_env_t *
+drmu_env_new_open_n(const char * name, const unsigned int n, const struct drmu_log_env_s * const log2)
 {
     const struct drmu_log_env_s * const log = (log2 == NULL) ? &drmu_log_env_none : log2;
     int fd = drmOpen(name, NULL);
@@ -3853,7 +6050,13 @@ drmu_env_new_open(const char * name, const struct drmu_log_env_s * const log2)
         drmu_err_log(log, "Failed to open %s", name);
         return NULL;
     }
-    return drmu_env_new_fd(fd, log);
+    return drmu_env_new_fd_n(fd, n, log);
+}
+
+drmu_env_t *
+drmu_env_new_open(const char * name, const struct drmu_log_env_s * const log)
+{
+    return drmu_env_new_open_n(name, 0, log);
 }
 
 //----------------------------------------------------------------------------
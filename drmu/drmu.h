@@ -43,6 +43,7 @@ struct drmu_plane_s;
 typedef struct drmu_plane_s drmu_plane_t;
 
 struct drmu_atomic_s;
+struct drmu_atomic_template_s;
 
 struct drmu_env_s;
 typedef struct drmu_env_s drmu_env_t;
@@ -154,6 +155,51 @@ uint32_t drmu_fb_pixel_format(const drmu_fb_t * const dfb);
 uint64_t drmu_fb_modifier(const drmu_fb_t * const dfb, const unsigned int plane);
 drmu_fb_t * drmu_fb_new_dumb(drmu_env_t * const du, uint32_t w, uint32_t h, const uint32_t format);
 drmu_fb_t * drmu_fb_new_dumb_mod(drmu_env_t * const du, uint32_t w, uint32_t h, const uint32_t format, const uint64_t mod);
+
+// When a new fb is mapped for CPU access
+typedef enum drmu_fb_map_e {
+    DRMU_FB_MAP_DEFAULT = 0,    // Allocator's choice (normally populate)
+    DRMU_FB_MAP_POPULATE,       // Map & prefault at alloc
+    DRMU_FB_MAP_LAZY,           // Map on first drmu_fb_data or read/write start
+    DRMU_FB_MAP_NONE,           // Never map - for buffers only touched by h/w
+} drmu_fb_map_t;
+
+// How the planes of a new fb are laid out in memory, so that buffers can be
+// allocated to match what a decoder (or other producer) wants.
+// Alignments must be powers of 2; 0 => none (w & h default to 16)
+typedef struct drmu_fb_layout_s {
+    uint32_t w_align;           // Allocated width, pixels
+    uint32_t h_align;           // Allocated height, rows
+    uint32_t h_pad;             // Extra rows allocated below h (not part of the fb)
+    uint32_t pitch_align[4];    // Per plane, bytes
+    uint32_t offset_align;      // Plane start within a shared object, bytes
+    bool separate_objects;      // One object per plane
+    drmu_fb_map_t map;
+    bool map_huge;              // Ask for transparent huge pages on the map
+                                // (Only works if the exporter supports it)
+} drmu_fb_layout_t;
+
+// Where the planes go for a given layout, format & size
+typedef struct drmu_fb_planes_s {
+    uint32_t width;             // Allocated (fb) size
+    uint32_t height;
+    unsigned int plane_count;
+    unsigned int obj_count;
+    uint32_t pitch[4];
+    uint32_t offset[4];         // Within obj
+    unsigned int obj[4];        // Object holding plane
+    size_t obj_size[4];         // Min bytes for each object
+} drmu_fb_planes_t;
+
+// layout NULL gives the default packed layout
+// Returns -EINVAL for an unknown format or bad layout
+int drmu_fb_layout_planes(const drmu_fb_layout_t * const layout, const uint32_t format,
+                          const uint32_t w, const uint32_t h, drmu_fb_planes_t * const planes);
+// Dumb fb with the given layout; layout NULL => drmu_fb_new_dumb_mod
+// Sand modifiers have a fixed layout and are rejected
+drmu_fb_t * drmu_fb_new_dumb_layout(drmu_env_t * const du, uint32_t w, uint32_t h,
+                                    const uint32_t format, const uint64_t mod,
+                                    const drmu_fb_layout_t * const layout);
 drmu_fb_t * drmu_fb_realloc_dumb(drmu_env_t * const du, drmu_fb_t * dfb, uint32_t w, uint32_t h, const uint32_t format);
 drmu_fb_t * drmu_fb_realloc_dumb_mod(drmu_env_t * const du, drmu_fb_t * dfb, uint32_t w, uint32_t h, const uint32_t format, const uint64_t mod);
 // Try to reset geometry to these values
@@ -175,6 +221,8 @@ void * drmu_fb_data(const drmu_fb_t *const dfb, const unsigned int layer);
 drmu_bo_t * drmu_fb_bo(const drmu_fb_t * const dfb, const unsigned int layer);
 // Allocated width height - may be rounded up from requested w/h
 uint32_t drmu_fb_width(const drmu_fb_t *const dfb);
+// Bytes of buffer behind the fb, 0 if unknown (e.g. imported)
+size_t drmu_fb_size(const drmu_fb_t *const dfb);
 uint32_t drmu_fb_height(const drmu_fb_t *const dfb);
 // Set cropping (fractional) - x, y, relative to active x, y (and must be +ve)
 int drmu_fb_crop_frac_set(drmu_fb_t *const dfb, drmu_rect_t crop_frac);
@@ -234,6 +282,16 @@ void drmu_fb_int_layer_set(drmu_fb_t *const dfb, unsigned int i, unsigned int ob
 void drmu_fb_int_layer_mod_set(drmu_fb_t *const dfb, unsigned int i, unsigned int obj_idx, uint32_t pitch, uint32_t offset, uint64_t modifier);
 void drmu_fb_int_fd_set(drmu_fb_t *const dfb, const int fd);
 void drmu_fb_int_mmap_set(drmu_fb_t *const dfb, void * const buf, const size_t size, const size_t pitch);
+// Per object (as bo_list) dmabuf fd; the above sets obj 0
+void drmu_fb_int_obj_fd_set(drmu_fb_t *const dfb, const unsigned int obj, const int fd);
+// Set how obj is mapped - mmap(map_fd, offset, size). map_fd is not owned.
+// Maps now if map is populate (or default), on first CPU access if lazy.
+// Policy & huge apply to the whole fb.
+int drmu_fb_int_obj_map_set(drmu_fb_t *const dfb, const unsigned int obj,
+                            const int map_fd, const uint64_t offset, const size_t size,
+                            const drmu_fb_map_t map, const bool huge);
+// CPU caches are coherent with the buffer so read/write start/end are no-ops
+void drmu_fb_int_coherent_set(drmu_fb_t *const dfb, const bool coherent);
 drmu_isset_t drmu_fb_hdr_metadata_isset(const drmu_fb_t *const dfb);
 const struct hdr_output_metadata * drmu_fb_hdr_metadata_get(const drmu_fb_t *const dfb);
 drmu_broadcast_rgb_t drmu_color_range_to_broadcast_rgb(const drmu_color_range_t range);
@@ -241,6 +299,8 @@ drmu_colorspace_t drmu_fb_colorspace_get(const drmu_fb_t * const dfb);
 drmu_color_range_t drmu_fb_color_range_get(const drmu_fb_t * const dfb);
 const struct drmu_fmt_info_s * drmu_fb_format_info_get(const drmu_fb_t * const dfb);
 void drmu_fb_hdr_metadata_set(drmu_fb_t *const dfb, const struct hdr_output_metadata * meta);
+// Return HDR metadata to unset (as on alloc) - for reused fbs
+void drmu_fb_int_hdr_metadata_unset(drmu_fb_t *const dfb);
 int drmu_fb_int_make(drmu_fb_t *const dfb);
 
 // Cached fb sync ops
@@ -375,6 +435,11 @@ int drmu_atomic_plane_add_alpha(struct drmu_atomic_s * const da, const drmu_plan
 
 int drmu_atomic_plane_add_zpos(struct drmu_atomic_s * const da, const drmu_plane_t * const dp, const int zpos);
 
+bool drmu_plane_has_alpha(const drmu_plane_t * const dp);
+// Range zpos may be set to. Immutable zpos has min == max
+// Returns -ENOENT if the plane has no zpos
+int drmu_plane_zpos_range(const drmu_plane_t * const dp, int * const pmin, int * const pmax);
+
 // X, Y & TRANSPOSE can be ORed to get all others
 #define DRMU_PLANE_ROTATION_0                   0
 #define DRMU_PLANE_ROTATION_X_FLIP              1
@@ -397,6 +462,16 @@ int drmu_atomic_plane_clear_add(struct drmu_atomic_s * const da, drmu_plane_t *
 // pos is dest rect on the plane in full pixels (not frac)
 int drmu_atomic_plane_add_fb(struct drmu_atomic_s * const da, drmu_plane_t * const dp, drmu_fb_t * const dfb, const drmu_rect_t pos);
 
+// Add the props set by drmu_atomic_plane_add_fb for position and fb (but
+// not colour etc.) to a template.
+// Returns the first of DRMU_TEMPLATE_PLANE_SLOTS consecutive slots or -ve error
+#define DRMU_TEMPLATE_PLANE_SLOTS 10
+int drmu_atomic_template_add_plane(struct drmu_atomic_template_s * const dt, const drmu_plane_t * const dp);
+// Set the values in a template plane - equivalent to drmu_atomic_plane_add_fb
+// slot0 is the value returned by drmu_atomic_template_add_plane
+int drmu_atomic_template_plane_set_fb(struct drmu_atomic_template_s * const dt, const int slot0,
+                                      drmu_plane_t * const dp, drmu_fb_t * const dfb, const drmu_rect_t pos);
+
 // Is this plane reffed?
 bool drmu_plane_is_claimed(drmu_plane_t * const dp);
 
@@ -436,11 +511,111 @@ struct drmu_log_env_s;
 // If there is a pending commit this atomic will be merged with it
 // Commits are done with the PAGE_FLIP flag set so we expect the ack
 // on the next page flip.
+// The Q is per CRTC: the atomic is routed by the CRTCs its objects are
+// bound to so outputs flip independently. An atomic that touches several
+// CRTCs waits until all of them are idle and completes when all have flipped.
 int drmu_atomic_queue(struct drmu_atomic_s ** ppda);
+// Q the atomic to be presented as close to target_ns (CLOCK_MONOTONIC) as
+// possible. It is held until the next vblank is the one nearest the target.
+// If several atomics for a CRTC are due on the same vblank they are merged
+// in target order so the latest values win; the earlier ones count as
+// dropped. Timed atomics are merged under any untimed atomic pending for
+// the same flip. Atomics that span CRTCs are not timed.
+int drmu_atomic_queue_at(struct drmu_atomic_s ** ppda, const uint64_t target_ns);
+
+// Info for a single flip
+typedef struct drmu_present_info_s {
+    uint32_t crtc_id;
+    uint32_t sequence;          // vblank sequence of the flip
+    uint64_t present_ns;        // Time of the flip (CLOCK_MONOTONIC)
+    uint64_t target_ns;         // Target if queued with drmu_atomic_queue_at, else 0
+    uint64_t queue_ns;          // When the earliest atomic in the flip was queued
+    uint64_t latency_ns;        // present_ns - queue_ns
+    unsigned int merged;        // Number of queued atomics merged into the flip
+} drmu_present_info_t;
+
+// Histograms over the last DRMU_QUEUE_HIST_WINDOW flips
+#define DRMU_QUEUE_HIST_WINDOW  256
+#define DRMU_QUEUE_HIST_BINS    16
+typedef struct drmu_queue_hist_s {
+    unsigned int flips;                             // Flips in the window
+    unsigned int latency[DRMU_QUEUE_HIST_BINS];     // Queue to flip, 2ms bins, last is >= 30ms
+    unsigned int interval[DRMU_QUEUE_HIST_BINS];    // vblanks since the previous flip, last is >= 15
+    unsigned int timed;                             // Timed flips in the window
+    unsigned int error[DRMU_QUEUE_HIST_BINS];       // |present - target| of timed flips, 1ms bins
+} drmu_queue_hist_t;
+
+typedef struct drmu_queue_present_s {
+    drmu_present_info_t last;   // Last flip
+    uint64_t period_ns;         // Measured frame period (from mode if unknown)
+    unsigned long flips;        // Total flips
+    unsigned long presented;    // Timed atomics presented
+    unsigned long dropped;      // Timed atomics superseded by a later one on the same vblank
+    unsigned long late;         // Timed atomics presented > 1/2 frame from target
+    drmu_queue_hist_t hist;
+} drmu_queue_present_t;
+
+// Get presentation info & stats for the Q on a CRTC
+int drmu_env_queue_present_get(drmu_env_t * const du, const drmu_crtc_t * const dc, drmu_queue_present_t * const pres);
+
+// Set a callback to be called on every flip with the info for that flip
+// Called on the poll thread - may queue but must not wait on the Q
+// fn = NULL to disable
+typedef void drmu_queue_present_fn(void * v, const drmu_present_info_t * const info);
+void drmu_env_queue_present_cb_set(drmu_env_t * const du, drmu_queue_present_fn * const fn, void * const v);
+
+// Delta mode (default off)
+// Before each Q commit drop any props that are already on screen with the
+// same value so the ioctl only carries what has changed - useful where most
+// of each frame is static (e.g. a scrolling overlay on a video). Plane FB_ID
+// & CRTC_ID and writeback props are always sent, as is at least one prop of
+// every object in the atomic.
+// Only safe if nothing else changes the props of objects used via the Q
+// (e.g. a drmu_atomic_commit outside the Q) as the Q would not know that the
+// screen no longer matches what it last flipped.
+int drmu_env_queue_delta_set(drmu_env_t * const du, const bool enable);
+
 // Wait for there to be no pending commit (there may be a commit in
-// progress)
+// progress). Timed atomics (drmu_atomic_queue_at) are pending until they
+// have been committed.
 int drmu_env_queue_wait(drmu_env_t * const du);
 
+// Handler for DRM events that drmu does not consume itself
+// (DRM_EVENT_VBLANK, DRM_EVENT_CRTC_SEQUENCE). Events are read in batches
+// and dispatched on the poll thread; the event has been length checked
+// against its type. Set before requesting events of that type.
+// fn = NULL restores the default (warn & discard)
+#define DRMU_ENV_EVENT_TYPES 4
+struct drm_event;
+typedef void drmu_env_event_fn(void * v, const struct drm_event * const ev);
+int drmu_env_event_handler_set(drmu_env_t * const du, const uint32_t type, drmu_env_event_fn * const fn, void * const v);
+
+// Destroy fbs whose last ref has gone on a low priority background thread
+// rather than in whichever thread dropped it (RMFB, munmap, GEM close etc.
+// can take 100s of us). Pre-delete (pool recycling) is still immediate.
+// Frees are batched. Each pending fb holds an env ref so destruction always
+// completes before the env is freed.
+int drmu_env_fb_defer_free_enable(drmu_env_t * const du);
+
+// Low priority background worker for deferrable work (deferred fb free,
+// pool growth). Created on first use. Returns a new ref or NULL.
+struct pollqueue;
+struct pollqueue * drmu_env_bg_pollqueue_ref(drmu_env_t * const du);
+
+// The env's own pollqueue. Returns a new ref or NULL.
+// Tasks on it with the default key run on the executors if the env has any
+// (see drmu_env_new_fd_n), otherwise on the poll thread. Key a task
+// POLLTASK_KEY_POLL_THREAD to run it on the poll thread, ordered with flip
+// handling.
+struct pollqueue * drmu_env_pollqueue_ref(drmu_env_t * const du);
+
+// Set scheduling (RT policy & priority, CPU affinity, name) of the poll
+// thread that does flip handling & atomic commits. Applied on the thread
+// itself; waits until done. Must not be called from that thread.
+// Returns 0 or the first -errno (parts that can be applied are)
+struct drmu_thread_cfg_s;
+int drmu_env_poll_thread_cfg_set(drmu_env_t * const du, const struct drmu_thread_cfg_s * const cfg);
+
 // Do ioctl - returns -errno on error, 0 on success
 // deals with recalling the ioctl when required
 int drmu_ioctl(const drmu_env_t * const du, unsigned long req, void * arg);
@@ -453,6 +628,14 @@ drmu_env_t * drmu_env_ref(drmu_env_t * const du);
 // buffers that hold a ref for logging or DRM fd but it should resolve circular
 // reference problems where buffers on the screen hold refs to the env.
 void drmu_env_kill(drmu_env_t ** const ppdu);
+// Prop cache
+// The env caches prop info, object prop values & blob contents so repeated
+// queries (claim, snapshot, restore) don't need ioctls. Values are kept up
+// to date from commits made through drmu and dropped on any change uevent
+// for the device (hotplug etc.). If something else may have changed props
+// (e.g. another master has had the device) call this to drop the cached
+// values.
+void drmu_env_prop_cache_invalidate(drmu_env_t * const du);
 // Restore state on env close
 int drmu_env_restore_enable(drmu_env_t * const du);
 bool drmu_env_restore_is_enabled(const drmu_env_t * const du);
@@ -467,6 +650,13 @@ int drmu_atomic_env_restore_add_snapshot(struct drmu_atomic_s ** const ppda);
 // If log = NULL logging is disabled (set to drmu_log_env_none).
 drmu_env_t * drmu_env_new_fd(const int fd, const struct drmu_log_env_s * const log);
 drmu_env_t * drmu_env_new_open(const char * name, const struct drmu_log_env_s * const log);
+// As above but the env's pollqueue has n executor threads as well as the
+// poll thread. Flip handling & the atomic Q stay on the poll thread; commit
+// callbacks of Qed atomics & user tasks on drmu_env_pollqueue_ref run on
+// the executors so a slow callback doesn't hold up flips.
+// n == 0 is the same as drmu_env_new_fd/_open
+drmu_env_t * drmu_env_new_fd_n(const int fd, const unsigned int n, const struct drmu_log_env_s * const log);
+drmu_env_t * drmu_env_new_open_n(const char * name, const unsigned int n, const struct drmu_log_env_s * const log);
 
 // Logging
 
@@ -479,9 +669,29 @@ typedef struct drmu_atomic_s drmu_atomic_t;
 
 void drmu_atomic_dump(const drmu_atomic_t * const da);
 drmu_env_t * drmu_atomic_env(const drmu_atomic_t * const da);
+// Presentation target time (CLOCK_MONOTONIC ns) used by the Q, 0 = ASAP
+// Copied by drmu_atomic_copy, not changed by merge
+void drmu_atomic_target_ns_set(drmu_atomic_t * const da, const uint64_t target_ns);
+uint64_t drmu_atomic_target_ns(const drmu_atomic_t * const da);
+// Queue accounting (internal)
+// Stamp sets the queue time & a merge count of 1 if not already set.
+// Merge keeps the earliest queue time & sums the counts.
+void drmu_atomic_queue_stamp(drmu_atomic_t * const da, const uint64_t now_ns);
+uint64_t drmu_atomic_queue_ns(const drmu_atomic_t * const da);
+unsigned int drmu_atomic_merge_count(const drmu_atomic_t * const da);
+// Call fn for each object that has props set in the atomic
+typedef void drmu_atomic_obj_fn(void * v, uint32_t obj_id);
+void drmu_atomic_obj_foreach(const drmu_atomic_t * const da, drmu_atomic_obj_fn * const fn, void * const v);
+// Get the value of a prop set in the atomic
+// Returns 0, -ENOENT if not set
+int drmu_atomic_prop_value_get(const drmu_atomic_t * const da, const uint32_t obj_id, const uint32_t prop_id,
+                               uint64_t * const pvalue);
 void drmu_atomic_unref(drmu_atomic_t ** const ppda);
 drmu_atomic_t * drmu_atomic_ref(drmu_atomic_t * const da);
 drmu_atomic_t * drmu_atomic_new(drmu_env_t * const du);
+// Make room for at least n_objs objects & n_props props in total so that
+// adding them (or merging them in) doesn't need to allocate
+int drmu_atomic_reserve(drmu_atomic_t * const da, const unsigned int n_objs, const unsigned int n_props);
 
 // Copy (rather than just ref) b
 drmu_atomic_t * drmu_atomic_copy(drmu_atomic_t * const b);
@@ -506,8 +716,13 @@ static inline int drmu_atomic_move_merge(drmu_atomic_t ** const ppa, drmu_atomic
 }
 
 // Remove all els in a that are also in b
-// b may be sorted (if not already) but is otherwise unchanged
+// b is unchanged
 void drmu_atomic_sub(drmu_atomic_t * const a, drmu_atomic_t * const b);
+// Remove els in a that are also in b with the same value, i.e. that would
+// change nothing if a was committed on top of b. Props whose ids are in
+// keep_ids are never removed and every object in a keeps at least one prop.
+void drmu_atomic_sub_unchanged(drmu_atomic_t * const a, const drmu_atomic_t * const b,
+                               const uint32_t * const keep_ids, const unsigned int n_keep);
 
 // flags are DRM_MODE_ATOMIC_xxx (e.g. DRM_MODE_ATOMIC_TEST_ONLY) and DRM_MODE_PAGE_FLIP_xxx
 int drmu_atomic_commit(const drmu_atomic_t * const da, uint32_t flags);
@@ -518,6 +733,9 @@ int drmu_atomic_commit_test(const drmu_atomic_t * const da, uint32_t flags, drmu
 // Add a callback that occurs when the atomic has been committed
 // This will occur on flip if atomic queued via _atomic_queue - if multiple
 // atomics are queued before flip then all fill occur on the same flip
+// For an atomic queued on an env with executors (drmu_env_new_fd_n) the
+// callbacks run on an executor, in queue order, rather than on the poll
+// thread.
 // If cb is 0 then NOP
 typedef void drmu_atomic_commit_fn(void * v);
 int drmu_atomic_add_commit_callback(drmu_atomic_t * const da, drmu_atomic_commit_fn * const cb, void * const v);
@@ -525,6 +743,59 @@ int drmu_atomic_add_commit_callback(drmu_atomic_t * const da, drmu_atomic_commit
 void drmu_atomic_clear_commit_callbacks(drmu_atomic_t * const da);
 // Run all commit callbacks on this atomic. Callbacks are not cleared.
 void drmu_atomic_run_commit_callbacks(const drmu_atomic_t * const da);
+// Move b's commit callbacks onto the end of a's. Returns true if b had any.
+bool drmu_atomic_commit_callbacks_move(drmu_atomic_t * const a, drmu_atomic_t * const b);
+
+// Atomic pool
+// Each env has a pool that recycles atomics, their prop storage and commit
+// callbacks so that a steady state display loop does no heap allocation.
+struct drmu_atomic_pool_s;
+typedef struct drmu_atomic_pool_s drmu_atomic_pool_t;
+
+drmu_atomic_pool_t * drmu_atomic_pool_new(void);
+void drmu_atomic_pool_unref(drmu_atomic_pool_t ** const pppool);
+// Internal - the pool held by the env (may be NULL)
+drmu_atomic_pool_t * drmu_env_atomic_pool(const drmu_env_t * const du);
+// Internal - update the env prop cache with the (flattened) props of a
+// successful commit
+void drmu_env_prop_cache_commit(drmu_env_t * const du, const unsigned int n_objs,
+                                const uint32_t * const obj_ids, const uint32_t * const prop_counts,
+                                const uint32_t * const prop_ids, const uint64_t * const values);
+// Internal - the fb pool budget held by the env (may be NULL)
+struct drmu_pool_budget_s;
+struct drmu_pool_budget_s * drmu_env_pool_budget(const drmu_env_t * const du);
+
+typedef struct drmu_atomic_stats_s {
+    unsigned long atomic_new;   // Atomics created
+    unsigned long atomic_alloc; // ... of which needed a heap alloc
+    unsigned long cb_new;       // Commit callbacks added
+    unsigned long cb_alloc;     // ... of which needed a heap alloc
+    unsigned long array_alloc;  // Obj & prop array allocs & reallocs
+    unsigned int free_atomics;  // Atomics currently held for reuse
+    unsigned int free_cbs;      // Callbacks currently held for reuse
+} drmu_atomic_stats_t;
+
+// Get the counters for the env atomic pool. Counts are cumulative so take
+// the difference between two calls to get allocs over a period.
+void drmu_env_atomic_stats(drmu_env_t * const du, drmu_atomic_stats_t * const stats);
+
+// Atomic list (internal)
+// Lock-free list of atomics waiting to be merged. Any thread may push, only
+// one thread at a time may merge.
+struct drmu_atomic_list_s;
+typedef struct drmu_atomic_list_s drmu_atomic_list_t;
+
+drmu_atomic_list_t * drmu_atomic_list_new(void);
+// Unrefs anything remaining on the list
+void drmu_atomic_list_free(drmu_atomic_list_t ** const pplist);
+// Takes ownership of *ppda (unrefed on error); copies it if it is shared
+// Returns 1 if the list was empty before the push, 0 if not, -errno on error
+int drmu_atomic_list_push(drmu_atomic_list_t * const list, drmu_atomic_t ** const ppda);
+bool drmu_atomic_list_is_empty(drmu_atomic_list_t * const list);
+// Takes everything on the list & calls fn for each atomic in push order
+// fn may take *ppda, anything left is unrefed
+typedef void drmu_atomic_list_take_fn(void * v, drmu_atomic_t ** const ppda);
+void drmu_atomic_list_take_each(drmu_atomic_list_t * const list, drmu_atomic_list_take_fn * const fn, void * const v);
 
 typedef void drmu_prop_unref_fn(void * v);
 typedef void drmu_prop_ref_fn(void * v);
@@ -545,6 +816,34 @@ int drmu_atomic_add_prop_generic(drmu_atomic_t * const da,
         const drmu_atomic_prop_fns_t * const fns, void * const v);
 int drmu_atomic_add_prop_value(drmu_atomic_t * const da, const uint32_t obj_id, const uint32_t prop_id, const uint64_t value);
 
+// Atomic template
+// A template is a fixed set of obj/prop pairs that is flattened once into
+// the arrays that the atomic ioctl takes so that per frame only the values
+// need updating. Add all props before setting any values - the layout is
+// frozen on first set or commit.
+struct drmu_atomic_template_s;
+typedef struct drmu_atomic_template_s drmu_atomic_template_t;
+
+drmu_atomic_template_t * drmu_atomic_template_new(drmu_env_t * const du);
+void drmu_atomic_template_unref(drmu_atomic_template_t ** const ppdt);
+drmu_atomic_template_t * drmu_atomic_template_ref(drmu_atomic_template_t * const dt);
+// Add obj/prop to the template layout
+// Returns slot number (>= 0) or -ve error. Adding an existing pair returns
+// its current slot.
+int drmu_atomic_template_add(drmu_atomic_template_t * const dt, const uint32_t obj_id, const uint32_t prop_id);
+int drmu_atomic_template_set_generic(drmu_atomic_template_t * const dt, const unsigned int slot,
+        const uint64_t value,
+        const drmu_atomic_prop_fns_t * const fns, void * const v);
+int drmu_atomic_template_set_value(drmu_atomic_template_t * const dt, const unsigned int slot, const uint64_t value);
+int drmu_atomic_template_set_fb(drmu_atomic_template_t * const dt, const unsigned int slot, struct drmu_fb_s * const dfb);
+// Commit the current values directly. Refs on values (e.g. fbs) are held
+// until replaced by the next successful commit.
+// This bypasses the atomic Q so only use for blocking or TEST_ONLY commits
+int drmu_atomic_template_commit(drmu_atomic_template_t * const dt, uint32_t flags);
+// Make a new atomic holding the current values, e.g. for drmu_atomic_queue
+// It is built pre-sorted so no sort is needed on merge or commit
+drmu_atomic_t * drmu_atomic_template_atomic(drmu_atomic_template_t * const dt);
+
 // drmu_xlease
 
 drmu_env_t * drmu_env_new_xlease(const struct drmu_log_env_s * const log);
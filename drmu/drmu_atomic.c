@@ -1,36 +1,38 @@
 #include "drmu.h"
 #include "drmu_log.h"
 
-#include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdatomic.h>
 #include <string.h>
 
 #include <libdrm/drm.h>
 #include <libdrm/drm_mode.h>
 
-// Atomic property chain structures - no external visibility
-typedef struct aprop_prop_s {
-    uint32_t id;
-    uint64_t value;
+// Atomic property structures - no external visibility
+//
+// Props are held flattened in the form DRM_IOCTL_MODE_ATOMIC wants, sorted
+// by obj id then prop id: obj_ids & prop_counts [n_objs] and prop_ids,
+// values & refs [n_props], each obj's props being a run in the prop arrays.
+// Keeping them sorted as they are added means commit can pass the arrays
+// straight to the ioctl and merge & sub are single linear passes.
+typedef struct aprop_ref_s {
     void * v;
     const drmu_atomic_prop_fns_t * fns;
-} aprop_prop_t;
-
-typedef struct aprop_obj_s {
-    uint32_t id;
-    unsigned int n;
-    unsigned int size;
-    bool unsorted;
-    aprop_prop_t * props;
-} aprop_obj_t;
+} aprop_ref_t;
 
 typedef struct aprop_hdr_s {
-    unsigned int n;
-    unsigned int size;
-    bool unsorted;
-    aprop_obj_t * objs;
+    unsigned int n_objs;
+    unsigned int n_props;
+    unsigned int obj_size;
+    unsigned int prop_size;
+    // obj_ids & prop_counts share an alloc as do values, refs & prop_ids
+    uint32_t * obj_ids;
+    uint32_t * prop_counts;
+    uint64_t * values;
+    aprop_ref_t * refs;
+    uint32_t * prop_ids;
 } aprop_hdr_t;
 
 typedef struct atomic_cb_s {
@@ -43,6 +45,11 @@ typedef struct drmu_atomic_s {
     atomic_int ref_count;  // 0 == 1 ref for ease of init
 
     struct drmu_env_s * du;
+    struct drmu_atomic_pool_s * pool;
+    struct drmu_atomic_s * next;  // Pool free list link
+    uint64_t target_ns;     // Presentation target (CLOCK_MONOTONIC), 0 = ASAP
+    uint64_t queue_ns;      // Earliest queue time of anything merged in, 0 = unset
+    unsigned int merge_count;   // Number of queued atomics merged into this
 
     aprop_hdr_t props;
 
@@ -50,18 +57,85 @@ typedef struct drmu_atomic_s {
     atomic_cb_t ** commit_cb_last_ptr;
 } drmu_atomic_t;
 
-static inline unsigned int
-max_uint(const unsigned int a, const unsigned int b)
-{
-    return a < b ? b : a;
-}
+// Max atomics kept on the pool free list
+#define ATOMIC_POOL_MAX_FREE    16
+// Max commit callback structs kept on the pool free list
+#define ATOMIC_POOL_MAX_CBS     64
+// Atomics with obj or prop arrays bigger than these have their storage freed
+// rather than kept (e.g. restore or snapshot atomics)
+#define ATOMIC_POOL_MAX_OBJS    64
+#define ATOMIC_POOL_MAX_PROPS   1024
+
+// Commit failure diagnoses remembered per env
+#define COMMIT_DIAG_CACHE_SIZE  8
+// Diagnoses with more bad props than this aren't cached
+#define COMMIT_DIAG_BAD_MAX     8
+
+typedef struct commit_diag_prop_s {
+    uint32_t obj_id;
+    uint32_t prop_id;
+} commit_diag_prop_t;
+
+// Result of bisecting a failed commit, keyed on a hash of its flags, error
+// and (obj, prop) list but not values, so that a repeat failure of the same
+// prop set (e.g. EBUSY after a modeset) is found even though FB_IDs etc.
+// differ. A hit is confirmed by a test commit before being used.
+typedef struct commit_diag_s {
+    uint64_t key;
+    unsigned int n_bad;
+    commit_diag_prop_t bad[COMMIT_DIAG_BAD_MAX];
+} commit_diag_t;
+
+// Recycles atomics, their prop arrays and commit callbacks so that steady
+// state frame display doesn't need to touch the heap.
+// Each env holds a ref and each live atomic allocated from it holds a ref
+// so it is safe for atomics to outlive the env.
+typedef struct drmu_atomic_pool_s {
+    atomic_int ref_count;  // 0 == 1 ref for ease of init
+
+    pthread_mutex_t lock;
+    drmu_atomic_t * free_atomics;
+    unsigned int free_atomic_count;
+    atomic_cb_t * free_cbs;
+    unsigned int free_cb_count;
+
+    atomic_ulong atomic_new;
+    atomic_ulong atomic_alloc;
+    atomic_ulong cb_new;
+    atomic_ulong cb_alloc;
+    atomic_ulong array_alloc;
+
+    // Commit diagnosis cache, MRU first. Protected by lock
+    unsigned int diag_n;
+    commit_diag_t diags[COMMIT_DIAG_CACHE_SIZE];
+} drmu_atomic_pool_t;
+
+// Stats are lockless and pool may be NULL
+#define pool_stat_add(_pool, _stat, _n) do {\
+    if ((_pool) != NULL && (_n) != 0)\
+        atomic_fetch_add(&(_pool)->_stat, (_n));\
+} while (0)
 
 static atomic_cb_t *
-atomic_cb_new(drmu_atomic_commit_fn * cb, void * v)
+atomic_cb_new(drmu_atomic_pool_t * const pool, drmu_atomic_commit_fn * cb, void * v)
 {
-    atomic_cb_t * acb = malloc(sizeof(*acb));
-    if (acb == NULL)
-        return NULL;
+    atomic_cb_t * acb = NULL;
+
+    if (pool != NULL) {
+        atomic_fetch_add(&pool->cb_new, 1);
+        pthread_mutex_lock(&pool->lock);
+        if ((acb = pool->free_cbs) != NULL) {
+            pool->free_cbs = acb->next;
+            --pool->free_cb_count;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (acb == NULL) {
+        if ((acb = malloc(sizeof(*acb))) == NULL)
+            return NULL;
+        pool_stat_add(pool, cb_alloc, 1);
+    }
 
     *acb = (atomic_cb_t){
         .next = NULL,
@@ -71,489 +145,394 @@ atomic_cb_new(drmu_atomic_commit_fn * cb, void * v)
     return acb;
 }
 
-static void
-aprop_prop_unref(aprop_prop_t * const pp)
-{
-    pp->fns->unref(pp->v);
-}
-
-static void
-aprop_prop_ref(aprop_prop_t * const pp)
-{
-    pp->fns->ref(pp->v);
-}
+static const drmu_atomic_prop_fns_t null_fns = {
+    .ref    = drmu_prop_fn_null_ref,
+    .unref  = drmu_prop_fn_null_unref,
+    .commit = drmu_prop_fn_null_commit
+};
 
 static void
-aprop_obj_uninit(aprop_obj_t * const po)
-{
-    unsigned int i;
-    for (i = 0; i != po->n; ++i)
-        aprop_prop_unref(po->props + i);
-    free(po->props);
-    memset(po, 0, sizeof(*po));
-}
-
-static int
-aprop_obj_copy(aprop_obj_t * const po_c, const aprop_obj_t * const po_a)
+aprop_refs_unref(const aprop_ref_t * const refs, const unsigned int n)
 {
     unsigned int i;
-    aprop_prop_t * props;
-
-    aprop_obj_uninit(po_c);
-    if (po_a->n == 0)
-        return 0;
-
-    if ((props = calloc(po_a->size, sizeof(*props))) == NULL)
-        return -ENOMEM;
-    memcpy(props, po_a->props, po_a->n * sizeof(*po_a->props));
-
-    *po_c = *po_a;
-    po_c->props = props;
-
-    for (i = 0; i != po_a->n; ++i)
-        aprop_prop_ref(props + i);
-    return 0;
+    for (i = 0; i != n; ++i)
+        refs[i].fns->unref(refs[i].v);
 }
 
 static void
-aprop_obj_move(aprop_obj_t * const po_c, aprop_obj_t * const po_a)
+aprop_refs_ref(const aprop_ref_t * const refs, const unsigned int n)
 {
-    *po_c = *po_a;
-    memset(po_a, 0, sizeof(*po_a));
-}
-
-static int
-aprop_prop_qsort_cb(const void * va, const void * vb)
-{
-    const aprop_prop_t * const a = va;
-    const aprop_prop_t * const b = vb;
-    return a->id == b->id ? 0 : a->id < b->id ? -1 : 1;
+    unsigned int i;
+    for (i = 0; i != n; ++i)
+        refs[i].fns->ref(refs[i].v);
 }
 
-static void
-aprop_obj_props_sort(aprop_obj_t * const po)
+// Copy n props from b[j] to a[i]. Ranges may overlap
+static inline void
+aprop_props_move(aprop_hdr_t * const ph_a, const unsigned int i,
+                 const aprop_hdr_t * const ph_b, const unsigned int j, const unsigned int n)
 {
-    if (!po->unsorted)
+    if (n == 0)
         return;
-    qsort(po->props, po->n, sizeof(po->props[0]), aprop_prop_qsort_cb);
-    po->unsorted = false;
+    memmove(ph_a->prop_ids + i, ph_b->prop_ids + j, n * sizeof(*ph_a->prop_ids));
+    memmove(ph_a->values + i, ph_b->values + j, n * sizeof(*ph_a->values));
+    memmove(ph_a->refs + i, ph_b->refs + j, n * sizeof(*ph_a->refs));
 }
 
-// Merge b into a and put the result in c. a & b are uninit on exit
-// Could (easily) merge into a but its more convienient for the caller to create new
+// Make room for at least n_objs objs & n_props props, keeping contents
+// Returns count of arrays allocated or -ve error
 static int
-aprop_obj_merge(aprop_obj_t * const po_c, aprop_obj_t * const po_a, aprop_obj_t * const po_b)
+aprop_hdr_reserve(aprop_hdr_t * const ph, const unsigned int n_objs, const unsigned int n_props)
 {
-    unsigned int i, j, k;
-    unsigned int c_size;
-    aprop_prop_t * c;
-    aprop_prop_t * const a = po_a->props;
-    aprop_prop_t * const b = po_b->props;
-
-    // As we should have no identical els we don't care that qsort is unstable
-    aprop_obj_props_sort(po_a);
-    aprop_obj_props_sort(po_b);
-
-    // Pick a size
-    c_size = max_uint(po_a->size, po_b->size);
-    if (c_size < po_a->n + po_b->n)
-        c_size *= 2;
-    if ((c = calloc(c_size, sizeof(*c))) == NULL)
-        return -ENOMEM;
+    int n = 0;
 
-    for (i = 0, j = 0, k = 0; i < po_a->n && j < po_b->n; ++k) {
-        if (a[i].id < b[j].id)
-            c[k] = a[i++];
-        else if (a[i].id > b[j].id)
-            c[k] = b[j++];
-        else {
-            c[k] = b[j++];
-            aprop_prop_unref(a + i++);
+    if (n_objs > ph->obj_size) {
+        uint32_t * const objs = malloc(n_objs * 2 * sizeof(*objs));
+        if (objs == NULL)
+            return -ENOMEM;
+        if (ph->n_objs != 0) {
+            memcpy(objs, ph->obj_ids, ph->n_objs * sizeof(*objs));
+            memcpy(objs + n_objs, ph->prop_counts, ph->n_objs * sizeof(*objs));
         }
+        free(ph->obj_ids);
+        ph->obj_ids = objs;
+        ph->prop_counts = objs + n_objs;
+        ph->obj_size = n_objs;
+        ++n;
     }
-    for (; i < po_a->n; ++i, ++k)
-        c[k] = a[i];
-    for (; j < po_b->n; ++j, ++k)
-        c[k] = b[j];
-
-    *po_c = (aprop_obj_t){
-        .id = po_a->id,
-        .n = k,
-        .size = c_size,
-        .unsorted = false,
-        .props = c
-    };
-
-    // We have avoided excess ref / unref by simple copy so just free the props array
-    free(a);
-    free(b);
 
-    memset(po_a, 0, sizeof(*po_a));
-    memset(po_b, 0, sizeof(*po_b));
-
-    return 0;
+    if (n_props > ph->prop_size) {
+        aprop_hdr_t t = {
+            .prop_size = n_props,
+            .values = malloc(n_props * (sizeof(*t.values) + sizeof(*t.refs) + sizeof(*t.prop_ids)))
+        };
+        if (t.values == NULL)
+            return -ENOMEM;
+        t.refs = (aprop_ref_t *)(t.values + n_props);
+        t.prop_ids = (uint32_t *)(t.refs + n_props);
+        aprop_props_move(&t, 0, ph, 0, ph->n_props);
+        free(ph->values);
+        ph->values = t.values;
+        ph->refs = t.refs;
+        ph->prop_ids = t.prop_ids;
+        ph->prop_size = n_props;
+        ++n;
+    }
+    return n;
 }
 
-// Remove any props in a that are also in b
-// b must be sorted
-// Returns count of props remaining in a
 static unsigned int
-aprop_obj_sub(aprop_obj_t * const po_a, const aprop_obj_t * const po_b)
+aprop_grow_size(const unsigned int size, const unsigned int n)
 {
-    unsigned int i = 0, j = 0, k;
-    aprop_prop_t * const a = po_a->props;
-    const aprop_prop_t * const b = po_b->props;
-
-    if (po_a->n == 0 || po_b->n == 0)
-        return po_a->n;
-
-    // As we should have no identical els we don't care that qsort is unstable
-    aprop_obj_props_sort(po_a);
-    assert(!po_b->unsorted);
-
-    // Skip initial non-matches, returning if no match found
-    while (a[i].id != b[j].id) {
-        if (a[i].id < b[j].id) {
-            if (++i == po_a->n)
-                return po_a->n;
-        }
-        else {
-            if (++j == po_b->n)
-                return po_a->n;
-        }
-    }
-    // We have a match - next loop will do the unref
-    k = i;
-
-    do {
-        if (a[i].id < b[j].id)
-            a[k++] = a[i++];
-        else {
-            if (a[i].id == b[j].id)
-                aprop_prop_unref(a + i++);
-            j++;
-        }
-    } while (i != po_a->n && j != po_b->n);
-
-    for (; i < po_a->n; ++i, ++k)
-        a[k] = a[i];
-    po_a->n = k;
-
-    return po_a->n;
+    unsigned int newsize = size < 16 ? 16 : size;
+    while (newsize < n)
+        newsize *= 2;
+    return newsize;
 }
 
-
-static aprop_prop_t *
-aprop_obj_prop_get(aprop_obj_t * const po, const uint32_t id)
+// As reserve but at least doubles anything that needs to grow so repeated
+// adds are amortised
+static int
+aprop_hdr_grow(aprop_hdr_t * const ph, const unsigned int n_objs, const unsigned int n_props)
 {
-    unsigned int i;
-    aprop_prop_t * pp = po->props;
-
-    static const drmu_atomic_prop_fns_t null_fns = {
-        .ref    = drmu_prop_fn_null_ref,
-        .unref  = drmu_prop_fn_null_unref,
-        .commit = drmu_prop_fn_null_commit
-    };
-
-    for (i = 0; i != po->n; ++i, ++pp) {
-        if (pp->id == id)
-            return pp;
-    }
-
-    if (po->n >= po->size) {
-        size_t newsize = po->size < 16 ? 16 : po->size * 2;
-        if ((pp = realloc(po->props, newsize * sizeof(*pp))) == NULL)
-            return NULL;
-        memset(pp + po->size, 0, (newsize - po->size) * sizeof(*pp));
-
-        po->props = pp;
-        po->size = newsize;
-        pp += po->n;
-    }
-    if (!po->unsorted && po->n != 0 && pp[-1].id > id)
-        po->unsorted = true;
-    ++po->n;
-
-    pp->id = id;
-    pp->fns = &null_fns;
-    return pp;
+    return aprop_hdr_reserve(ph,
+                             n_objs <= ph->obj_size ? n_objs : aprop_grow_size(ph->obj_size, n_objs),
+                             n_props <= ph->prop_size ? n_props : aprop_grow_size(ph->prop_size, n_props));
 }
 
-static void
-aprop_obj_atomic_fill(const aprop_obj_t * const po, uint32_t * prop_ids, uint64_t * prop_values)
+// Find prop, inserting it in order if not already present
+// New props have value 0 and no fns
+// Returns index of the prop or -ve error
+static int
+aprop_hdr_prop_get(aprop_hdr_t * const ph, const uint32_t obj_id, const uint32_t prop_id)
 {
     unsigned int i;
-    for (i = 0; i != po->n; ++i) {
-        *prop_ids++ = po->props[i].id;
-        *prop_values++ = po->props[i].value;
+    unsigned int lo = 0;
+    unsigned int hi;
+    bool new_obj;
+    int rv;
+
+    for (i = 0; i != ph->n_objs && ph->obj_ids[i] < obj_id; ++i)
+        lo += ph->prop_counts[i];
+
+    new_obj = i == ph->n_objs || ph->obj_ids[i] != obj_id;
+    if (!new_obj) {
+        // Props are commonly added in order so check the end first
+        const unsigned int end = lo + ph->prop_counts[i];
+        hi = end;
+        if (ph->prop_ids[hi - 1] < prop_id)
+            lo = hi;
+        while (lo < hi) {
+            const unsigned int mid = (lo + hi) / 2;
+            if (ph->prop_ids[mid] < prop_id)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo != end && ph->prop_ids[lo] == prop_id)
+            return lo;
     }
-}
 
-static void
-aprop_obj_dump(drmu_env_t * const du, const aprop_obj_t * const po)
-{
-    unsigned int i;
-    drmu_info(du, "Obj: %02x: size %d n %d", po->id, po->size, po->n);
-    for (i = 0; i != po->n; ++i) {
-        struct drm_mode_get_property pattr = {.prop_id = po->props[i].id};
-        drmu_ioctl(du, DRM_IOCTL_MODE_GETPROPERTY, &pattr);
+    if ((rv = aprop_hdr_grow(ph, ph->n_objs + new_obj, ph->n_props + 1)) < 0)
+        return rv;
 
-        drmu_info(du, "Obj %02x: Prop %02x (%s) Value %"PRIx64" v %p", po->id, po->props[i].id, pattr.name, po->props[i].value, po->props[i].v);
+    if (new_obj) {
+        memmove(ph->obj_ids + i + 1, ph->obj_ids + i, (ph->n_objs - i) * sizeof(*ph->obj_ids));
+        memmove(ph->prop_counts + i + 1, ph->prop_counts + i, (ph->n_objs - i) * sizeof(*ph->prop_counts));
+        ph->obj_ids[i] = obj_id;
+        ph->prop_counts[i] = 0;
+        ++ph->n_objs;
     }
+    aprop_props_move(ph, lo + 1, ph, lo, ph->n_props - lo);
+    ph->prop_ids[lo] = prop_id;
+    ph->values[lo] = 0;
+    ph->refs[lo] = (aprop_ref_t){.fns = &null_fns};
+    ++ph->prop_counts[i];
+    ++ph->n_props;
+    return lo;
 }
 
 static void
 aprop_hdr_dump(drmu_env_t * const du, const aprop_hdr_t * const ph)
 {
-    unsigned int i;
-    drmu_info(du, "Header: size %d n %d", ph->size, ph->n);
-    for (i = 0; i != ph->n; ++i)
-        aprop_obj_dump(du, ph->objs + i);
-}
-
-static aprop_obj_t *
-aprop_hdr_obj_get(aprop_hdr_t * const ph, const uint32_t id)
-{
-    unsigned int i;
-    aprop_obj_t * po = ph->objs;
-
-    for (i = 0; i != ph->n; ++i, ++po) {
-        if (po->id == id)
-            return po;
-    }
+    unsigned int i, j, k;
 
-    if (ph->n >= ph->size) {
-        size_t newsize = ph->size < 16 ? 16 : ph->size * 2;
-        if ((po = realloc(ph->objs, newsize * sizeof(*po))) == NULL)
-            return NULL;
-        memset(po + ph->size, 0, (newsize - ph->size) * sizeof(*po));
+    drmu_info(du, "Header: objs %d/%d props %d/%d", ph->n_objs, ph->obj_size, ph->n_props, ph->prop_size);
+    for (i = 0, k = 0; i != ph->n_objs; ++i) {
+        const uint32_t obj_id = ph->obj_ids[i];
+        drmu_info(du, "Obj: %02x: n %d", obj_id, ph->prop_counts[i]);
+        for (j = 0; j != ph->prop_counts[i]; ++j, ++k) {
+            struct drm_mode_get_property pattr = {.prop_id = ph->prop_ids[k]};
+            drmu_ioctl(du, DRM_IOCTL_MODE_GETPROPERTY, &pattr);
 
-        ph->objs = po;
-        ph->size = newsize;
-        po += ph->n;
+            drmu_info(du, "Obj %02x: Prop %02x (%s) Value %"PRIx64" v %p", obj_id, ph->prop_ids[k], pattr.name, ph->values[k], ph->refs[k].v);
+        }
     }
-    if (!ph->unsorted && ph->n != 0 && po[-1].id > id)
-        ph->unsorted = true;
-    ++ph->n;
-
-    po->id = id;
-    return po;
 }
 
 static void
 aprop_hdr_uninit(aprop_hdr_t * const ph)
 {
-    unsigned int i;
-    for (i = 0; i != ph->n; ++i)
-        aprop_obj_uninit(ph->objs + i);
-    free(ph->objs);
+    aprop_refs_unref(ph->refs, ph->n_props);
+    free(ph->obj_ids);
+    free(ph->values);
     memset(ph, 0, sizeof(*ph));
 }
 
-static int
-aprop_hdr_copy(aprop_hdr_t * const ph_c, const aprop_hdr_t * const ph_a)
+// Unref all props but keep the arrays for reuse
+static void
+aprop_hdr_reset(aprop_hdr_t * const ph)
 {
-    unsigned int i;
-
-    aprop_hdr_uninit(ph_c);
-
-    if (ph_a->n == 0)
-        return 0;
-
-    if ((ph_c->objs = calloc(ph_a->size, sizeof(*ph_c->objs))) == NULL)
-        return -ENOMEM;
-
-    ph_c->n = ph_a->n;
-    ph_c->size = ph_a->size;
-    ph_c->unsorted = ph_a->unsorted;
-
-    for (i = 0; i != ph_a->n; ++i)
-        aprop_obj_copy(ph_c->objs + i, ph_a->objs + i);
-    return 0;
+    aprop_refs_unref(ph->refs, ph->n_props);
+    ph->n_objs = 0;
+    ph->n_props = 0;
 }
 
-// Move b to a. a must be empty
+// Copy a to c. c must be empty but may have storage
+// Returns count of arrays allocated or -ve error
 static int
-aprop_hdr_move(aprop_hdr_t * const ph_a, aprop_hdr_t * const ph_b)
+aprop_hdr_copy(aprop_hdr_t * const ph_c, const aprop_hdr_t * const ph_a)
 {
-    *ph_a = *ph_b;
-    *ph_b = (aprop_hdr_t){0};
-    return 0;
-}
+    int rv;
 
-static int
-aprop_obj_qsort_cb(const void * va, const void * vb)
-{
-    const aprop_obj_t * const a = va;
-    const aprop_obj_t * const b = vb;
-    return a->id == b->id ? 0 : a->id < b->id ? -1 : 1;
-}
+    if (ph_a->n_props == 0)
+        return 0;
+    if ((rv = aprop_hdr_reserve(ph_c, ph_a->n_objs, ph_a->n_props)) < 0)
+        return rv;
 
-// As we should have no identical els we don't care that qsort is unstable
-// Doesn't sort props
-static void
-aprop_hdr_sort(aprop_hdr_t * const ph)
-{
-    if (!ph->unsorted)
-        return;
-    qsort(ph->objs, ph->n, sizeof(ph->objs[0]), aprop_obj_qsort_cb);
-    ph->unsorted = false;
+    memcpy(ph_c->obj_ids, ph_a->obj_ids, ph_a->n_objs * sizeof(*ph_c->obj_ids));
+    memcpy(ph_c->prop_counts, ph_a->prop_counts, ph_a->n_objs * sizeof(*ph_c->prop_counts));
+    aprop_props_move(ph_c, 0, ph_a, 0, ph_a->n_props);
+    aprop_refs_ref(ph_c->refs, ph_a->n_props);
+    ph_c->n_objs = ph_a->n_objs;
+    ph_c->n_props = ph_a->n_props;
+    return rv;
 }
 
-// Merge b into a. b will be uninited
+// Merge b into a. b is left empty (but keeps its storage)
+// Props in both take b's value
+//
+// a is grown to hold everything in a & b and then the merge runs from the
+// end backwards, so the write position is never before the next a read,
+// leaving a gap at the start if there were duplicates.
+// Returns count of arrays allocated or -ve error
 static int
 aprop_hdr_merge(aprop_hdr_t * const ph_a, aprop_hdr_t * const ph_b)
 {
-    unsigned int i, j, k;
-    unsigned int c_size;
-    aprop_obj_t * c;
-    aprop_obj_t * const a = ph_a->objs;
-    aprop_obj_t * const b = ph_b->objs;
-
-    if (ph_b->n == 0)
+    unsigned int ia = ph_a->n_objs;
+    unsigned int ib = ph_b->n_objs;
+    unsigned int pa = ph_a->n_props;
+    unsigned int pb = ph_b->n_props;
+    unsigned int ko = ia + ib;
+    unsigned int kp = pa + pb;
+    int rv;
+
+    if (pb == 0)
+        return 0;
+    if (pa == 0 && ph_b->prop_size >= ph_a->prop_size && ph_b->obj_size >= ph_a->obj_size) {
+        // Just swap storage
+        const aprop_hdr_t t = *ph_a;
+        *ph_a = *ph_b;
+        *ph_b = t;
         return 0;
-    if (ph_a->n == 0)
-        return aprop_hdr_move(ph_a, ph_b);
-
-    aprop_hdr_sort(ph_a);
-    aprop_hdr_sort(ph_b);
-
-    // Pick a size
-    c_size = max_uint(ph_a->size, ph_b->size);
-    if (c_size < ph_a->n + ph_b->n)
-        c_size *= 2;
-    if ((c = calloc(c_size, sizeof(*c))) == NULL)
-        return -ENOMEM;
-
-    for (i = 0, j = 0, k = 0; i < ph_a->n && j < ph_b->n; ++k) {
-        if (a[i].id < b[j].id)
-            aprop_obj_move(c + k, a + i++);
-        else if (a[i].id > b[j].id)
-            aprop_obj_move(c + k, b + j++);
-        else
-            aprop_obj_merge(c + k, a + i++, b + j++);
     }
-    for (; i < ph_a->n; ++i, ++k)
-        aprop_obj_move(c + k, a + i);
-    for (; j < ph_b->n; ++j, ++k)
-        aprop_obj_move(c + k, b + j);
-
-    aprop_hdr_uninit(ph_a);
-    aprop_hdr_uninit(ph_b);
-
-    ph_a->n = k;
-    ph_a->size = c_size;
-    ph_a->objs = c;
-    // Merge will maintain sort so leave unsorted false
-
-    return 0;
-}
 
-// Remove any props in a that are also in b
-// b must be sorted
-static void
-aprop_hdr_sub(aprop_hdr_t * const ph_a, const aprop_hdr_t * const ph_b)
-{
-    unsigned int i = 0, j = 0, k;
-    aprop_obj_t * const a = ph_a->objs;
-    const aprop_obj_t * const b = ph_b->objs;
-
-    aprop_hdr_sort(ph_a);
-    assert(!ph_b->unsorted);
-
-    // Scan whilst we haven't deleted anything
-    for (;;) {
-        // If we run out of either array then nothing more needed
-        if (i == ph_a->n || j == ph_b->n)
-            return;
+    if ((rv = aprop_hdr_grow(ph_a, ko, kp)) < 0)
+        return rv;
 
-        if (a[i].id < b[j].id)
-            ++i;
-        else if (a[i].id > b[j].id)
-            ++j;
+    while (ia != 0 || ib != 0) {
+        if (ib == 0 || (ia != 0 && ph_a->obj_ids[ia - 1] > ph_b->obj_ids[ib - 1])) {
+            const uint32_t obj_id = ph_a->obj_ids[--ia];
+            const unsigned int n = ph_a->prop_counts[ia];
+            pa -= n;
+            kp -= n;
+            aprop_props_move(ph_a, kp, ph_a, pa, n);
+            ph_a->obj_ids[--ko] = obj_id;
+            ph_a->prop_counts[ko] = n;
+        }
+        else if (ia == 0 || ph_a->obj_ids[ia - 1] < ph_b->obj_ids[ib - 1]) {
+            const unsigned int n = ph_b->prop_counts[--ib];
+            pb -= n;
+            kp -= n;
+            aprop_props_move(ph_a, kp, ph_b, pb, n);
+            ph_a->obj_ids[--ko] = ph_b->obj_ids[ib];
+            ph_a->prop_counts[ko] = n;
+        }
         else {
-            k = i;
-            if (aprop_obj_sub(a + i++, b + j++) == 0) {
-                aprop_obj_uninit(a + k);
-                break;
+            const uint32_t obj_id = ph_a->obj_ids[--ia];
+            const unsigned int end = kp;
+            unsigned int i = pa;
+            unsigned int j = pb;
+
+            pa -= ph_a->prop_counts[ia];
+            pb -= ph_b->prop_counts[--ib];
+            while (i != pa || j != pb) {
+                if (j == pb || (i != pa && ph_a->prop_ids[i - 1] > ph_b->prop_ids[j - 1])) {
+                    aprop_props_move(ph_a, --kp, ph_a, --i, 1);
+                }
+                else {
+                    if (i != pa && ph_a->prop_ids[i - 1] == ph_b->prop_ids[j - 1])
+                        aprop_refs_unref(ph_a->refs + --i, 1);
+                    aprop_props_move(ph_a, --kp, ph_b, --j, 1);
+                }
             }
+            ph_a->obj_ids[--ko] = obj_id;
+            ph_a->prop_counts[ko] = end - kp;
         }
     }
 
-    // Move & scan
-    while (i < ph_a->n && j < ph_b->n) {
-        if (a[i].id < b[j].id)
-            aprop_obj_move(a + k++, a + i++);
-        else if (a[i].id > b[j].id)
-            j++;
-        else {
-            if (aprop_obj_sub(a + i, b + j) == 0)
-                aprop_obj_uninit(a + i);
-            else
-                aprop_obj_move(a + k++, a + i);
-            i++;
-            j++;
-        }
+    // Close the gap left by duplicates
+    if (ko != 0) {
+        memmove(ph_a->obj_ids, ph_a->obj_ids + ko, (ph_a->n_objs + ph_b->n_objs - ko) * sizeof(*ph_a->obj_ids));
+        memmove(ph_a->prop_counts, ph_a->prop_counts + ko, (ph_a->n_objs + ph_b->n_objs - ko) * sizeof(*ph_a->prop_counts));
     }
+    aprop_props_move(ph_a, 0, ph_a, kp, ph_a->n_props + ph_b->n_props - kp);
 
-    // Move any remaining entries
-    for (; i < ph_a->n; ++i, ++k)
-        aprop_obj_move(a + k, a + i);
-    ph_a->n = k;
-
-    return;
+    ph_a->n_objs += ph_b->n_objs - ko;
+    ph_a->n_props += ph_b->n_props - kp;
+    // Refs have moved to a
+    ph_b->n_objs = 0;
+    ph_b->n_props = 0;
+    return rv;
 }
 
-// Sort header objs & obj props
-static void
-aprop_hdr_props_sort(aprop_hdr_t * const ph)
+// What to remove in aprop_hdr_sub
+typedef struct aprop_sub_s {
+    const aprop_hdr_t * ph_b;
+    bool unchanged;             // Only if the value is the same in b
+    const uint32_t * keep_ids;  // [n_keep] Never remove these if unchanged
+    unsigned int n_keep;
+} aprop_sub_t;
+
+// True if prop pa of a is to be removed. b's props of the same obj are
+// [*pj, end_b); *pj is advanced so a scan of an obj's props is linear
+static bool
+aprop_sub_match(const aprop_sub_t * const sub, const aprop_hdr_t * const ph_a, const unsigned int pa,
+                unsigned int * const pj, const unsigned int end_b)
 {
-    aprop_hdr_sort(ph);
-    for (unsigned int i = 0; i != ph->n; ++i)
-        aprop_obj_props_sort(ph->objs + i);
-}
+    const aprop_hdr_t * const ph_b = sub->ph_b;
+    const uint32_t id = ph_a->prop_ids[pa];
+    unsigned int j = *pj;
+    unsigned int i;
 
-static aprop_prop_t *
-aprop_hdr_prop_get(aprop_hdr_t * const ph, const uint32_t obj_id, const uint32_t prop_id)
-{
-    aprop_obj_t * const po = aprop_hdr_obj_get(ph, obj_id);
-    return po == NULL ? NULL : aprop_obj_prop_get(po, prop_id);
+    while (j != end_b && ph_b->prop_ids[j] < id)
+        ++j;
+    *pj = j;
+
+    if (j == end_b || ph_b->prop_ids[j] != id)
+        return false;
+    if (!sub->unchanged)
+        return true;
+    if (ph_b->values[j] != ph_a->values[pa])
+        return false;
+    for (i = 0; i != sub->n_keep; ++i) {
+        if (sub->keep_ids[i] == id)
+            return false;
+    }
+    return true;
 }
 
-// Total props
-static unsigned int
-aprop_hdr_props_count(const aprop_hdr_t * const ph)
+// Remove any props in a that are also in b
+// If unchanged then an obj always keeps at least one prop so the set of
+// objs in a doesn't change
+static void
+aprop_hdr_sub(aprop_hdr_t * const ph_a, const aprop_sub_t * const sub)
 {
-    unsigned int i;
-    unsigned int n = 0;
+    const aprop_hdr_t * const ph_b = sub->ph_b;
+    unsigned int ia, ib = 0;
+    unsigned int pa = 0, pb = 0;
+    unsigned int ko = 0, kp = 0;
 
-    for (i = 0; i != ph->n; ++i)
-        n += ph->objs[i].n;
-    return n;
-}
+    if (ph_a->n_props == 0 || ph_b->n_props == 0)
+        return;
 
-static unsigned int
-aprop_hdr_objs_count(const aprop_hdr_t * const ph)
-{
-    return ph->n;
-}
+    for (ia = 0; ia != ph_a->n_objs; ++ia) {
+        const uint32_t obj_id = ph_a->obj_ids[ia];
+        const unsigned int end = pa + ph_a->prop_counts[ia];
+        const unsigned int k0 = kp;
 
-static void
-aprop_hdr_atomic_fill(const aprop_hdr_t * const ph,
-                     uint32_t * obj_ids,
-                     uint32_t * prop_counts,
-                     uint32_t * prop_ids,
-                     uint64_t * prop_values)
-{
-    unsigned int i;
-    for (i = 0; i != ph->n; ++i) {
-        const unsigned int n = ph->objs[i].n;
-        *obj_ids++ = ph->objs[i].id;
-        *prop_counts++ = n;
-        aprop_obj_atomic_fill(ph->objs +i, prop_ids, prop_values);
-        prop_ids += n;
-        prop_values += n;
+        while (ib != ph_b->n_objs && ph_b->obj_ids[ib] < obj_id)
+            pb += ph_b->prop_counts[ib++];
+
+        if (ib == ph_b->n_objs || ph_b->obj_ids[ib] != obj_id) {
+            aprop_props_move(ph_a, kp, ph_a, pa, end - pa);
+            kp += end - pa;
+            pa = end;
+        }
+        else {
+            const unsigned int end_b = pb + ph_b->prop_counts[ib];
+            unsigned int j = pb;
+            bool spare = false;
+
+            if (sub->unchanged) {
+                unsigned int i;
+                unsigned int n = 0;
+                for (i = pa; i != end; ++i)
+                    n += aprop_sub_match(sub, ph_a, i, &j, end_b);
+                spare = n == end - pa;
+                j = pb;
+            }
+
+            for (; pa != end; ++pa) {
+                if (aprop_sub_match(sub, ph_a, pa, &j, end_b) && !spare) {
+                    aprop_refs_unref(ph_a->refs + pa, 1);
+                }
+                else {
+                    spare = false;
+                    if (kp != pa)
+                        aprop_props_move(ph_a, kp, ph_a, pa, 1);
+                    ++kp;
+                }
+            }
+        }
+
+        if (kp != k0) {
+            ph_a->obj_ids[ko] = obj_id;
+            ph_a->prop_counts[ko++] = kp - k0;
+        }
     }
+    ph_a->n_objs = ko;
+    ph_a->n_props = kp;
 }
 
 void
@@ -579,7 +558,7 @@ int
 drmu_atomic_add_commit_callback(drmu_atomic_t * const da, drmu_atomic_commit_fn * const cb, void * const v)
 {
     if (cb) {
-        atomic_cb_t *acb = atomic_cb_new(cb, v);
+        atomic_cb_t *acb = atomic_cb_new(da->pool, cb, v);
         if (acb == NULL)
             return -ENOMEM;
 
@@ -593,11 +572,24 @@ drmu_atomic_add_commit_callback(drmu_atomic_t * const da, drmu_atomic_commit_fn
 void
 drmu_atomic_clear_commit_callbacks(drmu_atomic_t * const da)
 {
+    drmu_atomic_pool_t * const pool = da->pool;
     atomic_cb_t *p = da->commit_cb_q;
 
     da->commit_cb_q = NULL;
     da->commit_cb_last_ptr = &da->commit_cb_q;
 
+    if (p != NULL && pool != NULL) {
+        pthread_mutex_lock(&pool->lock);
+        while (p != NULL && pool->free_cb_count < ATOMIC_POOL_MAX_CBS) {
+            atomic_cb_t * const next = p->next;
+            p->next = pool->free_cbs;
+            pool->free_cbs = p;
+            ++pool->free_cb_count;
+            p = next;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
     while (p != NULL) {
         atomic_cb_t * const next = p->next;
         free(p);
@@ -605,6 +597,19 @@ drmu_atomic_clear_commit_callbacks(drmu_atomic_t * const da)
     }
 }
 
+bool
+drmu_atomic_commit_callbacks_move(drmu_atomic_t * const a, drmu_atomic_t * const b)
+{
+    if (b->commit_cb_q == NULL)
+        return false;
+
+    *a->commit_cb_last_ptr = b->commit_cb_q;
+    a->commit_cb_last_ptr = b->commit_cb_last_ptr;
+    b->commit_cb_q = NULL;
+    b->commit_cb_last_ptr = &b->commit_cb_q;
+    return true;
+}
+
 void
 drmu_atomic_run_commit_callbacks(const drmu_atomic_t * const da)
 {
@@ -628,17 +633,24 @@ drmu_atomic_add_prop_generic(drmu_atomic_t * const da,
     }
     else
     {
-        aprop_prop_t *const pp = aprop_hdr_prop_get(ph, obj_id, prop_id);
-        if (pp == NULL)
-            return -ENOMEM;
+        const unsigned int obj_size = ph->obj_size;
+        const unsigned int prop_size = ph->prop_size;
+        const int i = aprop_hdr_prop_get(ph, obj_id, prop_id);
+        aprop_ref_t * pr;
+
+        if (i < 0)
+            return i;
 
-        aprop_prop_unref(pp);
-        pp->value = value;
+        pool_stat_add(da->pool, array_alloc, (ph->obj_size != obj_size) + (ph->prop_size != prop_size));
+
+        pr = ph->refs + i;
+        pr->fns->unref(pr->v);
+        ph->values[i] = value;
         if (fns) {
-            pp->fns = fns;
-            pp->v = v;
+            pr->fns = fns;
+            pr->v = v;
         }
-        aprop_prop_ref(pp);
+        pr->fns->ref(pr->v);
         return 0;
     }
 }
@@ -665,12 +677,207 @@ drmu_atomic_env(const drmu_atomic_t * const da)
     return da == NULL ? NULL : da->du;
 }
 
+void
+drmu_atomic_target_ns_set(drmu_atomic_t * const da, const uint64_t target_ns)
+{
+    da->target_ns = target_ns;
+}
+
+uint64_t
+drmu_atomic_target_ns(const drmu_atomic_t * const da)
+{
+    return da == NULL ? 0 : da->target_ns;
+}
+
+void
+drmu_atomic_queue_stamp(drmu_atomic_t * const da, const uint64_t now_ns)
+{
+    if (da->queue_ns == 0)
+        da->queue_ns = now_ns;
+    if (da->merge_count == 0)
+        da->merge_count = 1;
+}
+
+uint64_t
+drmu_atomic_queue_ns(const drmu_atomic_t * const da)
+{
+    return da == NULL ? 0 : da->queue_ns;
+}
+
+unsigned int
+drmu_atomic_merge_count(const drmu_atomic_t * const da)
+{
+    return da == NULL ? 0 : da->merge_count;
+}
+
+void
+drmu_atomic_obj_foreach(const drmu_atomic_t * const da, drmu_atomic_obj_fn * const fn, void * const v)
+{
+    unsigned int i;
+
+    if (da == NULL)
+        return;
+    for (i = 0; i != da->props.n_objs; ++i)
+        fn(v, da->props.obj_ids[i]);
+}
+
+int
+drmu_atomic_prop_value_get(const drmu_atomic_t * const da, const uint32_t obj_id, const uint32_t prop_id,
+                           uint64_t * const pvalue)
+{
+    const aprop_hdr_t * const ph = &da->props;
+    unsigned int i, j;
+    unsigned int p0 = 0;
+
+    for (i = 0; i != ph->n_objs && ph->obj_ids[i] < obj_id; ++i)
+        p0 += ph->prop_counts[i];
+    if (i == ph->n_objs || ph->obj_ids[i] != obj_id)
+        return -ENOENT;
+    for (j = p0; j != p0 + ph->prop_counts[i]; ++j) {
+        if (ph->prop_ids[j] == prop_id) {
+            *pvalue = ph->values[j];
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
+//----------------------------------------------------------------------------
+//
+// Atomic pool fns
+
+static void
+atomic_pool_free(drmu_atomic_pool_t * const pool)
+{
+    drmu_atomic_t * da = pool->free_atomics;
+    atomic_cb_t * p = pool->free_cbs;
+
+    while (da != NULL) {
+        drmu_atomic_t * const next = da->next;
+        aprop_hdr_uninit(&da->props);
+        free(da);
+        da = next;
+    }
+    while (p != NULL) {
+        atomic_cb_t * const next = p->next;
+        free(p);
+        p = next;
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+void
+drmu_atomic_pool_unref(drmu_atomic_pool_t ** const pppool)
+{
+    drmu_atomic_pool_t * const pool = *pppool;
+
+    if (pool == NULL)
+        return;
+    *pppool = NULL;
+
+    if (atomic_fetch_sub(&pool->ref_count, 1) == 0)
+        atomic_pool_free(pool);
+}
+
+static drmu_atomic_pool_t *
+atomic_pool_ref(drmu_atomic_pool_t * const pool)
+{
+    if (pool != NULL)
+        atomic_fetch_add(&pool->ref_count, 1);
+    return pool;
+}
+
+drmu_atomic_pool_t *
+drmu_atomic_pool_new(void)
+{
+    drmu_atomic_pool_t * const pool = calloc(1, sizeof(*pool));
+
+    if (pool == NULL)
+        return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+// Take an atomic from the free list
+// Props are empty but may have storage attached
+static drmu_atomic_t *
+atomic_pool_get(drmu_atomic_pool_t * const pool)
+{
+    drmu_atomic_t * da;
+
+    if (pool == NULL)
+        return NULL;
+
+    atomic_fetch_add(&pool->atomic_new, 1);
+    pthread_mutex_lock(&pool->lock);
+    if ((da = pool->free_atomics) != NULL) {
+        pool->free_atomics = da->next;
+        --pool->free_atomic_count;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return da;
+}
+
+// Returns true if da taken by the pool
+static bool
+atomic_pool_put(drmu_atomic_pool_t * const pool, drmu_atomic_t * const da)
+{
+    bool taken = false;
+
+    if (pool == NULL || da->props.obj_size > ATOMIC_POOL_MAX_OBJS ||
+        da->props.prop_size > ATOMIC_POOL_MAX_PROPS)
+        return false;
+
+    aprop_hdr_reset(&da->props);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_atomic_count < ATOMIC_POOL_MAX_FREE) {
+        da->next = pool->free_atomics;
+        pool->free_atomics = da;
+        ++pool->free_atomic_count;
+        taken = true;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return taken;
+}
+
+void
+drmu_env_atomic_stats(drmu_env_t * const du, drmu_atomic_stats_t * const stats)
+{
+    drmu_atomic_pool_t * const pool = drmu_env_atomic_pool(du);
+
+    memset(stats, 0, sizeof(*stats));
+    if (pool == NULL)
+        return;
+
+    stats->atomic_new = atomic_load(&pool->atomic_new);
+    stats->atomic_alloc = atomic_load(&pool->atomic_alloc);
+    stats->cb_new = atomic_load(&pool->cb_new);
+    stats->cb_alloc = atomic_load(&pool->cb_alloc);
+    stats->array_alloc = atomic_load(&pool->array_alloc);
+
+    pthread_mutex_lock(&pool->lock);
+    stats->free_atomics = pool->free_atomic_count;
+    stats->free_cbs = pool->free_cb_count;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+//----------------------------------------------------------------------------
+//
+// Atomic fns
+
 static void
 drmu_atomic_free(drmu_atomic_t * const da)
 {
+    drmu_atomic_pool_t * pool = da->pool;
+
     drmu_atomic_clear_commit_callbacks(da);
-    aprop_hdr_uninit(&da->props);
-    free(da);
+    if (!atomic_pool_put(pool, da)) {
+        aprop_hdr_uninit(&da->props);
+        free(da);
+    }
+    drmu_atomic_pool_unref(&pool);
 }
 
 void
@@ -696,28 +903,56 @@ drmu_atomic_ref(drmu_atomic_t * const da)
 drmu_atomic_t *
 drmu_atomic_new(drmu_env_t * const du)
 {
-    drmu_atomic_t * const da = calloc(1, sizeof(*da));
+    drmu_atomic_pool_t * const pool = drmu_env_atomic_pool(du);
+    drmu_atomic_t * da = atomic_pool_get(pool);
 
     if (da == NULL) {
-        drmu_err(du, "%s: Failed to alloc struct", __func__);
-        return NULL;
+        if ((da = calloc(1, sizeof(*da))) == NULL) {
+            drmu_err(du, "%s: Failed to alloc struct", __func__);
+            return NULL;
+        }
+        pool_stat_add(pool, atomic_alloc, 1);
     }
+
+    atomic_init(&da->ref_count, 0);
     da->du = du;
+    da->pool = atomic_pool_ref(pool);
+    da->next = NULL;
+    da->target_ns = 0;
+    da->queue_ns = 0;
+    da->merge_count = 0;
+    da->commit_cb_q = NULL;
     da->commit_cb_last_ptr = &da->commit_cb_q;
 
     return da;
 }
 
+int
+drmu_atomic_reserve(drmu_atomic_t * const da, const unsigned int n_objs, const unsigned int n_props)
+{
+    const int rv = aprop_hdr_reserve(&da->props, n_objs, n_props);
+
+    if (rv < 0)
+        return rv;
+    pool_stat_add(da->pool, array_alloc, rv);
+    return 0;
+}
+
 drmu_atomic_t *
 drmu_atomic_copy(drmu_atomic_t * const b)
 {
     drmu_atomic_t * a;
+    int rv;
 
     if (b == NULL || (a = drmu_atomic_new(b->du)) == NULL)
         return NULL;
 
-    if (aprop_hdr_copy(&a->props, &b->props) != 0)
+    if ((rv = aprop_hdr_copy(&a->props, &b->props)) < 0)
         goto fail;
+    pool_stat_add(a->pool, array_alloc, rv);
+    a->target_ns = b->target_ns;
+    a->queue_ns = b->queue_ns;
+    a->merge_count = b->merge_count;
     for (atomic_cb_t * p = b->commit_cb_q; p != NULL; p = p->next)
         if (drmu_atomic_add_commit_callback(a, p->cb, p->v) != 0)
             goto fail;
@@ -762,19 +997,20 @@ drmu_atomic_merge(drmu_atomic_t * const a, drmu_atomic_t ** const ppb)
     if ((b = drmu_atomic_move(ppb)) == NULL)
         return -ENOMEM;
 
-    if (b->commit_cb_q != NULL) {
-        *a->commit_cb_last_ptr = b->commit_cb_q;
-        a->commit_cb_last_ptr = b->commit_cb_last_ptr;
-        b->commit_cb_q = NULL;
-    }
+    drmu_atomic_commit_callbacks_move(a, b);
+
+    a->merge_count += b->merge_count;
+    if (b->queue_ns != 0 && (a->queue_ns == 0 || b->queue_ns < a->queue_ns))
+        a->queue_ns = b->queue_ns;
 
     rv = aprop_hdr_merge(&a->props, &b->props);
     drmu_atomic_unref(&b);
 
-    if (rv != 0) {
+    if (rv < 0) {
         drmu_err(a->du, "%s: Merge Failed", __func__);
         return rv;
     }
+    pool_stat_add(a->pool, array_alloc, rv);
 
     return 0;
 }
@@ -782,89 +1018,315 @@ drmu_atomic_merge(drmu_atomic_t * const a, drmu_atomic_t ** const ppb)
 void
 drmu_atomic_sub(drmu_atomic_t * const a, drmu_atomic_t * const b)
 {
-    aprop_hdr_props_sort(&b->props);
-    aprop_hdr_sub(&a->props, &b->props);
+    const aprop_sub_t sub = {.ph_b = &b->props};
+    aprop_hdr_sub(&a->props, &sub);
+}
+
+void
+drmu_atomic_sub_unchanged(drmu_atomic_t * const a, const drmu_atomic_t * const b,
+                          const uint32_t * const keep_ids, const unsigned int n_keep)
+{
+    const aprop_sub_t sub = {
+        .ph_b = &b->props,
+        .unchanged = true,
+        .keep_ids = keep_ids,
+        .n_keep = n_keep
+    };
+    aprop_hdr_sub(&a->props, &sub);
 }
 
+// Failed commit diagnosis
+//
+// Props are flattened in object order. Props known to commit together are
+// kept in a good list; every test commits the good list plus a range of the
+// props not yet examined. First the whole remainder is tried, if that fails
+// a binary search over whole objects finds the first object that breaks it
+// and a second binary search within that object finds the bad prop. The bad
+// prop is dropped and the search resumes after it - nothing before it is
+// retested. k bad props in n props across m objects cost about
+// k * (1 + log2(m) + log2(n/m)) TEST_ONLY commits.
+
+typedef struct commit_diag_env_s {
+    drmu_env_t * du;
+    uint32_t flags;
+    unsigned int n_objs;
+    unsigned int n_props;
+    const uint32_t * obj_start;     // [n_objs + 1] index of 1st prop of each obj
+    const uint32_t * prop_obj;      // [n_props] obj id of each prop
+    const uint32_t * prop_ids;
+    const uint64_t * prop_values;
+    // Good list
+    unsigned int n_good;
+    uint32_t * good;
+    // Scratch for building test commits
+    uint32_t * t_objs;
+    uint32_t * t_counts;
+    uint32_t * t_props;
+    uint64_t * t_values;
+} commit_diag_env_t;
+
 static void
-atomic_props_crop(struct drm_mode_atomic * const f, const unsigned int n, uint32_t ** const undo_p, uint32_t * const undo_v)
+diag_test_add(const commit_diag_env_t * const de, unsigned int * const pn_objs, unsigned int * const pn_props,
+              const unsigned int i)
+{
+    const uint32_t obj = de->prop_obj[i];
+
+    if (*pn_objs == 0 || de->t_objs[*pn_objs - 1] != obj) {
+        de->t_objs[*pn_objs] = obj;
+        de->t_counts[(*pn_objs)++] = 0;
+    }
+    ++de->t_counts[*pn_objs - 1];
+    de->t_props[*pn_props] = de->prop_ids[i];
+    de->t_values[(*pn_props)++] = de->prop_values[i];
+}
+
+// Test good list + props [a, b)
+// Good props are all before a so obj order is preserved
+static int
+diag_test(const commit_diag_env_t * const de, const unsigned int a, const unsigned int b)
 {
+    unsigned int n_objs = 0;
+    unsigned int n_props = 0;
     unsigned int i;
-    unsigned int t = 0;
-    uint32_t * const c = (uint32_t *)(uintptr_t)f->count_props_ptr;
-
-    for (i = 0; i != f->count_objs; ++i) {
-        t += c[i];
-        if (t >= n) {
-            f->count_objs = i + 1;
-            *undo_p = c + i;
-            *undo_v = c[i];
-            c[i] -= t - n;
-            break;
-        }
+
+    for (i = 0; i != de->n_good; ++i)
+        diag_test_add(de, &n_objs, &n_props, de->good[i]);
+    for (i = a; i != b; ++i)
+        diag_test_add(de, &n_objs, &n_props, i);
+
+    {
+        struct drm_mode_atomic at = {
+            .flags           = DRM_MODE_ATOMIC_TEST_ONLY | (DRM_MODE_ATOMIC_ALLOW_MODESET & de->flags),
+            .count_objs      = n_objs,
+            .objs_ptr        = (uintptr_t)de->t_objs,
+            .count_props_ptr = (uintptr_t)de->t_counts,
+            .props_ptr       = (uintptr_t)de->t_props,
+            .prop_values_ptr = (uintptr_t)de->t_values,
+        };
+        return drmu_ioctl(de->du, DRM_IOCTL_MODE_ATOMIC, &at);
     }
 }
 
 static void
-atomic_props_del(struct drm_mode_atomic * const f, const unsigned int n, const unsigned int cp,
-                 uint32_t * const objid, uint32_t * const propid, uint64_t * const val)
+diag_good_add(commit_diag_env_t * const de, const unsigned int a, const unsigned int b)
 {
     unsigned int i;
-    unsigned int t = 0;
-    uint32_t * const c = (uint32_t *)(uintptr_t)f->count_props_ptr;
-    uint32_t * const o = (uint32_t *)(uintptr_t)f->objs_ptr;
-    uint32_t * const p = (uint32_t *)(uintptr_t)f->props_ptr;
-    uint64_t * const v = (uint64_t *)(uintptr_t)f->prop_values_ptr;
-
-    for (i = 0; i != f->count_objs; ++i) {
-        t += c[i];
-        if (t > n) {
-            // Copy out what we are going to delete
-            *objid = o[i];
-            *propid = p[n];
-            *val = v[n];
-
-            memmove(p + n, p + n + 1, (cp - n - 1) * sizeof(*p));
-            memmove(v + n, v + n + 1, (cp - n - 1) * sizeof(*v));
-
-            if (--c[i] == 0) {
-                memmove(c + i, c + i + 1, (f->count_objs - i - 1) * sizeof(*c));
-                memmove(o + i, o + i + 1, (f->count_objs - i - 1) * sizeof(*o));
-                --f->count_objs;
-            }
-            break;
+    for (i = a; i != b; ++i)
+        de->good[de->n_good++] = i;
+}
+
+// Returns index of the first bad prop at or after pos, n_props if none
+static unsigned int
+diag_find_bad(commit_diag_env_t * const de, const unsigned int pos)
+{
+    unsigned int lo, hi;
+    unsigned int o0;
+    unsigned int p0;
+
+    // Nothing left to examine. Don't retest the good list - if that fails
+    // (transiently) there is no object after pos to blame
+    if (pos >= de->n_props)
+        return de->n_props;
+
+    if (diag_test(de, pos, de->n_props) == 0) {
+        diag_good_add(de, pos, de->n_props);
+        return de->n_props;
+    }
+
+    // Whole objects: find the first obj boundary (hi) that makes the test
+    // fail. Boundary o0 is at or before pos so stands for the known good
+    // "nothing after pos"
+    for (o0 = 0; de->obj_start[o0 + 1] <= pos; ++o0)
+        /* Loop */;
+    lo = o0;
+    hi = de->n_objs;
+    while (lo + 1 < hi) {
+        const unsigned int mid = (lo + hi) / 2;
+        if (diag_test(de, pos, de->obj_start[mid]) == 0)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    // Objects before lo (== hi - 1) are good, bad is in lo
+    p0 = lo == o0 ? pos : de->obj_start[lo];
+    diag_good_add(de, pos, p0);
+
+    // Within the object: longest prefix [p0, lo) that commits
+    lo = p0;
+    hi = de->obj_start[hi];
+    while (lo + 1 < hi) {
+        const unsigned int mid = (lo + hi) / 2;
+        if (diag_test(de, p0, mid) == 0)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    diag_good_add(de, p0, lo);
+    return lo;
+}
+
+static uint64_t
+diag_key(const uint32_t flags, const int rv, const unsigned int n_objs,
+         const uint32_t * const obj_ids, const uint32_t * const prop_counts,
+         const uint32_t * const prop_ids)
+{
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ULL;
+    unsigned int i, j, k = 0;
+
+#define DIAG_HASH(_x) (h = (h ^ (uint64_t)(_x)) * 0x100000001b3ULL)
+    DIAG_HASH(flags & DRM_MODE_ATOMIC_ALLOW_MODESET);
+    DIAG_HASH((uint32_t)rv);
+    for (i = 0; i != n_objs; ++i) {
+        DIAG_HASH(obj_ids[i]);
+        for (j = 0; j != prop_counts[i]; ++j, ++k) {
+            DIAG_HASH(prop_ids[k]);
         }
     }
+#undef DIAG_HASH
+    return h;
 }
 
-// Returns count of initial good els (i.e. n of 1st bad)
+// Index of the flattened prop (obj_id, prop_id), n_props if not found
 static unsigned int
-commit_find_good(drmu_env_t * const du, const struct drm_mode_atomic * const atomic, const unsigned int n_props)
+diag_prop_find(const commit_diag_env_t * const de, const uint32_t obj_id, const uint32_t prop_id)
 {
-    unsigned int a = 0;             // N known good
-    unsigned int b = n_props + 1;   // N maybe good + 1
+    unsigned int i;
 
-    while (a + 1 < b) {
-        struct drm_mode_atomic at = *atomic;
-        unsigned int n = (a + b) / 2;
-        int rv;
-        uint32_t * undo_p = NULL;
-        uint32_t undo_v = 0;
+    for (i = 0; i != de->n_props; ++i) {
+        if (de->prop_obj[i] == obj_id && de->prop_ids[i] == prop_id)
+            return i;
+    }
+    return de->n_props;
+}
 
-        at.flags = DRM_MODE_ATOMIC_TEST_ONLY | (DRM_MODE_ATOMIC_ALLOW_MODESET & atomic->flags);
-        atomic_props_crop(&at, n, &undo_p, &undo_v);
+// If key cached, and removing its bad props makes the commit test OK, add
+// them (with this commit's values) to da_fail & return true
+static bool
+diag_cache_lookup(drmu_atomic_pool_t * const pool, commit_diag_env_t * const de,
+                  const uint64_t key, drmu_atomic_t * const da_fail)
+{
+    commit_diag_t d;
+    unsigned int bad_pos[COMMIT_DIAG_BAD_MAX];
+    unsigned int i, j;
+
+    if (pool == NULL)
+        return false;
+
+    pthread_mutex_lock(&pool->lock);
+    for (i = 0; i != pool->diag_n && pool->diags[i].key != key; ++i)
+        /* Loop */;
+    if (i == pool->diag_n) {
+        pthread_mutex_unlock(&pool->lock);
+        return false;
+    }
+    d = pool->diags[i];
+    memmove(pool->diags + 1, pool->diags, i * sizeof(*pool->diags));
+    pool->diags[0] = d;
+    pthread_mutex_unlock(&pool->lock);
+
+    // A hash collision may name props we don't have
+    for (i = 0; i != d.n_bad; ++i) {
+        if ((bad_pos[i] = diag_prop_find(de, d.bad[i].obj_id, d.bad[i].prop_id)) == de->n_props)
+            return false;
+    }
 
-        if ((rv = drmu_ioctl(du, DRM_IOCTL_MODE_ATOMIC, &at)) == 0) {
-            a = n;
-        }
-        else {
-            b = n;
-        }
+    // Confirm with everything but the bad props as the good list
+    de->n_good = 0;
+    for (i = 0; i != de->n_props; ++i) {
+        for (j = 0; j != d.n_bad && bad_pos[j] != i; ++j)
+            /* Loop */;
+        if (j == d.n_bad)
+            de->good[de->n_good++] = i;
+    }
+    if (diag_test(de, de->n_props, de->n_props) != 0) {
+        de->n_good = 0;
+        return false;
+    }
+
+    for (i = 0; i != d.n_bad; ++i)
+        drmu_atomic_add_prop_value(da_fail, d.bad[i].obj_id, d.bad[i].prop_id, de->prop_values[bad_pos[i]]);
+    return true;
+}
+
+static void
+diag_cache_add(drmu_atomic_pool_t * const pool, const commit_diag_t * const d)
+{
+    unsigned int i;
 
-        *undo_p = undo_v;  // Should always be set
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    // Replace an entry with the same key (one that failed to confirm)
+    for (i = 0; i != pool->diag_n && pool->diags[i].key != d->key; ++i)
+        /* Loop */;
+    if (i == pool->diag_n && pool->diag_n < COMMIT_DIAG_CACHE_SIZE)
+        ++pool->diag_n;
+    if (i == COMMIT_DIAG_CACHE_SIZE)
+        --i;
+    memmove(pool->diags + 1, pool->diags, i * sizeof(*pool->diags));
+    pool->diags[0] = *d;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void
+commit_diagnose(const drmu_atomic_t * const da, const uint32_t flags, const int rv,
+                const unsigned int n_objs, const unsigned int n_props,
+                const uint32_t * const obj_ids, const uint32_t * const prop_counts,
+                const uint32_t * const prop_ids, const uint64_t * const prop_values,
+                drmu_atomic_t * const da_fail)
+{
+    uint32_t obj_start[n_objs + 1];
+    uint32_t prop_obj[n_props];
+    uint32_t good[n_props];
+    uint32_t t_objs[n_objs];
+    uint32_t t_counts[n_objs];
+    uint32_t t_props[n_props];
+    uint64_t t_values[n_props];
+    commit_diag_env_t de = {
+        .du = da->du,
+        .flags = flags,
+        .n_objs = n_objs,
+        .n_props = n_props,
+        .obj_start = obj_start,
+        .prop_obj = prop_obj,
+        .prop_ids = prop_ids,
+        .prop_values = prop_values,
+        .good = good,
+        .t_objs = t_objs,
+        .t_counts = t_counts,
+        .t_props = t_props,
+        .t_values = t_values,
+    };
+    commit_diag_t d = {
+        .key = diag_key(flags, rv, n_objs, obj_ids, prop_counts, prop_ids)
+    };
+    unsigned int i, j, k;
+    unsigned int pos;
+    unsigned int n_bad = 0;
+
+    for (i = 0, k = 0; i != n_objs; ++i) {
+        obj_start[i] = k;
+        for (j = 0; j != prop_counts[i]; ++j, ++k)
+            prop_obj[k] = obj_ids[i];
     }
+    obj_start[n_objs] = k;
 
-    return a;
+    if (diag_cache_lookup(da->pool, &de, d.key, da_fail))
+        return;
+
+    for (pos = 0; (pos = diag_find_bad(&de, pos)) < n_props; ++pos) {
+        if (n_bad < COMMIT_DIAG_BAD_MAX)
+            d.bad[n_bad] = (commit_diag_prop_t){prop_obj[pos], prop_ids[pos]};
+        ++n_bad;
+        drmu_atomic_add_prop_value(da_fail, prop_obj[pos], prop_ids[pos], prop_values[pos]);
+    }
+
+    if (n_bad <= COMMIT_DIAG_BAD_MAX) {
+        d.n_bad = n_bad;
+        diag_cache_add(da->pool, &d);
+    }
 }
 
 // da_fail does not keep refs to its values - for info only
@@ -872,58 +1334,437 @@ int
 drmu_atomic_commit_test(const drmu_atomic_t * const da, uint32_t flags, drmu_atomic_t * const da_fail)
 {
     drmu_env_t * const du = da->du;
-    const unsigned int n_objs = aprop_hdr_objs_count(&da->props);
-    unsigned int n_props = aprop_hdr_props_count(&da->props);
+    const aprop_hdr_t * const ph = &da->props;
     int rv = 0;
 
-    if (n_props != 0) {
-        uint32_t obj_ids[n_objs];
-        uint32_t prop_counts[n_objs];
-        uint32_t prop_ids[n_props];
-        uint64_t prop_values[n_props];
+    if (ph->n_props != 0) {
         struct drm_mode_atomic atomic = {
             .flags           = flags,
-            .count_objs      = n_objs,
-            .objs_ptr        = (uintptr_t)obj_ids,
-            .count_props_ptr = (uintptr_t)prop_counts,
-            .props_ptr       = (uintptr_t)prop_ids,
-            .prop_values_ptr = (uintptr_t)prop_values,
+            .count_objs      = ph->n_objs,
+            .objs_ptr        = (uintptr_t)ph->obj_ids,
+            .count_props_ptr = (uintptr_t)ph->prop_counts,
+            .props_ptr       = (uintptr_t)ph->prop_ids,
+            .prop_values_ptr = (uintptr_t)ph->values,
             .user_data       = (uintptr_t)da
         };
 
-        aprop_hdr_atomic_fill(&da->props, obj_ids, prop_counts, prop_ids, prop_values);
-
         rv = drmu_ioctl(du, DRM_IOCTL_MODE_ATOMIC, &atomic);
 
+        if (rv == 0 && (flags & DRM_MODE_ATOMIC_TEST_ONLY) == 0)
+            drmu_env_prop_cache_commit(du, ph->n_objs, ph->obj_ids, ph->prop_counts, ph->prop_ids, ph->values);
+
         drmu_atomic_run_commit_callbacks(da);
 
         if (rv  == 0 || !da_fail)
             return rv;
 
-        for (;;) {
-            unsigned int a = commit_find_good(du, &atomic, n_props);
-            uint32_t objid = 0;
-            uint32_t propid = 0;
-            uint64_t val = 0;
+        commit_diagnose(da, flags, rv, ph->n_objs, ph->n_props,
+                        ph->obj_ids, ph->prop_counts, ph->prop_ids, ph->values, da_fail);
+    }
+
+    return rv;
+}
 
-            if (a >= n_props)
-                break;
 
-            atomic_props_del(&atomic, a, n_props, &objid, &propid, &val);
-            --n_props;
+int
+drmu_atomic_commit(const drmu_atomic_t * const da, uint32_t flags)
+{
+    return drmu_atomic_commit_test(da, flags, NULL);
+}
+
+//----------------------------------------------------------------------------
+//
+// Atomic list fns
+//
+// Lock-free multi-producer list. Producers push onto the head with CAS, the
+// single consumer takes the whole list with an exchange so there is no ABA
+// issue. The list is LIFO so is reversed on take.
+// Uses the atomic next link which is otherwise only used on the pool free
+// list so only unshared atomics may be on the list.
+
+struct drmu_atomic_list_s {
+    _Atomic(drmu_atomic_t *) head;
+};
+
+drmu_atomic_list_t *
+drmu_atomic_list_new(void)
+{
+    drmu_atomic_list_t * const list = malloc(sizeof(*list));
+    if (list != NULL)
+        atomic_init(&list->head, NULL);
+    return list;
+}
 
-            drmu_atomic_add_prop_value(da_fail, objid, propid, val);
+void
+drmu_atomic_list_free(drmu_atomic_list_t ** const pplist)
+{
+    drmu_atomic_list_t * const list = *pplist;
+    drmu_atomic_t * da;
+
+    if (list == NULL)
+        return;
+    *pplist = NULL;
+
+    da = atomic_exchange(&list->head, NULL);
+    while (da != NULL) {
+        drmu_atomic_t * next = da->next;
+        drmu_atomic_unref(&da);
+        da = next;
+    }
+    free(list);
+}
+
+int
+drmu_atomic_list_push(drmu_atomic_list_t * const list, drmu_atomic_t ** const ppda)
+{
+    // Unshare if needed
+    drmu_atomic_t * const da = drmu_atomic_move(ppda);
+    drmu_atomic_t * head;
+
+    if (da == NULL)
+        return -ENOMEM;
+
+    head = atomic_load(&list->head);
+    do {
+        da->next = head;
+    } while (!atomic_compare_exchange_weak(&list->head, &head, da));
+
+    return head == NULL ? 1 : 0;
+}
+
+bool
+drmu_atomic_list_is_empty(drmu_atomic_list_t * const list)
+{
+    return atomic_load(&list->head) == NULL;
+}
+
+void
+drmu_atomic_list_take_each(drmu_atomic_list_t * const list, drmu_atomic_list_take_fn * const fn, void * const v)
+{
+    drmu_atomic_t * da = atomic_exchange(&list->head, NULL);
+    drmu_atomic_t * fifo = NULL;
+
+    // Reverse into submission order
+    while (da != NULL) {
+        drmu_atomic_t * const next = da->next;
+        da->next = fifo;
+        fifo = da;
+        da = next;
+    }
+
+    // Must read next before fn as it may free da
+    while (fifo != NULL) {
+        drmu_atomic_t * next = fifo->next;
+
+        fifo->next = NULL;
+        fn(v, &fifo);
+        drmu_atomic_unref(&fifo);
+        fifo = next;
+    }
+}
+
+//----------------------------------------------------------------------------
+//
+// Atomic template fns
+
+typedef struct template_ref_s {
+    void * v;
+    const drmu_atomic_prop_fns_t * fns;
+} template_ref_t;
+
+typedef struct drmu_atomic_template_s {
+    atomic_int ref_count;  // 0 == 1 ref for ease of init
+
+    struct drmu_env_s * du;
+    bool frozen;
+
+    unsigned int n_objs;
+    unsigned int n_props;
+    unsigned int size;
+
+    // Flattened arrays as wanted by DRM_IOCTL_MODE_ATOMIC
+    // Valid once frozen, objs & props within objs are sorted by id
+    uint32_t * obj_ids;
+    uint32_t * prop_counts;
+    uint32_t * prop_ids;
+    uint64_t * prop_values;
+
+    // Per slot (in add order) obj id - only used before freeze
+    uint32_t * slot_objs;
+    // Slot -> index in the flattened arrays
+    unsigned int * slot_pos;
+
+    // Refs held on the values to be committed and on the values that were
+    // last successfully committed (i.e. those still in use)
+    template_ref_t * pending;
+    template_ref_t * committed;
+} drmu_atomic_template_t;
+
+static void
+template_refs_unref(template_ref_t * const refs, const unsigned int n)
+{
+    unsigned int i;
+    for (i = 0; i != n; ++i) {
+        refs[i].fns->unref(refs[i].v);
+        refs[i] = (template_ref_t){.fns = &null_fns};
+    }
+}
+
+static void
+template_free(drmu_atomic_template_t * const dt)
+{
+    if (dt->frozen) {
+        template_refs_unref(dt->pending, dt->n_props);
+        template_refs_unref(dt->committed, dt->n_props);
+    }
+    free(dt->obj_ids);
+    free(dt->prop_counts);
+    free(dt->prop_ids);
+    free(dt->prop_values);
+    free(dt->slot_objs);
+    free(dt->slot_pos);
+    free(dt->pending);
+    free(dt->committed);
+    free(dt);
+}
+
+void
+drmu_atomic_template_unref(drmu_atomic_template_t ** const ppdt)
+{
+    drmu_atomic_template_t * const dt = *ppdt;
+
+    if (dt == NULL)
+        return;
+    *ppdt = NULL;
+
+    if (atomic_fetch_sub(&dt->ref_count, 1) == 0)
+        template_free(dt);
+}
+
+drmu_atomic_template_t *
+drmu_atomic_template_ref(drmu_atomic_template_t * const dt)
+{
+    atomic_fetch_add(&dt->ref_count, 1);
+    return dt;
+}
+
+drmu_atomic_template_t *
+drmu_atomic_template_new(drmu_env_t * const du)
+{
+    drmu_atomic_template_t * const dt = calloc(1, sizeof(*dt));
+
+    if (dt == NULL) {
+        drmu_err(du, "%s: Failed to alloc struct", __func__);
+        return NULL;
+    }
+    dt->du = du;
+    return dt;
+}
+
+int
+drmu_atomic_template_add(drmu_atomic_template_t * const dt, const uint32_t obj_id, const uint32_t prop_id)
+{
+    unsigned int i;
+
+    if (obj_id == 0 || prop_id == 0)
+        return -EINVAL;
+    if (dt->frozen) {
+        drmu_err(dt->du, "%s: Template already in use", __func__);
+        return -EBUSY;
+    }
+
+    for (i = 0; i != dt->n_props; ++i) {
+        if (dt->slot_objs[i] == obj_id && dt->prop_ids[i] == prop_id)
+            return i;
+    }
+
+    if (dt->n_props >= dt->size) {
+        const unsigned int newsize = dt->size < 16 ? 16 : dt->size * 2;
+        uint32_t * objs;
+        uint32_t * props;
+
+        if ((objs = realloc(dt->slot_objs, newsize * sizeof(*objs))) == NULL)
+            return -ENOMEM;
+        dt->slot_objs = objs;
+        if ((props = realloc(dt->prop_ids, newsize * sizeof(*props))) == NULL)
+            return -ENOMEM;
+        dt->prop_ids = props;
+        dt->size = newsize;
+    }
+
+    dt->slot_objs[dt->n_props] = obj_id;
+    dt->prop_ids[dt->n_props] = prop_id;
+    return dt->n_props++;
+}
+
+// Sort slots by obj then prop & build the flattened arrays
+static int
+template_freeze(drmu_atomic_template_t * const dt)
+{
+    const unsigned int n = dt->n_props;
+    uint32_t * const ids = dt->prop_ids;
+    uint32_t * const objs = dt->slot_objs;
+    unsigned int * order;
+    unsigned int i, j;
+
+    if (dt->frozen)
+        return 0;
+    if (n == 0)
+        return -EINVAL;
+
+    if ((order = malloc(n * sizeof(*order))) == NULL ||
+        (dt->slot_pos = malloc(n * sizeof(*dt->slot_pos))) == NULL ||
+        (dt->obj_ids = malloc(n * sizeof(*dt->obj_ids))) == NULL ||
+        (dt->prop_counts = malloc(n * sizeof(*dt->prop_counts))) == NULL ||
+        (dt->prop_values = calloc(n, sizeof(*dt->prop_values))) == NULL ||
+        (dt->pending = malloc(n * sizeof(*dt->pending))) == NULL ||
+        (dt->committed = malloc(n * sizeof(*dt->committed))) == NULL) {
+        // Leave dt as it was so a later freeze can try again
+        free(order);
+        free(dt->slot_pos);
+        free(dt->obj_ids);
+        free(dt->prop_counts);
+        free(dt->prop_values);
+        free(dt->pending);
+        dt->slot_pos = NULL;
+        dt->obj_ids = NULL;
+        dt->prop_counts = NULL;
+        dt->prop_values = NULL;
+        dt->pending = NULL;
+        return -ENOMEM;
+    }
+
+    // Templates are small and built once so insertion sort is fine
+    for (i = 0; i != n; ++i) {
+        for (j = i; j != 0; --j) {
+            const unsigned int k = order[j - 1];
+            if (objs[k] < objs[i] || (objs[k] == objs[i] && ids[k] < ids[i]))
+                break;
+            order[j] = k;
         }
+        order[j] = i;
     }
 
-    return rv;
+    dt->n_objs = 0;
+    for (i = 0; i != n; ++i) {
+        const unsigned int k = order[i];
+        dt->slot_pos[k] = i;
+        if (dt->n_objs == 0 || dt->obj_ids[dt->n_objs - 1] != objs[k]) {
+            dt->obj_ids[dt->n_objs] = objs[k];
+            dt->prop_counts[dt->n_objs++] = 0;
+        }
+        ++dt->prop_counts[dt->n_objs - 1];
+        dt->pending[i] = (template_ref_t){.fns = &null_fns};
+        dt->committed[i] = (template_ref_t){.fns = &null_fns};
+    }
+
+    // Permute prop ids into flattened order (reuse order as scratch)
+    for (i = 0; i != n; ++i)
+        order[dt->slot_pos[i]] = ids[i];
+    for (i = 0; i != n; ++i)
+        ids[i] = order[i];
+
+    free(order);
+    free(dt->slot_objs);
+    dt->slot_objs = NULL;
+    dt->frozen = true;
+    return 0;
 }
 
+int
+drmu_atomic_template_set_generic(drmu_atomic_template_t * const dt, const unsigned int slot,
+                                 const uint64_t value,
+                                 const drmu_atomic_prop_fns_t * const fns, void * const v)
+{
+    template_ref_t * tr;
+    int rv;
+
+    if (slot >= dt->n_props)
+        return -EINVAL;
+    if ((rv = template_freeze(dt)) != 0)
+        return rv;
+
+    tr = dt->pending + dt->slot_pos[slot];
+    if (fns != NULL)
+        fns->ref(v);
+    tr->fns->unref(tr->v);
+    *tr = fns == NULL ? (template_ref_t){.fns = &null_fns} : (template_ref_t){.fns = fns, .v = v};
+    dt->prop_values[dt->slot_pos[slot]] = value;
+    return 0;
+}
 
 int
-drmu_atomic_commit(const drmu_atomic_t * const da, uint32_t flags)
+drmu_atomic_template_set_value(drmu_atomic_template_t * const dt, const unsigned int slot, const uint64_t value)
 {
-    return drmu_atomic_commit_test(da, flags, NULL);
+    return drmu_atomic_template_set_generic(dt, slot, value, NULL, NULL);
+}
+
+int
+drmu_atomic_template_commit(drmu_atomic_template_t * const dt, uint32_t flags)
+{
+    unsigned int i;
+    int rv;
+    struct drm_mode_atomic atomic;
+
+    if ((rv = template_freeze(dt)) != 0)
+        return rv;
+
+    atomic = (struct drm_mode_atomic){
+        .flags           = flags,
+        .count_objs      = dt->n_objs,
+        .objs_ptr        = (uintptr_t)dt->obj_ids,
+        .count_props_ptr = (uintptr_t)dt->prop_counts,
+        .props_ptr       = (uintptr_t)dt->prop_ids,
+        .prop_values_ptr = (uintptr_t)dt->prop_values,
+    };
+
+    if ((rv = drmu_ioctl(dt->du, DRM_IOCTL_MODE_ATOMIC, &atomic)) != 0 ||
+        (flags & DRM_MODE_ATOMIC_TEST_ONLY) != 0)
+        return rv;
+
+    drmu_env_prop_cache_commit(dt->du, dt->n_objs, dt->obj_ids, dt->prop_counts, dt->prop_ids, dt->prop_values);
+
+    // Values now in use - keep them until the next commit replaces them
+    for (i = 0; i != dt->n_props; ++i) {
+        template_ref_t * const tc = dt->committed + i;
+        const template_ref_t * const tp = dt->pending + i;
+        tp->fns->ref(tp->v);
+        tc->fns->unref(tc->v);
+        *tc = *tp;
+    }
+    return 0;
+}
+
+drmu_atomic_t *
+drmu_atomic_template_atomic(drmu_atomic_template_t * const dt)
+{
+    drmu_atomic_t * da;
+    aprop_hdr_t * ph;
+    unsigned int i;
+    int rv;
+
+    if (template_freeze(dt) != 0 || (da = drmu_atomic_new(dt->du)) == NULL)
+        return NULL;
+    ph = &da->props;
+
+    if ((rv = aprop_hdr_reserve(ph, dt->n_objs, dt->n_props)) < 0)
+        goto fail;
+    pool_stat_add(da->pool, array_alloc, rv);
+
+    memcpy(ph->obj_ids, dt->obj_ids, dt->n_objs * sizeof(*ph->obj_ids));
+    memcpy(ph->prop_counts, dt->prop_counts, dt->n_objs * sizeof(*ph->prop_counts));
+    memcpy(ph->prop_ids, dt->prop_ids, dt->n_props * sizeof(*ph->prop_ids));
+    memcpy(ph->values, dt->prop_values, dt->n_props * sizeof(*ph->values));
+    for (i = 0; i != dt->n_props; ++i)
+        ph->refs[i] = (aprop_ref_t){.v = dt->pending[i].v, .fns = dt->pending[i].fns};
+    aprop_refs_ref(ph->refs, dt->n_props);
+    ph->n_objs = dt->n_objs;
+    ph->n_props = dt->n_props;
+    return da;
+
+fail:
+    drmu_atomic_unref(&da);
+    return NULL;
 }
 
 
@@ -4,7 +4,14 @@
 #include "drmu_fmts.h"
 #include "drmu_log.h"
 
+#include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <libdrm/drm_mode.h>
 #include <libavutil/frame.h>
 #include <libavutil/hwcontext_drm.h>
@@ -308,12 +315,55 @@ drmu_av_fb_frame_metadata_set(drmu_fb_t * const dfb, const AVFrame * const frame
     return 0;
 }
 
+static void
+fb_av_active_set(drmu_fb_t * const dfb, const AVFrame * const frame, const uint32_t format)
+{
+    drmu_fb_int_fmt_size_set(dfb,
+                             format,
+                             frame->width,
+                             frame->height,
+                             (drmu_rect_t){
+                                 .x = frame->crop_left,
+                                 .y = frame->crop_top,
+                                 .w = frame->width - (frame->crop_left + frame->crop_right),
+                                 .h = frame->height - (frame->crop_top + frame->crop_bottom)});
+}
+
+// Import the frame objects as BOs & make the fb
+// Does not hold the frame or set metadata
+static int
+fb_av_frame_make(drmu_fb_t * const dfb, drmu_env_t * const du, const AVDRMFrameDescriptor * const desc)
+{
+    int i, j, n;
+
+    for (i = 0; i < desc->nb_objects; ++i)
+    {
+        drmu_bo_t * bo = drmu_bo_new_fd(du, desc->objects[i].fd);
+        if (bo == NULL)
+            return -ENOMEM;
+        drmu_fb_int_bo_set(dfb, i, bo);
+    }
+
+    n = 0;
+    for (i = 0; i < desc->nb_layers; ++i)
+    {
+        for (j = 0; j < desc->layers[i].nb_planes; ++j)
+        {
+            const AVDRMPlaneDescriptor *const p = desc->layers[i].planes + j;
+            const AVDRMObjectDescriptor *const obj = desc->objects + p->object_index;
+
+            drmu_fb_int_layer_mod_set(dfb, n++, p->object_index, p->pitch, p->offset, obj->format_modifier);
+        }
+    }
+
+    return drmu_fb_int_make(dfb);
+}
+
 // Create a new fb from a VLC DRM_PRIME picture.
 // Buf is held reffed by the fb until the fb is deleted
 drmu_fb_t *
 drmu_fb_av_new_frame_attach(drmu_env_t * const du, AVFrame * const frame)
 {
-    int i, j, n;
     drmu_fb_t * const dfb = drmu_fb_int_alloc(du);
     const AVDRMFrameDescriptor * const desc = (const AVDRMFrameDescriptor *)frame->data[0];
     fb_aux_buf_t * aux = NULL;
@@ -332,15 +382,7 @@ drmu_fb_av_new_frame_attach(drmu_env_t * const du, AVFrame * const frame)
         goto fail;
     }
 
-    drmu_fb_int_fmt_size_set(dfb,
-                             desc->layers[0].format,
-                             frame->width,
-                             frame->height,
-                             (drmu_rect_t){
-                                 .x = frame->crop_left,
-                                 .y = frame->crop_top,
-                                 .w = frame->width - (frame->crop_left + frame->crop_right),
-                                 .h = frame->height - (frame->crop_top + frame->crop_bottom)});
+    fb_av_active_set(dfb, frame, desc->layers[0].format);
 
     // Set delete callback & hold this pic
     // Aux attached to dfb immediately so no fail cleanup required
@@ -351,35 +393,375 @@ drmu_fb_av_new_frame_attach(drmu_env_t * const du, AVFrame * const frame)
     aux->buf = av_buffer_ref(frame->buf[0]);
     drmu_fb_int_on_delete_set(dfb, buf_fb_delete_cb, aux);
 
-    for (i = 0; i < desc->nb_objects; ++i)
-    {
-        drmu_bo_t * bo = drmu_bo_new_fd(du, desc->objects[i].fd);
-        if (bo == NULL)
-            goto fail;
-        drmu_fb_int_bo_set(dfb, i, bo);
+    if (fb_av_frame_make(dfb, du, desc) != 0)
+        goto fail;
+
+    drmu_av_fb_frame_metadata_set(dfb, frame);
+    return dfb;
+
+fail:
+    drmu_fb_int_free(dfb);
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+//
+// fb cache fns
+//
+// V4L2 decoders cycle through a fixed set of dmabufs so rather than import,
+// AddFB2 & RmFB every frame keep the fbs and reuse them when the same buffer
+// comes round again. A buffer is identified by the inode of its dmabuf(s)
+// together with its layout.
+//
+// We hold a BO ref on cached buffers so they cannot be freed underneath us
+// but that also means we cannot see when the decoder has finished with
+// them. Entries whose fd no longer refers to the same dmabuf are evicted
+// on cache miss, otherwise LRU eviction applies.
+
+typedef struct fb_cache_key_s {
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    unsigned int nb_objects;
+    dev_t dev[AV_DRM_MAX_PLANES];
+    ino_t ino[AV_DRM_MAX_PLANES];
+    unsigned int n_planes;
+    struct {
+        unsigned int obj_idx;
+        uint32_t pitch;
+        uint32_t offset;
+        uint64_t modifier;
+    } planes[4];
+} fb_cache_key_t;
+
+typedef struct fb_cache_ent_s {
+    struct drmu_av_fb_cache_s * cache;
+    drmu_fb_t * dfb;            // NULL if slot empty
+    bool in_use;                // dfb reffed outside the cache
+    int fd0;                    // fd of object 0 when last used - for eviction
+    uint64_t last_use;
+    AVBufferRef * buf;          // Held frame whilst in use
+    fb_cache_key_t key;
+} fb_cache_ent_t;
+
+struct drmu_av_fb_cache_s {
+    atomic_int ref_count;       // 0 == 1 ref for ease of init
+    bool dead;                  // Cache killed - never reuse again
+
+    struct drmu_env_s * du;     // Reffed
+
+    pthread_mutex_t lock;
+    uint64_t use_count;
+    unsigned int ent_count;
+    fb_cache_ent_t * ents;      // [ent_count]
+
+    unsigned int hits;
+    unsigned int misses;
+};
+
+static void
+fb_cache_free(drmu_av_fb_cache_t * const cache)
+{
+    pthread_mutex_destroy(&cache->lock);
+    drmu_env_unref(&cache->du);
+    free(cache->ents);
+    free(cache);
+}
+
+static void
+fb_cache_unref(drmu_av_fb_cache_t ** const ppcache)
+{
+    drmu_av_fb_cache_t * const cache = *ppcache;
+
+    if (cache == NULL)
+        return;
+    *ppcache = NULL;
+
+    if (atomic_fetch_sub(&cache->ref_count, 1) == 0)
+        fb_cache_free(cache);
+}
+
+static drmu_av_fb_cache_t *
+fb_cache_ref(drmu_av_fb_cache_t * const cache)
+{
+    atomic_fetch_add(&cache->ref_count, 1);
+    return cache;
+}
+
+// Returns false if the frame cannot be cached (e.g. stat fails)
+static bool
+fb_cache_key_make(fb_cache_key_t * const key, const AVFrame * const frame, const AVDRMFrameDescriptor * const desc)
+{
+    int i, j;
+    unsigned int n = 0;
+
+    memset(key, 0, sizeof(*key));
+    key->format = desc->layers[0].format;
+    key->width = frame->width;
+    key->height = frame->height;
+    key->nb_objects = desc->nb_objects;
+
+    for (i = 0; i < desc->nb_objects; ++i) {
+        struct stat st;
+        if (fstat(desc->objects[i].fd, &st) != 0)
+            return false;
+        key->dev[i] = st.st_dev;
+        key->ino[i] = st.st_ino;
     }
 
-    n = 0;
-    for (i = 0; i < desc->nb_layers; ++i)
-    {
-        for (j = 0; j < desc->layers[i].nb_planes; ++j)
-        {
+    for (i = 0; i < desc->nb_layers; ++i) {
+        for (j = 0; j < desc->layers[i].nb_planes; ++j) {
             const AVDRMPlaneDescriptor *const p = desc->layers[i].planes + j;
-            const AVDRMObjectDescriptor *const obj = desc->objects + p->object_index;
-
-            drmu_fb_int_layer_mod_set(dfb, n++, p->object_index, p->pitch, p->offset, obj->format_modifier);
+            if (n >= 4)
+                return false;
+            key->planes[n].obj_idx = p->object_index;
+            key->planes[n].pitch = p->pitch;
+            key->planes[n].offset = p->offset;
+            key->planes[n].modifier = desc->objects[p->object_index].format_modifier;
+            ++n;
         }
     }
+    key->n_planes = n;
+    return true;
+}
 
-    if (drmu_fb_int_make(dfb) != 0)
-        goto fail;
+// Key is memset before fill so simple compare is safe
+static bool
+fb_cache_key_eq(const fb_cache_key_t * const a, const fb_cache_key_t * const b)
+{
+    return memcmp(a, b, sizeof(*a)) == 0;
+}
 
-    drmu_av_fb_frame_metadata_set(dfb, frame);
+// True if fd0 no longer refers to the dmabuf we imported
+static bool
+fb_cache_ent_stale(const fb_cache_ent_t * const ent)
+{
+    struct stat st;
+    return fstat(ent->fd0, &st) != 0 || st.st_dev != ent->key.dev[0] || st.st_ino != ent->key.ino[0];
+}
+
+// Cache locked
+// Returns the fb to unref (outside the lock)
+static drmu_fb_t *
+fb_cache_ent_evict(fb_cache_ent_t * const ent)
+{
+    drmu_fb_t * const dfb = ent->dfb;
+
+    ent->dfb = NULL;
+    if (dfb != NULL)
+        drmu_fb_pre_delete_unset(dfb);
     return dfb;
+}
 
-fail:
-    drmu_fb_int_free(dfb);
+static int
+fb_cache_pre_delete_cb(drmu_fb_t * dfb, void * v)
+{
+    fb_cache_ent_t * const ent = v;
+    drmu_av_fb_cache_t * cache = ent->cache;
+    AVBufferRef * buf;
+    int rv = 1;
+
+    pthread_mutex_lock(&cache->lock);
+    buf = ent->buf;
+    ent->buf = NULL;
+    ent->in_use = false;
+
+    if (cache->dead) {
+        fb_cache_ent_evict(ent);
+        rv = 0;  // Continue with delete
+    }
+    else {
+        drmu_fb_ref(dfb);  // Restore ref - held by the cache
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    av_buffer_unref(&buf);
+    fb_cache_unref(&cache);
+    return rv;
+}
+
+// Drop all cached fbs that are not currently in use
+static void
+fb_cache_flush(drmu_av_fb_cache_t * const cache)
+{
+    unsigned int i;
+
+    for (i = 0; i != cache->ent_count; ++i) {
+        drmu_fb_t * dfb = NULL;
+
+        pthread_mutex_lock(&cache->lock);
+        if (!cache->ents[i].in_use)
+            dfb = fb_cache_ent_evict(cache->ents + i);
+        pthread_mutex_unlock(&cache->lock);
+
+        drmu_fb_unref(&dfb);
+    }
+}
+
+void
+drmu_av_fb_cache_flush(drmu_av_fb_cache_t * const cache)
+{
+    if (cache != NULL)
+        fb_cache_flush(cache);
+}
+
+void
+drmu_av_fb_cache_kill(drmu_av_fb_cache_t ** const ppcache)
+{
+    drmu_av_fb_cache_t * cache = *ppcache;
+
+    if (cache == NULL)
+        return;
+    *ppcache = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->dead = true;
+    pthread_mutex_unlock(&cache->lock);
+
+    drmu_debug(cache->du, "%s: hits=%u, misses=%u", __func__, cache->hits, cache->misses);
+
+    fb_cache_flush(cache);
+    fb_cache_unref(&cache);
+}
+
+drmu_av_fb_cache_t *
+drmu_av_fb_cache_new(drmu_env_t * const du, const unsigned int max_fbs)
+{
+    drmu_av_fb_cache_t * const cache = calloc(1, sizeof(*cache));
+    unsigned int i;
+
+    if (cache == NULL)
+        goto fail0;
+    if ((cache->ents = calloc(max_fbs, sizeof(*cache->ents))) == NULL)
+        goto fail1;
+
+    cache->du = drmu_env_ref(du);
+    cache->ent_count = max_fbs;
+    for (i = 0; i != max_fbs; ++i)
+        cache->ents[i].cache = cache;
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+
+fail1:
+    free(cache);
+fail0:
+    drmu_err(du, "%s: Failed to alloc cache", __func__);
     return NULL;
 }
 
+// Attach the frame to a cached fb (new or reused)
+static drmu_fb_t *
+fb_cache_ent_attach(fb_cache_ent_t * const ent, drmu_fb_t * const dfb, AVFrame * const frame,
+                    const AVDRMFrameDescriptor * const desc)
+{
+    ent->buf = av_buffer_ref(frame->buf[0]);
+    fb_av_active_set(dfb, frame, desc->layers[0].format);
+    drmu_fb_int_hdr_metadata_unset(dfb);
+    drmu_av_fb_frame_metadata_set(dfb, frame);
+    drmu_fb_pre_delete_set(dfb, fb_cache_pre_delete_cb, ent);
+    fb_cache_ref(ent->cache);
+    return dfb;
+}
 
+drmu_fb_t *
+drmu_fb_av_new_frame_attach_cache(drmu_av_fb_cache_t * const cache, AVFrame * const frame)
+{
+    drmu_env_t * const du = cache->du;
+    const AVDRMFrameDescriptor * const desc = (const AVDRMFrameDescriptor *)frame->data[0];
+    fb_cache_key_t key;
+    fb_cache_ent_t * ent = NULL;
+    drmu_fb_t * dfb;
+    drmu_fb_t * evict_fbs[16];
+    unsigned int n_evict = 0;
+    unsigned int i;
+
+    if (desc == NULL || desc->nb_objects > 4 || desc->nb_objects < 1 ||
+        !fb_cache_key_make(&key, frame, desc))
+        return drmu_fb_av_new_frame_attach(du, frame);
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (cache->dead)
+        goto uncached_unlock;
+
+    for (i = 0; i != cache->ent_count; ++i) {
+        fb_cache_ent_t * const e = cache->ents + i;
+        if (e->dfb != NULL && fb_cache_key_eq(&e->key, &key)) {
+            // Same buffer displayed twice at once? Don't try to share it
+            if (e->in_use)
+                goto uncached_unlock;
+
+            e->in_use = true;
+            e->fd0 = desc->objects[0].fd;
+            e->last_use = ++cache->use_count;
+            ++cache->hits;
+            dfb = e->dfb;
+            pthread_mutex_unlock(&cache->lock);
+
+            return fb_cache_ent_attach(e, dfb, frame, desc);
+        }
+    }
+    ++cache->misses;
+
+    // Miss - evict anything whose source has gone then pick an empty slot
+    // or failing that the LRU unused one
+    for (i = 0; i != cache->ent_count; ++i) {
+        fb_cache_ent_t * const e = cache->ents + i;
+        if (e->dfb != NULL && !e->in_use && n_evict < 16 && fb_cache_ent_stale(e))
+            evict_fbs[n_evict++] = fb_cache_ent_evict(e);
+    }
+    for (i = 0; i != cache->ent_count; ++i) {
+        fb_cache_ent_t * const e = cache->ents + i;
+        if (e->in_use)
+            continue;
+        if (e->dfb == NULL) {
+            ent = e;
+            break;
+        }
+        if (ent == NULL || e->last_use < ent->last_use)
+            ent = e;
+    }
+    if (ent == NULL)
+        goto uncached_unlock;
+
+    if (ent->dfb != NULL)
+        evict_fbs[n_evict++] = fb_cache_ent_evict(ent);
+
+    // Claim the slot whilst we build the fb outside the lock
+    ent->in_use = true;
+    ent->key = key;
+    ent->fd0 = desc->objects[0].fd;
+    ent->last_use = ++cache->use_count;
+    pthread_mutex_unlock(&cache->lock);
+
+    for (i = 0; i != n_evict; ++i)
+        drmu_fb_unref(evict_fbs + i);
+
+    if ((dfb = drmu_fb_int_alloc(du)) == NULL) {
+        drmu_err(du, "%s: Alloc failure", __func__);
+        goto fail;
+    }
+    fb_av_active_set(dfb, frame, desc->layers[0].format);
+    if (fb_av_frame_make(dfb, du, desc) != 0) {
+        drmu_fb_int_free(dfb);
+        goto fail;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    ent->dfb = dfb;
+    pthread_mutex_unlock(&cache->lock);
+
+    return fb_cache_ent_attach(ent, dfb, frame, desc);
+
+fail:
+    pthread_mutex_lock(&cache->lock);
+    ent->in_use = false;
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+
+uncached_unlock:
+    pthread_mutex_unlock(&cache->lock);
+    for (i = 0; i != n_evict; ++i)
+        drmu_fb_unref(evict_fbs + i);
+    return drmu_fb_av_new_frame_attach(du, frame);
+}
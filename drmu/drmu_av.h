@@ -19,6 +19,23 @@ int drmu_av_fb_frame_metadata_set(struct drmu_fb_s * const dfb, const struct AVF
 
 struct drmu_fb_s * drmu_fb_av_new_frame_attach(struct drmu_env_s * const du, struct AVFrame * const frame);
 
+// fb cache for DRM_PRIME frames
+// Keeps the fbs made for DRM_PRIME frames so that when the same dmabuf (with
+// the same layout) is seen again its fb_id & BOs are reused rather than
+// reimported. Holds up to max_fbs fbs (and therefore their dmabufs).
+struct drmu_av_fb_cache_s;
+typedef struct drmu_av_fb_cache_s drmu_av_fb_cache_t;
+
+drmu_av_fb_cache_t * drmu_av_fb_cache_new(struct drmu_env_s * const du, const unsigned int max_fbs);
+// Drop all fbs not currently in use - e.g. on decoder reinit
+void drmu_av_fb_cache_flush(drmu_av_fb_cache_t * const cache);
+// Flush & unref. fbs in use are freed when their last ref goes
+void drmu_av_fb_cache_kill(drmu_av_fb_cache_t ** const ppcache);
+
+// As drmu_fb_av_new_frame_attach but using the cache
+// Falls back to an uncached fb if the frame cannot be cached
+struct drmu_fb_s * drmu_fb_av_new_frame_attach_cache(drmu_av_fb_cache_t * const cache, struct AVFrame * const frame);
+
 #ifdef __cplusplus
 }
 #endif
@@ -4,18 +4,16 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#include <linux/mman.h>
 #include <linux/dma-heap.h>
 #include <sys/ioctl.h>
-#include <sys/mman.h>
 
 #include "drmu.h"
-#include "drmu_fmts.h"
 #include "drmu_log.h"
 #include "drmu_pool.h"
 
@@ -24,49 +22,41 @@ struct drmu_dmabuf_env_s {
     drmu_env_t * du;
     int fd;
     size_t page_size;
+    drmu_dmabuf_cache_t cache;
+    bool lazy_map;
 };
 
 drmu_fb_t *
-drmu_fb_new_dmabuf_mod(drmu_dmabuf_env_t * const dde, const uint32_t w, const uint32_t h, const uint32_t format, const uint64_t mod)
+drmu_fb_new_dmabuf_layout(drmu_dmabuf_env_t * const dde, const uint32_t w, const uint32_t h,
+                          const uint32_t format, const uint64_t mod,
+                          const drmu_fb_layout_t * const layout)
 {
-    const drmu_fmt_info_t * const fmti = drmu_fmt_info_find_fmt(format);
     drmu_env_t * const du = dde->du;
+    drmu_fb_planes_t planes;
     unsigned int i;
-    unsigned int layers;
-    unsigned int bypp;
-    uint32_t w2 = (w + 15) & ~15;
-    uint32_t h2 = (h + 15) & ~15;
     drmu_fb_t * fb;
-    uint32_t offset = 0;
+    const drmu_fb_map_t map = layout != NULL && layout->map != DRMU_FB_MAP_DEFAULT ? layout->map :
+        dde->lazy_map ? DRMU_FB_MAP_LAZY : DRMU_FB_MAP_POPULATE;
+    const bool huge = layout != NULL && layout->map_huge;
 
-    if (fmti == NULL) {
-        drmu_err(du, "%s: Format not found: %s", __func__, drmu_log_fourcc(format));
+    if (drmu_fb_layout_planes(layout, format, w, h, &planes) != 0) {
+        drmu_err(du, "%s: Format not found or bad layout: %s", __func__, drmu_log_fourcc(format));
         return NULL;
     }
 
     if ((fb = drmu_fb_int_alloc(du)) == NULL)
         return NULL;
 
-    drmu_fb_int_fmt_size_set(fb, format, w2, h2, drmu_rect_wh(w, h));
-
-    layers = drmu_fmt_info_plane_count(fmti);
-    bypp = (drmu_fmt_info_pixel_bits(fmti) + 7) / 8;
-
-    for (offset = 0, i = 0; i != layers; ++i) {
-        const uint32_t stride = w2 * bypp / drmu_fmt_info_wdiv(fmti, i);
-        const uint32_t size = stride * h2 / drmu_fmt_info_hdiv(fmti, i);
-        offset += size;
-    }
+    drmu_fb_int_fmt_size_set(fb, format, planes.width, planes.height, drmu_rect_wh(w, h));
+    drmu_fb_int_coherent_set(fb, dde->cache != DRMU_DMABUF_CACHE_CACHED);
 
-
-    {
+    for (i = 0; i != planes.obj_count; ++i) {
         struct dma_heap_allocation_data data = {
-            .len = (offset + dde->page_size - 1) & ~(dde->page_size - 1),
+            .len = (planes.obj_size[i] + dde->page_size - 1) & ~(dde->page_size - 1),
             .fd = 0,
             .fd_flags = O_RDWR | O_CLOEXEC,
             .heap_flags = 0
         };
-        void * map_ptr;
         drmu_bo_t * bo;
 
         while (ioctl(dde->fd, DMA_HEAP_IOCTL_ALLOC, &data)) {
@@ -78,32 +68,21 @@ drmu_fb_new_dmabuf_mod(drmu_dmabuf_env_t * const dde, const uint32_t w, const ui
             goto fail;
         }
 
-        drmu_fb_int_fd_set(fb, data.fd);
+        drmu_fb_int_obj_fd_set(fb, i, data.fd);
 
         if ((bo = drmu_bo_new_fd(du, data.fd)) == NULL) {
             drmu_err(du, "%s: Failed to allocate BO", __func__);
             goto fail;
         }
 
-        drmu_fb_int_bo_set(fb, 0, bo);
+        drmu_fb_int_bo_set(fb, i, bo);
 
-        if ((map_ptr = mmap(NULL, (size_t)data.len,
-                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
-                            data.fd, 0)) == MAP_FAILED) {
-            drmu_err(du, "%s: mmap failed (size=%zd, fd=%d): %s", __func__,
-                     (size_t)data.len, data.fd, strerror(errno));
+        if (drmu_fb_int_obj_map_set(fb, i, data.fd, 0, (size_t)data.len, map, huge) != 0)
             goto fail;
-        }
-
-        drmu_fb_int_mmap_set(fb, map_ptr, (size_t)data.len, w2 * bypp);
     }
 
-    for (offset = 0, i = 0; i != layers; ++i) {
-        const uint32_t stride = w2 * bypp / drmu_fmt_info_wdiv(fmti, i);
-        const uint32_t size = stride * h2 / drmu_fmt_info_hdiv(fmti, i);
-        drmu_fb_int_layer_mod_set(fb, i, 0, stride, offset, mod);
-        offset += size;
-    }
+    for (i = 0; i != planes.plane_count; ++i)
+        drmu_fb_int_layer_mod_set(fb, i, planes.obj[i], planes.pitch[i], planes.offset[i], mod);
 
     if (drmu_fb_int_make(fb))
         goto fail;
@@ -115,6 +94,12 @@ fail:
     return NULL;
 }
 
+drmu_fb_t *
+drmu_fb_new_dmabuf_mod(drmu_dmabuf_env_t * const dde, const uint32_t w, const uint32_t h, const uint32_t format, const uint64_t mod)
+{
+    return drmu_fb_new_dmabuf_layout(dde, w, h, format, mod, NULL);
+}
+
 drmu_dmabuf_env_t *
 drmu_dmabuf_env_ref(drmu_dmabuf_env_t * const dde)
 {
@@ -137,6 +122,27 @@ void drmu_dmabuf_env_unref(drmu_dmabuf_env_t ** const ppdde)
     free(dde);
 }
 
+drmu_dmabuf_cache_t
+drmu_dmabuf_env_cache(const drmu_dmabuf_env_t * const dde)
+{
+    return dde->cache;
+}
+
+void
+drmu_dmabuf_env_lazy_map_set(drmu_dmabuf_env_t * const dde, const bool lazy)
+{
+    dde->lazy_map = lazy;
+}
+
+drmu_dmabuf_env_t *
+drmu_dmabuf_env_new_fd_cache(struct drmu_env_s * const du, const int fd, const drmu_dmabuf_cache_t cache)
+{
+    drmu_dmabuf_env_t * const dde = drmu_dmabuf_env_new_fd(du, fd);
+    if (dde != NULL)
+        dde->cache = cache;
+    return dde;
+}
+
 drmu_dmabuf_env_t *
 drmu_dmabuf_env_new_fd(struct drmu_env_s * const du, const int fd)
 {
@@ -157,26 +163,51 @@ drmu_dmabuf_env_new_fd(struct drmu_env_s * const du, const int fd)
     }
 }
 
+// Contiguous (scanout capable) heaps in order of preference
+// vidbuf_cached is the Raspberry Pi heap, linux,cma & reserved are the
+// upstream CMA heap names (both cached). linux,cma-uncached comes from
+// vendor kernels (e.g. NXP i.MX) - upstream has no uncached CMA heap.
+static const struct video_heap_s {
+    const char * name;
+    drmu_dmabuf_cache_t cache;
+} video_heaps[] = {
+    {"/dev/dma_heap/vidbuf_cached",      DRMU_DMABUF_CACHE_CACHED},
+    {"/dev/dma_heap/linux,cma",          DRMU_DMABUF_CACHE_CACHED},
+    {"/dev/dma_heap/reserved",           DRMU_DMABUF_CACHE_CACHED},
+    {"/dev/dma_heap/linux,cma-uncached", DRMU_DMABUF_CACHE_UNCACHED},
+    {NULL, DRMU_DMABUF_CACHE_CACHED}
+};
+
 drmu_dmabuf_env_t *
-drmu_dmabuf_env_new_video(struct drmu_env_s * const du)
+drmu_dmabuf_env_new_video_cache(struct drmu_env_s * const du, const drmu_dmabuf_cache_t cache)
 {
-    static const char * const names[] = {
-        "/dev/dma_heap/vidbuf_cached",
-        "/dev/dma_heap/linux,cma",
-        "/dev/dma_heap/reserved",
-        NULL
-    };
-    const char * const * pfname;
+    const struct video_heap_s * vh;
+    unsigned int pass;
+
+    // Exact match first, then anything
+    for (pass = 0; pass != 2; ++pass) {
+        for (vh = video_heaps; vh->name != NULL; ++vh) {
+            drmu_dmabuf_env_t * dde;
 
-    for (pfname = names; pfname != NULL; ++pfname) {
-        const int fd = open(*pfname, O_RDWR | O_CLOEXEC);
-        drmu_dmabuf_env_t * const dde = drmu_dmabuf_env_new_fd(du, fd);
-        if (dde != NULL)
-            return dde;
+            if (pass == 0 && vh->cache != cache)
+                continue;
+            if ((dde = drmu_dmabuf_env_new_fd_cache(du, open(vh->name, O_RDWR | O_CLOEXEC), vh->cache)) != NULL) {
+                if (vh->cache != cache)
+                    drmu_debug(du, "%s: No heap with caching %d", __func__, cache);
+                drmu_debug(du, "%s: Using %s", __func__, vh->name);
+                return dde;
+            }
+        }
     }
     return NULL;
 }
 
+drmu_dmabuf_env_t *
+drmu_dmabuf_env_new_video(struct drmu_env_s * const du)
+{
+    return drmu_dmabuf_env_new_video_cache(du, DRMU_DMABUF_CACHE_CACHED);
+}
+
 static drmu_fb_t *
 pool_dmabuf_alloc_cb(void * const v, const uint32_t w, const uint32_t h, const uint32_t format, const uint64_t mod)
 {
@@ -204,3 +235,43 @@ drmu_pool_new_dmabuf(drmu_dmabuf_env_t * dde, unsigned int total_fbs_max)
                                &fns, drmu_dmabuf_env_ref(dde));
 }
 
+// Pool with a layout - holds the dde & a copy of the layout
+typedef struct pool_dmabuf_layout_s {
+    drmu_dmabuf_env_t * dde;
+    drmu_fb_layout_t layout;
+} pool_dmabuf_layout_t;
+
+static drmu_fb_t *
+pool_dmabuf_layout_alloc_cb(void * const v, const uint32_t w, const uint32_t h, const uint32_t format, const uint64_t mod)
+{
+    pool_dmabuf_layout_t * const pdl = v;
+    return drmu_fb_new_dmabuf_layout(pdl->dde, w, h, format, mod, &pdl->layout);
+}
+
+static void
+pool_dmabuf_layout_on_delete_cb(void * const v)
+{
+    pool_dmabuf_layout_t * const pdl = v;
+    drmu_dmabuf_env_unref(&pdl->dde);
+    free(pdl);
+}
+
+drmu_pool_t *
+drmu_pool_new_dmabuf_layout(drmu_dmabuf_env_t * dde, unsigned int total_fbs_max,
+                            const drmu_fb_layout_t * const layout)
+{
+    static const drmu_pool_callback_fns_t fns = {
+        .alloc_fn = pool_dmabuf_layout_alloc_cb,
+        .on_delete_fn = pool_dmabuf_layout_on_delete_cb,
+        .try_reuse_fn = drmu_fb_try_reuse,
+    };
+    pool_dmabuf_layout_t * pdl;
+
+    if (layout == NULL)
+        return drmu_pool_new_dmabuf(dde, total_fbs_max);
+    if (dde == NULL || (pdl = calloc(1, sizeof(*pdl))) == NULL)
+        return NULL;
+    pdl->dde = drmu_dmabuf_env_ref(dde);
+    pdl->layout = *layout;
+    return drmu_pool_new_alloc(dde->du, total_fbs_max, &fns, pdl);
+}
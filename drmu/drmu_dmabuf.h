@@ -1,6 +1,7 @@
 #ifndef _DRMU_DRMU_DMABUF_H
 #define _DRMU_DRMU_DMABUF_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -9,26 +10,58 @@ extern "C" {
 
 struct drmu_env_s;
 struct drmu_fb_s;
+struct drmu_fb_layout_s;
 struct drmu_pool_s;
 
 struct drmu_dmabuf_env_s;
 typedef struct drmu_dmabuf_env_s drmu_dmabuf_env_t;
 
+// CPU caching of a heap's buffers
+typedef enum drmu_dmabuf_cache_e {
+    DRMU_DMABUF_CACHE_CACHED = 0,   // Fast CPU access but needs sync (fb_write_start etc.)
+    DRMU_DMABUF_CACHE_UNCACHED,     // No sync needed, slow CPU access
+} drmu_dmabuf_cache_t;
+
 struct drmu_fb_s * drmu_fb_new_dmabuf_mod(drmu_dmabuf_env_t * const dde, const uint32_t w, const uint32_t h, const uint32_t format, const uint64_t mod);
+// Allocate with the given layout (see drmu_fb_layout_t)
+// With separate_objects each plane gets its own dmabuf
+// layout NULL gives the same as _mod
+struct drmu_fb_s * drmu_fb_new_dmabuf_layout(drmu_dmabuf_env_t * const dde, const uint32_t w, const uint32_t h,
+                                             const uint32_t format, const uint64_t mod,
+                                             const struct drmu_fb_layout_s * const layout);
 
 drmu_dmabuf_env_t * drmu_dmabuf_env_ref(drmu_dmabuf_env_t * const dde);
 void drmu_dmabuf_env_unref(drmu_dmabuf_env_t ** const ppdde);
 // Takes control of fd and will close it when the env is deleted
 // or on creation error so dup if it is needed to survive the pool
+// Heap is assumed to be cached
 drmu_dmabuf_env_t * drmu_dmabuf_env_new_fd(struct drmu_env_s * const du, int fd);
+// As above but with the heap's caching known
+drmu_dmabuf_env_t * drmu_dmabuf_env_new_fd_cache(struct drmu_env_s * const du, int fd, const drmu_dmabuf_cache_t cache);
 
+// Open a heap suitable for video & scanout, preferring one with the given
+// caching but falling back to any that exists. Upstream kernels only have
+// cached contiguous heaps; an uncached one (linux,cma-uncached) is only
+// found on some vendor kernels. Check drmu_dmabuf_env_cache for what you got.
+drmu_dmabuf_env_t * drmu_dmabuf_env_new_video_cache(struct drmu_env_s * const du, const drmu_dmabuf_cache_t cache);
+// Cached video heap
 drmu_dmabuf_env_t * drmu_dmabuf_env_new_video(struct drmu_env_s * const du);
 
+drmu_dmabuf_cache_t drmu_dmabuf_env_cache(const drmu_dmabuf_env_t * const dde);
+// Don't map fbs until first CPU access (drmu_fb_data or drmu_fb_xxx_start)
+// Saves map & page fault cost on buffers only accessed by hardware
+// Default off. Affects fbs allocated after the call whose layout doesn't
+// set a map policy.
+void drmu_dmabuf_env_lazy_map_set(drmu_dmabuf_env_t * const dde, const bool lazy);
+
 // Construct an fb pool from dmabufs
 // A reference to dde is held by the pool so it is safe to unref immediately
 // after this call
 // dde = NULL returns NULL safely
 struct drmu_pool_s * drmu_pool_new_dmabuf(drmu_dmabuf_env_t * dde, unsigned int total_fbs_max);
+// As above, every fb allocated with layout (which is copied)
+struct drmu_pool_s * drmu_pool_new_dmabuf_layout(drmu_dmabuf_env_t * dde, unsigned int total_fbs_max,
+                                                 const struct drmu_fb_layout_s * const layout);
 
 // Convienience fn.
 static inline struct drmu_pool_s *
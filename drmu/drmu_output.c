@@ -10,12 +10,44 @@
 #include <libdrm/drm.h>
 #include <libdrm/drm_mode.h>
 
+// Planes the planner may hold at once
+#define PLAN_PLANES_MAX 32
+// Cached layouts
+#define PLAN_CACHE_SIZE 8
+// Bound on TEST_ONLY commits per search
+#define PLAN_TESTS_MAX 64
+
 // Update return value with a new one for cases where we don't stop on error
 static inline int rvup(int rv1, int rv2)
 {
     return rv2 ? rv2 : rv1;
 }
 
+// Everything about a set of layers that affects whether they will commit
+// Zeroed before filling so it can be memcmped
+typedef struct plan_key_s {
+    unsigned int n;
+    struct {
+        uint32_t format;
+        uint64_t mod;
+        uint32_t src_w, src_h;  // 16.16
+        drmu_rect_t pos;
+        int zpos;
+        int alpha;
+    } l[DRMU_OUTPUT_LAYERS_MAX];
+} plan_key_t;
+
+typedef struct plan_layout_s {
+    drmu_plane_t * planes[DRMU_OUTPUT_LAYERS_MAX];  // NULL => fallback
+    int zpos[DRMU_OUTPUT_LAYERS_MAX];               // Plane zpos to set
+    bool set_zpos[DRMU_OUTPUT_LAYERS_MAX];
+} plan_layout_t;
+
+typedef struct plan_cache_ent_s {
+    plan_key_t key;
+    plan_layout_t layout;
+} plan_cache_ent_t;
+
 struct drmu_output_s {
     atomic_int ref_count;
 
@@ -38,6 +70,19 @@ struct drmu_output_s {
     // HDR metadata
     drmu_isset_t hdr_metadata_isset;
     struct hdr_output_metadata hdr_metadata;
+
+    // Composition planner
+    // Planes claimed by the planner. Shown planes have had an fb added by
+    // drmu_atomic_output_add_layers and must be cleared before release.
+    unsigned int plan_planes_n;
+    drmu_plane_t * plan_planes[PLAN_PLANES_MAX];
+    bool plan_shown[PLAN_PLANES_MAX];
+    // Last plan
+    unsigned int layer_n;
+    plan_layout_t layout;
+    // LRU first
+    unsigned int cache_n;
+    plan_cache_ent_t cache[PLAN_CACHE_SIZE];
 };
 
 drmu_plane_t *
@@ -92,6 +137,425 @@ drmu_output_plane_ref_format(drmu_output_t * const dout, const unsigned int type
     return dp;
 }
 
+//----------------------------------------------------------------------------
+//
+// Composition planner
+
+typedef struct plan_search_s {
+    drmu_output_t * dout;
+    drmu_atomic_t * da_base;
+    const drmu_output_layer_t * layers;
+    unsigned int n;
+    unsigned int order[DRMU_OUTPUT_LAYERS_MAX];     // Layers bottom to top
+    unsigned int tests;
+
+    // Candidates are all the planes we hold, sorted by zpos
+    unsigned int cand_n;
+    drmu_plane_t * cand[PLAN_PLANES_MAX];
+    bool cand_has_z[PLAN_PLANES_MAX];
+    int cand_zmin[PLAN_PLANES_MAX];
+    int cand_zmax[PLAN_PLANES_MAX];
+    bool cand_used[PLAN_PLANES_MAX];
+
+    plan_layout_t cur;
+    unsigned int best_placed;
+    plan_layout_t best;
+} plan_search_t;
+
+static void
+plan_key_make(plan_key_t * const key, const drmu_output_layer_t * const layers, const unsigned int n)
+{
+    unsigned int i;
+
+    memset(key, 0, sizeof(*key));
+    key->n = n;
+    for (i = 0; i != n; ++i) {
+        const drmu_rect_t crop = drmu_fb_crop_frac(layers[i].fb);
+        key->l[i].format = drmu_fb_pixel_format(layers[i].fb);
+        key->l[i].mod = drmu_fb_modifier(layers[i].fb, 0);
+        key->l[i].src_w = crop.w;
+        key->l[i].src_h = crop.h;
+        key->l[i].pos = layers[i].pos;
+        key->l[i].zpos = layers[i].zpos;
+        key->l[i].alpha = layers[i].alpha;
+    }
+}
+
+static int
+plan_plane_find(const drmu_output_t * const dout, const drmu_plane_t * const dp)
+{
+    unsigned int i;
+    for (i = 0; i != dout->plan_planes_n; ++i) {
+        if (dout->plan_planes[i] == dp)
+            return (int)i;
+    }
+    return -1;
+}
+
+static bool
+plan_layout_has(const plan_layout_t * const layout, const unsigned int n, const drmu_plane_t * const dp)
+{
+    unsigned int i;
+    for (i = 0; i != n; ++i) {
+        if (layout->planes[i] == dp)
+            return true;
+    }
+    return false;
+}
+
+static bool
+plan_any_cb(const drmu_plane_t * dp, void * v)
+{
+    (void)dp;
+    (void)v;
+    return true;
+}
+
+// Claim every free plane this crtc can use
+static void
+plan_planes_claim(drmu_output_t * const dout)
+{
+    drmu_plane_t * dp;
+
+    while (dout->plan_planes_n < PLAN_PLANES_MAX &&
+           (dp = drmu_plane_new_find(dout->dc, plan_any_cb, NULL)) != NULL) {
+        if (drmu_plane_ref_crtc(dp, dout->dc) != 0)
+            break;
+        dout->plan_shown[dout->plan_planes_n] = false;
+        dout->plan_planes[dout->plan_planes_n++] = dp;
+    }
+}
+
+// Release planes that are neither shown nor in the current plan
+static void
+plan_planes_release_unused(drmu_output_t * const dout)
+{
+    unsigned int i, j;
+
+    for (i = 0, j = 0; i != dout->plan_planes_n; ++i) {
+        drmu_plane_t * dp = dout->plan_planes[i];
+
+        if (!dout->plan_shown[i] && !plan_layout_has(&dout->layout, dout->layer_n, dp)) {
+            drmu_plane_unref(&dp);
+            continue;
+        }
+        dout->plan_shown[j] = dout->plan_shown[i];
+        dout->plan_planes[j++] = dp;
+    }
+    dout->plan_planes_n = j;
+}
+
+// Add the layers in layout to da with all other held planes cleared
+static int
+plan_layout_add(drmu_atomic_t * const da, drmu_output_t * const dout,
+                const drmu_output_layer_t * const layers, const unsigned int n,
+                const plan_layout_t * const layout)
+{
+    unsigned int i;
+    int rv;
+
+    for (i = 0; i != dout->plan_planes_n; ++i) {
+        if (!plan_layout_has(layout, n, dout->plan_planes[i]) &&
+            (rv = drmu_atomic_plane_clear_add(da, dout->plan_planes[i])) != 0)
+            return rv;
+    }
+    for (i = 0; i != n; ++i) {
+        drmu_plane_t * const dp = layout->planes[i];
+
+        if (dp == NULL)
+            continue;
+        if ((rv = drmu_atomic_plane_add_fb(da, dp, layers[i].fb, layers[i].pos)) != 0 ||
+            (layout->set_zpos[i] && (rv = drmu_atomic_plane_add_zpos(da, dp, layout->zpos[i])) != 0) ||
+            (drmu_plane_has_alpha(dp) &&
+             (rv = drmu_atomic_plane_add_alpha(da, dp, layers[i].alpha)) != 0))
+            return rv;
+    }
+    return 0;
+}
+
+static int
+plan_layout_test(drmu_output_t * const dout, drmu_atomic_t * const da_base,
+                 const drmu_output_layer_t * const layers, const unsigned int n,
+                 const plan_layout_t * const layout)
+{
+    drmu_atomic_t * da = da_base != NULL ? drmu_atomic_copy(da_base) : drmu_atomic_new(dout->du);
+    int rv;
+
+    if (da == NULL)
+        return -ENOMEM;
+    if ((rv = plan_layout_add(da, dout, layers, n, layout)) == 0)
+        rv = drmu_atomic_commit(da, DRM_MODE_ATOMIC_TEST_ONLY |
+                                (dout->modeset_allow ? DRM_MODE_ATOMIC_ALLOW_MODESET : 0));
+    drmu_atomic_unref(&da);
+    return rv;
+}
+
+// Can cand c take layer li with a zpos above zlast?
+static bool
+plan_cand_ok(const plan_search_t * const ps, const unsigned int c, const unsigned int li,
+             const int zlast, int * const pz)
+{
+    const drmu_output_layer_t * const layer = ps->layers + li;
+    const drmu_plane_t * const dp = ps->cand[c];
+
+    if (ps->cand_used[c] ||
+        !drmu_plane_format_check(dp, drmu_fb_pixel_format(layer->fb), drmu_fb_modifier(layer->fb, 0)))
+        return false;
+    if (layer->alpha != DRMU_PLANE_ALPHA_UNSET && layer->alpha != DRMU_PLANE_ALPHA_OPAQUE &&
+        !drmu_plane_has_alpha(dp))
+        return false;
+    if (!ps->cand_has_z[c]) {
+        *pz = zlast;
+        return true;
+    }
+    *pz = zlast + 1 > ps->cand_zmin[c] ? zlast + 1 : ps->cand_zmin[c];
+    return *pz <= ps->cand_zmax[c];
+}
+
+// Depth first, bottom layer first, trying a plane before fallback so the
+// first complete assignment is the greedy one. Each placement is tested with
+// everything placed below it so a complete assignment has always been
+// tested as a whole. Branches that cannot beat the best so far are cut.
+static void
+plan_search(plan_search_t * const ps, const unsigned int depth, const int zlast, const unsigned int placed)
+{
+    unsigned int li;
+    unsigned int c;
+
+    if (placed + (ps->n - depth) <= ps->best_placed)
+        return;
+    if (depth == ps->n) {
+        ps->best = ps->cur;
+        ps->best_placed = placed;
+        return;
+    }
+
+    li = ps->order[depth];
+    for (c = 0; c != ps->cand_n; ++c) {
+        int z;
+
+        if (!plan_cand_ok(ps, c, li, zlast, &z))
+            continue;
+        if (ps->tests >= PLAN_TESTS_MAX)
+            break;
+
+        ps->cur.planes[li] = ps->cand[c];
+        ps->cur.zpos[li] = z;
+        ps->cur.set_zpos[li] = ps->cand_has_z[c] && ps->cand_zmin[c] != ps->cand_zmax[c];
+        ps->cand_used[c] = true;
+        ++ps->tests;
+
+        if (plan_layout_test(ps->dout, ps->da_base, ps->layers, ps->n, &ps->cur) == 0)
+            plan_search(ps, depth + 1, z, placed + 1);
+
+        ps->cand_used[c] = false;
+        ps->cur.planes[li] = NULL;
+        ps->cur.set_zpos[li] = false;
+
+        if (ps->best_placed == ps->n)
+            return;
+    }
+
+    plan_search(ps, depth + 1, zlast, placed);
+}
+
+static void
+plan_search_init(plan_search_t * const ps, drmu_output_t * const dout, drmu_atomic_t * const da_base,
+                 const drmu_output_layer_t * const layers, const unsigned int n)
+{
+    unsigned int i, j;
+
+    memset(ps, 0, sizeof(*ps));
+    ps->dout = dout;
+    ps->da_base = da_base;
+    ps->layers = layers;
+    ps->n = n;
+
+    // Stable sort of layers by zpos
+    for (i = 0; i != n; ++i) {
+        for (j = i; j != 0 && layers[ps->order[j - 1]].zpos > layers[i].zpos; --j)
+            ps->order[j] = ps->order[j - 1];
+        ps->order[j] = i;
+    }
+
+    // Candidates sorted by min zpos, those without zpos last
+    for (i = 0; i != dout->plan_planes_n; ++i) {
+        drmu_plane_t * const dp = dout->plan_planes[i];
+        int zmin = 0, zmax = 0;
+        const bool has_z = drmu_plane_zpos_range(dp, &zmin, &zmax) == 0;
+
+        for (j = ps->cand_n;
+             j != 0 && (!ps->cand_has_z[j - 1] || (has_z && ps->cand_zmin[j - 1] > zmin));
+             --j) {
+            ps->cand[j] = ps->cand[j - 1];
+            ps->cand_has_z[j] = ps->cand_has_z[j - 1];
+            ps->cand_zmin[j] = ps->cand_zmin[j - 1];
+            ps->cand_zmax[j] = ps->cand_zmax[j - 1];
+        }
+        ps->cand[j] = dp;
+        ps->cand_has_z[j] = has_z;
+        ps->cand_zmin[j] = zmin;
+        ps->cand_zmax[j] = zmax;
+        ++ps->cand_n;
+    }
+}
+
+// Find key in the cache & move it to the front
+static plan_cache_ent_t *
+plan_cache_find(drmu_output_t * const dout, const plan_key_t * const key)
+{
+    unsigned int i;
+
+    for (i = 0; i != dout->cache_n; ++i) {
+        if (memcmp(&dout->cache[i].key, key, sizeof(*key)) == 0) {
+            if (i != 0) {
+                const plan_cache_ent_t t = dout->cache[i];
+                memmove(dout->cache + 1, dout->cache, i * sizeof(dout->cache[0]));
+                dout->cache[0] = t;
+            }
+            return dout->cache;
+        }
+    }
+    return NULL;
+}
+
+static void
+plan_cache_remove(drmu_output_t * const dout, plan_cache_ent_t * const ent)
+{
+    const unsigned int i = (unsigned int)(ent - dout->cache);
+    memmove(ent, ent + 1, (dout->cache_n - i - 1) * sizeof(*ent));
+    --dout->cache_n;
+}
+
+static void
+plan_cache_add(drmu_output_t * const dout, const plan_key_t * const key, const plan_layout_t * const layout)
+{
+    if (dout->cache_n < PLAN_CACHE_SIZE)
+        ++dout->cache_n;
+    memmove(dout->cache + 1, dout->cache, (dout->cache_n - 1) * sizeof(dout->cache[0]));
+    dout->cache[0].key = *key;
+    dout->cache[0].layout = *layout;
+}
+
+// All planes in a cached layout must be ours (claiming them if free)
+static bool
+plan_cache_planes_ok(drmu_output_t * const dout, const plan_layout_t * const layout, const unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i != n; ++i) {
+        drmu_plane_t * const dp = layout->planes[i];
+
+        if (dp == NULL || plan_plane_find(dout, dp) >= 0)
+            continue;
+        if (dout->plan_planes_n >= PLAN_PLANES_MAX || drmu_plane_ref_crtc(dp, dout->dc) != 0)
+            return false;
+        dout->plan_shown[dout->plan_planes_n] = false;
+        dout->plan_planes[dout->plan_planes_n++] = dp;
+    }
+    return true;
+}
+
+static unsigned int
+plan_layout_placed(const plan_layout_t * const layout, const unsigned int n)
+{
+    unsigned int placed = 0;
+    unsigned int i;
+
+    for (i = 0; i != n; ++i)
+        placed += layout->planes[i] != NULL;
+    return placed;
+}
+
+static uint32_t
+plan_fallback_mask(const plan_layout_t * const layout, const unsigned int n)
+{
+    uint32_t mask = 0;
+    unsigned int i;
+
+    for (i = 0; i != n; ++i) {
+        if (layout->planes[i] == NULL)
+            mask |= 1U << i;
+    }
+    return mask;
+}
+
+int
+drmu_output_layers_plan(drmu_output_t * const dout, drmu_atomic_t * const da_base,
+                        const drmu_output_layer_t * const layers, const unsigned int n,
+                        uint32_t * const fallback_mask)
+{
+    plan_key_t key;
+    plan_cache_ent_t * ent;
+    plan_search_t * ps;
+    unsigned int i;
+
+    if (dout->dc == NULL || n > DRMU_OUTPUT_LAYERS_MAX)
+        return -EINVAL;
+    for (i = 0; i != n; ++i) {
+        if (layers[i].fb == NULL)
+            return -EINVAL;
+    }
+
+    plan_key_make(&key, layers, n);
+
+    if ((ent = plan_cache_find(dout, &key)) != NULL) {
+        if (plan_cache_planes_ok(dout, &ent->layout, n) &&
+            (plan_layout_placed(&ent->layout, n) == 0 ||
+             plan_layout_test(dout, da_base, layers, n, &ent->layout) == 0)) {
+            dout->layout = ent->layout;
+            dout->layer_n = n;
+            goto done;
+        }
+        drmu_debug(dout->du, "%s: Cached layout no longer commits", __func__);
+        plan_cache_remove(dout, ent);
+    }
+
+    if ((ps = malloc(sizeof(*ps))) == NULL)
+        return -ENOMEM;
+
+    plan_planes_claim(dout);
+    plan_search_init(ps, dout, da_base, layers, n);
+    plan_search(ps, 0, -1, 0);
+    drmu_debug(dout->du, "%s: %u/%u layers on planes after %u tests", __func__,
+               ps->best_placed, n, ps->tests);
+
+    dout->layout = ps->best;
+    dout->layer_n = n;
+    plan_cache_add(dout, &key, &ps->best);
+    free(ps);
+
+done:
+    plan_planes_release_unused(dout);
+
+    if (fallback_mask != NULL)
+        *fallback_mask = plan_fallback_mask(&dout->layout, n);
+    return (int)plan_layout_placed(&dout->layout, n);
+}
+
+drmu_plane_t *
+drmu_output_layer_plane(const drmu_output_t * const dout, const unsigned int n)
+{
+    return n >= dout->layer_n ? NULL : dout->layout.planes[n];
+}
+
+int
+drmu_atomic_output_add_layers(drmu_atomic_t * const da, drmu_output_t * const dout,
+                              const drmu_output_layer_t * const layers, const unsigned int n)
+{
+    unsigned int i;
+    int rv;
+
+    if (n != dout->layer_n)
+        return -EINVAL;
+
+    if ((rv = plan_layout_add(da, dout, layers, n, &dout->layout)) != 0)
+        return rv;
+
+    for (i = 0; i != dout->plan_planes_n; ++i)
+        dout->plan_shown[i] = plan_layout_has(&dout->layout, n, dout->plan_planes[i]);
+    return 0;
+}
 
 int
 drmu_atomic_output_add_props(drmu_atomic_t * const da, drmu_output_t * const dout)
@@ -590,6 +1054,8 @@ static void
 output_free(drmu_output_t * const dout)
 {
     unsigned int i;
+    for (i = 0; i != dout->plan_planes_n; ++i)
+        drmu_plane_unref(dout->plan_planes + i);
     for (i = 0; i != dout->conn_n; ++i)
         drmu_conn_unref(dout->dns + i);
     free(dout->dns);
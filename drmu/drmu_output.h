@@ -18,6 +18,44 @@ drmu_plane_t * drmu_output_plane_ref_other(drmu_output_t * const dout);
 // add_output must be called before this (so we have a crtc to check against)
 drmu_plane_t * drmu_output_plane_ref_format(drmu_output_t * const dout, const unsigned int types, const uint32_t format, const uint64_t mod);
 
+// Composition planner
+//
+// Given a set of layers finds planes for as many of them as the hardware
+// will take at once, checking candidate assignments (format, scaling,
+// zpos, alpha & whatever bandwidth limits the driver has) with TEST_ONLY
+// commits. Layers that get no plane must be composed by the caller (CPU or
+// GPU) into something that does have one.
+//
+// The planner claims the planes it uses and holds them until the output is
+// freed, so don't mix it with drmu_output_plane_ref_xxx on the same output.
+// Results are cached by layer signature (format, modifier, crop size, dest
+// rect, zpos & alpha - not the fb itself) so replanning an unchanged scene
+// costs a single TEST_ONLY commit.
+
+#define DRMU_OUTPUT_LAYERS_MAX 8
+
+typedef struct drmu_output_layer_s {
+    drmu_fb_t * fb;
+    drmu_rect_t pos;        // Dest rect on the crtc in pixels
+    int zpos;               // Higher is nearer the viewer. Equal zpos keeps layer order
+    int alpha;              // DRMU_PLANE_ALPHA_xxx
+} drmu_output_layer_t;
+
+// Plan n (<= DRMU_OUTPUT_LAYERS_MAX) layers
+// da_base (may be NULL) is merged under every test commit - use it for
+// anything else that will be in the real commit (e.g. mode or output props)
+// Sets *fallback_mask (if not NULL) to a bit per layer that got no plane
+// Returns the number of layers given planes, -ve error
+int drmu_output_layers_plan(drmu_output_t * const dout, drmu_atomic_t * const da_base,
+                            const drmu_output_layer_t * const layers, const unsigned int n,
+                            uint32_t * const fallback_mask);
+// Plane planned for layer n, NULL if none
+drmu_plane_t * drmu_output_layer_plane(const drmu_output_t * const dout, const unsigned int n);
+// Add the last plan to an atomic. layers must match the planned ones in all
+// but fb. Planes held by the planner but not in the plan are cleared.
+int drmu_atomic_output_add_layers(drmu_atomic_t * const da, drmu_output_t * const dout,
+                                  const drmu_output_layer_t * const layers, const unsigned int n);
+
 // Add all props accumulated on the output to the atomic
 int drmu_atomic_output_add_props(drmu_atomic_t * const da, drmu_output_t * const dout);
 
@@ -1,6 +1,7 @@
 #include "drmu_pool.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
@@ -10,102 +11,530 @@
 #include "drmu.h"
 #include "drmu_log.h"
 
+#include "pollqueue.h"
+
 //----------------------------------------------------------------------------
 //
 // Pool fns
 
+// Free FBs are hashed by the (w, h, format, mod) they were last allocated
+// for so a repeat request (the usual case for video) finds a reusable FB
+// without scanning the whole free list. Must be a power of 2.
+#define POOL_BUCKETS 64
+
+struct drmu_pool_s;
+
+// One slot per FB the pool has allocated, whether free or in use
 typedef struct drmu_fb_slot_s {
     struct drmu_fb_s * fb;
-    struct drmu_fb_slot_s * next;
+    struct drmu_pool_s * pool;
+    struct drmu_fb_slot_s * next;   // LRU list (or unused list)
     struct drmu_fb_slot_s * prev;
+    struct drmu_fb_slot_s * b_next; // Bucket list
+    struct drmu_fb_slot_s * b_prev;
+    struct drmu_fb_slot_s * r_next; // Returned stack
+    unsigned int bucket;
+    size_t size;                    // Bytes charged for fb
 } drmu_fb_slot_t;
 
+typedef struct drmu_fb_bucket_s {
+    drmu_fb_slot_t * head;
+    drmu_fb_slot_t * tail;
+    unsigned int n;             // Free FBs in this bucket
+} drmu_fb_bucket_t;
+
 typedef struct drmu_fb_list_s {
     drmu_fb_slot_t * head;      // Double linked list of free FBs; LRU @ head
     drmu_fb_slot_t * tail;
-    drmu_fb_slot_t * unused;    // Single linked list of unused slots
+    drmu_fb_slot_t * unused;    // Single linked list of slots with no FB
+    unsigned int n;             // Free FBs
+    size_t bytes;               // ... and their size
+    drmu_fb_bucket_t buckets[POOL_BUCKETS];
 } drmu_fb_list_t;
 
+// Size & format that the pool keeps warm
+typedef struct pool_warm_s {
+    unsigned int n;             // Free FBs wanted, 0 => not warming
+    uint32_t w;
+    uint32_t h;
+    uint32_t format;
+    uint64_t mod;
+    unsigned int bucket;
+} pool_warm_t;
+
+// Budget shared by all the pools on an env
+struct drmu_pool_budget_s {
+    atomic_int ref_count;       // 0 == 1 ref for ease of init
+    pthread_mutex_t lock;       // Protects pools & serialises shrinking
+    struct drmu_pool_s * pools; // Pools charging this budget
+    _Atomic(size_t) bytes;
+    _Atomic(size_t) bytes_peak;
+    _Atomic(size_t) bytes_max;  // 0 => unlimited
+};
+
 struct drmu_pool_s {
     atomic_int ref_count;       // 0 == 1 ref for ease of init
     bool dead;                  // Pool killed - never alloc again
 
-    unsigned int fb_count;      // FBs allocated (not free count)
     unsigned int fb_max;        // Max FBs to allocate
 
-    struct drmu_env_s * du;     // Logging only - not reffed
+    struct drmu_env_s * du;     // Logging & bg worker only - not reffed
 
     drmu_pool_callback_fns_t callback_fns;
     void * callback_v;
 
     pthread_mutex_t lock;
 
+    // FBs released since the pool was last locked. Pushed lock-free by
+    // pre-delete so that releases never contend with allocation, moved
+    // to free_fbs by pool_lock.
+    _Atomic(drmu_fb_slot_t *) returned;
+
     drmu_fb_list_t free_fbs;    // Free FB list header
     drmu_fb_slot_t * slots;     // [fb_max]
+
+    // Background refill on the env's bg worker - set on first
+    // drmu_pool_warm_set
+    pool_warm_t warm;
+    struct pollqueue * pq;
+    struct polltask * refill_task;
+
+    // Byte accounting - protected by lock
+    unsigned int fb_count;
+    size_t bytes;
+    size_t bytes_peak;
+    size_t bytes_max;           // 0 => unlimited
+    size_t bucket_size[POOL_BUCKETS];  // Size of last alloc for each bucket
+
+    // Env budget - list links protected by budget->lock
+    struct drmu_pool_budget_s * budget;
+    struct drmu_pool_s * budget_next;
+    struct drmu_pool_s * budget_prev;
 };
 
+static unsigned int
+pool_bucket(const uint32_t w, const uint32_t h, const uint32_t format, const uint64_t mod)
+{
+    uint64_t x = ((uint64_t)w << 32 | h) ^ ((uint64_t)format << 16) ^ mod;
+    x *= 0x9E3779B97F4A7C15ULL;
+    return (unsigned int)(x >> 58) & (POOL_BUCKETS - 1);
+}
+
 static void
-fb_list_add_tail(drmu_fb_list_t * const fbl, drmu_fb_t * const dfb)
+fb_list_add_tail(drmu_fb_list_t * const fbl, drmu_fb_slot_t * const slot)
 {
-    drmu_fb_slot_t * const slot = fbl->unused;
+    drmu_fb_bucket_t * const b = fbl->buckets + slot->bucket;
 
-    assert(slot != NULL);
-    fbl->unused = slot->next;
-    slot->fb = dfb;
     slot->next = NULL;
-
     if (fbl->tail == NULL)
         fbl->head = slot;
     else
         fbl->tail->next = slot;
     slot->prev = fbl->tail;
     fbl->tail = slot;
+
+    slot->b_next = NULL;
+    if (b->tail == NULL)
+        b->head = slot;
+    else
+        b->tail->b_next = slot;
+    slot->b_prev = b->tail;
+    b->tail = slot;
+    ++b->n;
+
+    ++fbl->n;
+    fbl->bytes += slot->size;
 }
 
-static drmu_fb_t *
-fb_list_extract(drmu_fb_list_t * const fbl, drmu_fb_slot_t * const slot)
+// Remove a free slot from the free lists - slot & its FB remain allocated
+static void
+fb_list_take(drmu_fb_list_t * const fbl, drmu_fb_slot_t * const slot)
 {
-    drmu_fb_t * dfb;
-
-    if (slot == NULL)
-        return NULL;
+    drmu_fb_bucket_t * const b = fbl->buckets + slot->bucket;
 
     if (slot->prev == NULL)
         fbl->head = slot->next;
     else
         slot->prev->next = slot->next;
-
     if (slot->next == NULL)
         fbl->tail = slot->prev;
     else
         slot->next->prev = slot->prev;
 
-    dfb = slot->fb;
+    if (slot->b_prev == NULL)
+        b->head = slot->b_next;
+    else
+        slot->b_prev->b_next = slot->b_next;
+    if (slot->b_next == NULL)
+        b->tail = slot->b_prev;
+    else
+        slot->b_next->b_prev = slot->b_prev;
+    --b->n;
+
+    --fbl->n;
+    fbl->bytes -= slot->size;
+
+    slot->next = NULL;
+    slot->prev = NULL;
+    slot->b_next = NULL;
+    slot->b_prev = NULL;
+}
+
+static drmu_fb_slot_t *
+fb_slot_get_unused(drmu_fb_list_t * const fbl)
+{
+    drmu_fb_slot_t * const slot = fbl->unused;
+    if (slot != NULL) {
+        fbl->unused = slot->next;
+        slot->next = NULL;
+    }
+    return slot;
+}
+
+static void
+fb_slot_put_unused(drmu_fb_list_t * const fbl, drmu_fb_slot_t * const slot)
+{
     slot->fb = NULL;
     slot->next = fbl->unused;
-    slot->prev = NULL;
     fbl->unused = slot;
+}
+
+// Remove slot from free lists & return its FB to the caller for unref
+static drmu_fb_t *
+fb_list_extract(drmu_fb_list_t * const fbl, drmu_fb_slot_t * const slot)
+{
+    drmu_fb_t * dfb;
+
+    if (slot == NULL)
+        return NULL;
+
+    fb_list_take(fbl, slot);
+    dfb = slot->fb;
+    fb_slot_put_unused(fbl, slot);
     return dfb;
 }
 
+static void
+pool_returned_push(drmu_pool_t * const pool, drmu_fb_slot_t * const slot)
+{
+    slot->r_next = atomic_load(&pool->returned);
+    while (!atomic_compare_exchange_weak(&pool->returned, &slot->r_next, slot))
+        /* loop */;
+}
+
+// Needs locked
+static void
+pool_returned_drain(drmu_pool_t * const pool)
+{
+    drmu_fb_slot_t * slot;
+    drmu_fb_slot_t * prev = NULL;
+
+    if (atomic_load_explicit(&pool->returned, memory_order_relaxed) == NULL)
+        return;
+    slot = atomic_exchange(&pool->returned, NULL);
+
+    // Stack is newest first - reverse so LRU order is kept
+    while (slot != NULL) {
+        drmu_fb_slot_t * const next = slot->r_next;
+        slot->r_next = prev;
+        prev = slot;
+        slot = next;
+    }
+    while ((slot = prev) != NULL) {
+        prev = slot->r_next;
+        slot->r_next = NULL;
+        fb_list_add_tail(&pool->free_fbs, slot);
+    }
+}
+
+static void
+pool_lock(drmu_pool_t * const pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool_returned_drain(pool);
+}
+
+//----------------------------------------------------------------------------
+//
+// Budget fns
+
+static struct drmu_pool_budget_s *
+budget_ref(struct drmu_pool_budget_s * const b)
+{
+    if (b != NULL)
+        atomic_fetch_add(&b->ref_count, 1);
+    return b;
+}
+
+void
+drmu_pool_budget_unref(struct drmu_pool_budget_s ** const ppbudget)
+{
+    struct drmu_pool_budget_s * const b = *ppbudget;
+    int n;
+
+    if (b == NULL)
+        return;
+    *ppbudget = NULL;
+
+    n = atomic_fetch_sub(&b->ref_count, 1);
+    assert(n >= 0);
+    if (n == 0) {
+        pthread_mutex_destroy(&b->lock);
+        free(b);
+    }
+}
+
+struct drmu_pool_budget_s *
+drmu_pool_budget_new(void)
+{
+    struct drmu_pool_budget_s * const b = calloc(1, sizeof(*b));
+
+    if (b == NULL)
+        return NULL;
+    pthread_mutex_init(&b->lock, NULL);
+    return b;
+}
+
+static bool
+budget_over(const struct drmu_pool_budget_s * const b, const size_t add)
+{
+    const size_t max = atomic_load(&b->bytes_max);
+    return max != 0 && atomic_load(&b->bytes) + add > max;
+}
+
+static void
+budget_add(struct drmu_pool_budget_s * const b, const size_t size)
+{
+    const size_t n = atomic_fetch_add(&b->bytes, size) + size;
+    size_t peak = atomic_load(&b->bytes_peak);
+
+    while (n > peak && !atomic_compare_exchange_weak(&b->bytes_peak, &peak, n))
+        /* loop */;
+}
+
+static void
+budget_pool_add(struct drmu_pool_budget_s * const b, struct drmu_pool_s * const pool)
+{
+    pthread_mutex_lock(&b->lock);
+    pool->budget_prev = NULL;
+    pool->budget_next = b->pools;
+    if (b->pools != NULL)
+        b->pools->budget_prev = pool;
+    b->pools = pool;
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void
+budget_pool_remove(struct drmu_pool_budget_s * const b, struct drmu_pool_s * const pool)
+{
+    pthread_mutex_lock(&b->lock);
+    if (pool->budget_prev == NULL)
+        b->pools = pool->budget_next;
+    else
+        pool->budget_prev->budget_next = pool->budget_next;
+    if (pool->budget_next != NULL)
+        pool->budget_next->budget_prev = pool->budget_prev;
+    pthread_mutex_unlock(&b->lock);
+}
+
+// Needs locked
+static void
+pool_bytes_add(drmu_pool_t * const pool, const size_t size)
+{
+    ++pool->fb_count;
+    pool->bytes += size;
+    if (pool->bytes > pool->bytes_peak)
+        pool->bytes_peak = pool->bytes;
+    if (pool->budget != NULL)
+        budget_add(pool->budget, size);
+}
+
+// Needs locked
+static void
+pool_bytes_sub(drmu_pool_t * const pool, const size_t size)
+{
+    --pool->fb_count;
+    pool->bytes -= size;
+    if (pool->budget != NULL)
+        atomic_fetch_sub(&pool->budget->bytes, size);
+}
+
+// Needs locked
+// True if another add bytes would take the pool or its env over budget
+static bool
+pool_over_budget(const drmu_pool_t * const pool, const size_t add)
+{
+    return (pool->bytes_max != 0 && pool->bytes + add > pool->bytes_max) ||
+        (pool->budget != NULL && budget_over(pool->budget, add));
+}
+
+// Needs locked
+// Remove the LRU free FB from the pool & return it to the caller for unref
 static drmu_fb_t *
-fb_list_extract_head(drmu_fb_list_t * const fbl)
+pool_extract_head(drmu_pool_t * const pool)
 {
-    return fb_list_extract(fbl, fbl->head);
+    drmu_fb_slot_t * const slot = pool->free_fbs.head;
+
+    if (slot == NULL)
+        return NULL;
+    pool_bytes_sub(pool, slot->size);
+    return fb_list_extract(&pool->free_fbs, slot);
 }
 
 static void
 pool_free_pool(drmu_pool_t * const pool)
 {
-    drmu_fb_t * dfb;
-    pthread_mutex_lock(&pool->lock);
-    while ((dfb = fb_list_extract_head(&pool->free_fbs)) != NULL) {
-        --pool->fb_count;
+    drmu_pool_shrink(pool, 0);
+}
+
+// Needs budget lock
+// Release enough of pool's free FBs to fit another add bytes in the budget
+// (or all of them if that isn't enough)
+static void
+budget_pool_shrink(struct drmu_pool_budget_s * const b, drmu_pool_t * const pool, const size_t add)
+{
+    size_t excess;
+    size_t free_bytes;
+
+    if (!budget_over(b, add))
+        return;
+    excess = atomic_load(&b->bytes) + add - atomic_load(&b->bytes_max);
+
+    pool_lock(pool);
+    free_bytes = pool->free_fbs.bytes;
+    pthread_mutex_unlock(&pool->lock);
+
+    drmu_pool_shrink(pool, free_bytes > excess ? free_bytes - excess : 0);
+}
+
+// Release free FBs (from this pool and then from the others on the env)
+// until another add bytes fit in both budgets
+static void
+pool_make_room(drmu_pool_t * const pool, const size_t add)
+{
+    struct drmu_pool_budget_s * const b = pool->budget;
+    size_t keep = SIZE_MAX;
+
+    pool_lock(pool);
+    if (pool->bytes_max != 0 && pool->bytes + add > pool->bytes_max) {
+        const size_t excess = pool->bytes + add - pool->bytes_max;
+        keep = pool->free_fbs.bytes > excess ? pool->free_fbs.bytes - excess : 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (keep != SIZE_MAX)
+        drmu_pool_shrink(pool, keep);
+
+    if (b == NULL || !budget_over(b, add))
+        return;
+
+    pthread_mutex_lock(&b->lock);
+    budget_pool_shrink(b, pool, add);
+    for (drmu_pool_t * p = b->pools; p != NULL; p = p->budget_next) {
+        if (p != pool)
+            budget_pool_shrink(b, p, add);
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+size_t
+drmu_pool_shrink(drmu_pool_t * const pool, const size_t keep_bytes)
+{
+    size_t done = 0;
+
+    pool_lock(pool);
+    while (pool->free_fbs.bytes > keep_bytes || (keep_bytes == 0 && pool->free_fbs.n != 0)) {
+        drmu_fb_t * dfb;
+
+        done += pool->free_fbs.head->size;
+        dfb = pool_extract_head(pool);
         pthread_mutex_unlock(&pool->lock);
-        drmu_fb_unref(&dfb);
-        pthread_mutex_lock(&pool->lock);
+        drmu_fb_unref(&dfb);  // Will free the dfb as pre-delete CB is unset
+        pool_lock(pool);
     }
     pthread_mutex_unlock(&pool->lock);
+    return done;
+}
+
+void
+drmu_pool_budget_set(drmu_pool_t * const pool, const size_t bytes_max)
+{
+    pool_lock(pool);
+    pool->bytes_max = bytes_max;
+    pthread_mutex_unlock(&pool->lock);
+    pool_make_room(pool, 0);
+}
+
+void
+drmu_pool_stats_get(drmu_pool_t * const pool, drmu_pool_stats_t * const stats)
+{
+    pool_lock(pool);
+    *stats = (drmu_pool_stats_t){
+        .bytes = pool->bytes,
+        .bytes_peak = pool->bytes_peak,
+        .bytes_max = pool->bytes_max,
+        .free_bytes = pool->free_fbs.bytes,
+        .fbs = pool->fb_count,
+        .free_fbs = pool->free_fbs.n,
+    };
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void
+drmu_env_pool_budget_set(drmu_env_t * const du, const size_t bytes_max)
+{
+    struct drmu_pool_budget_s * const b = drmu_env_pool_budget(du);
+    drmu_pool_t * pool;
+
+    if (b == NULL)
+        return;
+    atomic_store(&b->bytes_max, bytes_max);
+
+    pthread_mutex_lock(&b->lock);
+    for (pool = b->pools; pool != NULL; pool = pool->budget_next)
+        budget_pool_shrink(b, pool, 0);
+    pthread_mutex_unlock(&b->lock);
+}
+
+void
+drmu_env_pool_stats_get(drmu_env_t * const du, drmu_pool_stats_t * const stats)
+{
+    struct drmu_pool_budget_s * const b = drmu_env_pool_budget(du);
+    drmu_pool_t * pool;
+
+    *stats = (drmu_pool_stats_t){0};
+    if (b == NULL)
+        return;
+
+    pthread_mutex_lock(&b->lock);
+    stats->bytes = atomic_load(&b->bytes);
+    stats->bytes_peak = atomic_load(&b->bytes_peak);
+    stats->bytes_max = atomic_load(&b->bytes_max);
+    for (pool = b->pools; pool != NULL; pool = pool->budget_next) {
+        pool_lock(pool);
+        stats->free_bytes += pool->free_fbs.bytes;
+        stats->fbs += pool->fb_count;
+        stats->free_fbs += pool->free_fbs.n;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+size_t
+drmu_env_pool_pressure(drmu_env_t * const du)
+{
+    struct drmu_pool_budget_s * const b = drmu_env_pool_budget(du);
+    drmu_pool_t * pool;
+    size_t done = 0;
+
+    if (b == NULL)
+        return 0;
+
+    pthread_mutex_lock(&b->lock);
+    for (pool = b->pools; pool != NULL; pool = pool->budget_next)
+        done += drmu_pool_shrink(pool, 0);
+    pthread_mutex_unlock(&b->lock);
+    return done;
 }
 
 static void
@@ -113,7 +542,17 @@ pool_free(drmu_pool_t * const pool)
 {
     void *const v = pool->callback_v;
     const drmu_pool_on_delete_fn on_delete_fn = pool->callback_fns.on_delete_fn;
+
+    // Stop refill before freeing what it might add to
+    polltask_delete(&pool->refill_task);
+    pollqueue_unref(&pool->pq);
+
+    // Stop others shrinking us before we go
+    if (pool->budget != NULL)
+        budget_pool_remove(pool->budget, pool);
+
     pool_free_pool(pool);
+    drmu_pool_budget_unref(&pool->budget);
     free(pool->slots);
     pthread_mutex_destroy(&pool->lock);
     free(pool);
@@ -162,12 +601,18 @@ drmu_pool_new_alloc(drmu_env_t * const du, const unsigned int total_fbs_max,
     pool->callback_fns = *cb_fns;
     pool->callback_v = v;
 
-    for (i = 1; i != total_fbs_max; ++i)
-        pool->slots[i - 1].next = pool->slots + i;
-    pool->free_fbs.unused = pool->slots + 0;
+    for (i = 0; i != total_fbs_max; ++i) {
+        pool->slots[i].pool = pool;
+        if (i != 0)
+            pool->slots[i - 1].next = pool->slots + i;
+    }
+    pool->free_fbs.unused = total_fbs_max == 0 ? NULL : pool->slots + 0;
 
     pthread_mutex_init(&pool->lock, NULL);
 
+    if ((pool->budget = budget_ref(drmu_env_pool_budget(du))) != NULL)
+        budget_pool_add(pool->budget, pool);
+
     return pool;
 
 fail1:
@@ -181,7 +626,8 @@ fail0:
 static int
 pool_fb_pre_delete_cb(drmu_fb_t * dfb, void * v)
 {
-    drmu_pool_t * pool = v;
+    drmu_fb_slot_t * const slot = v;
+    drmu_pool_t * pool = slot->pool;
 
     // Ensure we cannot end up in a delete loop
     drmu_fb_pre_delete_unset(dfb);
@@ -190,15 +636,17 @@ pool_fb_pre_delete_cb(drmu_fb_t * dfb, void * v)
     // It should all work without this shortcut but this reclaims
     // storage quicker
     if (pool->dead) {
+        pool_lock(pool);
+        pool_bytes_sub(pool, slot->size);
+        fb_slot_put_unused(&pool->free_fbs, slot);
+        pthread_mutex_unlock(&pool->lock);
         drmu_pool_unref(&pool);
         return 0;
     }
 
     drmu_fb_ref(dfb);  // Restore ref
 
-    pthread_mutex_lock(&pool->lock);
-    fb_list_add_tail(&pool->free_fbs, dfb);
-    pthread_mutex_unlock(&pool->lock);
+    pool_returned_push(pool, slot);
 
     // May cause suicide & recursion on fb delete, but that should be OK as
     // the 1 we return here should cause simple exit of fb delete
@@ -206,50 +654,187 @@ pool_fb_pre_delete_cb(drmu_fb_t * dfb, void * v)
     return 1;  // Stop delete
 }
 
+// Needs locked
+// True if the warm bucket wants another FB and there is room for it
+// Refill never releases FBs to make room
+static bool
+pool_refill_wanted(const drmu_pool_t * const pool)
+{
+    return pool->warm.n != 0 && !pool->dead &&
+        pool->free_fbs.buckets[pool->warm.bucket].n < pool->warm.n &&
+        pool->free_fbs.unused != NULL &&
+        !pool_over_budget(pool, pool->bucket_size[pool->warm.bucket]);
+}
+
+// Needs locked
+// Kick the refill if the warm bucket has been drawn down
+static void
+pool_refill_check(drmu_pool_t * const pool)
+{
+    if (pool_refill_wanted(pool))
+        pollqueue_add_task(pool->refill_task, 0);
+}
+
+static void
+pool_refill_cb(void * v, short revents)
+{
+    drmu_pool_t * const pool = v;
+    (void)revents;
+
+    pool_lock(pool);
+    while (pool_refill_wanted(pool)) {
+        const pool_warm_t warm = pool->warm;
+        drmu_fb_slot_t * const slot = fb_slot_get_unused(&pool->free_fbs);
+        drmu_fb_t * dfb;
+        size_t size;
+
+        pthread_mutex_unlock(&pool->lock);
+
+        dfb = pool->callback_fns.alloc_fn(pool->callback_v, warm.w, warm.h, warm.format, warm.mod);
+        size = dfb == NULL ? 0 : drmu_fb_size(dfb);
+
+        pool_lock(pool);
+        if (dfb == NULL || pool->dead || pool_over_budget(pool, size)) {
+            fb_slot_put_unused(&pool->free_fbs, slot);
+            if (dfb == NULL) {
+                drmu_warn(pool->du, "%s: Failed to alloc %ux%u fb", __func__, warm.w, warm.h);
+                break;
+            }
+            pthread_mutex_unlock(&pool->lock);
+            drmu_fb_unref(&dfb);
+            pool_lock(pool);
+            break;
+        }
+        slot->fb = dfb;
+        slot->bucket = warm.bucket;
+        slot->size = size;
+        pool->bucket_size[warm.bucket] = size;
+        pool_bytes_add(pool, size);
+        fb_list_add_tail(&pool->free_fbs, slot);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int
+drmu_pool_warm_set(drmu_pool_t * const pool, const unsigned int n,
+                   const uint32_t w, const uint32_t h, const uint32_t format, const uint64_t mod)
+{
+    int rv = 0;
+
+    pool_lock(pool);
+    if (pool->dead) {
+        rv = -EINVAL;
+        goto unlock;
+    }
+
+    if (n != 0 && pool->refill_task == NULL) {
+        if ((pool->pq = drmu_env_bg_pollqueue_ref(pool->du)) == NULL ||
+            (pool->refill_task = polltask_new_timer(pool->pq, pool_refill_cb, pool)) == NULL) {
+            pollqueue_unref(&pool->pq);
+            rv = -ENOMEM;
+            goto unlock;
+        }
+    }
+
+    pool->warm = (pool_warm_t){
+        .n = n,
+        .w = w,
+        .h = h,
+        .format = format,
+        .mod = mod,
+        .bucket = pool_bucket(w, h, format, mod)
+    };
+    pool_refill_check(pool);
+
+unlock:
+    pthread_mutex_unlock(&pool->lock);
+    return rv;
+}
+
 drmu_fb_t *
 drmu_pool_fb_new(drmu_pool_t * const pool, uint32_t w, uint32_t h, const uint32_t format, const uint64_t mod)
 {
+    const unsigned int bucket = pool_bucket(w, h, format, mod);
     drmu_fb_t * dfb;
     drmu_fb_slot_t * slot;
+    size_t size;
 
-    pthread_mutex_lock(&pool->lock);
+    pool_lock(pool);
 
     // If pool killed then _fb_new must fail
     if (pool->dead)
         goto fail_unlock;
 
-    slot = pool->free_fbs.head;
-    while (slot != NULL) {
-        dfb = slot->fb;
-        if (pool->callback_fns.try_reuse_fn(dfb, w, h, format, mod)) {
-            fb_list_extract(&pool->free_fbs, slot);
-            pthread_mutex_unlock(&pool->lock);
+    // Try FBs last used for this size first then anything
+    for (slot = pool->free_fbs.buckets[bucket].head; slot != NULL; slot = slot->b_next) {
+        if (pool->callback_fns.try_reuse_fn(slot->fb, w, h, format, mod))
+            goto found;
+    }
+    for (slot = pool->free_fbs.head; slot != NULL; slot = slot->next) {
+        if (slot->bucket != bucket && pool->callback_fns.try_reuse_fn(slot->fb, w, h, format, mod))
             goto found;
-        }
-        slot = slot->next;
     }
+
     // Nothing reusable
-    dfb = NULL;
+    // Make room in the budget for what this bucket last needed
+    size = pool->bucket_size[bucket];
+    if (pool_over_budget(pool, size)) {
+        pthread_mutex_unlock(&pool->lock);
+        pool_make_room(pool, size);
+        pool_lock(pool);
+    }
 
     // Simply allocate new buffers until we hit fb_max then free LRU
     // first. If nothing to free then fail.
-    if (pool->fb_count++ >= pool->fb_max) {
-        --pool->fb_count;
-        if ((dfb = fb_list_extract_head(&pool->free_fbs)) == NULL)
-            goto fail_unlock;
-    }
+    dfb = NULL;
+    if (pool->free_fbs.unused == NULL &&
+        (dfb = pool_extract_head(pool)) == NULL)
+        goto fail_unlock;
+    slot = fb_slot_get_unused(&pool->free_fbs);
     pthread_mutex_unlock(&pool->lock);
 
     drmu_fb_unref(&dfb);  // Will free the dfb as pre-delete CB will be unset
 
     if ((dfb = pool->callback_fns.alloc_fn(pool->callback_v, w, h, format, mod)) == NULL) {
-        pthread_mutex_lock(&pool->lock);
-        --pool->fb_count;
+        pool_lock(pool);
+        fb_slot_put_unused(&pool->free_fbs, slot);
         goto fail_unlock;
     }
+    size = drmu_fb_size(dfb);
+
+    // Our guess at size may have been wrong - if so try again now we know
+    pool_lock(pool);
+    if (pool_over_budget(pool, size)) {
+        pthread_mutex_unlock(&pool->lock);
+        pool_make_room(pool, size);
+        pool_lock(pool);
+        if (pool_over_budget(pool, size)) {
+            fb_slot_put_unused(&pool->free_fbs, slot);
+            pthread_mutex_unlock(&pool->lock);
+            drmu_warn(pool->du, "%s: %ux%u fb of %zu bytes over budget", __func__, w, h, size);
+            drmu_fb_unref(&dfb);
+            return NULL;
+        }
+    }
+    slot->fb = dfb;
+    slot->bucket = bucket;
+    slot->size = size;
+    pool->bucket_size[bucket] = size;
+    pool_bytes_add(pool, size);
+    pool_refill_check(pool);
+    pthread_mutex_unlock(&pool->lock);
+    goto done;
 
 found:
-    drmu_fb_pre_delete_set(dfb, pool_fb_pre_delete_cb, drmu_pool_ref(pool));
+    fb_list_take(&pool->free_fbs, slot);
+    slot->bucket = bucket;
+    dfb = slot->fb;
+    pool_refill_check(pool);
+    pthread_mutex_unlock(&pool->lock);
+
+done:
+    drmu_fb_pre_delete_set(dfb, pool_fb_pre_delete_cb, slot);
+    drmu_pool_ref(pool);
     return dfb;
 
 fail_unlock:
@@ -303,4 +888,42 @@ drmu_pool_new_dumb(drmu_env_t * const du, unsigned int total_fbs_max)
     return drmu_pool_new_alloc(du, total_fbs_max, &fns, drmu_env_ref(du));
 }
 
+typedef struct pool_dumb_layout_s {
+    drmu_env_t * du;
+    drmu_fb_layout_t layout;
+} pool_dumb_layout_t;
 
+static drmu_fb_t *
+pool_dumb_layout_alloc_cb(void * const v, const uint32_t w, const uint32_t h, const uint32_t format, const uint64_t mod)
+{
+    pool_dumb_layout_t * const pdl = v;
+    return drmu_fb_new_dumb_layout(pdl->du, w, h, format, mod, &pdl->layout);
+}
+
+static void
+pool_dumb_layout_on_delete_cb(void * const v)
+{
+    pool_dumb_layout_t * const pdl = v;
+    drmu_env_unref(&pdl->du);
+    free(pdl);
+}
+
+drmu_pool_t *
+drmu_pool_new_dumb_layout(drmu_env_t * const du, unsigned int total_fbs_max,
+                          const drmu_fb_layout_t * const layout)
+{
+    static const drmu_pool_callback_fns_t fns = {
+        .alloc_fn = pool_dumb_layout_alloc_cb,
+        .on_delete_fn = pool_dumb_layout_on_delete_cb,
+        .try_reuse_fn = drmu_fb_try_reuse,
+    };
+    pool_dumb_layout_t * pdl;
+
+    if (layout == NULL)
+        return drmu_pool_new_dumb(du, total_fbs_max);
+    if ((pdl = calloc(1, sizeof(*pdl))) == NULL)
+        return NULL;
+    pdl->du = drmu_env_ref(du);
+    pdl->layout = *layout;
+    return drmu_pool_new_alloc(du, total_fbs_max, &fns, pdl);
+}
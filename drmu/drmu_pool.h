@@ -2,6 +2,7 @@
 #define _DRMU_DRMU_POOL_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -33,7 +34,7 @@ typedef struct drmu_pool_callback_fns_s {
 
 // Create a new pool with custom alloc & pool delete
 // If pool creation fails then on_delete_fn(v) called and NULL returned
-// Pool entries are not pre-allocated.
+// Pool entries are not pre-allocated (see drmu_pool_warm_set).
 drmu_pool_t * drmu_pool_new_alloc(struct drmu_env_s * const du, const unsigned int total_fbs_max,
                                   const drmu_pool_callback_fns_t * const cb_fns,
                                   void * const v);
@@ -41,12 +42,62 @@ drmu_pool_t * drmu_pool_new_alloc(struct drmu_env_s * const du, const unsigned i
 // N.B. BOs are alloced from uncached memory so may be slow to do anything other
 // than copy into. (See drmu_dmabuf_ if you want cached data)
 struct drmu_fb_s * drmu_pool_fb_new(drmu_pool_t * const pool, uint32_t w, uint32_t h, const uint32_t format, const uint64_t mod);
+// Keep n free fbs of (w, h, format, mod) in the pool so that
+// drmu_pool_fb_new for that size finds one without waiting for allocation.
+// FBs are allocated on the env's background worker, initially and
+// whenever _fb_new takes the free count below n. Total FBs are still limited
+// by total_fbs_max. n = 0 stops warming. Setting replaces any previous size.
+int drmu_pool_warm_set(drmu_pool_t * const pool, const unsigned int n,
+                       const uint32_t w, const uint32_t h, const uint32_t format, const uint64_t mod);
+
+// Memory budget
+//
+// Each pool counts the bytes of the fbs it holds (in use + free) against its
+// own limit and against the budget shared by all pools on its env. Before an
+// alloc that would go over either limit free fbs are released, LRU first,
+// from this pool and then from the other pools on the env. If the new fb is
+// still over budget the alloc fails. Warming never releases fbs to make room.
+// A limit of 0 is unlimited, which is the default.
+
+typedef struct drmu_pool_stats_s {
+    size_t bytes;               // Allocated (in use + free)
+    size_t bytes_peak;
+    size_t bytes_max;           // Limit, 0 => unlimited
+    size_t free_bytes;          // Held free for reuse
+    unsigned int fbs;           // Allocated
+    unsigned int free_fbs;
+} drmu_pool_stats_t;
+
+void drmu_pool_budget_set(drmu_pool_t * const pool, const size_t bytes_max);
+void drmu_pool_stats_get(drmu_pool_t * const pool, drmu_pool_stats_t * const stats);
+// Release free fbs, LRU first, until no more than keep_bytes are held free
+// Returns bytes released
+size_t drmu_pool_shrink(drmu_pool_t * const pool, const size_t keep_bytes);
+
+// Limit the total of all pools on the env
+void drmu_env_pool_budget_set(struct drmu_env_s * const du, const size_t bytes_max);
+// Totals for all pools on the env. bytes_peak is the peak of the total &
+// bytes_max the env budget
+void drmu_env_pool_stats_get(struct drmu_env_s * const du, drmu_pool_stats_t * const stats);
+// Memory pressure - release every free fb in every pool on the env
+// Returns bytes released
+size_t drmu_env_pool_pressure(struct drmu_env_s * const du);
+
+// Internal - the shared budget object held by each env
+struct drmu_pool_budget_s;
+struct drmu_pool_budget_s * drmu_pool_budget_new(void);
+void drmu_pool_budget_unref(struct drmu_pool_budget_s ** const ppbudget);
+
 // Marks the pool as dead & unrefs this reference
 //   No allocs will succeed after this
 //   All free fbs are unrefed
 void drmu_pool_kill(drmu_pool_t ** const pppool);
 
 drmu_pool_t * drmu_pool_new_dumb(struct drmu_env_s * const du, unsigned int total_fbs_max);
+// As above, every fb allocated with layout (which is copied)
+struct drmu_fb_layout_s;
+drmu_pool_t * drmu_pool_new_dumb_layout(struct drmu_env_s * const du, unsigned int total_fbs_max,
+                                        const struct drmu_fb_layout_s * const layout);
 // Allocate a fb from the pool
 // Allocations need not be all of the same size but no guarantees are made about
 // efficient memory use if this is the case
@@ -0,0 +1,345 @@
+#include "drmu_sand.h"
+
+#include "drmu.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include <libdrm/drm_fourcc.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAS_NEON 1
+#else
+#define HAS_NEON 0
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAS_X86 1
+#else
+#define HAS_X86 0
+#endif
+
+#ifndef DRM_FORMAT_P030
+#define DRM_FORMAT_P030 fourcc_code('P', '0', '3', '0')
+#endif
+
+#define SAND_COL_BYTES 128
+#define SAND30_COL_SAMPLES (SAND_COL_BYTES / 4 * 3)
+#define SAND30_PAD 0x200U
+
+// Pack n (<= SAND30_COL_SAMPLES) samples into one line of a column,
+// padding out to the full column width
+typedef void (* sand30_pack_fn)(uint32_t * const d, const uint16_t * const s,
+                                const unsigned int n, const unsigned int shift);
+
+static inline uint32_t
+sand30_sample(const uint16_t * const s, const unsigned int k, const unsigned int n, const unsigned int shift)
+{
+    return k >= n ? SAND30_PAD : (uint32_t)((s[k] >> shift) & 0x3ff);
+}
+
+// Scalar packing from sample k (a multiple of 3) to the end of the column
+static inline void
+sand30_pack_tail(uint32_t * const d, const uint16_t * const s, unsigned int k,
+                 const unsigned int n, const unsigned int shift)
+{
+    for (; k != SAND30_COL_SAMPLES; k += 3) {
+        d[k / 3] =
+            sand30_sample(s, k + 0, n, shift) |
+            (sand30_sample(s, k + 1, n, shift) << 10) |
+            (sand30_sample(s, k + 2, n, shift) << 20);
+    }
+}
+
+static void
+sand30_pack_c(uint32_t * const d, const uint16_t * const s,
+              const unsigned int n, const unsigned int shift)
+{
+    unsigned int k;
+
+    // Whole words without the bounds checks
+    for (k = 0; k + 3 <= n; k += 3) {
+        d[k / 3] =
+            (uint32_t)((s[k + 0] >> shift) & 0x3ff) |
+            ((uint32_t)((s[k + 1] >> shift) & 0x3ff) << 10) |
+            ((uint32_t)((s[k + 2] >> shift) & 0x3ff) << 20);
+    }
+    sand30_pack_tail(d, s, k, n, shift);
+}
+
+#if HAS_NEON
+// vld3 does the 1-in-3 deinterleave for us
+static void
+sand30_pack_neon(uint32_t * const d, const uint16_t * const s,
+                 const unsigned int n, const unsigned int shift)
+{
+    const int16x8_t vshift = vdupq_n_s16((int16_t)-(int)shift);
+    const uint16x8_t mask = vdupq_n_u16(0x3ff);
+    unsigned int k;
+
+    for (k = 0; k + 24 <= n; k += 24) {
+        const uint16x8x3_t v = vld3q_u16(s + k);
+        const uint16x8_t a = vandq_u16(vshlq_u16(v.val[0], vshift), mask);
+        const uint16x8_t b = vandq_u16(vshlq_u16(v.val[1], vshift), mask);
+        const uint16x8_t c = vandq_u16(vshlq_u16(v.val[2], vshift), mask);
+
+        vst1q_u32(d + k / 3,
+                  vorrq_u32(vorrq_u32(vmovl_u16(vget_low_u16(a)),
+                                      vshll_n_u16(vget_low_u16(b), 10)),
+                            vshlq_n_u32(vmovl_u16(vget_low_u16(c)), 20)));
+        vst1q_u32(d + k / 3 + 4,
+                  vorrq_u32(vorrq_u32(vmovl_u16(vget_high_u16(a)),
+                                      vshll_n_u16(vget_high_u16(b), 10)),
+                            vshlq_n_u32(vmovl_u16(vget_high_u16(c)), 20)));
+    }
+    sand30_pack_tail(d, s, k, n, shift);
+}
+#endif
+
+#if HAS_X86
+// 12 samples (24 bytes) make 4 words. Two overlapping loads cover them:
+// A = s[0..7], B = s[4..11]. Shuffle (a, b) pairs into 16-bit slots and c
+// into the bottom of 32-bit slots, then a | b << 10 is a madd by (1, 1024)
+// and c << 20 a shift.
+#define SSE_SHUF_XA 0, 1, 2, 3, 6, 7, 8, 9, -1, -1, -1, -1, -1, -1, -1, -1
+#define SSE_SHUF_XB -1, -1, -1, -1, -1, -1, -1, -1, 4, 5, 6, 7, 10, 11, 12, 13
+#define SSE_SHUF_YA 4, 5, -1, -1, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+#define SSE_SHUF_YB -1, -1, -1, -1, -1, -1, -1, -1, 8, 9, -1, -1, 14, 15, -1, -1
+
+__attribute__((target("ssse3")))
+static void
+sand30_pack_ssse3(uint32_t * const d, const uint16_t * const s,
+                  const unsigned int n, const unsigned int shift)
+{
+    const __m128i xa = _mm_setr_epi8(SSE_SHUF_XA);
+    const __m128i xb = _mm_setr_epi8(SSE_SHUF_XB);
+    const __m128i ya = _mm_setr_epi8(SSE_SHUF_YA);
+    const __m128i yb = _mm_setr_epi8(SSE_SHUF_YB);
+    const __m128i vshift = _mm_cvtsi32_si128((int)shift);
+    const __m128i mask = _mm_set1_epi16(0x3ff);
+    const __m128i mul = _mm_set1_epi32(1 | (1024 << 16));
+    unsigned int k;
+
+    for (k = 0; k + 12 <= n; k += 12) {
+        const __m128i a = _mm_loadu_si128((const __m128i *)(s + k));
+        const __m128i b = _mm_loadu_si128((const __m128i *)(s + k + 4));
+        __m128i x = _mm_or_si128(_mm_shuffle_epi8(a, xa), _mm_shuffle_epi8(b, xb));
+        __m128i y = _mm_or_si128(_mm_shuffle_epi8(a, ya), _mm_shuffle_epi8(b, yb));
+
+        x = _mm_and_si128(_mm_srl_epi16(x, vshift), mask);
+        y = _mm_and_si128(_mm_srl_epi16(y, vshift), mask);
+        _mm_storeu_si128((__m128i *)(d + k / 3),
+                         _mm_or_si128(_mm_madd_epi16(x, mul), _mm_slli_epi32(y, 20)));
+    }
+    sand30_pack_tail(d, s, k, n, shift);
+}
+
+// As SSSE3 with each 128-bit lane doing 12 samples
+__attribute__((target("avx2")))
+static void
+sand30_pack_avx2(uint32_t * const d, const uint16_t * const s,
+                 const unsigned int n, const unsigned int shift)
+{
+    const __m256i xa = _mm256_setr_epi8(SSE_SHUF_XA, SSE_SHUF_XA);
+    const __m256i xb = _mm256_setr_epi8(SSE_SHUF_XB, SSE_SHUF_XB);
+    const __m256i ya = _mm256_setr_epi8(SSE_SHUF_YA, SSE_SHUF_YA);
+    const __m256i yb = _mm256_setr_epi8(SSE_SHUF_YB, SSE_SHUF_YB);
+    const __m128i vshift = _mm_cvtsi32_si128((int)shift);
+    const __m256i mask = _mm256_set1_epi16(0x3ff);
+    const __m256i mul = _mm256_set1_epi32(1 | (1024 << 16));
+    unsigned int k;
+
+    for (k = 0; k + 24 <= n; k += 24) {
+        const __m256i a = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(s + k))),
+            _mm_loadu_si128((const __m128i *)(s + k + 12)), 1);
+        const __m256i b = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(s + k + 4))),
+            _mm_loadu_si128((const __m128i *)(s + k + 16)), 1);
+        __m256i x = _mm256_or_si256(_mm256_shuffle_epi8(a, xa), _mm256_shuffle_epi8(b, xb));
+        __m256i y = _mm256_or_si256(_mm256_shuffle_epi8(a, ya), _mm256_shuffle_epi8(b, yb));
+
+        x = _mm256_and_si256(_mm256_srl_epi16(x, vshift), mask);
+        y = _mm256_and_si256(_mm256_srl_epi16(y, vshift), mask);
+        _mm256_storeu_si256((__m256i *)(d + k / 3),
+                            _mm256_or_si256(_mm256_madd_epi16(x, mul), _mm256_slli_epi32(y, 20)));
+    }
+    sand30_pack_tail(d, s, k, n, shift);
+}
+#endif
+
+//----------------------------------------------------------------------------
+//
+// Dispatch
+
+static sand30_pack_fn
+impl_fn(const drmu_sand_impl_t impl)
+{
+    switch (impl) {
+        case DRMU_SAND_IMPL_C:
+            return sand30_pack_c;
+#if HAS_NEON
+        case DRMU_SAND_IMPL_NEON:
+            return sand30_pack_neon;
+#endif
+#if HAS_X86
+        case DRMU_SAND_IMPL_SSSE3:
+            return __builtin_cpu_supports("ssse3") ? sand30_pack_ssse3 : NULL;
+        case DRMU_SAND_IMPL_AVX2:
+            return __builtin_cpu_supports("avx2") ? sand30_pack_avx2 : NULL;
+#endif
+        default:
+            break;
+    }
+    return NULL;
+}
+
+// Set on first use - racing first uses pick the same answer
+static _Atomic drmu_sand_impl_t cur_impl = DRMU_SAND_IMPL_AUTO;
+static _Atomic sand30_pack_fn cur_pack = NULL;
+
+static sand30_pack_fn
+sand30_pack_get(void)
+{
+    static const drmu_sand_impl_t best[] = {
+        DRMU_SAND_IMPL_AVX2, DRMU_SAND_IMPL_SSSE3, DRMU_SAND_IMPL_NEON, DRMU_SAND_IMPL_C
+    };
+    sand30_pack_fn fn = atomic_load_explicit(&cur_pack, memory_order_acquire);
+    unsigned int i;
+
+    if (fn != NULL)
+        return fn;
+
+    for (i = 0; (fn = impl_fn(best[i])) == NULL; ++i)
+        /* Loop */;
+    atomic_store(&cur_impl, best[i]);
+    atomic_store_explicit(&cur_pack, fn, memory_order_release);
+    return fn;
+}
+
+int
+drmu_sand_impl_set(const drmu_sand_impl_t impl)
+{
+    sand30_pack_fn fn;
+
+    if (impl == DRMU_SAND_IMPL_AUTO) {
+        atomic_store(&cur_pack, NULL);
+        sand30_pack_get();
+        return 0;
+    }
+    if ((fn = impl_fn(impl)) == NULL)
+        return -ENOTSUP;
+    atomic_store(&cur_impl, impl);
+    atomic_store_explicit(&cur_pack, fn, memory_order_release);
+    return 0;
+}
+
+drmu_sand_impl_t
+drmu_sand_impl(void)
+{
+    sand30_pack_get();
+    return atomic_load(&cur_impl);
+}
+
+const char *
+drmu_sand_impl_name(const drmu_sand_impl_t impl)
+{
+    switch (impl) {
+        case DRMU_SAND_IMPL_AUTO:
+            return "auto";
+        case DRMU_SAND_IMPL_C:
+            return "c";
+        case DRMU_SAND_IMPL_NEON:
+            return "neon";
+        case DRMU_SAND_IMPL_SSSE3:
+            return "ssse3";
+        case DRMU_SAND_IMPL_AVX2:
+            return "avx2";
+        default:
+            break;
+    }
+    return "?";
+}
+
+//----------------------------------------------------------------------------
+//
+// Conversion fns
+
+void
+drmu_sand30_from_u16(uint8_t * const dst, const unsigned int dst_stride2,
+                     const uint8_t * const src, const unsigned int src_stride,
+                     const unsigned int w, const unsigned int h, const unsigned int shift)
+{
+    const sand30_pack_fn pack = sand30_pack_get();
+    const size_t col_stride = (size_t)dst_stride2 * SAND_COL_BYTES;
+    unsigned int i, j;
+
+    for (i = 0; i != h; ++i) {
+        const uint16_t * const s = (const uint16_t *)(src + (size_t)i * src_stride);
+        uint8_t * d = dst + (size_t)i * SAND_COL_BYTES;
+
+        for (j = 0; j < w; j += SAND30_COL_SAMPLES, d += col_stride)
+            pack((uint32_t *)d, s + j, w - j < SAND30_COL_SAMPLES ? w - j : SAND30_COL_SAMPLES, shift);
+    }
+}
+
+void
+drmu_sand30_from_u16_uv(uint8_t * const dst, const unsigned int dst_stride2,
+                        const uint8_t * const src_u, const unsigned int u_stride,
+                        const uint8_t * const src_v, const unsigned int v_stride,
+                        const unsigned int w, const unsigned int h, const unsigned int shift)
+{
+    const sand30_pack_fn pack = sand30_pack_get();
+    const size_t col_stride = (size_t)dst_stride2 * SAND_COL_BYTES;
+    uint16_t uv[SAND30_COL_SAMPLES];
+    unsigned int i, j, k;
+
+    // Interleave a column's worth at a time then pack as P010 chroma
+    for (i = 0; i != h; ++i) {
+        const uint16_t * const su = (const uint16_t *)(src_u + (size_t)i * u_stride);
+        const uint16_t * const sv = (const uint16_t *)(src_v + (size_t)i * v_stride);
+        uint8_t * d = dst + (size_t)i * SAND_COL_BYTES;
+
+        for (j = 0; j < w; j += SAND30_COL_SAMPLES / 2, d += col_stride) {
+            const unsigned int n = w - j < SAND30_COL_SAMPLES / 2 ? w - j : SAND30_COL_SAMPLES / 2;
+            for (k = 0; k != n; ++k) {
+                uv[k * 2 + 0] = su[j + k];
+                uv[k * 2 + 1] = sv[j + k];
+            }
+            pack((uint32_t *)d, uv, n * 2, shift);
+        }
+    }
+}
+
+int
+drmu_fb_sand30_from_p010(drmu_fb_t * const dfb,
+                         const uint8_t * const src_y, const unsigned int y_stride,
+                         const uint8_t * const src_uv, const unsigned int uv_stride,
+                         const unsigned int w, const unsigned int h)
+{
+    uint8_t * dst_y;
+    uint8_t * dst_uv;
+    int rv;
+
+    if (drmu_fb_pixel_format(dfb) != DRM_FORMAT_P030 ||
+        fourcc_mod_broadcom_mod(drmu_fb_modifier(dfb, 0)) != DRM_FORMAT_MOD_BROADCOM_SAND128 ||
+        drmu_fb_width(dfb) < w || drmu_fb_height(dfb) < h)
+        return -EINVAL;
+
+    if ((rv = drmu_fb_write_start(dfb)) != 0)
+        return rv;
+    // Unmapped (DRMU_FB_MAP_NONE) or failed lazy map
+    if ((dst_y = drmu_fb_data(dfb, 0)) == NULL || (dst_uv = drmu_fb_data(dfb, 1)) == NULL) {
+        drmu_fb_write_end(dfb);
+        return -EINVAL;
+    }
+    drmu_sand30_from_u16(dst_y, drmu_fb_pitch2(dfb, 0),
+                         src_y, y_stride, w, h, 6);
+    drmu_sand30_from_u16(dst_uv, drmu_fb_pitch2(dfb, 1),
+                         src_uv, uv_stride, (w + 1) & ~1U, (h + 1) / 2, 6);
+    return drmu_fb_write_end(dfb);
+}
+
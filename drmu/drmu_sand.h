@@ -0,0 +1,67 @@
+#ifndef _DRMU_DRMU_SAND_H
+#define _DRMU_DRMU_SAND_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct drmu_fb_s;
+
+// SAND30 conversion
+//
+// SAND30 is DRM_FORMAT_P030 with DRM_FORMAT_MOD_BROADCOM_SAND128. Each plane
+// is a set of 128 byte wide columns, each line of a column holding 32 words
+// of 3 10-bit samples, so 96 samples. dst_stride2 is the column height in
+// lines (drmu_fb_pitch2). Column positions past the end of the source width
+// are filled with 0x200.
+//
+// Sources are 16-bit samples with the 10 valid bits at bit shift: 6 for
+// P010, 0 for yuv420p10 & friends. Anything outside those 10 bits is ignored.
+// w, h are in samples and lines of the plane being converted.
+
+// One plane of samples into a SAND30 plane
+// Converts luma or, given a P010 style interleaved UV plane, chroma
+void drmu_sand30_from_u16(uint8_t * const dst, const unsigned int dst_stride2,
+                          const uint8_t * const src, const unsigned int src_stride,
+                          const unsigned int w, const unsigned int h, const unsigned int shift);
+// Separate U & V planes into a SAND30 chroma plane
+// w is the width of each chroma plane (so dst gets 2 * w samples per line)
+void drmu_sand30_from_u16_uv(uint8_t * const dst, const unsigned int dst_stride2,
+                             const uint8_t * const src_u, const unsigned int u_stride,
+                             const uint8_t * const src_v, const unsigned int v_stride,
+                             const unsigned int w, const unsigned int h, const unsigned int shift);
+
+// Copy a w x h P010 frame into a P030 SAND128 fb
+// Takes care of write_start/end
+// Returns -EINVAL if the fb isn't SAND30, is smaller than w x h or can't
+// be mapped
+int drmu_fb_sand30_from_p010(struct drmu_fb_s * const dfb,
+                             const uint8_t * const src_y, const unsigned int y_stride,
+                             const uint8_t * const src_uv, const unsigned int uv_stride,
+                             const unsigned int w, const unsigned int h);
+
+// Which kernel does the packing
+// By default the best one the CPU supports, picked on first use
+typedef enum drmu_sand_impl_e {
+    DRMU_SAND_IMPL_AUTO = 0,
+    DRMU_SAND_IMPL_C,
+    DRMU_SAND_IMPL_NEON,
+    DRMU_SAND_IMPL_SSSE3,
+    DRMU_SAND_IMPL_AVX2,
+} drmu_sand_impl_t;
+
+// Force a kernel (mostly for testing)
+// Returns -ENOTSUP if the kernel isn't built or the CPU doesn't have it
+// Not thread safe against conversions in progress
+int drmu_sand_impl_set(const drmu_sand_impl_t impl);
+drmu_sand_impl_t drmu_sand_impl(void);
+const char * drmu_sand_impl_name(const drmu_sand_impl_t impl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
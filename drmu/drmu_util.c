@@ -1,12 +1,21 @@
+// Needed for pthread_setaffinity_np & pthread_setname_np
+#define _GNU_SOURCE
+
 #include "drmu_util.h"
 
 #include "drmu.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <error.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include <libdrm/drm_mode.h>
 
@@ -161,3 +170,49 @@ drmu_memcpy_2d(void * const dst_p, const size_t dst_stride,
         }
     }
 }
+
+int
+drmu_thread_cfg_apply(const drmu_thread_cfg_t * const cfg)
+{
+    const pthread_t self = pthread_self();
+    int rv = 0;
+    int err;
+
+    if (cfg == NULL)
+        return 0;
+
+    if (cfg->name[0] != 0) {
+        char name[16];
+        memcpy(name, cfg->name, sizeof(name) - 1);
+        name[sizeof(name) - 1] = 0;
+        if ((err = pthread_setname_np(self, name)) != 0 && rv == 0)
+            rv = -err;
+    }
+
+    if (cfg->cpu_mask != 0) {
+        cpu_set_t cpus;
+        unsigned int i;
+
+        CPU_ZERO(&cpus);
+        for (i = 0; i != 64; ++i) {
+            if ((cfg->cpu_mask >> i) & 1)
+                CPU_SET(i, &cpus);
+        }
+        if ((err = pthread_setaffinity_np(self, sizeof(cpus), &cpus)) != 0 && rv == 0)
+            rv = -err;
+    }
+
+    if (cfg->policy != SCHED_OTHER) {
+        const struct sched_param param = {.sched_priority = cfg->priority};
+        if ((err = pthread_setschedparam(self, cfg->policy, &param)) != 0 && rv == 0)
+            rv = -err;
+    }
+
+    // Linux nice is per thread if given a tid
+    if (cfg->nice != 0) {
+        if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), cfg->nice) != 0 && rv == 0)
+            rv = -errno;
+    }
+
+    return rv;
+}
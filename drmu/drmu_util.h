@@ -2,6 +2,7 @@
 #define _DRMU_DRMU_UTIL_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include "drmu_math.h"
 
@@ -49,6 +50,23 @@ drmu_memcpy_rect(void * const dst_p, const size_t dst_stride, const drmu_rect_t
                    src_rect.h < dst_rect.h ? src_rect.h : dst_rect.h);
 }
 
+// Thread scheduling
+
+// Zero fields are left unchanged so {0} is a no-op
+typedef struct drmu_thread_cfg_s {
+    int policy;         // SCHED_FIFO or SCHED_RR, SCHED_OTHER (0) => unchanged
+    int priority;       // sched_priority for FIFO/RR
+    int nice;           // Nice value (non-RT policies), 0 => unchanged
+    uint64_t cpu_mask;  // Bit n => may run on CPU n, 0 => unchanged
+    char name[16];      // Thread name, "" => unchanged
+} drmu_thread_cfg_t;
+
+// Apply cfg to the calling thread
+// Tries everything asked for even if an earlier part fails (RT priority
+// typically needs CAP_SYS_NICE or an rtprio rlimit)
+// Returns 0 or the first -errno
+int drmu_thread_cfg_apply(const drmu_thread_cfg_t * const cfg);
+
 
 #ifdef __cplusplus
 }
@@ -57,7 +57,7 @@ main(int argc, char **argv)
 
     if ((rte = runticker_start(dout,
                                mode->width / 10, mode->height * 8/10, mode->width * 8/10, mode->height / 10,
-                               argv[2], argv[1])) == NULL) {
+                               argv[2], argv[1], NULL)) == NULL) {
         fprintf(stderr, "Failed to create ticker\n");
         return 1;
     }
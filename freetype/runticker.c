@@ -13,6 +13,7 @@
 #include <drmu.h>
 #include <drmu_log.h>
 #include <drmu_output.h>
+#include <drmu_util.h>
 
 #include "ticker.h"
 
@@ -22,6 +23,7 @@ struct runticker_env_s {
     char *text;
     const char *cchar;
     int prod_fd;
+    drmu_thread_cfg_t tcfg;
     bool thread_running;
     pthread_t thread_id;
 };
@@ -49,6 +51,8 @@ runticker_thread(void * v)
 {
     runticker_env_t * const dfte = v;
 
+    drmu_thread_cfg_apply(&dfte->tcfg);
+
     while (!atomic_load(&dfte->kill) && ticker_run(dfte->te) >= 0) {
         char evt_buf[8];
         read(dfte->prod_fd, evt_buf, 8);
@@ -61,7 +65,8 @@ runticker_env_t *
 runticker_start(drmu_output_t * const dout,
                 unsigned int x, unsigned int y, unsigned int w, unsigned int h,
                 const char * const text,
-                const char * const fontfile)
+                const char * const fontfile,
+                const drmu_thread_cfg_t * const tcfg)
 {
     runticker_env_t *dfte = calloc(1, sizeof(*dfte));
     drmu_env_t * const du = drmu_output_env(dout);
@@ -70,6 +75,8 @@ runticker_start(drmu_output_t * const dout,
         return NULL;
 
     dfte->prod_fd = -1;
+    if (tcfg != NULL)
+        dfte->tcfg = *tcfg;
     dfte->text  = strdup(text);
     dfte->cchar = dfte->text;
 
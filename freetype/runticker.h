@@ -9,11 +9,14 @@ struct runticker_env_s;
 typedef struct runticker_env_s runticker_env_t;
 
 struct drmu_output_s;
+struct drmu_thread_cfg_s;
 
+// tcfg is applied to the ticker thread when it starts, NULL => default
 runticker_env_t * runticker_start(struct drmu_output_s * const dout,
                                   unsigned int x, unsigned int y, unsigned int w, unsigned int h,
                                   const char * const text,
-                                  const char * const fontfile);
+                                  const char * const fontfile,
+                                  const struct drmu_thread_cfg_s * const tcfg);
 
 void runticker_stop(runticker_env_t ** const ppDfte);
 
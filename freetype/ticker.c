@@ -8,6 +8,7 @@
 #include "ticker.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <unistd.h>
@@ -35,7 +36,16 @@ struct ticker_env_s {
     drmu_output_t *dout;
     drmu_plane_t *dp;
     drmu_fb_t *dfbs[2];
+    // Scrolling only changes fb & crop so after the 1st frame (which sets
+    // all the plane props) use a template
+    drmu_atomic_template_t *dt;
+    int dt_slot0;
+    bool dt_primed;
     drmu_dmabuf_env_t *dde;
+    // Shift & draw happen here in cached memory so the fbs are only ever
+    // written (whole) which suits an uncached heap
+    uint32_t *shadow;
+    size_t shadow_pitch;
 
     uint32_t format;
     uint64_t modifier;
@@ -75,17 +85,16 @@ grey2argb(const uint32_t x)
     return ((x << 24) | (x << 16) | (x << 8) | (x));
 }
 
-void
-draw_bitmap(drmu_fb_t *const dfb,
+static void
+draw_bitmap(uint32_t *const image,
+            const int fb_width,
+            const int fb_height,
+            const size_t fb_stride,
             FT_Bitmap *bitmap,
             FT_Int      x,
             FT_Int      y)
 {
     int  i, j, p, q;
-    const int fb_width = drmu_fb_width(dfb);
-    const int fb_height = drmu_fb_height(dfb);
-    const size_t fb_stride = drmu_fb_pitch(dfb, 0) / 4;
-    uint32_t *const image = drmu_fb_data(dfb, 0);
 
     const int  x_max = MIN(fb_width, (int)(x + bitmap->width));
     const int  y_max = MIN(fb_height, (int)(y + bitmap->rows));
@@ -109,7 +118,7 @@ shift_2d(void *dst, const void *src, size_t stride, size_t offset, size_t h)
 
     for (i = 0; i != h; ++i)
     {
-        memcpy(d, s + offset, stride - offset);
+        memmove(d, s + offset, stride - offset);
         memset(d + stride - offset, 0, offset);
         d += stride;
         s += stride;
@@ -141,15 +150,26 @@ do_scroll(ticker_env_t *const te)
     else
     {
         drmu_fb_t *const fb0 = te->dfbs[te->bn];
+        drmu_atomic_t *da;
 
-        drmu_atomic_t *da = drmu_atomic_new(te->du);
 //        printf("tw=%d, pos.w=%d, shl=%d, x=%d\n",
 //               te->target_width, (int)te->pos.w, te->shl,
 //               te->target_width - (int)te->pos.w - te->shl);
         drmu_fb_crop_frac_set(fb0, drmu_rect_shl16((drmu_rect_t) {
                                                        .x = MAX(0, te->target_width - (int)te->pos.w - te->shl), .y = 0,
                                                        .w = te->pos.w, .h = te->pos.h }));
-        drmu_atomic_plane_add_fb(da, te->dp, fb0, te->pos);
+        if (te->dt_primed)
+        {
+            drmu_atomic_template_plane_set_fb(te->dt, te->dt_slot0, te->dp, fb0, te->pos);
+            da = drmu_atomic_template_atomic(te->dt);
+        }
+        else if ((da = drmu_atomic_new(te->du)) != NULL)
+        {
+            drmu_atomic_plane_add_fb(da, te->dp, fb0, te->pos);
+            te->dt_primed = true;
+        }
+        if (da == NULL)
+            return -1;
         if (te->commit_cb)
             drmu_atomic_add_commit_callback(da, te->commit_cb, te->commit_v);
         drmu_atomic_queue(&da);
@@ -171,8 +191,8 @@ do_render(ticker_env_t *const te)
     const FT_GlyphSlot slot = te->face->glyph;
     FT_UInt glyph_index;
     int c;
-    drmu_fb_t *const fb1 = te->dfbs[te->bn];
     drmu_fb_t *const fb0 = te->dfbs[te->bn ^ 1];
+    const unsigned int height = drmu_fb_height(fb0);
     int shl1;
 
     /* set transformation */
@@ -209,16 +229,19 @@ do_render(ticker_env_t *const te)
         return -1;
     }
 
-    drmu_fb_write_start(fb0);
     shl1 = MAX(slot->bitmap_left + slot->bitmap.width, (te->pen.x + slot->advance.x) >> 6) - te->target_width;
     if (shl1 > 0)
     {
         te->pen.x -= shl1 << 6;
-        shift_2d(drmu_fb_data(fb0, 0), drmu_fb_data(fb1, 0), drmu_fb_pitch(fb0, 0), shl1 * 4, drmu_fb_height(fb0));
+        shift_2d(te->shadow, te->shadow, te->shadow_pitch, shl1 * 4, height);
     }
 
     // now, draw to our target surface (convert position)
-    draw_bitmap(fb0, &slot->bitmap, slot->bitmap_left - shl1, te->target_height - slot->bitmap_top);
+    draw_bitmap(te->shadow, drmu_fb_width(fb0), height, te->shadow_pitch / 4,
+                &slot->bitmap, slot->bitmap_left - shl1, te->target_height - slot->bitmap_top);
+
+    drmu_fb_write_start(fb0);
+    memcpy(drmu_fb_data(fb0, 0), te->shadow, te->shadow_pitch * height);
     drmu_fb_write_end(fb0);
 
     /* increment pen position */
@@ -267,9 +290,11 @@ ticker_delete(ticker_env_t **ppTicker)
         drmu_atomic_queue(&da);
     }
 
+    drmu_atomic_template_unref(&te->dt);
     drmu_fb_unref(te->dfbs + 0);
     drmu_fb_unref(te->dfbs + 1);
     drmu_dmabuf_env_unref(&te->dde);
+    free(te->shadow);
     drmu_plane_unref(&te->dp);
     drmu_output_unref(&te->dout);
 
@@ -294,8 +319,15 @@ ticker_init(ticker_env_t *const te)
         }
     }
 
+    te->shadow_pitch = drmu_fb_pitch(te->dfbs[0], 0);
+    if ((te->shadow = calloc(drmu_fb_height(te->dfbs[0]), te->shadow_pitch)) == NULL)
+    {
+        drmu_err(te->du, "Failed to get shadow buffer");
+        return -1;
+    }
+
     drmu_fb_write_start(te->dfbs[0]);
-    memset(drmu_fb_data(te->dfbs[0], 0), 0x00, drmu_fb_height(te->dfbs[0]) * drmu_fb_pitch(te->dfbs[0], 0));
+    memset(drmu_fb_data(te->dfbs[0], 0), 0x00, drmu_fb_height(te->dfbs[0]) * te->shadow_pitch);
     drmu_fb_write_end(te->dfbs[0]);
     return 0;
 }
@@ -354,7 +386,9 @@ ticker_new(drmu_output_t *dout, unsigned int x, unsigned int y, unsigned int w,
 
     te->dout = drmu_output_ref(dout);
     te->du = drmu_output_env(dout);
-    te->dde = drmu_dmabuf_env_new_video(te->du);
+    // Only whole fb writes so no need for cache maintenance. Most kernels
+    // have no uncached video heap in which case this gives a cached one
+    te->dde = drmu_dmabuf_env_new_video_cache(te->du, DRMU_DMABUF_CACHE_UNCACHED);
 
     te->pos = (drmu_rect_t) { x, y, w, h };
     te->format = DRM_FORMAT_ARGB8888;
@@ -374,6 +408,13 @@ ticker_new(drmu_output_t *dout, unsigned int x, unsigned int y, unsigned int w,
         goto fail;
     }
 
+    if ((te->dt = drmu_atomic_template_new(te->du)) == NULL ||
+        (te->dt_slot0 = drmu_atomic_template_add_plane(te->dt, te->dp)) < 0)
+    {
+        drmu_err(te->du, "Failed to create plane template");
+        goto fail;
+    }
+
 
     return te;
 
@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/epoll.h>
 #include <sys/eventfd.h>
 
 #define request_log(...) fprintf(stderr, __VA_ARGS__)
@@ -26,20 +27,53 @@ enum polltask_state {
     POLLTASK_Q_KILL,
     POLLTASK_Q_DEAD,
     POLLTASK_RUN_KILL,
+    POLLTASK_PENDING,   // Triggered & waiting for an executor
 };
 
 #define POLLTASK_FLAG_ONCE 1
 
+#define HEAP_IDX_NONE UINT_MAX
+
+// Max events taken from epoll per wakeup - more will be picked up next time
+#define POLLQUEUE_MAX_EVENTS 64
+
+// Number of serialization strands - must be a power of 2 (see strand_idx)
+#define POLLQUEUE_STRANDS 256
+
+// Tasks sharing a strand are run one at a time, in the order they were
+// triggered. Only the first is on the run queue, the rest wait here.
+struct pollstrand {
+    bool busy;
+    struct polltask *head;
+    struct polltask **tail;
+};
+
+// Tasks with an fd are registered with epoll (EPOLLONESHOT) when Qed, tasks
+// with a timeout are put on a min-heap ordered by timeout. Neither needs the
+// worker to rebuild anything so add, remove & fire are O(log n) at worst.
 struct polltask {
-    struct polltask *next;
-    struct polltask *prev;
+    struct polltask *next;  // Ready, run or strand list link
+    struct polltask *kill_next;
     struct pollqueue *q;
     enum polltask_state state;
 
+    uintptr_t key;
+    struct pollstrand *strand;
+    pthread_t runner;   // Thread running the callback, valid if running
+
     int fd;
     short events;
     unsigned short flags;
 
+    int efd;            // fd registered with epoll (fd or a dup), -1 if none
+    bool armed;         // Registered & waiting for an event
+    bool ready;         // On the worker ready list
+    bool killing;       // On the kill list
+    bool pending;       // On the run queue or a strand list
+    bool running;       // Callback in progress
+    short revents;
+    unsigned int heap_idx;
+
     void (*fn)(void *v, short revents);
     void * v;
 
@@ -51,8 +85,15 @@ struct pollqueue {
     pthread_mutex_t lock;
     pthread_cond_t cond;
 
-    struct polltask *head;
-    struct polltask *tail;
+    int epoll_fd;
+
+    // Min-heap of Qed tasks with timeouts
+    struct polltask **heap;
+    unsigned int heap_n;
+    unsigned int heap_size;
+
+    // Tasks deleted whilst Qed - DQed by the worker
+    struct polltask *kill_head;
 
     struct prepost_ss {
         void (*pre)(void *v, struct pollfd *pfd);
@@ -67,11 +108,28 @@ struct pollqueue {
     bool sig_seq; // Signal cond when seq incremented
     uint32_t seq;
 
+    uint64_t wait_timeout;  // Timeout the worker is waiting for, 0 => none
+
     int prod_fd;
     struct polltask *prod_pt;
     pthread_t worker;
+
+    // Executor pool - if n_exec == 0 callbacks are run on the poll thread
+    unsigned int n_exec;
+    pthread_t *exec;
+    bool exec_exit;
+    pthread_cond_t run_cond;
+    struct polltask *run_head;
+    struct polltask **run_tail;
+    struct pollstrand strands[POLLQUEUE_STRANDS];
 };
 
+static unsigned int strand_idx(const uintptr_t key)
+{
+    // Fibonacci hash - top bits
+    return (unsigned int)(((uint64_t)key * 0x9E3779B97F4A7C15ULL) >> 56) & (POLLQUEUE_STRANDS - 1);
+}
+
 static struct polltask *
 polltask_new2(struct pollqueue *const pq,
               const int fd, const short events,
@@ -90,14 +148,17 @@ polltask_new2(struct pollqueue *const pq,
 
     *pt = (struct polltask){
         .next = NULL,
-        .prev = NULL,
+        .kill_next = NULL,
         .q = pollqueue_ref(pq),
         .fd = fd,
         .events = events,
         .flags = flags,
+        .efd = -1,
+        .heap_idx = HEAP_IDX_NONE,
         .fn = fn,
         .v = v
     };
+    pt->strand = pq->strands + strand_idx((uintptr_t)pt);
 
     return pt;
 }
@@ -118,6 +179,23 @@ struct polltask *polltask_new_timer(struct pollqueue *const pq,
     return polltask_new(pq, -1, 0, fn, v);
 }
 
+int polltask_set_key(struct polltask *const pt, const uintptr_t key)
+{
+    struct pollqueue *const pq = pt->q;
+    int rv = 0;
+
+    pthread_mutex_lock(&pq->lock);
+    if (pt->state != POLLTASK_UNQUEUED || pt->running) {
+        rv = -EBUSY;
+    }
+    else {
+        pt->key = key;
+        pt->strand = pq->strands + strand_idx(key != 0 ? key : (uintptr_t)pt);
+    }
+    pthread_mutex_unlock(&pq->lock);
+    return rv;
+}
+
 int
 pollqueue_callback_once(struct pollqueue *const pq,
                         void (*const fn)(void *v, short revents),
@@ -130,22 +208,137 @@ pollqueue_callback_once(struct pollqueue *const pq,
     return 0;
 }
 
+static void heap_swap(struct polltask **const heap, const unsigned int a, const unsigned int b)
+{
+    struct polltask *const t = heap[a];
+    heap[a] = heap[b];
+    heap[b] = t;
+    heap[a]->heap_idx = a;
+    heap[b]->heap_idx = b;
+}
+
+static void heap_up(struct pollqueue *const pq, unsigned int i)
+{
+    while (i != 0) {
+        const unsigned int p = (i - 1) / 2;
+        if (pq->heap[p]->timeout <= pq->heap[i]->timeout)
+            break;
+        heap_swap(pq->heap, i, p);
+        i = p;
+    }
+}
+
+static void heap_down(struct pollqueue *const pq, unsigned int i)
+{
+    for (;;) {
+        const unsigned int l = i * 2 + 1;
+        unsigned int m = i;
+
+        if (l < pq->heap_n && pq->heap[l]->timeout < pq->heap[m]->timeout)
+            m = l;
+        if (l + 1 < pq->heap_n && pq->heap[l + 1]->timeout < pq->heap[m]->timeout)
+            m = l + 1;
+        if (m == i)
+            break;
+        heap_swap(pq->heap, i, m);
+        i = m;
+    }
+}
+
+static int heap_add(struct pollqueue *const pq, struct polltask *const pt)
+{
+    if (pq->heap_n >= pq->heap_size) {
+        const unsigned int size = pq->heap_size == 0 ? 64 : pq->heap_size * 2;
+        struct polltask **const heap = realloc(pq->heap, size * sizeof(*heap));
+        if (!heap)
+            return -ENOMEM;
+        pq->heap = heap;
+        pq->heap_size = size;
+    }
+    pt->heap_idx = pq->heap_n;
+    pq->heap[pq->heap_n++] = pt;
+    heap_up(pq, pt->heap_idx);
+    return 0;
+}
+
+static void heap_rem(struct pollqueue *const pq, struct polltask *const pt)
+{
+    const unsigned int i = pt->heap_idx;
+
+    if (i == HEAP_IDX_NONE)
+        return;
+    pt->heap_idx = HEAP_IDX_NONE;
+
+    if (i != --pq->heap_n) {
+        pq->heap[i] = pq->heap[pq->heap_n];
+        pq->heap[i]->heap_idx = i;
+        heap_up(pq, i);
+        heap_down(pq, pq->heap[i]->heap_idx);
+    }
+}
+
+// Arm for a single event
+static int polltask_arm(struct pollqueue *const pq, struct polltask *const pt)
+{
+    struct epoll_event ev = {
+        .events = (uint32_t)(unsigned short)pt->events | EPOLLONESHOT,
+        .data = {.ptr = pt}
+    };
+
+    if (pt->efd != -1) {
+        if (epoll_ctl(pq->epoll_fd, EPOLL_CTL_MOD, pt->efd, &ev) == 0)
+            goto ok;
+        if (pt->efd != pt->fd)
+            close(pt->efd);
+        pt->efd = -1;
+    }
+
+    if (epoll_ctl(pq->epoll_fd, EPOLL_CTL_ADD, pt->fd, &ev) == 0) {
+        pt->efd = pt->fd;
+        goto ok;
+    }
+    if (errno != EEXIST)
+        return -errno;
+
+    // Another task already has this fd registered - use a dup of it
+    if ((pt->efd = dup(pt->fd)) == -1)
+        return -errno;
+    if (epoll_ctl(pq->epoll_fd, EPOLL_CTL_ADD, pt->efd, &ev) != 0) {
+        const int err = errno;
+        close(pt->efd);
+        pt->efd = -1;
+        return -err;
+    }
+
+ok:
+    pt->armed = true;
+    return 0;
+}
+
+static void polltask_disarm(struct pollqueue *const pq, struct polltask *const pt)
+{
+    struct epoll_event ev = {.events = 0, .data = {.ptr = pt}};
+
+    if (!pt->armed)
+        return;
+    pt->armed = false;
+    epoll_ctl(pq->epoll_fd, EPOLL_CTL_MOD, pt->efd, &ev);
+}
+
+// Remove from heap & epoll
 static void pollqueue_rem_task(struct pollqueue *const pq, struct polltask *const pt)
 {
-    if (pt->prev)
-        pt->prev->next = pt->next;
-    else
-        pq->head = pt->next;
-    if (pt->next)
-        pt->next->prev = pt->prev;
-    else
-        pq->tail = pt->prev;
-    pt->next = NULL;
-    pt->prev = NULL;
+    heap_rem(pq, pt);
+    polltask_disarm(pq, pt);
 }
 
 static void polltask_free(struct polltask * const pt)
 {
+    if (pt->efd != -1) {
+        epoll_ctl(pt->q->epoll_fd, EPOLL_CTL_DEL, pt->efd, NULL);
+        if (pt->efd != pt->fd)
+            close(pt->efd);
+    }
     free(pt);
 }
 
@@ -168,6 +361,33 @@ static int pollqueue_prod(const struct pollqueue *const pq)
     return write(pq->prod_fd, &one, sizeof(one));
 }
 
+// True if we are the poll thread or one of the executors
+static bool pollqueue_is_own_thread(const struct pollqueue *const pq)
+{
+    const pthread_t self = pthread_self();
+    unsigned int i;
+
+    if (pthread_equal(self, pq->worker))
+        return true;
+    for (i = 0; i != pq->n_exec; ++i) {
+        if (pthread_equal(self, pq->exec[i]))
+            return true;
+    }
+    return false;
+}
+
+// Locked
+// Once nothing else refers to a deleted task either mark it dead (deleter
+// is waiting) or return true if the caller should kill it
+static bool polltask_reap(struct polltask *const pt)
+{
+    if (pt->killing || pt->pending || pt->running)
+        return false;
+    if (pt->state == POLLTASK_Q_KILL)
+        polltask_dead(pt);
+    return pt->state == POLLTASK_RUN_KILL;
+}
+
 void polltask_delete(struct polltask **const ppt)
 {
     struct polltask *const pt = *ppt;
@@ -180,12 +400,22 @@ void polltask_delete(struct polltask **const ppt)
         return;
 
     pq = pt->q;
-    inthread = pthread_equal(pthread_self(), pq->worker);
 
     pthread_mutex_lock(&pq->lock);
     state = pt->state;
+    // If the callback is in progress we can only avoid waiting if we are it
+    // otherwise any of our threads can leave the kill to whoever DQs it
+    inthread = pt->running ?
+        pthread_equal(pt->runner, pthread_self()) :
+        pollqueue_is_own_thread(pq);
     pt->state = inthread ? POLLTASK_RUN_KILL : POLLTASK_Q_KILL;
     prodme = !pq->no_prod;
+    // If Qed the worker needs to DQ it
+    if (state == POLLTASK_QUEUED && !pt->killing) {
+        pt->killing = true;
+        pt->kill_next = pq->kill_head;
+        pq->kill_head = pt;
+    }
     pthread_mutex_unlock(&pq->lock);
 
     switch (state) {
@@ -196,6 +426,7 @@ void polltask_delete(struct polltask **const ppt)
 
         case POLLTASK_QUEUED:
         case POLLTASK_RUNNING:
+        case POLLTASK_PENDING:
         {
             int rv = 0;
 
@@ -245,90 +476,242 @@ void pollqueue_add_task(struct polltask *const pt, const int timeout)
 
     pthread_mutex_lock(&pq->lock);
     if (pt->state == POLLTASK_UNQUEUED || pt->state == POLLTASK_RUNNING) {
-        if (pq->tail)
-            pq->tail->next = pt;
-        else
-            pq->head = pt;
-        pt->prev = pq->tail;
-        pt->next = NULL;
         pt->state = POLLTASK_QUEUED;
         pt->timeout = timeout_time;
-        pq->tail = pt;
-        prodme = !pq->no_prod;
+        pt->revents = 0;
+
+        if (pt->fd != -1 && polltask_arm(pq, pt) != 0)
+            request_log("%s: Failed to add fd %d: %s\n", __func__, pt->fd, strerror(errno));
+
+        // Only need to wake the worker if it is waiting for a later time
+        // fd events are seen by epoll without a prod
+        if (timeout_time != 0) {
+            if (heap_add(pq, pt) != 0)
+                request_log("%s: Failed to add timeout\n", __func__);
+            else if (pq->wait_timeout == 0 || timeout_time < pq->wait_timeout)
+                prodme = !pq->no_prod;
+        }
     }
     pthread_mutex_unlock(&pq->lock);
     if (prodme)
         pollqueue_prod(pq);
 }
 
+// Locked
+// Deal with tasks deleted whilst Qed
+static void pollqueue_kill_tasks(struct pollqueue *const pq)
+{
+    struct polltask *pt;
+
+    while ((pt = pq->kill_head) != NULL) {
+        pq->kill_head = pt->kill_next;
+        pt->kill_next = NULL;
+        pt->killing = false;
+        pollqueue_rem_task(pq, pt);
+
+        if (polltask_reap(pt))
+            polltask_kill(pt);
+    }
+}
+
+// Locked - unlocked whilst the callback runs
+// Returns true if the task should now be killed
+static bool polltask_run(struct pollqueue *const pq, struct polltask *const pt)
+{
+    // Task may be re-added (resetting revents) as soon as we unlock
+    const short revents = pt->revents;
+
+    pt->state = POLLTASK_RUNNING;
+    pt->running = true;
+    pt->runner = pthread_self();
+    pthread_mutex_unlock(&pq->lock);
+
+    pt->fn(pt->v, revents);
+
+    pthread_mutex_lock(&pq->lock);
+    pt->running = false;
+    if (pt->state == POLLTASK_RUNNING)
+        pt->state = (pt->flags & POLLTASK_FLAG_ONCE) != 0 ?
+            POLLTASK_RUN_KILL : POLLTASK_UNQUEUED;
+    return polltask_reap(pt);
+}
+
+// Locked
+static void pollqueue_run_add(struct pollqueue *const pq, struct polltask *const pt)
+{
+    pt->next = NULL;
+    *pq->run_tail = pt;
+    pq->run_tail = &pt->next;
+    pthread_cond_signal(&pq->run_cond);
+}
+
+// Locked
+// Hand a triggered task to the executors via its strand
+static void pollstrand_add(struct pollqueue *const pq, struct polltask *const pt)
+{
+    struct pollstrand *const ps = pt->strand;
+
+    pt->state = POLLTASK_PENDING;
+    pt->pending = true;
+    if (ps->busy) {
+        pt->next = NULL;
+        *ps->tail = pt;
+        ps->tail = &pt->next;
+        return;
+    }
+    ps->busy = true;
+    ps->head = NULL;
+    ps->tail = &ps->head;
+    pollqueue_run_add(pq, pt);
+}
+
+static void *exec_thread(void *v)
+{
+    struct pollqueue *const pq = v;
+
+    pthread_mutex_lock(&pq->lock);
+    for (;;) {
+        struct polltask *pt;
+        struct pollstrand *ps;
+        bool kill;
+
+        while ((pt = pq->run_head) == NULL && !pq->exec_exit)
+            pthread_cond_wait(&pq->run_cond, &pq->lock);
+        if (pt == NULL)
+            break;
+
+        if ((pq->run_head = pt->next) == NULL)
+            pq->run_tail = &pq->run_head;
+        pt->next = NULL;
+        pt->pending = false;
+        ps = pt->strand;
+
+        if (pt->state == POLLTASK_PENDING)
+            kill = polltask_run(pq, pt);
+        else
+            kill = polltask_reap(pt);  // Deleted whilst pending
+
+        if (kill) {
+            // Kill unlocked as this may drop the last pollqueue ref
+            pthread_mutex_unlock(&pq->lock);
+            polltask_kill(pt);
+            pthread_mutex_lock(&pq->lock);
+        }
+
+        // Pass the strand on - put its next task on the back of the run
+        // queue rather than running it here so busy strands cannot starve
+        // the rest
+        if ((pt = ps->head) == NULL) {
+            ps->busy = false;
+        }
+        else {
+            if ((ps->head = pt->next) == NULL)
+                ps->tail = &ps->head;
+            pollqueue_run_add(pq, pt);
+        }
+    }
+    pthread_mutex_unlock(&pq->lock);
+    return NULL;
+}
+
+// Stop & join all the executors
+static void pollqueue_exec_stop(struct pollqueue *const pq)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&pq->lock);
+    pq->exec_exit = true;
+    pthread_cond_broadcast(&pq->run_cond);
+    pthread_mutex_unlock(&pq->lock);
+
+    for (i = 0; i != pq->n_exec; ++i)
+        pthread_join(pq->exec[i], NULL);
+    pq->n_exec = 0;
+    free(pq->exec);
+    pq->exec = NULL;
+}
+
+// Locked
+static void polltask_ready(struct polltask ***const pplast, struct polltask *const pt, const short revents)
+{
+    if (pt->ready)
+        return;
+    pt->ready = true;
+    pt->revents = revents;
+    pt->next = NULL;
+    **pplast = pt;
+    *pplast = &pt->next;
+}
+
 static void *poll_thread(void *v)
 {
     struct pollqueue *const pq = v;
+    struct epoll_event evs[POLLQUEUE_MAX_EVENTS];
+    // Marker for the pre/post fd in epoll results
+    static const char prepost_marker = 0;
 
     pthread_mutex_lock(&pq->lock);
     do {
-        struct pollfd a[POLLQUEUE_MAX_QUEUE];
-        unsigned int i, j;
-        unsigned int nall = 0;
-        unsigned int npoll = 0;
+        struct pollfd pre_pfd = {.fd = -1, .events = 0, .revents = 0};
+        struct polltask *ready = NULL;
+        struct polltask **ready_last = &ready;
         struct polltask *pt;
-        struct polltask *pt_next;
         struct prepost_ss prepost;
-        uint64_t now = pollqueue_now(0);
+        uint64_t now;
         int timeout = -1;
         int rv;
+        int i;
 
-        for (pt = pq->head; pt; pt = pt_next) {
-            int64_t t;
+        pollqueue_kill_tasks(pq);
 
-            pt_next = pt->next;
-
-            if (pt->state == POLLTASK_Q_KILL) {
-                pollqueue_rem_task(pq, pt);
-                polltask_dead(pt);
-                continue;
-            }
-            if (pt->state == POLLTASK_RUN_KILL) {
-                pollqueue_rem_task(pq, pt);
-                polltask_kill(pt);
-                continue;
-            }
-
-            if (pt->fd != -1) {
-                assert(npoll < POLLQUEUE_MAX_QUEUE - 1); // Allow for pre/post
-                a[npoll++] = (struct pollfd){
-                    .fd = pt->fd,
-                    .events = pt->events
-                };
-            }
-
-            t = (int64_t)(pt->timeout - now);
-            if (pt->timeout && t < INT_MAX &&
-                (timeout < 0 || (int)t < timeout))
-                timeout = (t < 0) ? 0 : (int)t;
-            ++nall;
+        if (pq->heap_n != 0) {
+            const int64_t t = (int64_t)(pq->heap[0]->timeout - pollqueue_now(0));
+            timeout = t < 0 ? 0 : t < INT_MAX ? (int)t : INT_MAX;
+            pq->wait_timeout = pq->heap[0]->timeout;
+        }
+        else {
+            pq->wait_timeout = 0;
         }
         prepost = pq->prepost;
         pthread_mutex_unlock(&pq->lock);
 
-        a[npoll] = (struct pollfd){.fd=-1, .events=0, .revents=0};
-        if (prepost.pre)
-            prepost.pre(prepost.v, a + npoll);
+        if (prepost.pre) {
+            prepost.pre(prepost.v, &pre_pfd);
+            if (pre_pfd.fd != -1) {
+                struct epoll_event ev = {
+                    .events = (uint32_t)(unsigned short)pre_pfd.events,
+                    .data = {.ptr = (void *)&prepost_marker}
+                };
+                if (epoll_ctl(pq->epoll_fd, EPOLL_CTL_ADD, pre_pfd.fd, &ev) != 0) {
+                    request_log("Failed to add pre fd: %s\n", strerror(errno));
+                    pre_pfd.fd = -1;
+                }
+            }
+        }
 
-        while ((rv = poll(a, npoll + (a[npoll].fd != -1), timeout)) == -1)
+        while ((rv = epoll_wait(pq->epoll_fd, evs, POLLQUEUE_MAX_EVENTS, timeout)) == -1)
         {
             if (errno != EINTR)
                 break;
         }
 
-        if (prepost.post)
-            prepost.post(prepost.v, a[npoll].revents);
+        if (pre_pfd.fd != -1)
+            epoll_ctl(pq->epoll_fd, EPOLL_CTL_DEL, pre_pfd.fd, NULL);
 
         if (rv == -1) {
             request_log("Poll error: %s\n", strerror(errno));
+            if (prepost.post)
+                prepost.post(prepost.v, 0);
             goto fail_unlocked;
         }
 
+        for (i = 0; i < rv; ++i) {
+            if (evs[i].data.ptr == &prepost_marker)
+                pre_pfd.revents = (short)evs[i].events;
+        }
+        if (prepost.post)
+            prepost.post(prepost.v, pre_pfd.revents);
+
         now = pollqueue_now(0);
 
         pthread_mutex_lock(&pq->lock);
@@ -336,6 +719,7 @@ static void *poll_thread(void *v)
          * infinite looping
         */
         pq->no_prod = true;
+        pq->wait_timeout = 0;
 
         // Sync for prepost changes
         ++pq->seq;
@@ -344,34 +728,36 @@ static void *poll_thread(void *v)
             pthread_cond_broadcast(&pq->cond);
         }
 
-        for (i = 0, j = 0, pt = pq->head; i < nall; ++i, pt = pt_next) {
-            const short r = pt->fd == -1 ? 0 : a[j++].revents;
-            pt_next = pt->next;
+        // Gather everything that has triggered before running anything so
+        // a task is run at most once per wakeup
+        for (i = 0; i < rv; ++i) {
+            if (evs[i].data.ptr == &prepost_marker)
+                continue;
+            pt = evs[i].data.ptr;
+            pt->armed = false;  // Oneshot
+            if (pt->state == POLLTASK_QUEUED)
+                polltask_ready(&ready_last, pt, (short)evs[i].events);
+        }
+        while (pq->heap_n != 0 && (int64_t)(now - pq->heap[0]->timeout) >= 0) {
+            pt = pq->heap[0];
+            heap_rem(pq, pt);
+            polltask_ready(&ready_last, pt, 0);
+        }
+
+        while ((pt = ready) != NULL) {
+            ready = pt->next;
+            pt->next = NULL;
+            pt->ready = false;
 
+            // Deleted since triggering?
             if (pt->state != POLLTASK_QUEUED)
                 continue;
 
-            /* Pending? */
-            if (r || (pt->timeout && (int64_t)(now - pt->timeout) >= 0)) {
-                pollqueue_rem_task(pq, pt);
-                pt->state = POLLTASK_RUNNING;
-                pthread_mutex_unlock(&pq->lock);
-
-                /* This can add new entries to the Q but as
-                 * those are added to the tail our existing
-                 * chain remains intact
-                */
-                pt->fn(pt->v, r);
-
-                pthread_mutex_lock(&pq->lock);
-                if (pt->state == POLLTASK_Q_KILL)
-                    polltask_dead(pt);
-                else if (pt->state == POLLTASK_RUN_KILL ||
-                    (pt->flags & POLLTASK_FLAG_ONCE) != 0)
-                    polltask_kill(pt);
-                else if (pt->state == POLLTASK_RUNNING)
-                    pt->state = POLLTASK_UNQUEUED;
-            }
+            pollqueue_rem_task(pq, pt);
+            if (pq->n_exec != 0 && pt->key != POLLTASK_KEY_POLL_THREAD)
+                pollstrand_add(pq, pt);
+            else if (polltask_run(pq, pt))
+                polltask_kill(pt);
         }
         pq->no_prod = false;
 
@@ -380,10 +766,14 @@ static void *poll_thread(void *v)
     pthread_mutex_unlock(&pq->lock);
 fail_unlocked:
 
+    pollqueue_exec_stop(pq);
     polltask_free(pq->prod_pt);
+    pthread_cond_destroy(&pq->run_cond);
     pthread_cond_destroy(&pq->cond);
     pthread_mutex_destroy(&pq->lock);
     close(pq->prod_fd);
+    close(pq->epoll_fd);
+    free(pq->heap);
     if (!pq->join_req)
         pthread_detach(pthread_self());
     free(pq);
@@ -401,7 +791,7 @@ static void prod_fn(void *v, short revents)
         pollqueue_add_task(pq->prod_pt, -1);
 }
 
-struct pollqueue * pollqueue_new(void)
+struct pollqueue * pollqueue_new_n(const unsigned int n)
 {
     struct pollqueue *pq = malloc(sizeof(*pq));
     if (!pq)
@@ -410,34 +800,61 @@ struct pollqueue * pollqueue_new(void)
         .ref_count = ATOMIC_VAR_INIT(0),
         .lock = PTHREAD_MUTEX_INITIALIZER,
         .cond = PTHREAD_COND_INITIALIZER,
-        .head = NULL,
-        .tail = NULL,
+        .run_cond = PTHREAD_COND_INITIALIZER,
+        .epoll_fd = -1,
+        .heap = NULL,
+        .kill_head = NULL,
         .kill = false,
         .prod_fd = -1
     };
+    pq->run_tail = &pq->run_head;
 
+    pq->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (pq->epoll_fd == -1)
+        goto fail0;
     pq->prod_fd = eventfd(0, EFD_NONBLOCK);
     if (pq->prod_fd == -1)
         goto fail1;
     pq->prod_pt = polltask_new(pq, pq->prod_fd, POLLIN, prod_fn, pq);
     if (!pq->prod_pt)
         goto fail2;
+    // Prod is always run on the poll thread
+    pq->prod_pt->key = POLLTASK_KEY_POLL_THREAD;
     pollqueue_add_task(pq->prod_pt, -1);
+
+    if (n != 0) {
+        if ((pq->exec = calloc(n, sizeof(*pq->exec))) == NULL)
+            goto fail3;
+        for (pq->n_exec = 0; pq->n_exec != n; ++pq->n_exec) {
+            if (pthread_create(pq->exec + pq->n_exec, NULL, exec_thread, pq))
+                goto fail4;
+        }
+    }
     if (pthread_create(&pq->worker, NULL, poll_thread, pq))
-        goto fail3;
+        goto fail4;
     // Reset ref count which will have been inced by the add_task
     atomic_store(&pq->ref_count, 0);
     return pq;
 
+fail4:
+    pollqueue_exec_stop(pq);
 fail3:
     polltask_free(pq->prod_pt);
 fail2:
     close(pq->prod_fd);
 fail1:
+    close(pq->epoll_fd);
+fail0:
+    free(pq->heap);
     free(pq);
     return NULL;
 }
 
+struct pollqueue * pollqueue_new(void)
+{
+    return pollqueue_new_n(0);
+}
+
 static void pollqueue_free(struct pollqueue *const pq)
 {
     const pthread_t worker = pq->worker;
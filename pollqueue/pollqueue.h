@@ -2,13 +2,18 @@
 #define POLLQUEUE_H_
 
 #include <poll.h>
+#include <stdint.h>
 
 struct polltask;
 struct pollqueue;
 
-// Max number of tasks that can be Qed
+// No longer a limit on the number of Qed tasks (epoll based) - retained
+// for compatibility
 #define POLLQUEUE_MAX_QUEUE 128
 
+// Key that pins a task to the poll thread (see polltask_set_key)
+#define POLLTASK_KEY_POLL_THREAD UINTPTR_MAX
+
 // Create a new polltask
 // Holds a reference on the pollqueue until the polltask is deleted
 //
@@ -27,12 +32,24 @@ struct polltask *polltask_new_timer(struct pollqueue *const pq,
                               void (*const fn)(void *v, short revents),
                               void *const v);
 
+// Set the serialization key of a task
+// Tasks with the same key never run concurrently and run in the order they
+// were triggered. Tasks with different keys may run in parallel if the
+// pollqueue has executor threads (unrelated keys may occasionally share a
+// strand & so be serialized too).
+// 0                        => serialized only with itself (default)
+// POLLTASK_KEY_POLL_THREAD => always run on the poll thread itself
+// The task must not be queued or running. Returns -EBUSY if it is.
+int polltask_set_key(struct polltask *const pt, const uintptr_t key);
+
 // deletes the task
 // Safe to call if *ppt == NULL
 // It is safe to call whilst a polltask is queued (and may be triggered)
 // Callback may occur whilst this is in progress but will not occur
 // once it is done. (*ppt is nulled only once the callback can not occur)
-// May be called in a polltask callback
+// May be called in a polltask callback. If called from a callback other
+// than the task's own whilst the task's callback is running elsewhere it
+// will wait for that callback to finish.
 // If called from outside the polltask thread and this causes the pollqueue
 // to be deleted then it will wait for the polltask thread to terminate
 // before returning.
@@ -44,7 +61,7 @@ void polltask_delete(struct polltask **const ppt);
 // May only be added once (currently)
 void pollqueue_add_task(struct polltask *const pt, const int timeout);
 
-// Run a callback once on the poll thread
+// Run a callback once on a pollqueue thread
 int pollqueue_callback_once(struct pollqueue *const pq,
                             void (*const fn)(void *v, short revents),
                             void *const v);
@@ -53,6 +70,14 @@ int pollqueue_callback_once(struct pollqueue *const pq,
 // Generates a new thread to do the polltask callbacks
 struct pollqueue * pollqueue_new(void);
 
+// Create a pollqueue with n executor threads as well as the poll thread
+// Callbacks are run by the executors (subject to the task's key) so a slow
+// callback does not hold up others. Tasks keyed to POLLTASK_KEY_POLL_THREAD
+// are still run on the poll thread.
+// n == 0 is the same as pollqueue_new
+// pollqueue_finish must not be called from an executor
+struct pollqueue * pollqueue_new_n(const unsigned int n);
+
 // Unref a pollqueue
 // Will be deleted once all polltasks (Qed or otherwise) are deleted too
 // Will not wait for polltask termination whether or not this is the last
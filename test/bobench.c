@@ -0,0 +1,179 @@
+// Imported BO index benchmark
+//
+// Exports n dumb BOs as dmabufs & then times importing them with
+// drmu_bo_new_fd (insert), importing them again whilst they are still
+// live (lookup - finds the existing BO) and dropping them (removal) as the
+// number of live imported BOs grows. Per-op time should stay flat with n.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "drmu.h"
+#include "drmu_log.h"
+#include <libdrm/drm_mode.h>
+
+#define DRM_MODULE "vc4"
+
+static void
+drmu_log_stderr_cb(void * v, enum drmu_log_level_e level, const char * fmt, va_list vl)
+{
+    char buf[256];
+    int n = vsnprintf(buf, 255, fmt, vl);
+
+    (void)v;
+    (void)level;
+
+    if (n >= 255)
+        n = 255;
+    buf[n] = '\n';
+    fwrite(buf, n + 1, 1, stderr);
+}
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Make n dmabuf fds, each of a separate dumb BO that is then dropped so
+// that the fd is the only thing keeping it alive
+static int
+make_fds(drmu_env_t * const du, int * const fds, const unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i != n; ++i) {
+        struct drm_mode_create_dumb dumb = {.width = 16, .height = 16, .bpp = 32};
+        drmu_bo_t * bo = drmu_bo_new_dumb(du, &dumb);
+
+        if (bo == NULL)
+            return -1;
+        fds[i] = drmu_bo_export_fd(bo, 0);
+        drmu_bo_unref(&bo);
+        if (fds[i] == -1)
+            return -1;
+    }
+    return 0;
+}
+
+static int
+run(drmu_env_t * const du, const int * const fds, const unsigned int n)
+{
+    drmu_bo_t ** const bos = calloc(n, sizeof(*bos));
+    uint64_t t0, t1, t2, t3;
+    unsigned int i;
+    int rv = -1;
+
+    if (bos == NULL)
+        return -1;
+
+    t0 = now_ns();
+    for (i = 0; i != n; ++i) {
+        if ((bos[i] = drmu_bo_new_fd(du, fds[i])) == NULL)
+            goto fail;
+    }
+    t1 = now_ns();
+    // Every one is already live so this only finds & refs
+    for (i = 0; i != n; ++i) {
+        drmu_bo_t * bo = drmu_bo_new_fd(du, fds[i]);
+        if (bo != bos[i]) {
+            fprintf(stderr, "Lookup of fd %d found the wrong BO\n", fds[i]);
+            drmu_bo_unref(&bo);
+            goto fail;
+        }
+        drmu_bo_unref(&bo);
+    }
+    t2 = now_ns();
+    for (i = 0; i != n; ++i)
+        drmu_bo_unref(bos + i);
+    t3 = now_ns();
+
+    printf("%6u BOs: insert %6"PRIu64"ns, lookup %6"PRIu64"ns, remove %6"PRIu64"ns per op\n",
+           n, (t1 - t0) / n, (t2 - t1) / n, (t3 - t2) / n);
+    rv = 0;
+
+fail:
+    for (i = 0; i != n; ++i)
+        drmu_bo_unref(bos + i);
+    free(bos);
+    return rv;
+}
+
+static void
+usage(void)
+{
+    printf("Usage: bobench [-M <module>] [-n <max BOs>]\n\n"
+           "Times importing, looking up & removing dmabuf BOs for 16 up to\n"
+           "<max BOs> (default 4096) live at once.\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char * module = DRM_MODULE;
+    unsigned int n_max = 4096;
+    drmu_env_t * du = NULL;
+    int * fds = NULL;
+    unsigned int n_fds = 0;
+    unsigned int n;
+    unsigned int i;
+    int rv = 1;
+    int c;
+
+    while ((c = getopt(argc, argv, "M:n:")) != -1) {
+        switch (c) {
+        case 'M':
+            module = optarg;
+            break;
+        case 'n':
+            n_max = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (n_max == 0)
+        usage();
+
+    {
+        const drmu_log_env_t log = {
+            .fn = drmu_log_stderr_cb,
+            .v = NULL,
+            .max_level = DRMU_LOG_LEVEL_ERROR
+        };
+        if ((du = drmu_env_new_open(module, &log)) == NULL)
+            goto fail;
+    }
+
+    if ((fds = malloc(n_max * sizeof(*fds))) == NULL)
+        goto fail;
+    for (i = 0; i != n_max; ++i)
+        fds[i] = -1;
+    n_fds = n_max;
+    if (make_fds(du, fds, n_max) != 0) {
+        fprintf(stderr, "Failed to make %u dmabufs\n", n_max);
+        goto fail;
+    }
+
+    for (n = 16; n < n_max; n *= 4) {
+        if (run(du, fds, n) != 0)
+            goto fail;
+    }
+    if (run(du, fds, n_max) != 0)
+        goto fail;
+    rv = 0;
+
+fail:
+    for (i = 0; i != n_fds; ++i) {
+        if (fds[i] != -1)
+            close(fds[i]);
+    }
+    free(fds);
+    drmu_env_unref(&du);
+    return rv;
+}
@@ -63,14 +63,21 @@ struct drmprime_out_env_s
     drmu_output_t * dout;
     drmu_plane_t * dp;
     drmu_pool_t * pic_pool;
+    drmu_av_fb_cache_t * prime_cache;
     drmu_atomic_t * display_set;
 
+    // Size the pic pool is being kept warm for
+    int warm_w;
+    int warm_h;
+    uint32_t warm_fmt;
+
     int mode_id;
     drmu_mode_simple_params_t picked;
 
     bool prod_wait;
     int prod_fd;
 
+    drmu_thread_cfg_t tcfg;
     runticker_env_t * rte;
     runcube_env_t * rce;
 };
@@ -97,6 +104,15 @@ static void gb2_free(void * v, uint8_t * data)
     free(gb2);
 }
 
+// Layout that lets decoders use pic_pool buffers directly
+// Pitches suit the largest STRIDE_ALIGN avcodec uses and there are spare
+// rows below the picture as avcodec_default_get_buffer2 gives.
+#define PIC_STRIDE_ALIGN 64
+static const drmu_fb_layout_t pic_layout = {
+    .pitch_align = {PIC_STRIDE_ALIGN, PIC_STRIDE_ALIGN, PIC_STRIDE_ALIGN, PIC_STRIDE_ALIGN},
+    .h_pad = 16 + PIC_STRIDE_ALIGN - 1,
+};
+
 // Assumes drmprime_out_env in s->opaque
 int drmprime_out_get_buffer2(struct AVCodecContext *s, AVFrame *frame, int flags)
 {
@@ -118,6 +134,15 @@ int drmprime_out_get_buffer2(struct AVCodecContext *s, AVFrame *frame, int flags
     // Alignment logic taken directly from avcodec_default_get_buffer2
     avcodec_align_dimensions2(s, &w, &h, align);
 
+    // Keep a few spare buffers of the current size ready so the decoder
+    // doesn't wait on allocation
+    if (w != dpo->warm_w || h != dpo->warm_h || fmt != dpo->warm_fmt) {
+        dpo->warm_w = w;
+        dpo->warm_h = h;
+        dpo->warm_fmt = fmt;
+        drmu_pool_warm_set(dpo->pic_pool, 4, w, h, fmt, mod);
+    }
+
     gb2 = calloc(1, sizeof(*gb2));
     if ((gb2->fb = drmu_pool_fb_new(dpo->pic_pool, w, h, fmt, mod)) == NULL)
         return AVERROR(ENOMEM);
@@ -130,6 +155,11 @@ int drmprime_out_get_buffer2(struct AVCodecContext *s, AVFrame *frame, int flags
     for (i = 0; i != layers; ++i) {
         frame->data[i] = drmu_fb_data(gb2->fb, i);
         frame->linesize[i] = drmu_fb_pitch(gb2->fb, i);
+        if (align[i] != 0 && frame->linesize[i] % align[i] != 0) {
+            fprintf(stderr, "%s: Pitch %d not aligned to %d\n", __func__, frame->linesize[i], align[i]);
+            av_buffer_unref(frame->buf + 0);
+            return AVERROR(EINVAL);
+        }
     }
 
     drmu_fb_write_start(gb2->fb);
@@ -166,7 +196,7 @@ int drmprime_out_display(drmprime_out_env_t *de, struct AVFrame *src_frame)
     {
         drmu_atomic_t * da = drmu_atomic_new(de->du);
         drmu_fb_t * dfb = is_prime ?
-            drmu_fb_av_new_frame_attach(de->du, src_frame) :
+            drmu_fb_av_new_frame_attach_cache(de->prime_cache, src_frame) :
             drmu_fb_ref(((gb2_dmabuf_t *)src_frame->buf[0]->data)->fb);
         const drmu_mode_simple_params_t *const sp = drmu_output_mode_simple_params(de->dout);
         drmu_rect_t r = drmu_rect_wh(sp->width, sp->height);
@@ -277,6 +307,7 @@ void drmprime_out_delete(drmprime_out_env_t *de)
     drmprime_out_runcube_stop(de);
 
     drmu_pool_kill(&de->pic_pool);
+    drmu_av_fb_cache_kill(&de->prime_cache);
 
     drmu_plane_unref(&de->dp);
     drmu_output_unref(&de->dout);
@@ -324,6 +355,7 @@ drmprime_out_env_t* drmprime_out_new()
             goto fail;
     }
     drmu_env_restore_enable(de->du);
+    drmu_env_fb_defer_free_enable(de->du);
 
     if ((de->dout = drmu_output_new(de->du)) == NULL)
         goto fail;
@@ -338,7 +370,14 @@ drmprime_out_env_t* drmprime_out_new()
         goto fail;
     }
 
-    if ((de->pic_pool = drmu_pool_new_dmabuf_video(de->du, 32)) == NULL)
+    {
+        drmu_dmabuf_env_t * dde = drmu_dmabuf_env_new_video(de->du);
+        de->pic_pool = drmu_pool_new_dmabuf_layout(dde, 32, &pic_layout);
+        drmu_dmabuf_env_unref(&dde);
+        if (de->pic_pool == NULL)
+            goto fail;
+    }
+    if ((de->prime_cache = drmu_av_fb_cache_new(de->du, 32)) == NULL)
         goto fail;
 
     // Plane allocation delayed till we have a format - not all planes are idempotent
@@ -351,15 +390,69 @@ fail:
     return NULL;
 }
 
+// Copy of the thread cfg with a default name
+static drmu_thread_cfg_t
+thread_cfg_named(const drmprime_out_env_t * const dpo, const char * const name)
+{
+    drmu_thread_cfg_t tcfg = dpo->tcfg;
+    if (tcfg.name[0] == 0)
+        snprintf(tcfg.name, sizeof(tcfg.name), "%s", name);
+    return tcfg;
+}
+
+int drmprime_out_thread_cfg_set(drmprime_out_env_t * const dpo, const drmu_thread_cfg_t * const tcfg)
+{
+    drmu_thread_cfg_t poll_cfg;
+
+    dpo->tcfg = *tcfg;
+    poll_cfg = thread_cfg_named(dpo, "drmu-poll");
+    return drmu_env_poll_thread_cfg_set(dpo->du, &poll_cfg);
+}
+
+int drmprime_out_queue_delta_set(drmprime_out_env_t * const dpo, const bool enable)
+{
+    return drmu_env_queue_delta_set(dpo->du, enable);
+}
+
+void drmprime_out_stats_print(drmprime_out_env_t * const dpo)
+{
+    drmu_queue_present_t pres;
+    drmu_pool_stats_t ps;
+    unsigned int missed = 0;
+    unsigned int i;
+
+    drmu_pool_stats_get(dpo->pic_pool, &ps);
+    fprintf(stderr, "Pic pool: %u fbs (%u free), %zu bytes (%zu free), peak %zu\n",
+            ps.fbs, ps.free_fbs, ps.bytes, ps.free_bytes, ps.bytes_peak);
+
+    if (drmu_env_queue_present_get(dpo->du, drmu_output_crtc(dpo->dout), &pres) != 0) {
+        fprintf(stderr, "No flip stats\n");
+        return;
+    }
+    // Interval > 1 => vblank(s) passed without a flip - only a miss if the
+    // stream rate matches the display rate
+    for (i = 2; i != DRMU_QUEUE_HIST_BINS; ++i)
+        missed += pres.hist.interval[i];
+
+    fprintf(stderr, "Last %u flips: %u skipped at least one vblank\nvblanks per flip:",
+            pres.hist.flips, missed);
+    for (i = 1; i != DRMU_QUEUE_HIST_BINS; ++i) {
+        if (pres.hist.interval[i] != 0)
+            fprintf(stderr, " %u%s:%u", i, i == DRMU_QUEUE_HIST_BINS - 1 ? "+" : "", pres.hist.interval[i]);
+    }
+    fprintf(stderr, "\n");
+}
+
 void drmprime_out_runticker_start(drmprime_out_env_t * const dpo, const char * const ticker_text)
 {
 #if HAS_RUNTICKER
     const drmu_mode_simple_params_t * mode = drmu_output_mode_simple_params(dpo->dout);
     static const char fontfile[] = "/usr/share/fonts/truetype/freefont/FreeSerif.ttf";
+    const drmu_thread_cfg_t tcfg = thread_cfg_named(dpo, "ticker");
 
     if ((dpo->rte = runticker_start(dpo->dout,
                                mode->width / 10, mode->height * 8/10, mode->width * 8/10, mode->height / 10,
-                               ticker_text, fontfile)) == NULL) {
+                               ticker_text, fontfile, &tcfg)) == NULL) {
         fprintf(stderr, "Failed to create ticker\n");
     }
 #else
@@ -381,7 +474,8 @@ void drmprime_out_runticker_stop(drmprime_out_env_t * const dpo)
 void drmprime_out_runcube_start(drmprime_out_env_t * const dpo)
 {
 #if HAS_RUNCUBE
-    dpo->rce = runcube_drmu_start(dpo->dout);
+    const drmu_thread_cfg_t tcfg = thread_cfg_named(dpo, "cube");
+    dpo->rce = runcube_drmu_start(dpo->dout, &tcfg);
 #else
     (void)dpo;
     fprintf(stderr, "Cube support not compiled\n");
@@ -1,3 +1,4 @@
+#include <stdbool.h>
 #include <libavutil/rational.h>
 
 struct drmprime_out_env_s;
@@ -12,6 +13,15 @@ int drmprime_out_modeset(drmprime_out_env_t *dpo, int w, int h, const AVRational
 void drmprime_out_delete(drmprime_out_env_t * dpo);
 drmprime_out_env_t * drmprime_out_new();
 
+// Scheduling for the display threads (drmu poll thread, ticker & cube)
+// Set before starting the ticker or cube
+struct drmu_thread_cfg_s;
+int drmprime_out_thread_cfg_set(drmprime_out_env_t * const dpo, const struct drmu_thread_cfg_s * const tcfg);
+// Only commit props that have changed since the last flip
+int drmprime_out_queue_delta_set(drmprime_out_env_t * const dpo, const bool enable);
+// Print flip stats (missed vblanks etc.) to stderr
+void drmprime_out_stats_print(drmprime_out_env_t * const dpo);
+
 void drmprime_out_runticker_start(drmprime_out_env_t * const dpo, const char * const ticker_text);
 void drmprime_out_runticker_stop(drmprime_out_env_t * const dpo);
 
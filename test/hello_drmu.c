@@ -32,6 +32,7 @@
  * frames from the HW video surfaces.
  */
 
+#include <sched.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <unistd.h>
@@ -47,6 +48,7 @@
 #include <libavfilter/buffersrc.h>
 
 #include "drmprime_out.h"
+#include "drmu_util.h"
 
 static enum AVPixelFormat hw_pix_fmt;
 static FILE *output_file = NULL;
@@ -305,6 +307,7 @@ void usage()
             "                      [--modeset]\n"
             "                      [--ticker <text>]\n"
             "                      [--cube]\n"
+            "                      [--rt <prio>] [--cpu-mask <mask>] [--stats] [--delta]\n"
             "                      <input file> [<input_file> ...]\n");
     exit(1);
 }
@@ -336,6 +339,9 @@ int main(int argc, char *argv[])
     long pace_input_hz = 0;
     bool try_hw = true;
     bool wants_cube = false;
+    bool wants_stats = false;
+    bool wants_delta = false;
+    drmu_thread_cfg_t tcfg = {0};
     const char * ticker_text = NULL;
 
     {
@@ -389,6 +395,31 @@ int main(int argc, char *argv[])
             else if (strcmp(arg, "--modeset") == 0) {
                 wants_modeset = true;
             }
+            else if (strcmp(arg, "--rt") == 0) {
+                if (n == 0)
+                    usage();
+                tcfg.policy = SCHED_FIFO;
+                tcfg.priority = strtol(*a, &e, 0);
+                if (*e != 0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--cpu-mask") == 0) {
+                if (n == 0)
+                    usage();
+                tcfg.cpu_mask = strtoull(*a, &e, 0);
+                if (*e != 0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--stats") == 0) {
+                wants_stats = true;
+            }
+            else if (strcmp(arg, "--delta") == 0) {
+                wants_delta = true;
+            }
             else if (strcmp(arg, "--ticker") == 0) {
                 if (n == 0)
                     usage();
@@ -437,6 +468,12 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (tcfg.policy != SCHED_OTHER || tcfg.cpu_mask != 0)
+        drmprime_out_thread_cfg_set(dpo, &tcfg);
+
+    if (wants_delta)
+        drmprime_out_queue_delta_set(dpo, true);
+
     if (wants_cube)
         drmprime_out_runcube_start(dpo);
 
@@ -606,6 +643,8 @@ retry_hw:
     if (--loop_count > 0)
         goto loopy;
 
+    if (wants_stats)
+        drmprime_out_stats_print(dpo);
     drmprime_out_delete(dpo);
 
     return 0;
@@ -0,0 +1,186 @@
+// Pool contention benchmark
+//
+// Pairs of threads share one fb pool. In each pair the producer allocates
+// fbs from the pool and hands them to the consumer through a small ring,
+// the consumer drops them (returning them to the pool). So allocation and
+// release always happen on different threads, as they do with a decoder
+// and a display.
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "drmu.h"
+#include "drmu_log.h"
+#include "drmu_pool.h"
+#include <drm_fourcc.h>
+
+#define DRM_MODULE "vc4"
+#define RING_SIZE 8
+#define PAIRS_MAX 16
+
+typedef struct ring_s {
+    drmu_fb_t * fbs[RING_SIZE];
+    atomic_uint head;   // Next write
+    atomic_uint tail;   // Next read
+} ring_t;
+
+typedef struct pair_s {
+    pthread_t producer;
+    pthread_t consumer;
+    drmu_pool_t * pool;
+    unsigned int n;
+    unsigned int alloc_fails;
+    ring_t ring;
+} pair_t;
+
+static void
+drmu_log_stderr_cb(void * v, enum drmu_log_level_e level, const char * fmt, va_list vl)
+{
+    char buf[256];
+    int n = vsnprintf(buf, 255, fmt, vl);
+
+    (void)v;
+    (void)level;
+
+    if (n >= 255)
+        n = 255;
+    buf[n] = '\n';
+    fwrite(buf, n + 1, 1, stderr);
+}
+
+static uint64_t
+now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *
+producer_thread(void * v)
+{
+    pair_t * const pr = v;
+    unsigned int i;
+
+    for (i = 0; i != pr->n; ++i) {
+        const unsigned int head = atomic_load_explicit(&pr->ring.head, memory_order_relaxed);
+        drmu_fb_t * dfb;
+
+        while (head - atomic_load_explicit(&pr->ring.tail, memory_order_acquire) == RING_SIZE)
+            sched_yield();
+        // Other pairs may be holding every fb for the moment
+        while ((dfb = drmu_pool_fb_new(pr->pool, 64, 64, DRM_FORMAT_XRGB8888, 0)) == NULL) {
+            ++pr->alloc_fails;
+            sched_yield();
+        }
+        pr->ring.fbs[head % RING_SIZE] = dfb;
+        atomic_store_explicit(&pr->ring.head, head + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+static void *
+consumer_thread(void * v)
+{
+    pair_t * const pr = v;
+    unsigned int i;
+
+    for (i = 0; i != pr->n; ++i) {
+        const unsigned int tail = atomic_load_explicit(&pr->ring.tail, memory_order_relaxed);
+
+        while (atomic_load_explicit(&pr->ring.head, memory_order_acquire) == tail)
+            sched_yield();
+        drmu_fb_unref(pr->ring.fbs + tail % RING_SIZE);
+        atomic_store_explicit(&pr->ring.tail, tail + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+static void
+usage(void)
+{
+    printf("Usage: poolbench [-M <module>] [-p <pairs>] [-n <fbs per pair>]\n\n"
+           "Allocates fbs from a shared pool on producer threads and releases\n"
+           "them on consumer threads, then reports the rate achieved.\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char * module = DRM_MODULE;
+    unsigned int pairs = 4;
+    unsigned int n = 100000;
+    drmu_env_t * du = NULL;
+    drmu_pool_t * pool = NULL;
+    pair_t * prs = NULL;
+    drmu_pool_stats_t ps;
+    unsigned int fails = 0;
+    uint64_t t0, t1;
+    unsigned int i;
+    int c;
+
+    while ((c = getopt(argc, argv, "M:n:p:")) != -1) {
+        switch (c) {
+        case 'M':
+            module = optarg;
+            break;
+        case 'n':
+            n = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            pairs = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (pairs == 0 || pairs > PAIRS_MAX || n == 0)
+        usage();
+
+    {
+        const drmu_log_env_t log = {
+            .fn = drmu_log_stderr_cb,
+            .v = NULL,
+            .max_level = DRMU_LOG_LEVEL_ERROR
+        };
+        if ((du = drmu_env_new_open(module, &log)) == NULL)
+            goto fail;
+    }
+
+    // Enough fbs for every ring to be full with one in flight either side
+    if ((pool = drmu_pool_new_dumb(du, pairs * (RING_SIZE + 2))) == NULL)
+        goto fail;
+    if ((prs = calloc(pairs, sizeof(*prs))) == NULL)
+        goto fail;
+
+    t0 = now_us();
+    for (i = 0; i != pairs; ++i) {
+        prs[i].pool = pool;
+        prs[i].n = n;
+        pthread_create(&prs[i].consumer, NULL, consumer_thread, prs + i);
+        pthread_create(&prs[i].producer, NULL, producer_thread, prs + i);
+    }
+    for (i = 0; i != pairs; ++i) {
+        pthread_join(prs[i].producer, NULL);
+        pthread_join(prs[i].consumer, NULL);
+        fails += prs[i].alloc_fails;
+    }
+    t1 = now_us();
+
+    drmu_pool_stats_get(pool, &ps);
+    printf("%u pairs: %u fbs in %"PRIu64"us: %.0f fbs/s, %u retries, %u fbs allocated (%zu bytes)\n",
+           pairs, pairs * n, t1 - t0, (double)pairs * n * 1000000.0 / (double)(t1 - t0 ? t1 - t0 : 1),
+           fails, ps.fbs, ps.bytes);
+
+fail:
+    free(prs);
+    drmu_pool_kill(&pool);
+    drmu_env_unref(&du);
+    return 0;
+}
@@ -0,0 +1,222 @@
+// SAND30 conversion check & benchmark
+//
+// Checks that every packing kernel drmu_sand has for this CPU produces
+// exactly the same output as the scalar plane16_to_sand30_y/_c, for P010
+// and planar 10-bit sources over a range of sizes, then times each one on
+// a 1080p frame. Exits non-zero on any mismatch.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "drmu_sand.h"
+#include "plane16.h"
+
+#define COL_BYTES 128
+#define COL_SAMPLES 96
+
+typedef struct frame_s {
+    unsigned int w, h;
+    // Source
+    uint8_t * p16;
+    unsigned int p16_stride;
+    uint16_t * y;       // P010 Y
+    uint16_t * uv;      // P010 UV
+    uint16_t * u;       // yuv420p10 U
+    uint16_t * v;       // yuv420p10 V
+    // Dest
+    unsigned int cols;
+    unsigned int stride2_y, stride2_c;
+    size_t size_y, size_c;
+    uint8_t * ref_y, * ref_c;
+    uint8_t * dst_y, * dst_c;
+} frame_t;
+
+static uint64_t
+now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+frame_free(frame_t * const f)
+{
+    free(f->p16);
+    free(f->y);
+    free(f->uv);
+    free(f->u);
+    free(f->v);
+    free(f->ref_y);
+    free(f->ref_c);
+    free(f->dst_y);
+    free(f->dst_c);
+    memset(f, 0, sizeof(*f));
+}
+
+// Random source (all 16 bits of every sample) & its scalar conversion
+static int
+frame_make(frame_t * const f, const unsigned int w, const unsigned int h)
+{
+    const unsigned int cw = (w + 1) / 2;
+    const unsigned int ch = (h + 1) / 2;
+    unsigned int i, j;
+
+    memset(f, 0, sizeof(*f));
+    f->w = w;
+    f->h = h;
+    f->p16_stride = w * 8;
+    f->cols = (w + COL_SAMPLES - 1) / COL_SAMPLES;
+    // Odd column heights so a stride2 mixup shows
+    f->stride2_y = h + 3;
+    f->stride2_c = ch + 5;
+    f->size_y = (size_t)f->cols * f->stride2_y * COL_BYTES;
+    f->size_c = (size_t)f->cols * f->stride2_c * COL_BYTES;
+
+    if ((f->p16 = malloc((size_t)f->p16_stride * h)) == NULL ||
+        (f->y = malloc((size_t)w * h * 2)) == NULL ||
+        (f->uv = malloc((size_t)cw * 2 * ch * 2)) == NULL ||
+        (f->u = malloc((size_t)cw * ch * 2)) == NULL ||
+        (f->v = malloc((size_t)cw * ch * 2)) == NULL ||
+        (f->ref_y = calloc(1, f->size_y)) == NULL ||
+        (f->ref_c = calloc(1, f->size_c)) == NULL ||
+        (f->dst_y = malloc(f->size_y)) == NULL ||
+        (f->dst_c = malloc(f->size_c)) == NULL) {
+        frame_free(f);
+        return -1;
+    }
+
+    for (i = 0; i != h; ++i) {
+        for (j = 0; j != w; ++j) {
+            const uint64_t v = p16val(rand(), rand(), rand(), rand());
+            memcpy(p16pos(f->p16, f->p16_stride, j, i), &v, sizeof(v));
+            f->y[i * w + j] = (uint16_t)(v >> 32);
+            if ((i & 1) == 0 && (j & 1) == 0) {
+                const unsigned int n = (i / 2) * cw + j / 2;
+                const uint16_t u = (uint16_t)(v >> 16);
+                const uint16_t vv = (uint16_t)v;
+                f->uv[n * 2 + 0] = u;
+                f->uv[n * 2 + 1] = vv;
+                // Junk above the 10 bits should be ignored
+                f->u[n] = (uint16_t)((u >> 6) | ((rand() & 0x3f) << 10));
+                f->v[n] = (uint16_t)((vv >> 6) | ((rand() & 0x3f) << 10));
+            }
+        }
+    }
+
+    plane16_to_sand30_y(f->ref_y, f->stride2_y, f->p16, f->p16_stride, w, h);
+    plane16_to_sand30_c(f->ref_c, f->stride2_c, f->p16, f->p16_stride, w, h);
+    return 0;
+}
+
+static void
+dst_clear(frame_t * const f)
+{
+    memset(f->dst_y, 0, f->size_y);
+    memset(f->dst_c, 0, f->size_c);
+}
+
+static void
+conv_p010(frame_t * const f)
+{
+    const unsigned int cw = (f->w + 1) / 2;
+    drmu_sand30_from_u16(f->dst_y, f->stride2_y, (const uint8_t *)f->y, f->w * 2, f->w, f->h, 6);
+    drmu_sand30_from_u16(f->dst_c, f->stride2_c, (const uint8_t *)f->uv, cw * 4, cw * 2, (f->h + 1) / 2, 6);
+}
+
+static void
+conv_planar(frame_t * const f)
+{
+    const unsigned int cw = (f->w + 1) / 2;
+    drmu_sand30_from_u16_uv(f->dst_c, f->stride2_c,
+                            (const uint8_t *)f->u, cw * 2, (const uint8_t *)f->v, cw * 2,
+                            cw, (f->h + 1) / 2, 0);
+}
+
+static int
+check(const char * const name, const char * const what, const frame_t * const f,
+      const uint8_t * const ref, const uint8_t * const dst, const size_t size)
+{
+    size_t i;
+
+    if (memcmp(ref, dst, size) == 0)
+        return 0;
+    for (i = 0; ref[i] == dst[i]; ++i)
+        /* Loop */;
+    fprintf(stderr, "%s: %ux%u %s mismatch at byte %zu (col %zu line %zu)\n",
+            name, f->w, f->h, what, i,
+            i / (size / f->cols), (i % (size / f->cols)) / COL_BYTES);
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    static const unsigned int widths[] = {
+        1, 2, 3, 5, 11, 12, 13, 23, 24, 25, 48, 94, 95, 96, 97, 100, 191, 192, 193, 300, 720, 1366
+    };
+    static const unsigned int heights[] = {1, 2, 3, 17};
+    static const drmu_sand_impl_t impls[] = {
+        DRMU_SAND_IMPL_C, DRMU_SAND_IMPL_NEON, DRMU_SAND_IMPL_SSSE3, DRMU_SAND_IMPL_AVX2
+    };
+    const unsigned int bench_n = argc > 1 ? (unsigned int)strtoul(argv[1], NULL, 0) : 20;
+    frame_t f;
+    unsigned int i, j, k, n;
+    int rv = 0;
+
+    srand(1);
+    printf("Default kernel: %s\n", drmu_sand_impl_name(drmu_sand_impl()));
+
+    for (i = 0; i != sizeof(widths) / sizeof(widths[0]); ++i) {
+        for (j = 0; j != sizeof(heights) / sizeof(heights[0]); ++j) {
+            if (frame_make(&f, widths[i], heights[j]) != 0) {
+                fprintf(stderr, "Frame alloc failed\n");
+                return 1;
+            }
+            for (k = 0; k != sizeof(impls) / sizeof(impls[0]); ++k) {
+                const char * const name = drmu_sand_impl_name(impls[k]);
+                if (drmu_sand_impl_set(impls[k]) != 0)
+                    continue;
+                dst_clear(&f);
+                conv_p010(&f);
+                if (check(name, "P010 Y", &f, f.ref_y, f.dst_y, f.size_y) != 0 ||
+                    check(name, "P010 C", &f, f.ref_c, f.dst_c, f.size_c) != 0)
+                    rv = 1;
+                dst_clear(&f);
+                conv_planar(&f);
+                if (check(name, "planar C", &f, f.ref_c, f.dst_c, f.size_c) != 0)
+                    rv = 1;
+            }
+            frame_free(&f);
+        }
+    }
+    printf("Bit exactness: %s\n", rv == 0 ? "OK" : "FAIL");
+
+    if (bench_n == 0 || frame_make(&f, 1920, 1080) != 0)
+        return rv;
+    for (k = 0; k != sizeof(impls) / sizeof(impls[0]); ++k) {
+        uint64_t t0, t1, t2;
+        if (drmu_sand_impl_set(impls[k]) != 0)
+            continue;
+        t0 = now_us();
+        for (n = 0; n != bench_n; ++n)
+            conv_p010(&f);
+        t1 = now_us();
+        for (n = 0; n != bench_n; ++n)
+            conv_planar(&f);
+        t2 = now_us();
+        printf("%-6s 1080p P010: %6"PRIu64"us/frame, planar chroma: %6"PRIu64"us/frame\n",
+               drmu_sand_impl_name(impls[k]), (t1 - t0) / bench_n, (t2 - t1) / bench_n);
+    }
+    {
+        uint64_t t0 = now_us();
+        for (n = 0; n != bench_n; ++n)
+            plane16_to_sand30(f.ref_y, f.stride2_y, f.ref_c, f.stride2_c, f.p16, f.p16_stride, f.w, f.h);
+        printf("plane16 1080p:     %6"PRIu64"us/frame\n", (now_us() - t0) / bench_n);
+    }
+    frame_free(&f);
+    return rv;
+}
+
@@ -0,0 +1,266 @@
+// Missed vblank benchmark
+//
+// Flips the primary plane between two fbs every vblank while busy threads
+// load every CPU, counting vblanks that pass without a flip. Runs once
+// with default scheduling and then again with an RT (SCHED_FIFO) cfg on
+// the drmu poll thread & the producer thread so the miss rates can be
+// compared.
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include "drmu.h"
+#include "drmu_log.h"
+#include "drmu_output.h"
+#include "drmu_util.h"
+#include <drm_fourcc.h>
+
+#define DRM_MODULE "vc4"
+#define LOADS_MAX 64
+
+typedef struct bench_s {
+    drmu_env_t * du;
+    drmu_output_t * dout;
+    drmu_plane_t * dp;
+    drmu_fb_t * fbs[2];
+    int prod_fd;
+
+    // Written on the poll thread by the present callback
+    atomic_ulong flips;
+    atomic_ulong missed;
+    atomic_bool seq_valid;
+    uint32_t last_seq;
+
+    atomic_bool load_stop;
+    pthread_t loads[LOADS_MAX];
+} bench_t;
+
+static void
+drmu_log_stderr_cb(void * v, enum drmu_log_level_e level, const char * fmt, va_list vl)
+{
+    char buf[256];
+    int n = vsnprintf(buf, 255, fmt, vl);
+
+    (void)v;
+    (void)level;
+
+    if (n >= 255)
+        n = 255;
+    buf[n] = '\n';
+    fwrite(buf, n + 1, 1, stderr);
+}
+
+static uint64_t
+now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+present_cb(void * v, const drmu_present_info_t * const info)
+{
+    bench_t * const b = v;
+
+    if (atomic_load(&b->seq_valid)) {
+        const uint32_t n = info->sequence - b->last_seq;
+        if (n > 1)
+            atomic_fetch_add(&b->missed, n - 1);
+    }
+    atomic_fetch_add(&b->flips, 1);
+    b->last_seq = info->sequence;
+    atomic_store(&b->seq_valid, true);
+}
+
+static void
+do_prod(void * v)
+{
+    static const uint64_t one = 1;
+    bench_t * const b = v;
+    write(b->prod_fd, &one, sizeof(one));
+}
+
+static void *
+load_thread(void * v)
+{
+    bench_t * const b = v;
+    volatile uint64_t x = 0;
+
+    while (!atomic_load_explicit(&b->load_stop, memory_order_relaxed))
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    return NULL;
+}
+
+// Queue a flip each time the last one has been committed so there is always
+// one waiting for the next vblank
+static int
+run(bench_t * const b, const char * const name, const unsigned int n_loads, const unsigned int secs)
+{
+    const uint64_t t_end = now_us() + (uint64_t)secs * 1000000;
+    unsigned int n_started = 0;
+    unsigned int i;
+    unsigned long flips, missed;
+    int rv = 0;
+
+    atomic_store(&b->load_stop, false);
+    for (n_started = 0; n_started != n_loads; ++n_started) {
+        if (pthread_create(b->loads + n_started, NULL, load_thread, b) != 0)
+            break;
+    }
+
+    drmu_env_queue_wait(b->du);
+    atomic_store(&b->seq_valid, false);
+    atomic_store(&b->flips, 0);
+    atomic_store(&b->missed, 0);
+
+    for (i = 0; now_us() < t_end; ++i) {
+        drmu_atomic_t * da = drmu_atomic_new(b->du);
+        uint64_t evt;
+
+        if (da == NULL) {
+            rv = -1;
+            break;
+        }
+        drmu_atomic_output_add_props(da, b->dout);
+        drmu_atomic_plane_add_fb(da, b->dp, b->fbs[i & 1], drmu_rect_wh(drmu_fb_width(b->fbs[0]), drmu_fb_height(b->fbs[0])));
+        drmu_atomic_add_commit_callback(da, do_prod, b);
+        drmu_atomic_queue(&da);
+        read(b->prod_fd, &evt, sizeof(evt));
+    }
+    drmu_env_queue_wait(b->du);
+
+    atomic_store(&b->load_stop, true);
+    while (n_started != 0)
+        pthread_join(b->loads[--n_started], NULL);
+
+    flips = atomic_load(&b->flips);
+    missed = atomic_load(&b->missed);
+    printf("%-8s %u loads: %lu flips, %lu vblanks missed (%.2f%%)\n",
+           name, n_loads, flips, missed, flips + missed == 0 ? 0.0 : (double)missed * 100.0 / (double)(flips + missed));
+    return rv;
+}
+
+static int
+fb_fill(drmu_fb_t * const dfb, const uint8_t val)
+{
+    if (dfb == NULL)
+        return -1;
+    drmu_fb_write_start(dfb);
+    memset(drmu_fb_data(dfb, 0), val, (size_t)drmu_fb_pitch(dfb, 0) * drmu_fb_height(dfb));
+    drmu_fb_write_end(dfb);
+    return 0;
+}
+
+static void
+usage(void)
+{
+    printf("Usage: vblbench [-M <module>] [-t <secs>] [-l <load threads>] [-p <rt prio>] [-c <cpu mask>]\n\n"
+           "Flips every vblank under CPU load, first with default scheduling then\n"
+           "with SCHED_FIFO (default prio 10) on the poll & producer threads, and\n"
+           "reports the vblanks missed in each case. RT needs CAP_SYS_NICE.\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char * module = DRM_MODULE;
+    unsigned int secs = 10;
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int n_loads = n_cpus <= 0 ? 4 : (unsigned int)n_cpus * 2;
+    drmu_thread_cfg_t tcfg = {.policy = SCHED_FIFO, .priority = 10};
+    bench_t b = {.prod_fd = -1};
+    const drmu_mode_simple_params_t * sp;
+    int rv = 1;
+    int c;
+
+    while ((c = getopt(argc, argv, "M:c:l:p:t:")) != -1) {
+        switch (c) {
+        case 'M':
+            module = optarg;
+            break;
+        case 'c':
+            tcfg.cpu_mask = strtoull(optarg, NULL, 0);
+            break;
+        case 'l':
+            n_loads = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            tcfg.priority = (int)strtol(optarg, NULL, 0);
+            break;
+        case 't':
+            secs = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (secs == 0 || n_loads > LOADS_MAX)
+        usage();
+
+    {
+        const drmu_log_env_t log = {
+            .fn = drmu_log_stderr_cb,
+            .v = NULL,
+            .max_level = DRMU_LOG_LEVEL_ERROR
+        };
+        if ((b.du = drmu_env_new_open(module, &log)) == NULL)
+            goto fail;
+    }
+    drmu_env_restore_enable(b.du);
+
+    if ((b.dout = drmu_output_new(b.du)) == NULL ||
+        drmu_output_add_output(b.dout, NULL) != 0)
+        goto fail;
+    sp = drmu_output_mode_simple_params(b.dout);
+    if ((b.dp = drmu_output_plane_ref_primary(b.dout)) == NULL) {
+        fprintf(stderr, "No primary plane\n");
+        goto fail;
+    }
+    if (fb_fill(b.fbs[0] = drmu_fb_new_dumb(b.du, sp->width, sp->height, DRM_FORMAT_XRGB8888), 0x20) != 0 ||
+        fb_fill(b.fbs[1] = drmu_fb_new_dumb(b.du, sp->width, sp->height, DRM_FORMAT_XRGB8888), 0x60) != 0) {
+        fprintf(stderr, "Failed to get fbs\n");
+        goto fail;
+    }
+    if ((b.prod_fd = eventfd(0, 0)) == -1)
+        goto fail;
+    drmu_env_queue_present_cb_set(b.du, present_cb, &b);
+
+    printf("Mode %ux%u @ %u.%03uHz\n", sp->width, sp->height, sp->hz_x_1000 / 1000, sp->hz_x_1000 % 1000);
+
+    if (run(&b, "default", n_loads, secs) != 0)
+        goto fail;
+
+    strcpy(tcfg.name, "drmu-poll");
+    if (drmu_env_poll_thread_cfg_set(b.du, &tcfg) != 0)
+        fprintf(stderr, "Failed to set poll thread cfg (no CAP_SYS_NICE?)\n");
+    strcpy(tcfg.name, "vblbench");
+    if (drmu_thread_cfg_apply(&tcfg) != 0)
+        fprintf(stderr, "Failed to set producer thread cfg\n");
+
+    if (run(&b, "rt", n_loads, secs) != 0)
+        goto fail;
+    rv = 0;
+
+fail:
+    if (b.du != NULL)
+        drmu_env_queue_present_cb_set(b.du, NULL, NULL);
+    drmu_fb_unref(b.fbs + 0);
+    drmu_fb_unref(b.fbs + 1);
+    drmu_plane_unref(&b.dp);
+    drmu_output_unref(&b.dout);
+    drmu_env_unref(&b.du);
+    if (b.prod_fd != -1)
+        close(b.prod_fd);
+    return rv;
+}
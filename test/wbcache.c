@@ -0,0 +1,249 @@
+// Prop cache writeback test
+//
+// Commits a writeback & then snapshots every object in the commit. The
+// write-only props (writeback fb & fences) must snapshot as the kernel
+// reports them rather than as last committed, else a restore would replay
+// an fb id & a pointer into an fb that may since have gone.
+//
+// Needs a device with a writeback connector (e.g. vkms). Exits 77 (skip) if
+// there isn't one.
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+
+#include "drmu.h"
+#include "drmu_log.h"
+#include "drmu_output.h"
+#include <drm_fourcc.h>
+#include <libdrm/drm_mode.h>
+
+#define DRM_MODULE "vkms"
+#define EXIT_SKIP 77
+
+static const char * const wo_names[] = {
+    "WRITEBACK_FB_ID",
+    "WRITEBACK_OUT_FENCE_PTR",
+    "OUT_FENCE_PTR",
+    "IN_FENCE_FD",
+    NULL
+};
+
+typedef struct check_env_s {
+    drmu_env_t * du;
+    const drmu_atomic_t * da;   // What was committed
+    unsigned int n_checked;
+    unsigned int n_bad;
+} check_env_t;
+
+static void
+drmu_log_stderr_cb(void * v, enum drmu_log_level_e level, const char * fmt, va_list vl)
+{
+    char buf[256];
+    int n = vsnprintf(buf, 255, fmt, vl);
+
+    (void)v;
+    (void)level;
+
+    if (n >= 255)
+        n = 255;
+    buf[n] = '\n';
+    fwrite(buf, n + 1, 1, stderr);
+}
+
+// Ask the kernel directly - bypasses the env's cache
+// Returns count of props or -errno
+static int
+kernel_props_get(const int fd, const uint32_t obj_id, const uint32_t obj_type,
+                 uint32_t ** const ppIds, uint64_t ** const ppValues)
+{
+    struct drm_mode_obj_get_properties op = {.obj_id = obj_id, .obj_type = obj_type};
+
+    *ppIds = NULL;
+    *ppValues = NULL;
+    if (ioctl(fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &op) != 0)
+        return -errno;
+    if ((*ppIds = calloc(op.count_props + 1, sizeof(**ppIds))) == NULL ||
+        (*ppValues = calloc(op.count_props + 1, sizeof(**ppValues))) == NULL)
+        return -ENOMEM;
+    op.props_ptr = (uintptr_t)*ppIds;
+    op.prop_values_ptr = (uintptr_t)*ppValues;
+    if (ioctl(fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &op) != 0)
+        return -errno;
+    return (int)op.count_props;
+}
+
+static bool
+is_write_only(const int fd, const uint32_t prop_id, const char ** const pname)
+{
+    struct drm_mode_get_property prop = {.prop_id = prop_id};
+    unsigned int i;
+
+    if (ioctl(fd, DRM_IOCTL_MODE_GETPROPERTY, &prop) != 0)
+        return false;
+    for (i = 0; wo_names[i] != NULL; ++i) {
+        if (strcmp(prop.name, wo_names[i]) == 0) {
+            *pname = wo_names[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+check_obj_cb(void * v, uint32_t obj_id)
+{
+    static const uint32_t types[] = {
+        DRM_MODE_OBJECT_CONNECTOR, DRM_MODE_OBJECT_CRTC, DRM_MODE_OBJECT_PLANE
+    };
+    check_env_t * const ce = v;
+    const int fd = drmu_fd(ce->du);
+    drmu_atomic_t * snap = NULL;
+    uint32_t * ids = NULL;
+    uint64_t * values = NULL;
+    unsigned int t;
+    int n = -ENOENT;
+    int i;
+
+    // Snapshot takes the real type as the cache is keyed on it
+    for (t = 0; t != sizeof(types) / sizeof(types[0]); ++t) {
+        free(ids);
+        free(values);
+        if ((n = kernel_props_get(fd, obj_id, types[t], &ids, &values)) >= 0)
+            break;
+    }
+    if (n < 0) {
+        fprintf(stderr, "Obj %u: failed to get props: %s\n", obj_id, strerror(-n));
+        ++ce->n_bad;
+        goto done;
+    }
+
+    if ((snap = drmu_atomic_new(ce->du)) == NULL ||
+        drmu_atomic_obj_add_snapshot(snap, obj_id, types[t]) != 0) {
+        fprintf(stderr, "Obj %u: snapshot failed\n", obj_id);
+        ++ce->n_bad;
+        goto done;
+    }
+
+    for (i = 0; i != n; ++i) {
+        const char * name;
+        uint64_t snap_val;
+        uint64_t commit_val = 0;
+
+        if (!is_write_only(fd, ids[i], &name) ||
+            drmu_atomic_prop_value_get(snap, obj_id, ids[i], &snap_val) != 0)
+            continue;
+        drmu_atomic_prop_value_get(ce->da, obj_id, ids[i], &commit_val);
+
+        ++ce->n_checked;
+        if (snap_val != values[i]) {
+            fprintf(stderr, "Obj %u %s: snapshot %#"PRIx64", kernel %#"PRIx64", committed %#"PRIx64"\n",
+                    obj_id, name, snap_val, values[i], commit_val);
+            ++ce->n_bad;
+        }
+    }
+
+done:
+    drmu_atomic_unref(&snap);
+    free(ids);
+    free(values);
+}
+
+static void
+usage(void)
+{
+    printf("Usage: wbcache [-M <module>]\n\n"
+           "Checks that snapshots taken after a writeback commit don't hold\n"
+           "the committed writeback fb & fence values.\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char * module = DRM_MODULE;
+    drmu_env_t * du = NULL;
+    drmu_output_t * dout = NULL;
+    drmu_plane_t * dp = NULL;
+    drmu_fb_t * fb_in = NULL;
+    drmu_fb_t * fb_out = NULL;
+    drmu_atomic_t * da = NULL;
+    check_env_t ce = {0};
+    const unsigned int w = 640;
+    const unsigned int h = 480;
+    int rv = 1;
+    int c;
+
+    while ((c = getopt(argc, argv, "M:")) != -1) {
+        switch (c) {
+        case 'M':
+            module = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    {
+        const drmu_log_env_t log = {
+            .fn = drmu_log_stderr_cb,
+            .v = NULL,
+            .max_level = DRMU_LOG_LEVEL_ERROR
+        };
+        if ((du = drmu_env_new_open(module, &log)) == NULL) {
+            printf("No %s device - skipping\n", module);
+            return EXIT_SKIP;
+        }
+    }
+    drmu_env_restore_enable(du);
+
+    if ((dout = drmu_output_new(du)) == NULL)
+        goto fail;
+    drmu_output_modeset_allow(dout, true);
+    if (drmu_output_add_writeback(dout) != 0) {
+        printf("No writeback connector - skipping\n");
+        rv = EXIT_SKIP;
+        goto fail;
+    }
+
+    if ((dp = drmu_output_plane_ref_primary(dout)) == NULL ||
+        (fb_in = drmu_fb_new_dumb(du, w, h, DRM_FORMAT_XRGB8888)) == NULL ||
+        (fb_out = drmu_fb_new_dumb(du, w, h, DRM_FORMAT_XRGB8888)) == NULL ||
+        (da = drmu_atomic_new(du)) == NULL) {
+        fprintf(stderr, "Failed to set up writeback\n");
+        goto fail;
+    }
+    if (drmu_atomic_output_add_writeback_fb(da, dout, fb_out) != 0 ||
+        drmu_atomic_plane_add_fb(da, dp, fb_in, drmu_rect_wh(w, h)) != 0 ||
+        drmu_atomic_commit(da, DRM_MODE_ATOMIC_ALLOW_MODESET) != 0) {
+        fprintf(stderr, "Failed to commit writeback\n");
+        goto fail;
+    }
+    if (drmu_fb_out_fence_wait(fb_out, 1000) != 1) {
+        fprintf(stderr, "Writeback didn't complete\n");
+        goto fail;
+    }
+
+    ce.du = du;
+    ce.da = da;
+    drmu_atomic_obj_foreach(da, check_obj_cb, &ce);
+    if (ce.n_checked == 0) {
+        fprintf(stderr, "No write-only props found to check\n");
+        goto fail;
+    }
+    printf("%u write-only props checked, %u bad\n", ce.n_checked, ce.n_bad);
+    rv = ce.n_bad == 0 ? 0 : 1;
+
+fail:
+    drmu_atomic_unref(&da);
+    drmu_fb_unref(&fb_out);
+    drmu_fb_unref(&fb_in);
+    drmu_plane_unref(&dp);
+    drmu_output_unref(&dout);
+    drmu_env_unref(&du);
+    return rv;
+}